@@ -0,0 +1,132 @@
+/*
+    Benchmarks for the search engines, printing the throughput of finding
+    every match in a buffer of generated text.
+
+        make bin/bench && bin/bench > bench_output.txt
+*/
+#include "../src/regexx.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* A fixed seed, so that every run searches the same text */
+static unsigned long long bench_seed = 0x2545F4914F6CDD1DULL;
+
+static unsigned bench_random(void) {
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 7;
+    bench_seed ^= bench_seed << 17;
+    return (unsigned)(bench_seed >> 32);
+}
+
+/** Fills the buffer with random bytes from the alphabet */
+static void bench_fill(char *buf, size_t length, const char *alphabet) {
+    size_t count = strlen(alphabet);
+    size_t i;
+
+    for (i=0; i<length; i++)
+        buf[i] = alphabet[bench_random() % count];
+}
+
+/* Each search is timed this many times, keeping the fastest */
+#define BENCH_RUNS 3
+
+/**
+ * Finds all the matches in the text, printing how many megabytes a
+ * second that went through
+ */
+static void bench_search(regexx_t *re, const char *name, const char *text, size_t length) {
+    double best = 0;
+    size_t match_count = 0;
+    int run;
+
+    for (run=0; run<BENCH_RUNS; run++) {
+        size_t offset = 0;
+        clock_t elapsed;
+        double seconds;
+
+        match_count = 0;
+        elapsed = clock();
+        for (;;) {
+            size_t start;
+            size_t match_length;
+
+            if (regexx_match(re, text, offset, length, &start, &match_length) == REGEXX_NOT_FOUND)
+                break;
+            match_count++;
+            offset = start + (match_length ? match_length : 1);
+        }
+        elapsed = clock() - elapsed;
+        seconds = (double)elapsed / CLOCKS_PER_SEC;
+        if (seconds <= 0)
+            seconds = 1.0 / CLOCKS_PER_SEC;
+        if ((double)length / seconds > best)
+            best = (double)length / seconds;
+    }
+    printf("[+] %-44s %9.1f MB/s %9u matches\n", name, best / 1000000.0, (unsigned)match_count);
+}
+
+/**
+ * Compiles `count` random literals of `width` bytes, searches random text
+ * made of the same letters, then the same text with every literal planted
+ * in it.
+ */
+static int bench_literals(size_t count, size_t width, size_t length, unsigned flags) {
+    regexx_t *re;
+    char *pattern;
+    char *text;
+    char *planted;
+    char name[64];
+    size_t i;
+
+    re = regexx_create(flags);
+    pattern = malloc(width + 1);
+    text = malloc(length);
+    planted = malloc(length);
+    if (re == NULL || pattern == NULL || text == NULL || planted == NULL)
+        abort();
+    bench_fill(text, length, "abcdefghijklmnopqrstuvwxyz");
+    memcpy(planted, text, length);
+    for (i=0; i<count; i++) {
+        bench_fill(pattern, width, "abcdefghijklmnopqrstuvwxyz");
+        pattern[width] = '\0';
+        if (regexx_add_pattern(re, pattern, i, 0) != 0) {
+            fprintf(stderr, "[-] bench: %s\n", regexx_get_error_msg(re));
+            return 1;
+        }
+        if ((i + 1) * width * 4 <= length)
+            memcpy(planted + i * width * 4, pattern, width);
+    }
+    if (regexx_compile(re) != 0) {
+        fprintf(stderr, "[-] bench: %s\n", regexx_get_error_msg(re));
+        return 1;
+    }
+
+    snprintf(name, sizeof(name), "literals: %u x %u bytes%s",
+            (unsigned)count, (unsigned)width, (flags & REGEXX_IGNORECASE) ? ", nocase" : "");
+    bench_search(re, name, text, length);
+    snprintf(name, sizeof(name), "literals: %u x %u bytes%s, planted",
+            (unsigned)count, (unsigned)width, (flags & REGEXX_IGNORECASE) ? ", nocase" : "");
+    bench_search(re, name, planted, length);
+
+    regexx_free(re);
+    free(planted);
+    free(text);
+    free(pattern);
+    return 0;
+}
+
+int main(void) {
+    size_t length = 32 * 1024 * 1024;
+
+    if (bench_literals(10, 8, length, 0) != 0)
+        return 1;
+    if (bench_literals(1000, 8, length, 0) != 0)
+        return 1;
+    if (bench_literals(100000, 16, length, 0) != 0)
+        return 1;
+    if (bench_literals(100000, 16, length, REGEXX_IGNORECASE) != 0)
+        return 1;
+    return 0;
+}
@@ -284,6 +284,15 @@ clex_t *clex_create(void) {
         }
         //printf("%s\n", regexx_print(clex->re, 0, 0, 0));
     }
+
+    /*
+     * Combine them all into a DFA, so that each token is matched in
+     * a single pass rather than pattern-by-pattern
+     */
+    if (regexx_compile(clex->re) != 0) {
+        fprintf(stderr, "[-] %s\n", regexx_get_error_msg(clex->re));
+        goto fail;
+    }
     
     return clex;
     
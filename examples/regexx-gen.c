@@ -0,0 +1,245 @@
+/*
+    regexx-gen - write a standalone C scanner for a set of patterns
+
+    Reads a file of rules, like a much simpler `lex` file:
+
+        # macros, as NAME value
+        D       [0-9]
+        L       [a-zA-Z_]
+        %%
+        # patterns, as pattern TOKEN
+        {L}({L}|{D})*       IDENTIFIER
+        {D}+                NUMBER
+        ==                  EQ
+
+    A pattern ends at the first space or tab that isn't escaped or within
+    brackets. Tokens with the same name have the same id. Blank lines and
+    lines starting with '#' are ignored.
+
+    Writes the scanner's C source to stdout (or `-o file`), where
+    `<prefix>_scan()` returns the token id of the longest match at an
+    offset. With `-h file`, also writes a header with an enum of the token
+    ids and the prototype of the scanner.
+
+    Usage:
+        regexx-gen [-p prefix] [-s] [-o out.c] [-h out.h] rules.txt
+*/
+#include "../src/regexx.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct gen_t {
+    regexx_t *re;
+    char **names;
+    size_t name_count;
+} gen_t;
+
+/** Finds the id of a token name, adding it if new, numbered from 1 */
+static size_t _token_id(gen_t *gen, const char *name) {
+    size_t i;
+
+    for (i=0; i<gen->name_count; i++) {
+        if (strcmp(gen->names[i], name) == 0)
+            return i + 1;
+    }
+    gen->names = realloc(gen->names, (gen->name_count + 1) * sizeof(gen->names[0]));
+    if (gen->names == NULL)
+        abort();
+    gen->names[gen->name_count] = strdup(name);
+    if (gen->names[gen->name_count] == NULL)
+        abort();
+    return ++gen->name_count;
+}
+
+/** Finds the end of the pattern at the start of the line */
+static char *_pattern_end(char *line) {
+    bool is_class = false;
+
+    for (; *line; line++) {
+        if (*line == '\\' && line[1]) {
+            line++;
+            continue;
+        }
+        if (is_class) {
+            if (*line == ']')
+                is_class = false;
+        } else if (*line == '[') {
+            is_class = true;
+            if (line[1] == ']' || (line[1] == '^' && line[2] == ']'))
+                line += (line[1] == '^') ? 2 : 1;
+        } else if (*line == ' ' || *line == '\t') {
+            break;
+        }
+    }
+    return line;
+}
+
+static void _trim(char *line) {
+    size_t length = strlen(line);
+
+    while (length && isspace(line[length-1]&0xFF))
+        line[--length] = '\0';
+}
+
+/**
+ * Reads the rules file, adding its macros and patterns.
+ * @return 0 on success, or -1 on error, after printing a message
+ */
+static int parse_rules(gen_t *gen, const char *filename, FILE *fp) {
+    char line[4096];
+    size_t line_number = 0;
+    bool is_patterns = false;
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *name;
+        char *value;
+
+        line_number++;
+        _trim(line);
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+        if (strcmp(line, "%%") == 0) {
+            is_patterns = true;
+            continue;
+        }
+
+        if (is_patterns) {
+            /* pattern TOKEN */
+            value = line;
+            name = _pattern_end(line);
+            if (*name)
+                *name++ = '\0';
+            while (*name == ' ' || *name == '\t')
+                name++;
+            if (*name == '\0') {
+                fprintf(stderr, "[-] %s:%u: missing token name\n", filename, (unsigned)line_number);
+                return -1;
+            }
+            if (regexx_add_pattern(gen->re, value, _token_id(gen, name), 0) != 0) {
+                fprintf(stderr, "[-] %s:%u: %s\n", filename, (unsigned)line_number, regexx_get_error_msg(gen->re));
+                return -1;
+            }
+        } else {
+            /* NAME value */
+            name = line;
+            value = line + strcspn(line, " \t");
+            if (*value)
+                *value++ = '\0';
+            while (*value == ' ' || *value == '\t')
+                value++;
+            if (*value == '\0') {
+                fprintf(stderr, "[-] %s:%u: missing macro value\n", filename, (unsigned)line_number);
+                return -1;
+            }
+            if (regexx_add_macro(gen->re, name, value) != 0) {
+                fprintf(stderr, "[-] %s:%u: %s\n", filename, (unsigned)line_number, regexx_get_error_msg(gen->re));
+                return -1;
+            }
+        }
+    }
+    if (ferror(fp)) {
+        fprintf(stderr, "[-] %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/** Writes the enum of token ids and the prototype of the scanner */
+static void write_header(gen_t *gen, FILE *fp, const char *prefix) {
+    size_t i;
+    size_t j;
+
+    char *upper;
+
+    upper = strdup(prefix);
+    if (upper == NULL)
+        abort();
+    for (j=0; upper[j]; j++)
+        upper[j] = (char)toupper(upper[j]&0xFF);
+
+    fprintf(fp, "/* Generated by regexx-gen; don't edit */\n");
+    fprintf(fp, "#ifndef %s_SCAN_H\n#define %s_SCAN_H\n#include <stddef.h>\n\n", upper, upper);
+    fprintf(fp, "enum {\n");
+    for (i=0; i<gen->name_count; i++)
+        fprintf(fp, "    %s_%s = %u,\n", upper, gen->names[i], (unsigned)(i + 1));
+    fprintf(fp, "};\n\n");
+    fprintf(fp, "size_t %s_scan(const char *text, size_t offset, size_t length, size_t *r_length);\n\n", prefix);
+    fprintf(fp, "#endif\n");
+    free(upper);
+}
+
+int main(int argc, char *argv[]) {
+    gen_t gen[1] = {{0}};
+    const char *prefix = "yy";
+    const char *rules_name = NULL;
+    const char *out_name = NULL;
+    const char *header_name = NULL;
+    unsigned flags = 0;
+    FILE *fp;
+    int err;
+    int i;
+
+    for (i=1; i<argc; i++) {
+        if (strcmp(argv[i], "-s") == 0)
+            flags |= REGEXX_GEN_SWITCH;
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+            prefix = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            out_name = argv[++i];
+        else if (strcmp(argv[i], "-h") == 0 && i + 1 < argc)
+            header_name = argv[++i];
+        else if (argv[i][0] == '-' || rules_name) {
+            fprintf(stderr, "usage: regexx-gen [-p prefix] [-s] [-o out.c] [-h out.h] rules.txt\n");
+            return 1;
+        } else
+            rules_name = argv[i];
+    }
+    if (rules_name == NULL) {
+        fprintf(stderr, "usage: regexx-gen [-p prefix] [-s] [-o out.c] [-h out.h] rules.txt\n");
+        return 1;
+    }
+
+    gen->re = regexx_create(0);
+    fp = fopen(rules_name, "rt");
+    if (fp == NULL) {
+        fprintf(stderr, "[-] %s: %s\n", rules_name, strerror(errno));
+        return 1;
+    }
+    err = parse_rules(gen, rules_name, fp);
+    fclose(fp);
+    if (err)
+        return 1;
+
+    fp = out_name ? fopen(out_name, "wt") : stdout;
+    if (fp == NULL) {
+        fprintf(stderr, "[-] %s: %s\n", out_name, strerror(errno));
+        return 1;
+    }
+    err = regexx_generate(gen->re, fp, prefix, flags);
+    if (err)
+        fprintf(stderr, "[-] %s\n", regexx_get_error_msg(gen->re));
+    if (out_name && fclose(fp) != 0) {
+        fprintf(stderr, "[-] %s: %s\n", out_name, strerror(errno));
+        err = -1;
+    }
+    if (err)
+        return 1;
+
+    if (header_name) {
+        fp = fopen(header_name, "wt");
+        if (fp == NULL) {
+            fprintf(stderr, "[-] %s: %s\n", header_name, strerror(errno));
+            return 1;
+        }
+        write_header(gen, fp, prefix);
+        fclose(fp);
+    }
+
+    regexx_free(gen->re);
+    for (i=0; i<(int)gen->name_count; i++)
+        free(gen->names[i]);
+    free(gen->names);
+    return 0;
+}
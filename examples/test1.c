@@ -5,7 +5,7 @@
 #include <string.h>
 
 
-int regex_selftest(void) {
+int regex_selftest(bool is_compiled, unsigned flags) {
 #define ULL "(" "([Uu]?[Ll]?[Ll]?)" "|([Ll]?[Ll]?[Uu]?)" ")?"
 #define identifier "[A-Z_a-z]\\w*"
 #define int_hex "0[Xx][0-9A-Fa-f]+" ULL
@@ -72,6 +72,9 @@ int regex_selftest(void) {
         {identifier, " Foo += 3; \n", 1, 3},
         {identifier, " F00 += 3; \n", 1, 3},
         {identifier, " 900 BAR \n", 5, 3},
+        {"foo(?=bar)", "foobaz foobar", 7, 3},
+        {"foo(?!bar)", "foobar foobaz", 7, 3},
+        {"a(?=\\w*z)\\w", "ab ac az", 6, 2},
         {0, 0}};
     size_t i;
 
@@ -83,16 +86,20 @@ int regex_selftest(void) {
         int err;
         size_t id;
         
-        re = regexx_create(0);
+        re = regexx_create(flags);
         err = regexx_add_pattern(re, expected->pattern, i, 0);
         if (err) {
             fprintf(stderr, "[-]%u: %s\n", (unsigned)i, regexx_get_error_msg(re));
             continue;
         }
+        if (is_compiled && regexx_compile(re) != 0) {
+            fprintf(stderr, "[-]%u: %s\n", (unsigned)i, regexx_get_error_msg(re));
+            return 1;
+        }
 
         /*regexx_print(re, stderr, 0);
         fprintf(stderr, "\n");*/
-        id = regexx_match(re, expected->text, SIZE_MAX, &match_offset, &match_length);
+        id = regexx_match(re, expected->text, 0, SIZE_MAX, &match_offset, &match_length);
         if (id == REGEXX_NOT_FOUND || match_offset != expected->offset || match_length != expected->length) {
             fprintf(stderr, "[-]%2u: \"%s\"\n", (unsigned)i, regexx_print(re, 0, 0, 0));
             fprintf(stderr, "[%c] id=%u, expected=%u\n",
@@ -208,11 +215,13 @@ static struct {
     {"{HP}{H}*\\.{H}+{P}{FS}?"},
     {"{HP}{H}+\\.{P}{FS}?"},
     {"({SP}?\\\"([^\"\\\\n]|{ES})*\\\"{WS}*)+"}, /* string */
+    {"\\+="}, {"="}, {"\\+"}, {"-"}, {"\\*"}, {";"}, /* operators */
     {0}
 };
 
 static int selftest_macros(void) {
     regexx_t *re = regexx_create(0);
+    char *buf;
     size_t i;
     int result = 0;
     
@@ -226,10 +235,1433 @@ static int selftest_macros(void) {
             fprintf(stderr, "[-]%u: %s\n", (unsigned)i, regexx_get_error_msg(re));
             result++;
         }
-        fprintf(stderr, "%s\n", regexx_print(re, i, 0, 0));
+        buf = regexx_print(re, i, 0, 0);
+        fprintf(stderr, "%s\n", buf);
+        free(buf);
+    }
+    regexx_free(re);
+    return 0;
+}
+static regexx_t *selftest_lexer(bool is_compiled, unsigned flags, size_t cache_size) {
+    regexx_t *re = regexx_create(flags);
+    size_t i;
+
+    if (cache_size)
+        regexx_set_cache_size(re, cache_size);
+
+    for (i=0; clex_macros[i].name; i++) {
+        regexx_add_macro(re, clex_macros[i].name, clex_macros[i].value);
+    }
+    for (i=0; clex_exp[i].pattern; i++) {
+        regexx_add_pattern(re, clex_exp[i].pattern, i+1, 0);
+    }
+    if (is_compiled && regexx_compile(re) != 0) {
+        fprintf(stderr, "[-] compile: %s\n", regexx_get_error_msg(re));
+        regexx_free(re);
+        return NULL;
+    }
+    return re;
+}
+
+/**
+ * Tokenize the same text with and without `regexx_compile()`, which should
+ * produce the same tokens.
+ */
+static int selftest_lex(unsigned flags, size_t cache_size) {
+    static const char text[] =
+        "x = 0x1F + 017u * 42UL - 3.14e-2f; c = 'a' + '\\n';\n"
+        "s = u8\"hello\" \"world\\x41\"\n"
+        "d = .5 + 1. + 0x1.8p3 + 0x.Fp-1L;\n";
+    regexx_t *re1 = selftest_lexer(false, 0, 0);
+    regexx_t *re2 = selftest_lexer(true, flags, cache_size);
+    size_t offset1 = 0;
+    size_t offset2 = 0;
+    size_t length = sizeof(text) - 1;
+    int result = 0;
+
+    if (re1 == NULL || re2 == NULL)
+        return 1;
+
+    while (offset1 < length) {
+        regexxtoken_t token1;
+        regexxtoken_t token2;
+
+        token1 = regexx_lex_token(re1, text, &offset1, length);
+        token2 = regexx_lex_token(re2, text, &offset2, length);
+        if (token1.id != token2.id || token1.length != token2.length || offset1 != offset2) {
+            fprintf(stderr, "[-] lex(0x%x): at %u: id=%u/%u length=%u/%u\n",
+                    flags, (unsigned)offset1,
+                    (unsigned)token1.id, (unsigned)token2.id,
+                    (unsigned)token1.length, (unsigned)token2.length);
+            result = 1;
+            break;
+        }
+        if (token1.id == REGEXX_NOT_FOUND) {
+            offset1++;
+            offset2++;
+        }
+    }
+
+    regexx_free(re1);
+    regexx_free(re2);
+    return result;
+}
+
+/**
+ * Nested quantifiers that make backtracking take exponential time
+ * shouldn't bother the Pike VM.
+ */
+static int selftest_pikevm(void) {
+    static const char *patterns[] = {"(a*)*b", "(a|aa)+c", "(a+)+?b", 0};
+    char text[4096];
+    size_t i;
+    int result = 0;
+
+    memset(text, 'a', sizeof(text));
+    for (i=0; patterns[i]; i++) {
+        regexx_t *re = regexx_create(REGEXX_PIKEVM);
+        size_t offset;
+        size_t length;
+
+        regexx_add_pattern(re, patterns[i], 1, 0);
+        if (regexx_match(re, text, 0, sizeof(text), &offset, &length) != REGEXX_NOT_FOUND) {
+            fprintf(stderr, "[-] pikevm: %s: unexpected match\n", patterns[i]);
+            result = 1;
+        }
+        regexx_free(re);
+    }
+    return result;
+}
+
+/**
+ * Patterns that can match nothing, where engines are easy to get out of
+ * step: every engine, compiled or not, should skip the empty matches and
+ * find the same ones as the DFA, both searching and lexing.
+ */
+static int selftest_empty(void) {
+    static const char *patterns[] = {
+        "x*", "x*?", "(|x)", "(x|)", "x?", "x??", "x+?",
+        "y(x*)", "y(x*?)", "(|x)y", "x*y", "x*?y", 0
+    };
+    static const char *texts[] = {"", "x", "yxx", "xxy", "zxx", "yy", "xyx", 0};
+    static const unsigned modes[] = {0, REGEXX_LAZY_DFA, REGEXX_PIKEVM, REGEXX_MEMOIZE};
+    int result = 0;
+    size_t i;
+    size_t t;
+
+    for (i=0; patterns[i]; i++)
+    for (t=0; texts[t]; t++) {
+        size_t length = strlen(texts[t]);
+        char expected[64] = "";
+        unsigned m;
+
+        for (m=0; m<sizeof(modes)/sizeof(modes[0])*2; m++) {
+            regexx_t *re = regexx_create(modes[m / 2]);
+            struct regexxtoken_t token;
+            size_t offset = 0;
+            size_t out_length = 0;
+            size_t id;
+            char found[64];
+
+            regexx_add_pattern(re, patterns[i], 1, 0);
+            if (m % 2 == 0)
+                regexx_compile(re);
+            id = regexx_match(re, texts[t], 0, length, &offset, &out_length);
+            snprintf(found, sizeof(found), "%d %u+%u", (int)id, (unsigned)offset, (unsigned)out_length);
+            offset = 0;
+            token = regexx_lex_token(re, texts[t], &offset, length);
+            snprintf(found + strlen(found), sizeof(found) - strlen(found), ", token %d %u", (int)token.id, (unsigned)token.length);
+            regexx_free(re);
+
+            /* The first is the compiled DFA, which the rest should agree with */
+            if (m == 0)
+                memcpy(expected, found, sizeof(found));
+            else if (strcmp(expected, found) != 0) {
+                fprintf(stderr, "[-] empty: mode 0x%x%s: \"%s\" in \"%s\": expected %s, found %s\n",
+                        modes[m / 2], (m % 2) ? "" : " compiled", patterns[i], texts[t], expected, found);
+                result = 1;
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * Bytes the patterns never tell apart share a column in the DFA.
+ */
+static int selftest_classes(void) {
+    regexx_t *re = regexx_create(0);
+    size_t count;
+    int result = 0;
+
+    /* {a}, {b,c}, {d}, {x}, and everything else */
+    regexx_add_pattern(re, "[a-c]x", 1, 0);
+    regexx_add_pattern(re, "[b-d]+", 2, 0);
+    regexx_compile(re);
+    count = regexx_get_class_count(re);
+    if (count != 5) {
+        fprintf(stderr, "[-] classes: found %u, expected 5\n", (unsigned)count);
+        result = 1;
+    }
+    regexx_free(re);
+
+    re = selftest_lexer(true, 0, 0);
+    if (re == NULL)
+        return 1;
+    count = regexx_get_class_count(re);
+    if (count == 0 || count >= 256) {
+        fprintf(stderr, "[-] classes: lexer has %u\n", (unsigned)count);
+        result = 1;
+    }
+    regexx_free(re);
+    return result;
+}
+
+/**
+ * Minimizing merges equivalent states, but never ones that end up
+ * matching different patterns.
+ */
+static int selftest_minimize(void) {
+    static const struct {
+        const char *patterns[3];
+        size_t built;
+        size_t minimized;
+    } cases[] = {
+        {{"ac|bc", 0}, 5, 4},
+        {{"a[cd]", "b[cd]", 0}, 6, 6},
+        {{0}}
+    };
+    size_t i;
+    int result = 0;
+
+    for (i=0; cases[i].patterns[0]; i++) {
+        regexx_t *re = regexx_create(0);
+        size_t built = 0;
+        size_t minimized = 0;
+        size_t j;
+
+        for (j=0; cases[i].patterns[j]; j++)
+            regexx_add_pattern(re, cases[i].patterns[j], j+1, 0);
+        regexx_compile(re);
+        regexx_get_state_counts(re, &built, &minimized);
+        if (built != cases[i].built || minimized != cases[i].minimized) {
+            fprintf(stderr, "[-] minimize %u: states %u/%u, expected %u/%u\n", (unsigned)i,
+                    (unsigned)built, (unsigned)minimized,
+                    (unsigned)cases[i].built, (unsigned)cases[i].minimized);
+            result = 1;
+        }
+        regexx_free(re);
+    }
+    return result;
+}
+
+/**
+ * Plain strings go into the Aho-Corasick automaton, whose matches get
+ * merged with those of the DFA.
+ */
+static int selftest_literals(void) {
+    static const char *patterns[] = {"he", "she", "his", "hers", "[a-z]+rs!", 0};
+    static const struct {
+        const char *text;
+        size_t id;
+        size_t offset;
+        size_t length;
+    } cases[] = {
+        {"ushers", 2, 1, 3},
+        {"a hers", 4, 2, 4},
+        {"ahishe", 3, 1, 3},
+        {"ushers!", 5, 0, 7},
+        {"xyz", REGEXX_NOT_FOUND, 0, 0},
+        {0}
+    };
+    regexx_t *re = regexx_create(0);
+    size_t i;
+    int result = 0;
+
+    for (i=0; patterns[i]; i++)
+        regexx_add_pattern(re, patterns[i], i+1, 0);
+    regexx_compile(re);
+    for (i=0; cases[i].text; i++) {
+        size_t offset = 0;
+        size_t length = 0;
+        size_t id;
+
+        id = regexx_match(re, cases[i].text, 0, SIZE_MAX, &offset, &length);
+        if (id != cases[i].id || (id != REGEXX_NOT_FOUND && (offset != cases[i].offset || length != cases[i].length))) {
+            fprintf(stderr, "[-] literals: \"%s\": id=%u %u,%u\n", cases[i].text,
+                    (unsigned)id, (unsigned)offset, (unsigned)length);
+            result = 1;
+        }
+    }
+    regexx_free(re);
+    return result;
+}
+
+/**
+ * When every pattern starts with a string, the SIMD prefilter skips to
+ * where one might start. Try a match at every offset, to cross all the
+ * block boundaries.
+ */
+static int selftest_prefilter(void) {
+    char text[128];
+    regexx_t *re = regexx_create(0);
+    size_t i;
+    int result = 0;
+
+    regexx_add_pattern(re, "key=\\d+", 1, 0);
+    regexx_add_pattern(re, "kex[0-9]", 2, 0);
+    regexx_add_pattern(re, "id:\\w+", 3, 0);
+    regexx_compile(re);
+    for (i=0; i + 7 <= sizeof(text); i++) {
+        size_t offset = 0;
+        size_t length = 0;
+        size_t id;
+
+        memset(text, 'k', sizeof(text));
+        memcpy(text + i, "key=42;", 7);
+        id = regexx_match(re, text, 0, sizeof(text), &offset, &length);
+        if (id != 1 || offset != i || length != 6) {
+            fprintf(stderr, "[-] prefilter: at %u: id=%u %u,%u\n", (unsigned)i,
+                    (unsigned)id, (unsigned)offset, (unsigned)length);
+            result = 1;
+            break;
+        }
+    }
+    regexx_free(re);
+    return result;
+}
+
+/**
+ * Compiled, the match that starts first wins, even when another pattern's
+ * match ends first, then the longest, then the pattern added first.
+ */
+static int selftest_leftmost(unsigned flags) {
+    static const struct {
+        const char *patterns[2];
+        const char *text;
+        size_t id;
+        size_t offset;
+        size_t length;
+    } tests[] = {
+        {{"b[c]", "a[b-e]*f"},          "xabcdef",      2, 1, 6},
+        {{"b[c]", "a[b-e]*f"},          "xabcdex",      1, 2, 2},
+        {{"[a-z]+", "[a-z]+[0-9]"},     "  abc1 ",      2, 2, 4},
+        {{"a[b]", "[a]b"},              "xab",          1, 1, 2},
+        {{"^a[x]", "[a]y$"},            "ayax ay",      2, 5, 2},
+        {{"^a[x]", "[a]y$"},            "axay",         1, 0, 2},
+        {{0}, 0}
+    };
+    size_t i;
+    int result = 0;
+
+    for (i=0; tests[i].text; i++) {
+        regexx_t *re = regexx_create(flags);
+        size_t offset = 0;
+        size_t length = 0;
+        size_t id;
+
+        regexx_set_cache_size(re, 1); /* flush the cache constantly */
+        regexx_add_pattern(re, tests[i].patterns[0], 1, 0);
+        regexx_add_pattern(re, tests[i].patterns[1], 2, 0);
+        regexx_compile(re);
+        id = regexx_match(re, tests[i].text, 0, strlen(tests[i].text), &offset, &length);
+        if (id != tests[i].id || offset != tests[i].offset || length != tests[i].length) {
+            fprintf(stderr, "[-] leftmost: \"%s\": id=%u %u,%u\n", tests[i].text,
+                    (unsigned)id, (unsigned)offset, (unsigned)length);
+            result = 1;
+        }
+        regexx_free(re);
+    }
+    return result;
+}
+
+/**
+ * Patterns without a leading string still skip offsets, by the bytes
+ * they can start with, and those anchored with '^' only match at 0.
+ */
+static int selftest_first(bool is_compiled, unsigned flags) {
+    char text[128];
+    regexx_t *re = regexx_create(flags);
+    size_t offset = 0;
+    size_t length = 0;
+    size_t id;
+    size_t i;
+    int result = 0;
+
+    regexx_add_pattern(re, "(x|y)*[0-9]+", 1, 0);
+    regexx_add_pattern(re, "^k+z", 2, 0);
+    if (is_compiled)
+        regexx_compile(re);
+    for (i=1; i + 3 <= sizeof(text); i++) {
+        memset(text, 'k', sizeof(text));
+        memcpy(text + i, "y7;", 3);
+        id = regexx_match(re, text, 0, sizeof(text), &offset, &length);
+        if (id != 1 || offset != i || length != 2) {
+            fprintf(stderr, "[-] first: at %u: id=%u %u,%u\n", (unsigned)i,
+                    (unsigned)id, (unsigned)offset, (unsigned)length);
+            result = 1;
+            break;
+        }
+    }
+
+    /* The anchored pattern matches at the start, but not after it */
+    memcpy(text, "kkz", 3);
+    id = regexx_match(re, text, 0, 3, &offset, &length);
+    if (id != 2 || offset != 0 || length != 3)
+        result = 1;
+    id = regexx_match(re, text, 1, 3, &offset, &length);
+    if (id != REGEXX_NOT_FOUND)
+        result = 1;
+    if (result)
+        fprintf(stderr, "[-] first: anchored\n");
+    regexx_free(re);
+    return result;
+}
+
+/**
+ * Memoized backtracking gives the same results as plain backtracking,
+ * without taking exponential time on nested quantifiers.
+ */
+static int selftest_memoize(void) {
+    static const struct {
+        const char *pattern;
+        const char *text;
+    } tests[] = {
+        {"(a*)*b", "xaaab"},
+        {"(a|ab)(c|bcd)(d*)", "abcd"},
+        {"a.*?b(?!c)", "axbcaxbd"},
+        {"(x+x+)+y", "xxxxxxxxxxy"},
+        {0, 0}
+    };
+    char text[200];
+    regexx_t *re1;
+    regexx_t *re2;
+    size_t offset1 = 0, offset2 = 0;
+    size_t length1 = 0, length2 = 0;
+    size_t id1, id2;
+    size_t i;
+    int result = 0;
+
+    for (i=0; tests[i].pattern; i++) {
+        size_t length = strlen(tests[i].text);
+
+        re1 = regexx_create(0);
+        re2 = regexx_create(REGEXX_MEMOIZE);
+        regexx_add_pattern(re1, tests[i].pattern, 1, 0);
+        regexx_add_pattern(re2, tests[i].pattern, 1, 0);
+        id1 = regexx_match(re1, tests[i].text, 0, length, &offset1, &length1);
+        id2 = regexx_match(re2, tests[i].text, 0, length, &offset2, &length2);
+        if (id1 != 1 || id2 != id1 || offset2 != offset1 || length2 != length1) {
+            fprintf(stderr, "[-] memoize: %s: %u,%u,%u != %u,%u,%u\n", tests[i].pattern,
+                    (unsigned)id2, (unsigned)offset2, (unsigned)length2,
+                    (unsigned)id1, (unsigned)offset1, (unsigned)length1);
+            result = 1;
+        }
+        regexx_free(re1);
+        regexx_free(re2);
+    }
+
+    /* Without memoizing, this takes about length^7 steps */
+    re2 = regexx_create(REGEXX_MEMOIZE);
+    regexx_add_pattern(re2, ".*.*.*.*.*.*.*x", 1, 0);
+    memset(text, 'a', sizeof(text));
+    id2 = regexx_match(re2, text, 0, sizeof(text), &offset2, &length2);
+    if (id2 != REGEXX_NOT_FOUND) {
+        fprintf(stderr, "[-] memoize: nested\n");
+        result = 1;
+    }
+    regexx_free(re2);
+    return result;
+}
+
+/**
+ * Backtracking over a long input, like a 1 megabyte comment, takes no
+ * more C stack than a short one.
+ */
+static int selftest_long(void) {
+    size_t length = 1024 * 1024;
+    char *text = malloc(length);
+    regexx_t *re = regexx_create(0);
+    size_t offset = 0;
+    size_t out_length = 0;
+    size_t id;
+    int result = 0;
+
+    memset(text, 'x', length);
+    memcpy(text, "/*", 2);
+    memcpy(text + length - 2, "*/", 2);
+    regexx_add_pattern(re, "/\\*.*?\\*/", 1, 0);
+    id = regexx_match(re, text, 0, length, &offset, &out_length);
+    if (id != 1 || offset != 0 || out_length != length) {
+        fprintf(stderr, "[-] long: %u,%u,%u\n", (unsigned)id, (unsigned)offset, (unsigned)out_length);
+        result = 1;
+    }
+    regexx_free(re);
+    free(text);
+    return result;
+}
+
+/**
+ * Scans stop with REGEXX_NOT_FINISHED when they run out of steps or
+ * time, or are cancelled, and carry on normally afterwards.
+ */
+static int selftest_limits(void) {
+    size_t length = 1024 * 1024;
+    char *text = malloc(length);
+    regexx_t *re1 = regexx_create(0);
+    regexx_t *re2 = regexx_create(0);
+    struct regexxtoken_t token;
+    size_t offset = 0;
+    size_t out_length = 0;
+    int result = 0;
+
+    memset(text, 'a', length);
+    memcpy(text + length - 3, "xyz", 3);
+
+    /* Backtracking, which would take about length^4 steps */
+    regexx_add_pattern(re1, ".*.*.*.*z", 1, 0);
+    regexx_set_limits(re1, 100000, 0);
+    if (regexx_match(re1, text, 0, 300, &offset, &out_length) != REGEXX_NOT_FINISHED)
+        result = 1;
+    regexx_set_limits(re1, 0, 1000);
+    if (regexx_match(re1, text, 0, 300, &offset, &out_length) != REGEXX_NOT_FINISHED)
+        result = 1;
+    if (regexx_match(re1, "abz", 0, 3, &offset, &out_length) != 1)
+        result = 1;
+
+    /* The compiled DFA, over a long input */
+    regexx_add_pattern(re2, "x[y]z", 1, 0);
+    regexx_compile(re2);
+    regexx_set_limits(re2, 10000, 0);
+    if (regexx_match(re2, text, 0, length, &offset, &out_length) != REGEXX_NOT_FINISHED)
+        result = 1;
+    offset = length - 100;
+    token = regexx_lex_token(re2, text, &offset, length);
+    if (token.id != REGEXX_NOT_FOUND)
+        result = 1;
+    regexx_set_limits(re2, 0, 0);
+    if (regexx_match(re2, text, 0, length, &offset, &out_length) != 1 || offset != length - 3)
+        result = 1;
+
+    /* Cancelling stops the next scan, but only that one */
+    regexx_cancel(re2);
+    if (regexx_match(re2, text, 0, length, &offset, &out_length) != REGEXX_NOT_FINISHED)
+        result = 1;
+    if (regexx_match(re2, text, 0, length, &offset, &out_length) != 1)
+        result = 1;
+
+    if (result)
+        fprintf(stderr, "[-] limits\n");
+    regexx_free(re1);
+    regexx_free(re2);
+    free(text);
+    return result;
+}
+
+/**
+ * The DFA compiled to machine code finds the same tokens as the one that
+ * is interpreted, including ones much longer than it runs at a time,
+ * and stops when it runs out of steps.
+ */
+static int selftest_jit(void) {
+    static const char *patterns[] = {"[a-z]+", "^ab", "x$", "[0-9]+b?", "(ab|cd)*e", 0};
+    size_t length = 100000;
+    char *text = malloc(length);
+    regexx_t *re1 = regexx_create(0);
+    regexx_t *re2 = regexx_create(REGEXX_JIT);
+    size_t offset;
+    int result = 0;
+    size_t i;
+
+    for (i=0; patterns[i]; i++) {
+        regexx_add_pattern(re1, patterns[i], i+1, 0);
+        regexx_add_pattern(re2, patterns[i], i+1, 0);
+    }
+    regexx_compile(re1);
+    regexx_compile(re2);
+
+    srand(1);
+    for (i=0; i<length; i++)
+        text[i] = "abcdex0129 "[rand() % 11];
+    memset(text + 5000, 'a', 50000);
+    for (offset=0; offset<length; offset++) {
+        size_t offset1 = offset;
+        size_t offset2 = offset;
+        regexxtoken_t token1 = regexx_lex_token(re1, text, &offset1, length);
+        regexxtoken_t token2 = regexx_lex_token(re2, text, &offset2, length);
+
+        if (token1.id != token2.id || offset1 != offset2)
+            result = 1;
+    }
+
+    regexx_set_limits(re2, 10000, 0);
+    offset = 5000;
+    if (regexx_lex_token(re2, text, &offset, length).id != REGEXX_NOT_FINISHED)
+        result = 1;
+
+    if (result)
+        fprintf(stderr, "[-] jit\n");
+    regexx_free(re1);
+    regexx_free(re2);
+    free(text);
+    return result;
+}
+
+/**
+ * With REGEXX_PIKEVM, a pattern the DFA can't handle is only searched for
+ * up to where the DFA's match starts, not on to the end of the input
+ * each time, which made finding every match take quadratic time.
+ */
+static int selftest_residual(void) {
+    size_t length = 200000;
+    char *text = malloc(length);
+    regexx_t *re = regexx_create(REGEXX_PIKEVM);
+    size_t offset = 0;
+    size_t count = 0;
+    int result = 0;
+    size_t i;
+
+    for (i=0; i<length; i++)
+        text[i] = (i % 2) ? 'b' : 'a';
+    regexx_add_pattern(re, "b", 1, 0);
+    regexx_add_pattern(re, "[ab]c+?", 2, 0);
+    regexx_compile(re);
+    regexx_set_limits(re, 10000, 0);
+    while (offset < length) {
+        size_t start = 0;
+        size_t out_length = 0;
+        size_t id = regexx_match(re, text, offset, length, &start, &out_length);
+
+        if (id != 1) {
+            result = 1;
+            break;
+        }
+        count++;
+        offset = start + out_length;
+    }
+    if (count != length / 2)
+        result = 1;
+
+    if (result)
+        fprintf(stderr, "[-] residual: %u matches\n", (unsigned)count);
+    regexx_free(re);
+    free(text);
+    return result;
+}
+
+typedef struct countingalloc_t {
+    size_t alloc_count;
+    size_t release_count;
+} countingalloc_t;
+
+static void *counting_alloc(void *ctx, size_t size) {
+    ((countingalloc_t *)ctx)->alloc_count++;
+    return malloc(size);
+}
+
+static void counting_release(void *ctx, void *ptr) {
+    ((countingalloc_t *)ctx)->release_count++;
+    free(ptr);
+}
+
+/**
+ * Parsing takes its memory in a few large blocks from the allocator, and
+ * gives it all back when freed, including after a pattern fails to parse.
+ */
+static int selftest_allocator(void) {
+    countingalloc_t counts = {0, 0};
+    regexx_t *re = regexx_create(0);
+    size_t offset = 0;
+    size_t length = 0;
+    int result = 0;
+    size_t i;
+
+    regexx_set_allocator(re, counting_alloc, counting_release, &counts);
+    for (i=0; clex_macros[i].name; i++)
+        regexx_add_macro(re, clex_macros[i].name, clex_macros[i].value);
+    for (i=0; i<100; i++)
+        regexx_add_pattern(re, clex_exp[i % 18].pattern, i+1, 0);
+    if (regexx_add_pattern(re, "a{NOSUCHMACRO}", 1000, 0) == 0)
+        result = 1;
+    if (regexx_match(re, "x = 0x1F;", 0, 9, &offset, &length) != 1 || length != 1)
+        result = 1;
+    if (counts.alloc_count == 0 || counts.alloc_count > 16)
+        result = 1;
+    regexx_free(re);
+    if (counts.release_count != counts.alloc_count)
+        result = 1;
+
+    if (result)
+        fprintf(stderr, "[-] allocator: %u blocks, %u given back\n",
+                (unsigned)counts.alloc_count, (unsigned)counts.release_count);
+    return result;
+}
+
+/**
+ * Patterns loaded with `regexx_deserialize()` match the same as the ones
+ * that were saved, and damaged data is refused.
+ */
+static int selftest_serialize(unsigned flags) {
+    static const char text[] =
+        "x = 0x1F + 017u * 42UL - 3.14e-2f; c = 'a' + '\\n';\n"
+        "s = u8\"hello\" \"world\\x41\"\n";
+    regexx_t *re1 = selftest_lexer(false, flags, 0);
+    regexx_t *re2;
+    void *data = NULL;
+    size_t length = 0;
+    size_t offset1 = 0;
+    size_t offset2 = 0;
+    int result = 0;
+
+    regexx_add_pattern(re1, "c(?= )", 100, 0);
+    regexx_add_pattern(re1, "hello", 101, 0);
+    if (regexx_serialize(re1, &data, &length) == 0)
+        result = 1; /* not compiled yet */
+    regexx_compile(re1);
+    if (regexx_serialize(re1, &data, &length) != 0)
+        return 1;
+    re2 = regexx_deserialize(data, length);
+    if (re2 == NULL) {
+        fprintf(stderr, "[-] serialize(0x%x): can't load\n", flags);
+        free(data);
+        regexx_free(re1);
+        return 1;
+    }
+
+    while (offset1 < sizeof(text) - 1) {
+        regexxtoken_t token1 = regexx_lex_token(re1, text, &offset1, sizeof(text) - 1);
+        regexxtoken_t token2 = regexx_lex_token(re2, text, &offset2, sizeof(text) - 1);
+        size_t start1 = 0, start2 = 0;
+        size_t length1 = 0, length2 = 0;
+        size_t id1, id2;
+
+        if (token1.id != token2.id || offset1 != offset2)
+            result = 1;
+        if (token1.id == REGEXX_NOT_FOUND) {
+            offset1++;
+            offset2++;
+        }
+        id1 = regexx_match(re1, text, offset1, sizeof(text) - 1, &start1, &length1);
+        id2 = regexx_match(re2, text, offset2, sizeof(text) - 1, &start2, &length2);
+        if (id1 != id2 || start1 != start2 || length1 != length2)
+            result = 1;
+    }
+    regexx_free(re2);
+
+    /* A damaged byte, or missing ones, are noticed */
+    ((char *)data)[length - 1] ^= 1;
+    if (regexx_deserialize(data, length) != NULL)
+        result = 1;
+    ((char *)data)[length - 1] ^= 1;
+    if (regexx_deserialize(data, length - 8) != NULL)
+        result = 1;
+
+    if (result)
+        fprintf(stderr, "[-] serialize(0x%x)\n", flags);
+    free(data);
+    regexx_free(re1);
+    return result;
+}
+
+#ifndef _WIN32
+/* A `main()` for the generated scanner, printing the token at each offset
+ * of the file it's given, the way `generate_expect()` does */
+static const char generate_main[] =
+    "#include <stdio.h>\n"
+    "size_t clex_scan(const char *text, size_t offset, size_t length, size_t *r_length);\n"
+    "int main(int argc, char *argv[]) {\n"
+    "    static char text[65536];\n"
+    "    FILE *fp = fopen(argv[argc - 1], \"rb\");\n"
+    "    size_t length = fp ? fread(text, 1, sizeof(text), fp) : 0;\n"
+    "    size_t offset = 0;\n"
+    "    while (offset < length) {\n"
+    "        size_t token_length = 0;\n"
+    "        size_t id = clex_scan(text, offset, length, &token_length);\n"
+    "        if (id == (size_t)-1)\n"
+    "            token_length = 0;\n"
+    "        printf(\"%d %u\\n\", (int)id, (unsigned)token_length);\n"
+    "        offset += token_length ? token_length : 1;\n"
+    "    }\n"
+    "    return 0;\n"
+    "}\n";
+
+/** The tokens `regexx_lex_token()` finds, as the generated scanner prints them */
+static void generate_expect(regexx_t *re, const char *text, size_t length, char *buf, size_t size) {
+    size_t offset = 0;
+    size_t used = 0;
+
+    buf[0] = '\0';
+    while (offset < length && used + 32 < size) {
+        regexxtoken_t token = regexx_lex_token(re, text, &offset, length);
+
+        if (token.id == REGEXX_NOT_FOUND) {
+            token.length = 0;
+            offset++;
+        }
+        used += (size_t)snprintf(buf + used, size - used, "%d %u\n", (int)token.id, (unsigned)token.length);
+    }
+}
+
+/**
+ * Compiles the scanner with warnings as errors, and runs it over `text`.
+ * @return 0 if its tokens are in `buf`, 1 if it didn't compile or run,
+ *  or -1 if there's no C compiler here to try it with
+ */
+static int generate_run(regexx_t *re, unsigned flags, const char *text, size_t length, char *buf, size_t size) {
+    char dir[] = "/tmp/regexx-gen-XXXXXX";
+    char path[256];
+    char command[1024];
+    const char *cc = getenv("CC") ? getenv("CC") : "cc";
+    size_t used = 0;
+    int result = 1;
+    FILE *fp;
+
+    snprintf(command, sizeof(command), "%s --version >/dev/null 2>&1", cc);
+    if (system(command) != 0 || mkdtemp(dir) == NULL)
+        return -1;
+
+    snprintf(path, sizeof(path), "%s/scan.c", dir);
+    fp = fopen(path, "wt");
+    if (fp == NULL || regexx_generate(re, fp, "clex", flags) != 0 || fclose(fp) != 0)
+        goto done;
+    snprintf(path, sizeof(path), "%s/main.c", dir);
+    fp = fopen(path, "wt");
+    if (fp == NULL || fputs(generate_main, fp) < 0 || fclose(fp) != 0)
+        goto done;
+    snprintf(path, sizeof(path), "%s/text", dir);
+    fp = fopen(path, "wb");
+    if (fp == NULL || fwrite(text, 1, length, fp) != length || fclose(fp) != 0)
+        goto done;
+
+    snprintf(command, sizeof(command),
+            "%s -Wall -Wextra -Werror -o %s/scan %s/scan.c %s/main.c && %s/scan %s/text >%s/out",
+            cc, dir, dir, dir, dir, dir, dir);
+    if (system(command) != 0) {
+        fprintf(stderr, "[-] generate(0x%x): the scanner in %s didn't build or run\n", flags, dir);
+        return 1; /* kept, to look at */
+    }
+    snprintf(path, sizeof(path), "%s/out", dir);
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+        goto done;
+    used = fread(buf, 1, size - 1, fp);
+    buf[used] = '\0';
+    fclose(fp);
+    result = 0;
+
+done:
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    if (system(command) != 0)
+        result = 1;
+    return result;
+}
+#endif
+
+/**
+ * `regexx_generate()` writes a scanner for the lexer, in either form,
+ * that finds the same tokens as `regexx_lex_token()`, but refuses
+ * patterns a DFA can't handle.
+ */
+static int selftest_generate(unsigned flags) {
+    static const char text[] =
+        "x = 0x1F + 017u * 42UL - 3.14e-2f; c = 'a' + '\\n';\n"
+        "s = u8\"hello\" \"world\\x41\"\n"
+        "d = .5 + 1. + 0x1.8p3 + 0x.Fp-1L;\n"
+        "int main(void) { return a[i] <<= 2 ? b->c : d.e; } /* done */ @ $\n";
+    regexx_t *re = selftest_lexer(true, 0, 0);
+    int result = 0;
+    FILE *fp;
+
+    if (re == NULL)
+        return 1;
+#ifndef _WIN32
+    {
+        static char expected[16384];
+        static char found[16384];
+        int err;
+
+        generate_expect(re, text, sizeof(text) - 1, expected, sizeof(expected));
+        err = generate_run(re, flags, text, sizeof(text) - 1, found, sizeof(found));
+        if (err > 0 || (err == 0 && strcmp(expected, found) != 0))
+            result = 1;
     }
+#endif
+
+    fp = tmpfile();
+    regexx_add_pattern(re, "c(?= )", 100, 0);
+    if (fp && regexx_generate(re, fp, "clex", flags) == 0)
+        result = 1;
+    if (fp)
+        fclose(fp);
+
+    if (result)
+        fprintf(stderr, "[-] generate(0x%x)\n", flags);
+    regexx_free(re);
+    return result;
+}
+
+typedef struct streammatches_t {
+    size_t ids[16];
+    uint64_t offsets[16];
+    uint64_t lengths[16];
+    size_t count;
+} streammatches_t;
+
+static int stream_collect(void *ctx, size_t id, uint64_t offset, uint64_t length) {
+    streammatches_t *matches = (streammatches_t *)ctx;
+
+    if (matches->count < 16) {
+        matches->ids[matches->count] = id;
+        matches->offsets[matches->count] = offset;
+        matches->lengths[matches->count] = length;
+    }
+    matches->count++;
     return 0;
 }
+
+/**
+ * A stream finds the same matches as `regexx_match()` on the whole input,
+ * however it's split into chunks, including matches across chunks and
+ * ones that are only decided at the end.
+ */
+static int selftest_stream(void) {
+    static const char text[] = "xabcabcabdd cd aaab abcabc";
+    static const size_t expected[][3] = {
+        {2, 1, 9}, {3, 12, 2}, {1, 15, 4}, {2, 20, 6},
+    };
+    size_t length = sizeof(text) - 1;
+    regexx_t *re = regexx_create(0);
+    regexxstream_t *stream;
+    size_t chunk_size;
+    int result = 0;
+    size_t i;
+
+    regexx_add_pattern(re, "a+b", 1, 0);
+    regexx_add_pattern(re, "(abc)+(abd)?", 2, 0);
+    regexx_add_pattern(re, "cd|c$", 3, 0);
+    regexx_compile(re);
+
+    for (chunk_size=1; chunk_size<=length; chunk_size++) {
+        streammatches_t matches = {{0}, {0}, {0}, 0};
+
+        stream = regexx_stream_open(re, stream_collect, &matches);
+        for (i=0; i<length; i+=chunk_size) {
+            size_t n = (length - i < chunk_size) ? length - i : chunk_size;
+            regexx_stream_scan(stream, text + i, n);
+        }
+        regexx_stream_close(stream);
+
+        if (matches.count != 4)
+            result = 1;
+        for (i=0; i<4 && i<matches.count; i++) {
+            if (matches.ids[i] != expected[i][0] || matches.offsets[i] != expected[i][1]
+                    || matches.lengths[i] != expected[i][2])
+                result = 1;
+        }
+        if (result) {
+            fprintf(stderr, "[-] stream: chunks of %u\n", (unsigned)chunk_size);
+            break;
+        }
+    }
+
+    /* The result of lookahead depends on what comes next */
+    regexx_add_pattern(re, "c(?= )", 4, 0);
+    if (regexx_stream_open(re, stream_collect, NULL) != NULL) {
+        fprintf(stderr, "[-] stream: opened with lookahead\n");
+        result = 1;
+    }
+
+    regexx_free(re);
+    return result;
+}
+
+/**
+ * Scanners with their own scratch share the compiled patterns without
+ * getting in each other's way, including the lazy DFA's cache and the
+ * line numbers.
+ */
+static int selftest_scratch(void) {
+    static const char text[] =
+        "x = 0x1F + \"a\"\n"
+        "s = u8\"hello\"\n"
+        "d = .5 + \"b\"\n";
+    static const char other[] = "'\\n' 017u \"\n\n\" 3.14e-2f 0x.Fp-1L";
+    regexx_t *re1 = selftest_lexer(true, 0, 0);
+    regexx_t *re2 = selftest_lexer(true, REGEXX_LAZY_DFA, 1);
+    regexx_scratch_t *scratch[2];
+    size_t offset1 = 0;
+    size_t offset2 = 0;
+    size_t offset3 = 0;
+    size_t length = sizeof(text) - 1;
+    int result = 0;
+
+    if (re1 == NULL || re2 == NULL)
+        return 1;
+    scratch[0] = regexx_scratch_create(re2);
+    scratch[1] = regexx_scratch_create(re2);
+
+    /* In between each token, the other scratch scans something else */
+    while (offset1 < length) {
+        regexxtoken_t token1 = regexx_lex_token(re1, text, &offset1, length);
+        regexxtoken_t token2;
+
+        if (offset3 < sizeof(other) - 1) {
+            token2 = regexx_scratch_lex_token(re2, scratch[0], other, &offset3, sizeof(other) - 1);
+            if (token2.id == REGEXX_NOT_FOUND)
+                offset3++;
+        }
+        token2 = regexx_scratch_lex_token(re2, scratch[1], text, &offset2, length);
+        if (token1.id != token2.id || token1.length != token2.length
+                || token1.line_number != token2.line_number || offset1 != offset2) {
+            result = 1;
+            break;
+        }
+        if (token1.id == REGEXX_NOT_FOUND) {
+            offset1++;
+            offset2++;
+        }
+    }
+
+    /* A nested file starts at line 1, and the outer one carries on
+     * where it was */
+    regexx_scratch_lex_push(scratch[1]);
+    offset2 = 0;
+    if (regexx_scratch_lex_token(re2, scratch[1], text, &offset2, length).line_number != 1)
+        result = 1;
+    regexx_scratch_lex_pop(scratch[1]);
+    offset2 = 0;
+    if (regexx_scratch_lex_token(re2, scratch[1], text, &offset2, length).line_number != 4)
+        result = 1;
+
+    if (result)
+        fprintf(stderr, "[-] scratch\n");
+    regexx_scratch_free(scratch[0]);
+    regexx_scratch_free(scratch[1]);
+    regexx_free(re1);
+    regexx_free(re2);
+    return result;
+}
+
+typedef struct matchlist_t {
+    size_t *ids;
+    size_t *offsets;
+    size_t count;
+    size_t max;
+} matchlist_t;
+
+static void matchlist_add(matchlist_t *list, size_t id, size_t offset) {
+    if (list->count >= list->max) {
+        list->max = list->max * 2 + 256;
+        list->ids = realloc(list->ids, list->max * sizeof(list->ids[0]));
+        list->offsets = realloc(list->offsets, list->max * sizeof(list->offsets[0]));
+        if (list->ids == NULL || list->offsets == NULL)
+            abort();
+    }
+    list->ids[list->count] = id;
+    list->offsets[list->count] = offset;
+    list->count++;
+}
+
+static int parallel_collect(void *ctx, size_t id, uint64_t offset, uint64_t length) {
+    (void)length;
+    matchlist_add((matchlist_t *)ctx, id, (size_t)offset);
+    return 0;
+}
+
+/**
+ * Scanning a buffer in chunks on several threads finds the same matches
+ * as one search after another, including where matches cross from one
+ * chunk into the next. The second set has no maximum length, and its
+ * matches from "90" to "12" run across the chunks.
+ */
+static int selftest_parallel(void) {
+    static const char *sets[][2] = {
+        {"x[0-9][0-9]?[0-9]?", "[0-9][0-9][0-9][0-9][0-9]?[0-9]?"},
+        {"x[0-9]+", "90x*12"},
+    };
+    size_t length = 2 * 1024 * 1024;
+    char *text = malloc(length);
+    int result = 0;
+    size_t s;
+    size_t i;
+
+    memset(text, 'x', length);
+    for (i=100; i + 10 < length; i+=4099)
+        memcpy(text + i, "1234567890", 10);
+    for (i=1; i<8; i++)
+        memcpy(text + i * length / 8 - 5, "1234567890", 10);
+
+    for (s=0; s<sizeof(sets)/sizeof(sets[0]); s++) {
+        regexx_t *re = regexx_create(0);
+        matchlist_t expected = {0};
+        matchlist_t found = {0};
+        size_t offset = 0;
+        int is_bad = 0;
+
+        regexx_add_pattern(re, sets[s][0], 1, 0);
+        regexx_add_pattern(re, sets[s][1], 2, 0);
+        regexx_compile(re);
+
+        for (;;) {
+            size_t start = 0;
+            size_t out_length = 0;
+            size_t id = regexx_match(re, text, offset, length, &start, &out_length);
+
+            if (id == REGEXX_NOT_FOUND)
+                break;
+            matchlist_add(&expected, id, start);
+            offset = start + out_length;
+        }
+
+        if (regexx_scan_parallel(re, text, length, 2, parallel_collect, &found) != 0)
+            is_bad = 1;
+        if (found.count != expected.count)
+            is_bad = 1;
+        for (i=0; i<found.count && i<expected.count; i++) {
+            if (found.ids[i] != expected.ids[i] || found.offsets[i] != expected.offsets[i])
+                is_bad = 1;
+        }
+
+        if (is_bad)
+            fprintf(stderr, "[-] parallel: %s|%s: %u matches, not %u\n", sets[s][0], sets[s][1],
+                    (unsigned)found.count, (unsigned)expected.count);
+        result |= is_bad;
+        free(expected.ids);
+        free(expected.offsets);
+        free(found.ids);
+        free(found.offsets);
+        regexx_free(re);
+    }
+    free(text);
+    return result;
+}
+
+/**
+ * Adding patterns in bulk, on several threads, gives the same patterns
+ * as adding them one at a time, and the same errors.
+ */
+static int selftest_add_patterns(void) {
+    size_t count = 1000;
+    char **patterns = malloc(count * sizeof(patterns[0]));
+    size_t *ids = malloc(count * sizeof(ids[0]));
+    int *results = malloc(count * sizeof(results[0]));
+    regexx_t *re1 = regexx_create(REGEXX_LAZY_DFA);
+    regexx_t *re2 = regexx_create(REGEXX_LAZY_DFA);
+    void *data1 = NULL;
+    void *data2 = NULL;
+    size_t length1 = 0;
+    size_t length2 = 0;
+    int failed = 0;
+    int result = 0;
+    size_t i;
+
+    for (i=0; clex_macros[i].name; i++) {
+        regexx_add_macro(re1, clex_macros[i].name, clex_macros[i].value);
+        regexx_add_macro(re2, clex_macros[i].name, clex_macros[i].value);
+    }
+    for (i=0; i<count; i++) {
+        char buf[64];
+
+        switch (i % 5) {
+            case 0: snprintf(buf, sizeof(buf), "word%u", (unsigned)i); break;
+            case 1: snprintf(buf, sizeof(buf), "w%u[a-f]+{D}", (unsigned)i); break;
+            case 2: snprintf(buf, sizeof(buf), "x%u(?=y)", (unsigned)i); break;
+            case 3: snprintf(buf, sizeof(buf), "(a|b%u)*c[^d]", (unsigned)i); break;
+            default: snprintf(buf, sizeof(buf), (i % 3) ? "{L}%u" : "*%u", (unsigned)i); break;
+        }
+        patterns[i] = strdup(buf);
+        ids[i] = i + 1;
+        if (regexx_add_pattern(re1, patterns[i], ids[i], 0) != 0)
+            failed++;
+    }
+
+    if (regexx_add_patterns(re2, (const char *const *)patterns, ids, count, 0, 4, results) != failed || failed == 0)
+        result = 1;
+    for (i=0; i<count; i++) {
+        if ((results[i] != 0) != (patterns[i][0] == '*'))
+            result = 1;
+    }
+    if (strncmp(regexx_get_error_msg(re2), "pattern 9: ", 11) != 0)
+        result = 1;
+
+    /* The same NFA program, so the same DFA */
+    regexx_compile(re1);
+    regexx_compile(re2);
+    if (regexx_serialize(re1, &data1, &length1) != 0 || regexx_serialize(re2, &data2, &length2) != 0
+            || length1 != length2 || memcmp(data1, data2, length1) != 0)
+        result = 1;
+
+    if (result)
+        fprintf(stderr, "[-] add_patterns: %s\n", regexx_get_error_msg(re2));
+    for (i=0; i<count; i++)
+        free(patterns[i]);
+    free(patterns);
+    free(ids);
+    free(results);
+    free(data1);
+    free(data2);
+    regexx_free(re1);
+    regexx_free(re2);
+    return result;
+}
+
+/** The patterns for `selftest_delta()`, by their number */
+static void delta_pattern(char *buf, size_t size, size_t i) {
+    switch (i % 4) {
+        case 0: snprintf(buf, size, "word%u", (unsigned)i); break;
+        case 1: snprintf(buf, size, "b%u[a-z]?", (unsigned)i); break;
+        case 2: snprintf(buf, size, "x%u(?=y)", (unsigned)i); break;
+        default: snprintf(buf, size, "w%u[a-f]+[0-9]", (unsigned)i); break;
+    }
+}
+
+/**
+ * Patterns added after compiling go into a delta, searched alongside the
+ * compiled ones, until there are enough to compile everything again, on
+ * another thread. Whether a merge has finished or not, and searching with
+ * scratch or with the set's own, the results must be those of compiling
+ * all the patterns at once.
+ */
+static int selftest_delta(void) {
+    static const char text[] = "word104 b105 x106y w107ab9 word2000 b201q x202yy w299ff3 b5 word8";
+    regexx_t *re = regexx_create(0);
+    regexx_scratch_t *sc = regexx_scratch_create(re);
+    char buf[64];
+    int result = 0;
+    size_t i;
+    size_t j;
+
+    for (i=0; i<300 && result == 0; i++) {
+        regexx_t *all;
+        size_t offset;
+
+        delta_pattern(buf, sizeof(buf), i);
+        regexx_add_pattern(re, buf, i + 1, 0);
+        if (i == 0 || i == 99)
+            regexx_compile(re);
+        if (i % 7 != 0)
+            continue;
+
+        all = regexx_create(0);
+        for (j=0; j<=i; j++) {
+            delta_pattern(buf, sizeof(buf), j);
+            regexx_add_pattern(all, buf, j + 1, 0);
+        }
+        regexx_compile(all);
+        for (offset=0; offset<sizeof(text); offset++) {
+            size_t offset1 = 0, length1 = 0;
+            size_t offset2 = 0, length2 = 0;
+            size_t offset5 = 0, length5 = 0;
+            size_t offset3 = offset;
+            size_t offset4 = offset;
+            size_t id1 = regexx_scratch_match(re, sc, text, offset, sizeof(text) - 1, &offset1, &length1);
+            size_t id2 = regexx_match(all, text, offset, sizeof(text) - 1, &offset2, &length2);
+            size_t id3 = regexx_match(re, text, offset, sizeof(text) - 1, &offset5, &length5);
+            struct regexxtoken_t token1 = regexx_scratch_lex_token(re, sc, text, &offset3, sizeof(text) - 1);
+            struct regexxtoken_t token2 = regexx_lex_token(all, text, &offset4, sizeof(text) - 1);
+
+            if (id1 != id2 || offset1 != offset2 || length1 != length2
+                    || id3 != id2 || offset5 != offset2 || length5 != length2
+                    || token1.id != token2.id || offset3 != offset4) {
+                fprintf(stderr, "[-] delta: %u patterns, offset %u: %u vs %u\n",
+                    (unsigned)(i + 1), (unsigned)offset, (unsigned)id1, (unsigned)id2);
+                result = 1;
+                break;
+            }
+        }
+        regexx_free(all);
+    }
+
+    regexx_scratch_free(sc);
+    regexx_free(re);
+    return result;
+}
+
+/**
+ * A reload makes the new patterns current for the next scan, while a
+ * reader that's in the middle of one keeps the old version until it
+ * leaves, and the reload waits for that. Meanwhile, readers can still
+ * be created and freed, even by the one that's scanning.
+ */
+static int selftest_live(void) {
+    static const char text[] = "say alpha";
+    regexx_t *re1 = regexx_create(0);
+    regexx_t *re2 = regexx_create(REGEXX_LAZY_DFA);
+    regexxlive_t *live;
+    regexxreader_t *reader1;
+    regexxreader_t *reader2;
+    regexxreader_t *reader3;
+    regexx_scratch_t *sc;
+    const regexx_t *old;
+    size_t offset = 0;
+    size_t length = 0;
+    size_t id = 0;
+    int result = 0;
+    unsigned i;
+
+    regexx_add_pattern(re1, "alpha", 1, 0);
+    regexx_compile(re1);
+    regexx_add_pattern(re2, "al+pha", 2, 0);
+    live = regexx_live_create(re1);
+    reader1 = regexx_live_reader_create(live);
+    reader2 = regexx_live_reader_create(live);
+
+    old = regexx_live_enter(reader1, &sc);
+    if (regexx_live_reload(live, re2) != 0)
+        result = 1;
+    for (i=0; i<100000000 && id != 2; i++)
+        id = regexx_live_match(reader2, text, 0, sizeof(text) - 1, &offset, &length);
+    if (id != 2 || offset != 4 || length != 5)
+        result = 1;
+    reader3 = regexx_live_reader_create(live);
+    if (regexx_live_match(reader3, text, 0, sizeof(text) - 1, &offset, &length) != 2)
+        result = 1;
+    regexx_live_reader_free(reader3);
+    if (regexx_scratch_match(old, sc, text, 0, sizeof(text) - 1, &offset, &length) != 1)
+        result = 1;
+    regexx_live_leave(reader1);
+    if (regexx_live_wait(live) != 0)
+        result = 1;
+    if (regexx_live_match(reader1, text, 0, sizeof(text) - 1, &offset, &length) != 2)
+        result = 1;
+
+    if (result)
+        fprintf(stderr, "[-] live: reload failed\n");
+    regexx_live_reader_free(reader1);
+    regexx_live_reader_free(reader2);
+    regexx_live_free(live);
+    return result;
+}
+
+/**
+ * Tests that finding every match in a long input stays linear: with a
+ * string pattern matching often, each call should only look as far as
+ * that match for the others, however rare they are, so a small step
+ * limit per call is enough.
+ */
+static int selftest_find_all(void) {
+    static const char *rare[] = {"zq+", "^a", "zq+?", NULL};
+    static const unsigned modes[] = {0, REGEXX_LAZY_DFA, REGEXX_PIKEVM};
+    size_t length = 1024 * 1024;
+    char *text = malloc(length);
+    int result = 0;
+    unsigned m;
+    size_t i;
+
+    for (i=0; i<length; i++)
+        text[i] = (i % 8 == 0) ? 'b' : 'a';
+    for (m=0; m<sizeof(modes)/sizeof(modes[0]); m++)
+    for (i=0; rare[i]; i++) {
+        regexx_t *re = regexx_create(modes[m]);
+        size_t in_offset = 1;
+        size_t count = 0;
+        size_t offset = 0;
+        size_t out_length = 0;
+        size_t id;
+
+        regexx_add_pattern(re, "b", 1, 0);
+        regexx_add_pattern(re, rare[i], 2, 0);
+        regexx_compile(re);
+        regexx_set_limits(re, 10000, 0);
+        while ((id = regexx_match(re, text, in_offset, length, &offset, &out_length)) == 1) {
+            count++;
+            in_offset = offset + out_length;
+        }
+        if (id != REGEXX_NOT_FOUND || count != length / 8 - 1) {
+            fprintf(stderr, "[-] find all: mode 0x%x, \"%s\": %u matches, then %d\n",
+                    modes[m], rare[i], (unsigned)count, (int)id);
+            result = 1;
+        }
+        regexx_free(re);
+    }
+    free(text);
+    return result;
+}
+
+/** Every match in the text, as a string of "id:offset:length" */
+static void ignorecase_matches(regexx_t *re, const char *text, char *buf, size_t size) {
+    size_t in_offset = 0;
+    size_t used = 0;
+
+    buf[0] = '\0';
+    while (in_offset <= strlen(text)) {
+        size_t offset = 0;
+        size_t length = 0;
+        size_t id = regexx_match(re, text, in_offset, strlen(text), &offset, &length);
+
+        if (id == REGEXX_NOT_FOUND || used + 64 > size)
+            break;
+        used += (size_t)snprintf(buf + used, size - used, "%u:%u:%u ", (unsigned)id, (unsigned)offset, (unsigned)length);
+        in_offset = offset + (length ? length : 1);
+    }
+}
+
+/**
+ * Tests that REGEXX_IGNORECASE, for the whole set or for one pattern,
+ * matches the same as the patterns written with both cases in classes,
+ * in every engine.
+ */
+static int selftest_ignorecase(void) {
+    static const char *patterns[] = {
+        "hello", "wor[lk]d+", "x[^a]z", "the quick brown fox jumps", "n\\w+ber", NULL
+    };
+    static const char *folded[] = {
+        "[Hh][Ee][Ll][Ll][Oo]", "[Ww][Oo][Rr][LlKk][Dd]+", "[Xx][^Aa][Zz]",
+        "[Tt][Hh][Ee] [Qq][Uu][Ii][Cc][Kk] [Bb][Rr][Oo][Ww][Nn] [Ff][Oo][Xx] [Jj][Uu][Mm][Pp][Ss]",
+        "[Nn]\\w+[Bb][Ee][Rr]", NULL
+    };
+    static const char *texts[] = {
+        "Hello, WORLD and hElLo wOrKdDd!",
+        "xAz xbz XBZ x-z",
+        "THE QUICK BROWN FOX JUMPS over the quick brown fox jumps; The Quick Brown Fox Jumpz",
+        "NumBER nUmber__ber exact Exact EXACT",
+        "@[`{ are not letters: @ELLO hELLO",
+    };
+    static const unsigned modes[] = {0, REGEXX_LAZY_DFA, REGEXX_PIKEVM, REGEXX_MEMOIZE, REGEXX_JIT};
+    char expected[1024];
+    char found[1024];
+    int result = 0;
+    unsigned m;
+    unsigned is_per_pattern;
+    unsigned is_compiled;
+    size_t i;
+    size_t t;
+
+    for (m=0; m<sizeof(modes)/sizeof(modes[0]); m++)
+    for (is_per_pattern=0; is_per_pattern<2; is_per_pattern++)
+    for (is_compiled=0; is_compiled<2; is_compiled++) {
+        regexx_t *re = regexx_create(modes[m] | (is_per_pattern ? 0 : REGEXX_IGNORECASE));
+        regexx_t *re2 = regexx_create(modes[m]);
+
+        for (i=0; patterns[i]; i++) {
+            regexx_add_pattern(re, patterns[i], i + 1, is_per_pattern ? REGEXX_IGNORECASE : 0);
+            regexx_add_pattern(re2, folded[i], i + 1, 0);
+        }
+        /* Only with the flag on the pattern can another keep its case */
+        if (is_per_pattern) {
+            regexx_add_pattern(re, "Exact", 99, 0);
+            regexx_add_pattern(re2, "Exact", 99, 0);
+        }
+        if (is_compiled) {
+            regexx_compile(re);
+            regexx_compile(re2);
+        }
+        for (t=0; t<sizeof(texts)/sizeof(texts[0]); t++) {
+            ignorecase_matches(re2, texts[t], expected, sizeof(expected));
+            ignorecase_matches(re, texts[t], found, sizeof(found));
+            if (strcmp(expected, found) != 0 || expected[0] == '\0') {
+                fprintf(stderr, "[-] ignorecase: mode 0x%x%s%s: \"%s\": expected %s, found %s\n",
+                        modes[m], is_per_pattern ? " per pattern" : "", is_compiled ? " compiled" : "",
+                        texts[t], expected, found);
+                result = 1;
+            }
+        }
+        regexx_free(re);
+        regexx_free(re2);
+    }
+    return result;
+}
+
 int main(int argc, char *argv[]) {
     int x = 0;
 
@@ -238,7 +1670,46 @@ int main(int argc, char *argv[]) {
     x += selftest_parses();
     
 
-    x += regex_selftest();
+    x += regex_selftest(false, 0);
+    x += regex_selftest(true, 0);
+    x += regex_selftest(false, REGEXX_PIKEVM);
+    x += regex_selftest(true, REGEXX_PIKEVM);
+    x += selftest_pikevm();
+    x += selftest_empty();
+    x += selftest_classes();
+    x += selftest_minimize();
+    x += selftest_literals();
+    x += selftest_prefilter();
+    x += selftest_leftmost(0);
+    x += selftest_leftmost(REGEXX_LAZY_DFA);
+    x += selftest_first(false, 0);
+    x += selftest_first(true, 0);
+    x += selftest_first(false, REGEXX_PIKEVM);
+    x += selftest_memoize();
+    x += selftest_long();
+    x += selftest_limits();
+    x += selftest_serialize(0);
+    x += selftest_serialize(REGEXX_LAZY_DFA);
+    x += selftest_serialize(REGEXX_JIT);
+    x += selftest_jit();
+    x += selftest_allocator();
+    x += selftest_residual();
+    x += selftest_generate(0);
+    x += selftest_generate(REGEXX_GEN_SWITCH);
+    x += selftest_stream();
+    x += selftest_scratch();
+    x += selftest_parallel();
+    x += selftest_add_patterns();
+    x += selftest_delta();
+    x += selftest_live();
+    x += selftest_ignorecase();
+    x += selftest_find_all();
+
+    x += selftest_lex(0, 0);
+    x += selftest_lex(REGEXX_LAZY_DFA, 0);
+    x += selftest_lex(REGEXX_LAZY_DFA, 1); /* flush the cache constantly */
+    x += selftest_lex(REGEXX_PIKEVM, 0);
+    x += selftest_lex(REGEXX_JIT, 0);
     if (x == 0) {
         fprintf(stderr, "[+] selftest succeeded\n");
         return 0;
@@ -57,6 +57,8 @@ int main(int argc, char *argv[]) {
      */
     re = regexx_create(0);
     err = regexx_add_pattern(re, argv[1], 0, 0);
+    if (err == 0)
+        err = regexx_compile(re);
     if (err) {
         /* Malformed input regexp */
         fprintf(stderr, "[-] %s\n", regexx_get_error_msg(re));
@@ -25,10 +25,68 @@
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <time.h>
+#include <limits.h>
 
 #ifdef _MSC_VER
+#include <intrin.h>
 #define snprintf _snprintf
 #define strdup _strdup
+#define ATOMIC_LOAD(p) (*(volatile long *)(p))
+#define ATOMIC_EXCHANGE(p, v) _InterlockedExchange((volatile long *)(p), (v))
+#define ATOMIC_ADD(p, v) _InterlockedExchangeAdd((volatile long *)(p), (v))
+#define ATOMIC_LOAD_PTR(p) _InterlockedCompareExchangePointer((void *volatile *)(p), NULL, NULL)
+#define ATOMIC_EXCHANGE_PTR(p, v) _InterlockedExchangePointer((void *volatile *)(p), (v))
+#else
+#define ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_EXCHANGE(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#define ATOMIC_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_ACQ_REL)
+#define ATOMIC_LOAD_PTR(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define ATOMIC_EXCHANGE_PTR(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#endif
+
+/* Threads, for `regexx_scan_parallel()` and reloading */
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+/* The SIMD prefilter has SSE2 (every x86-64), SSSE3 and AVX2 versions,
+ * chosen at runtime, and a plain C version for everything else */
+#if defined(__x86_64__) || defined(_M_X64)
+#define PREFILTER_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define PREFILTER_TARGET(x)
+#else
+#define PREFILTER_TARGET(x) __attribute__((target(x)))
+#endif
+#endif
+
+/* The NFA interpreter dispatches on instructions through a table of label
+ * addresses ("threaded" dispatch, a GCC and Clang extension), so each
+ * instruction's code jumps straight to the next one's, rather than back to
+ * one shared `switch` whose indirect branch predicts poorly. Elsewhere,
+ * it's a plain `switch`. */
+#if defined(__GNUC__) || defined(__clang__)
+#define VM_THREADED 1
+#define VM_DISPATCH(table, op) goto *table[op];
+#define VM_OP(name) vm_##name
+#else
+#define VM_DISPATCH(table, op) switch (op)
+#define VM_OP(name) case name
+#endif
+
+/* REGEXX_JIT emits x86-64 code for the System V calling convention, into
+ * memory from `mmap()`; everywhere else the DFA is interpreted */
+#if defined(__x86_64__) && !defined(_WIN32) && (defined(__unix__) || defined(__APPLE__))
+#define JIT_X86 1
+#include <sys/mman.h>
+#include <unistd.h>
 #endif
 
 /** All the possible sub-expresison types.
@@ -90,6 +148,7 @@ typedef struct node_t {
     };
     struct node_t *next;
     struct node_t *prev;
+    unsigned id;    /* numbered within its pattern, for memoizing */
 } node_t;
 
 typedef struct macro_t {
@@ -108,6 +167,369 @@ typedef struct fileoffsets_t {
     struct fileoffsets_t *next;
 } fileoffsets_t;
 
+/** The instructions of the Thompson NFA that `regexx_compile()` lowers
+ * the parse trees into. Unlike nodes, these are simple states connected
+ * by epsilon transitions, the form we need for subset construction. */
+enum nfaop_t {
+    OP_BYTE,        /* match the single byte `arg` */
+    OP_CLASS,       /* match any byte in the charclass table entry `arg` */
+    OP_SPLIT,       /* epsilon to both `out` and `out1`, `out` preferred */
+    OP_BEGIN,       /* '^', epsilon only at the start of the input */
+    OP_END,         /* '$', epsilon only at the end of the input */
+    OP_LOOK,        /* lookahead, epsilon if entry `arg` of the lookahead table holds */
+    OP_MATCH,       /* pattern number `arg` has matched, or NFA_NONE at the
+                     * end of a lookahead body */
+};
+
+#define NFA_NONE (~0U)
+#define DFA_UNKNOWN (~0U)
+
+typedef struct nfainst_t {
+    unsigned char op;
+    unsigned out;
+    unsigned out1;
+    unsigned arg;
+} nfainst_t;
+
+/** A lookahead group `(?=...)` or `(?!...)`. The body is lowered twice:
+ * forwards, for checking a single position, and backwards, for marking
+ * all the positions in a single pass when the body has no maximum length. */
+typedef struct lookahead_t {
+    unsigned forward;
+    unsigned reverse;
+    bool is_inverted;
+    bool is_bounded;
+} lookahead_t;
+
+/** The NFA program for all the patterns, with a table of all the
+ * charclasses they use (duplicates are shared). */
+typedef struct prog_t {
+    nfainst_t *insts;
+    unsigned count;
+    unsigned max;
+    charclass_t *classes;
+    unsigned class_count;
+    lookahead_t *looks;
+    unsigned look_count;
+} prog_t;
+
+/**
+ * A sparse set (Briggs & Torczon) of NFA instructions. It can be cleared,
+ * added to, and tested in constant time, and remembers the order
+ * that things were added.
+ */
+typedef struct sparseset_t {
+    unsigned *dense;
+    unsigned *sparse;
+    unsigned count;
+    unsigned max;
+} sparseset_t;
+
+/** The threads of a Pike VM: which instructions are active, in priority
+ * order, and the offset where each one's match started */
+typedef struct threadlist_t {
+    sparseset_t pcs;
+    size_t *starts;
+} threadlist_t;
+
+/** The working memory for simulating the NFA at one level of lookahead
+ * nesting (each lookahead is simulated at the next level down) */
+typedef struct pikevm_t {
+    threadlist_t lists[2];
+    unsigned *stack;
+} pikevm_t;
+
+/** The limits on the work one scan can do, and what it's used so far */
+typedef struct budget_t {
+    size_t step_limit;      /* or 0 for none */
+    uint64_t usec_limit;    /* or 0 for none */
+
+    uint64_t deadline;      /* in microseconds on `_budget_clock()` */
+    size_t steps;
+    size_t next_check;      /* the steps at which to check the limits */
+    bool is_stopped;
+
+    /* Set by `regexx_cancel()`, possibly on another thread */
+    long is_cancelled;
+} budget_t;
+
+/* The steps between checks of the clock and for cancelling, and how far
+ * the linear engines (DFA, Aho-Corasick) go before charging their steps */
+#define BUDGET_INTERVAL 4096
+
+/** A call to evaluate a node by backtracking that's yet to return */
+typedef struct evalframe_t {
+    struct node_t *node;
+    size_t offset;      /* where the node is evaluated */
+    size_t end;         /* the best match found so far */
+    size_t at;          /* quantifiers: where the repetitions got to */
+    size_t repeat;      /* quantifiers: where the latest one ended */
+    size_t count;       /* quantifiers: how many repetitions */
+    unsigned step;      /* where to resume when its call returns */
+} evalframe_t;
+
+/** Mutable memory used while scanning, reused from one call to the next */
+typedef struct scratch_t {
+    /* Sized for a program of `prog_size` instructions */
+    pikevm_t **vms;
+    size_t vm_count;
+    unsigned prog_size;
+
+    /* Lookahead results, for each lookahead and offset, valid when the
+     * stamp matches the current generation */
+    unsigned *look_stamps;
+    unsigned char *look_values;
+    size_t look_max;
+    unsigned look_generation;
+
+    /* With REGEXX_MEMOIZE, the backtracker's result for each node and
+     * offset, see `evalctx_t` */
+    unsigned *memo;
+    size_t memo_max;
+
+    /* The backtracker's stack */
+    evalframe_t *frames;
+    size_t frame_max;
+} scratch_t;
+
+/* The kinds of DFA. A longest DFA runs from an offset to find the longest
+ * match starting there. A leftmost DFA makes one pass over the input to
+ * find where the leftmost-longest match ends, keeping the NFA states in
+ * groups ordered by where their threads started. A reverse DFA runs the
+ * reversed patterns backwards from there to find where the match starts. */
+#define DFA_LONGEST     0
+#define DFA_LEFTMOST    1
+#define DFA_REVERSE     2
+
+/* A leftmost state's kernel starts with whether new groups are still
+ * being started, one for each byte, and each group ends with a mark */
+#define DFA_NOSEED      0U
+#define DFA_SEEDING     1U
+#define DFA_MARK        (~1U)
+
+/**
+ * The registers of a DFA compiled by REGEXX_JIT, which runs from state
+ * `state` at `text[i]` until it reaches `stop` or the dead state,
+ * remembering the last accepting state it passed through, like
+ * `_dfa_longest()`. The offsets of the fields are in the machine code.
+ */
+typedef struct jitrun_t {
+    const unsigned char *text;  /* 0 */
+    size_t i;                   /* 8 */
+    size_t stop;                /* 16 */
+    unsigned state;             /* 24 */
+    unsigned accept;            /* 28 */
+    size_t end;                 /* 32 */
+} jitrun_t;
+
+typedef void (*jitfn_t)(jitrun_t *run);
+
+/**
+ * A DFA built from subset construction over the NFA program. State 0 is
+ * the dead state, from which no pattern can ever match.
+ *
+ * In lazy mode, states are only built when the input first reaches them,
+ * with unknown transitions marked DFA_UNKNOWN. When the cache of states
+ * fills, it's flushed and we start building again from the current state.
+ */
+typedef struct dfa_t {
+    /* [state_count * class_count] transitions, indexed by state and the
+     * class of the input byte */
+    unsigned *trans;
+
+    /* The bytes, partitioned into classes that no pattern tells apart,
+     * and one byte from each class to build transitions with */
+    unsigned char byte_class[256];
+    unsigned char class_byte[256];
+    unsigned class_count;
+
+    /* For each state, 1 + the lowest numbered pattern that matches when we
+     * reach it, or 0 if none. The `eof` variant is the same, but also counts
+     * patterns that need a '$' anchor, for when we reach the end of input */
+    unsigned *accept;
+    unsigned *accept_eof;
+
+    unsigned state_count;
+    unsigned state_max;
+    unsigned kind;      /* DFA_LONGEST, DFA_LEFTMOST or DFA_REVERSE */
+
+    /* The start state when at the beginning of input (so '^' matches),
+     * and everywhere else */
+    unsigned start_begin;
+    unsigned start;
+
+    /* While building: the NFA set for each state, and a hash table
+     * (open addressing) from sets to states */
+    unsigned *sets;
+    size_t sets_length;
+    size_t sets_max;
+    size_t *set_offsets;
+    unsigned *table;
+    unsigned table_size;
+
+    /* Building stops (or in lazy mode, the cache is flushed) when we
+     * reach this many states */
+    unsigned state_limit;
+
+    /* Lazy mode: the starts of the patterns in the NFA, so that the start
+     * states can be rebuilt after a flush, and the working memory for
+     * building states while scanning */
+    bool is_lazy;
+    unsigned *starts;
+    size_t start_count;
+    sparseset_t set;
+    sparseset_t tmp;
+    unsigned *stack;
+    unsigned *list;
+    size_t flush_count;
+
+    /* For `_dfa_extend()`: the room in `starts`, how much of the program
+     * the byte classes were made from, and whether the start states
+     * (and seeds) have to be built again before the next scan */
+    size_t start_max;
+    unsigned class_inst_count;
+    unsigned class_set_count;
+    bool is_stale;
+
+    /* Leftmost mode: for each byte class, where the threads starting at
+     * a byte of that class go, as `seeds[seed_offsets[k]...]` */
+    unsigned *seeds;
+    size_t *seed_offsets;
+
+    /* How many states subset construction built, before minimizing */
+    unsigned built_count;
+
+    /* The transitions and accepts are in a database from
+     * `regexx_deserialize()`, rather than memory of our own */
+    bool is_borrowed;
+
+    /* REGEXX_JIT: the DFA as machine code, in `jit_size` bytes of
+     * executable memory from `mmap()` */
+    jitfn_t jit;
+    void *jit_code;
+    size_t jit_size;
+} dfa_t;
+
+/**
+ * Everything that changes while scanning, so that any number of threads,
+ * each with its own, can scan with the same compiled patterns at once:
+ * the working memory of the engines, the budget, the lexer's position,
+ * and the lazy DFAs, whose caches of states fill in as they run.
+ */
+struct regexx_scratch_t {
+    scratch_t work;
+    budget_t budget;
+    fileoffsets_t offsets;
+
+    /* The DFAs to scan with: those of the `regexx_t` when they're built
+     * ahead of time, otherwise copies with caches of their own (unless
+     * this is the `regexx_t`'s own scratch) */
+    dfa_t *dfa;
+    dfa_t *search;
+    dfa_t *reverse;
+    bool is_cloned;
+    bool is_dfa_cloned;
+
+    /* For searching the `regexx_t`'s delta, if it has one */
+    regexx_scratch_t *delta;
+
+    /* The `regexx_t` generation these are for */
+    unsigned generation;
+};
+
+/**
+ * A cell of the Aho-Corasick automaton for the literal patterns, in a
+ * double-array layout: the transition from state `s` on byte `c` is
+ * to cell `base[s] + c`, if that cell's `check` says its parent is `s`.
+ * That's all a transition reads, so the failure links, and the rest of
+ * what's known about a state, in its `literalinfo_t`, are kept apart.
+ */
+typedef struct literalcell_t {
+    unsigned base;
+    unsigned check;     /* the parent state, plus LITERALS_OUTPUT, or NFA_NONE for an unused cell */
+} literalcell_t;
+
+/* In a cell's `check`: some literal ends in this state */
+#define LITERALS_OUTPUT 0x80000000U
+#define LITERALS_PARENT 0x7FFFFFFFU
+
+typedef struct literalinfo_t {
+    unsigned output;    /* the state for the longest suffix that's a literal, or NFA_NONE */
+    unsigned match;     /* 1 + the lowest pattern that is this literal, or 0 */
+    unsigned depth;
+} literalinfo_t;
+
+/* The most memory for the full transitions of the first states */
+#define LITERALS_DENSE_MAX (256 * 1024)
+#define LITERALS_ESCAPE 0xFFFF
+
+typedef struct literals_t {
+    literalcell_t *cells;
+    unsigned *fails;        /* for each cell, the state for the longest proper suffix */
+    literalinfo_t *infos;   /* for each cell, only needed once a literal is found */
+
+    /* The states in the first `dense_count` cells, which are the shallow
+     * ones that most of the text goes through, have their transitions for
+     * every byte class worked out, failure links included, `class_count`
+     * of them per state, so the search takes one lookup per byte while
+     * it's there. A transition to a state past those is LITERALS_ESCAPE,
+     * to go through the double array instead, which keeps the table small
+     * enough to stay in the cache. */
+    unsigned short *dense;
+    unsigned dense_count;
+    unsigned class_count;
+    unsigned char byte_class[256];  /* the column in `dense` for each byte */
+
+    unsigned cell_count;
+    unsigned max_length;
+    bool is_borrowed;   /* the tables are in a deserialized database */
+    bool is_folded;     /* REGEXX_IGNORECASE: the literals are lowercase, and so is the text, as it's read */
+} literals_t;
+
+/* The prefilter handles up to this many distinct prefixes, spread over
+ * 8 buckets, one per bit of a byte */
+#define PREFILTER_MAX 64
+
+/* How many leading bytes of each prefix are compared */
+#define PREFILTER_WIDTH 3
+
+/**
+ * A "Teddy" prefilter, for when every pattern begins with a string:
+ * finds the offsets where one of those strings might start, by looking
+ * up the low and high nibbles of the next few bytes in tables of which
+ * buckets have prefixes with that nibble there. An offset is a candidate
+ * if some bucket is in all of them. Buckets are shared, so there are
+ * false positives, but never false negatives.
+ */
+typedef struct prefilter_t {
+    unsigned char lo[PREFILTER_WIDTH][16];
+    unsigned char hi[PREFILTER_WIDTH][16];
+    unsigned width;
+
+    /* SSE2 has no byte shuffle, so it looks for the distinct first bytes */
+    unsigned char firsts[PREFILTER_MAX];
+    unsigned first_count;
+
+    size_t (*next)(const struct prefilter_t *prefilter, const unsigned char *text, size_t offset, size_t length);
+} prefilter_t;
+
+/**
+ * A block of the arena, where the parse trees, macros and pattern text
+ * are allocated one after another, and freed all together by
+ * `regexx_free()`. Each block remembers the allocator it came from.
+ */
+typedef struct arenablock_t {
+    struct arenablock_t *next;
+    void (*release)(void *ctx, void *ptr);
+    void *ctx;
+    size_t size;
+    size_t used;
+} arenablock_t;
+
+/* The first block's size, doubling with each new block up to the max */
+#define ARENA_BLOCK_MIN (4 * 1024)
+#define ARENA_BLOCK_MAX (1024 * 1024)
+
 typedef struct regexx_t {
     /* For parsing regex patterns: the head of the chain we
      * are currently parsing. */
@@ -119,10 +541,29 @@ typedef struct regexx_t {
     
     
     bool is_dot_match_newline;
+
+    /* For parsing: whether the pattern ignores case (REGEXX_IGNORECASE),
+     * so its strings are folded to lowercase and its classes to both */
+    bool is_case_insensitive;
+
+    /* Flags passed to `regexx_create()` */
+    unsigned flags;
+
+    /* With REGEXX_LAZY_DFA, how many bytes the DFA state cache may use */
+    size_t cache_size;
     
     /* Lex-style macros that can be used in regular expressions */
     macro_t *macros;
     size_t macro_count;
+
+    /* Where the nodes and strings are allocated, from `alloc()` (set by
+     * `regexx_set_allocator()`, otherwise malloc), and the nodes that
+     * parsing discarded, to be used again */
+    arenablock_t *arena;
+    void *(*alloc)(void *ctx, size_t size);
+    void (*release)(void *ctx, void *ptr);
+    void *alloc_ctx;
+    node_t *free_nodes;
     
     /* When an error happens, the error message goes here. Use
      * `regexx_get_error_msg()` to retrieve */
@@ -132,34 +573,169 @@ typedef struct regexx_t {
     struct {
         node_t *head;
         size_t id;
+        unsigned node_count;
+
+        /* As added, for `regexx_serialize()` */
+        char *source;
+        unsigned flags;
+
+        /* For patterns that can't go into the DFA (lazy quantifiers,
+         * lookahead), which are evaluated separately by the Pike VM or
+         * by backtracking */
+        bool is_residual;
+
+        /* For patterns that are a plain string, which `regexx_compile()`
+         * puts into the Aho-Corasick automaton instead of the DFA */
+        bool is_literal;
+
+        /* Where the pattern starts in the NFA program, or NFA_NONE if
+         * it can't be lowered, and whether lazy quantifiers mean it
+         * prefers the first match to the longest */
+        unsigned start;
+        bool is_lazy;
+
+        /* For DFA patterns, where the pattern starts lowered backwards,
+         * for finding where a match begins from where it ends */
+        unsigned reverse;
+
+        /* Where a match can start: only at offset 0 when anchored with
+         * '^', and otherwise only where `first` finds a byte that can
+         * begin one (NULL if any byte can). Empty matches don't count,
+         * so this holds for patterns that can match nothing too. */
+        prefilter_t *first;
+        bool is_anchored;
     } *patterns;
     size_t pattern_count;
-    
-    fileoffsets_t offsets;
+    size_t residual_count;
+    size_t anchored_count;
+
+    /* The results of `regexx_compile()`, or NULL if the patterns
+     * haven't been compiled (or have changed since) */
+    prog_t prog;
+    dfa_t *dfa;
+    dfa_t *search;
+    dfa_t *reverse;
+    literals_t *literals;
+    prefilter_t *prefilter;
+
+    /* The patterns added since `regexx_compile()`, from `compiled_count`
+     * on, aren't in the above. They're also added to `delta`, a set of
+     * their own that's searched alongside, until there are enough of them
+     * to be worth compiling everything again, which `merge` does on a
+     * thread of its own. The residual and anchored counts only count the
+     * compiled patterns, since those are what the searches go by. */
+    size_t compiled_count;
+    regexx_t *delta;
+    struct mergejob_t *merge;
+
+    /* In a delta, added patterns extend what's compiled instead, and
+     * the prefilter goes by the bytes they can all begin with */
+    bool is_delta;
+    charclass_t firsts;
+
+    /* Counts the times the above were rebuilt (or thrown away, by adding
+     * a pattern), so scratch made for an older build can tell */
+    unsigned generation;
+
+    /* The limits from `regexx_set_limits()`, for every scan */
+    size_t step_limit;
+    uint64_t usec_limit;
+
+    /* For the calls that don't take their own scratch */
+    regexx_scratch_t scratch;
 } regex_t;
 
-void regexx_lex_push(regexx_t *re) {
+/** The time in microseconds, from a clock that only goes forwards */
+static uint64_t _budget_clock(void) {
+    struct timespec ts;
+
+#if defined(_WIN32)
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/** Starts a scan, with nothing used yet */
+static void _budget_start(budget_t *budget) {
+    budget->steps = 0;
+    budget->is_stopped = false;
+    budget->next_check = BUDGET_INTERVAL;
+    if (budget->step_limit && budget->step_limit < budget->next_check)
+        budget->next_check = budget->step_limit;
+    budget->deadline = 0;
+    if (budget->usec_limit)
+        budget->deadline = _budget_clock() + budget->usec_limit;
+}
+
+/**
+ * Checks whether the scan has to stop: it's out of steps or time, or
+ * another thread cancelled it.
+ */
+static bool _budget_check(budget_t *budget) {
+    if (ATOMIC_LOAD(&budget->is_cancelled) && ATOMIC_EXCHANGE(&budget->is_cancelled, 0))
+        budget->is_stopped = true;
+    if (budget->step_limit && budget->steps >= budget->step_limit)
+        budget->is_stopped = true;
+    if (budget->deadline && _budget_clock() >= budget->deadline)
+        budget->is_stopped = true;
+
+    budget->next_check = budget->steps + BUDGET_INTERVAL;
+    if (budget->step_limit && budget->step_limit < budget->next_check)
+        budget->next_check = budget->step_limit;
+    return budget->is_stopped;
+}
+
+/**
+ * Charges `count` steps to the scan.
+ * @return true if it has to stop, in which case the engines return
+ *  no match, and `regexx_match()` returns REGEXX_NOT_FINISHED
+ */
+static bool _budget_spend(budget_t *budget, size_t count) {
+    budget->steps += count;
+    if (budget->steps < budget->next_check)
+        return budget->is_stopped;
+    return _budget_check(budget);
+}
+
+static void _lex_push(fileoffsets_t *offsets) {
     fileoffsets_t *o = malloc(sizeof(*o));
-    o->line_number = re->offsets.line_number;
-    o->char_number = re->offsets.char_number;
-    o->next = re->offsets.next;
-    re->offsets.line_number = 1;
-    re->offsets.char_number = 0;
-    re->offsets.next = 0;
+    if (o == NULL)
+        abort();
+    o->line_number = offsets->line_number;
+    o->char_number = offsets->char_number;
+    o->next = offsets->next;
+    offsets->line_number = 1;
+    offsets->char_number = 0;
+    offsets->next = o;
 }
-void regexx_lex_pop(regexx_t *re) {
-    fileoffsets_t *o = re->offsets.next;
+static void _lex_pop(fileoffsets_t *offsets) {
+    fileoffsets_t *o = offsets->next;
     if (o == NULL) {
         fprintf(stderr, "[-] regexx_lex_pop: error\n");
         return;
     }
-    re->offsets.line_number = o->line_number;
-    re->offsets.char_number = o->char_number;
-    re->offsets.next = o;
+    offsets->line_number = o->line_number;
+    offsets->char_number = o->char_number;
+    offsets->next = o->next;
     free(o);
 }
+void regexx_lex_push(regexx_t *re) {
+    _lex_push(&re->scratch.offsets);
+}
+void regexx_lex_pop(regexx_t *re) {
+    _lex_pop(&re->scratch.offsets);
+}
+void regexx_scratch_lex_push(regexx_scratch_t *scratch) {
+    _lex_push(&scratch->offsets);
+}
+void regexx_scratch_lex_pop(regexx_scratch_t *scratch) {
+    _lex_pop(&scratch->offsets);
+}
 
 static const char *_node_print(node_t *node, buf_t *buf);
+static void _merge_finish(regexx_t *re, bool is_waiting);
 
 /**
  * Like `sprintf()`, but appends strings to a buffer. This is used
@@ -216,13 +792,94 @@ static void _error_msg(regexx_t *re, char *fmt, ...) {
 }
 
 
+static void *_default_alloc(void *ctx, size_t size) {
+    (void)ctx;
+    return malloc(size);
+}
+
+static void _default_release(void *ctx, void *ptr) {
+    (void)ctx;
+    free(ptr);
+}
+
+/**
+ * Allocates memory from the arena, which lasts until `regexx_free()`.
+ */
+static void *_arena_alloc(regexx_t *re, size_t size) {
+    arenablock_t *block = re->arena;
+    void *result;
+
+    size = (size + 15) & ~(size_t)15;
+    if (block == NULL || block->size - block->used < size) {
+        size_t block_size = block ? block->size * 2 : ARENA_BLOCK_MIN;
+        size_t header = (sizeof(*block) + 15) & ~(size_t)15;
+
+        if (block_size > ARENA_BLOCK_MAX)
+            block_size = ARENA_BLOCK_MAX;
+        if (block_size < size)
+            block_size = size;
+        block = re->alloc(re->alloc_ctx, header + block_size);
+        if (block == NULL)
+            abort();
+        block->next = re->arena;
+        block->release = re->release;
+        block->ctx = re->alloc_ctx;
+        block->size = block_size;
+        block->used = 0;
+        re->arena = block;
+    }
+    result = (char *)block + ((sizeof(*block) + 15) & ~(size_t)15) + block->used;
+    block->used += size;
+    return result;
+}
+
+static char *_arena_strdup(regexx_t *re, const char *string) {
+    size_t length = strlen(string);
+    char *result = _arena_alloc(re, length + 1);
+
+    memcpy(result, string, length + 1);
+    return result;
+}
+
+static void _arena_free(regexx_t *re) {
+    arenablock_t *block = re->arena;
+
+    while (block) {
+        arenablock_t *next = block->next;
+
+        block->release(block->ctx, block);
+        block = next;
+    }
+    re->arena = NULL;
+}
+
+/** A new, zeroed node, from the arena */
+static node_t *_node_new(regexx_t *re) {
+    node_t *node = re->free_nodes;
+
+    if (node)
+        re->free_nodes = node->next;
+    else
+        node = _arena_alloc(re, sizeof(*node));
+    memset(node, 0, sizeof(*node));
+    return node;
+}
+
+/** Keeps a node that parsing no longer needs, for the next `_node_new()` */
+static void _node_release(regexx_t *re, node_t *node) {
+    node->next = re->free_nodes;
+    re->free_nodes = node;
+}
+
 static macro_t *_macro_new(struct regexx_t *re, const char *name, const char *value) {
     macro_t *macro;
     
     re->macros = realloc(re->macros, (re->macro_count+1) * sizeof(macro_t));
+    if (re->macros == NULL)
+        abort();
     macro = &re->macros[re->macro_count++];
-    macro->name = strdup(name);
-    macro->value = strdup(value);
+    macro->name = _arena_strdup(re, name);
+    macro->value = _arena_strdup(re, value);
     return macro;
 }
 
@@ -254,6 +911,9 @@ int regexx_add_macro(regexx_t *re, const char *name, const char *value) {
         }
     }
 
+    /* A merge has copies of the macros from when it started, so it has
+     * to be done with before they change */
+    _merge_finish(re, true);
     _macro_new(re, name, value);
     return 0;
 }
@@ -299,6 +959,20 @@ static charclass_t _invert(charclass_t charclass) {
     return result;
 }
 
+/** Folds an ASCII letter to lowercase, for matching regardless of case */
+static unsigned _case_fold(unsigned c) {
+    return (c - 'A' < 26) ? c + ('a' - 'A') : c;
+}
+
+/** Adds the other case of each ASCII letter in the class */
+static charclass_t _charclass_fold(charclass_t charclass) {
+    const uint64_t letters = 0x07FFFFFEULL;     /* 'A'-'Z', and 32 bits up 'a'-'z' */
+    uint64_t x = charclass.list[1];
+
+    charclass.list[1] = x | ((x >> 32) & letters) | ((x & letters) << 32);
+    return charclass;
+}
+
 /** Merge two character classes together. */
 static charclass_t _charclass_merge(charclass_t lhs, charclass_t rhs) {
     charclass_t result;
@@ -422,30 +1096,79 @@ static void _charclass_print(charclass_t charclass, char *buf, size_t length) {
 }
 
 
+static void _dfa_free(dfa_t *dfa);
+static void _literals_free(literals_t *literals);
+static void _prog_free(prog_t *prog);
+static void _scratch_release(regexx_scratch_t *sc);
+static void _pattern_lower(regexx_t *re, size_t index);
+static void _pattern_first(regexx_t *re, size_t index);
+static int _compile(regexx_t *re, dfa_t *dfa, literals_t *literals);
+static void _merge_free(regexx_t *re);
+static void _delta_extend(regexx_t *delta, size_t index);
+
+/**
+ * Throws away the results of `regexx_compile()`, when the patterns change
+ * or before compiling them again.
+ */
+static void _compiled_free(regexx_t *re) {
+    re->generation++;
+    _merge_free(re);
+    if (re->delta) {
+        /* the macros are only lent to it */
+        re->delta->macros = NULL;
+        regexx_free(re->delta);
+        re->delta = NULL;
+    }
+    _dfa_free(re->dfa);
+    re->dfa = NULL;
+    _dfa_free(re->search);
+    re->search = NULL;
+    _dfa_free(re->reverse);
+    re->reverse = NULL;
+    _literals_free(re->literals);
+    re->literals = NULL;
+    free(re->prefilter);
+    re->prefilter = NULL;
+}
+
 /**
- * Recursively called function to free all the nodes.
+ * Numbers the nodes of a parse tree from `count` on.
+ * @return the count after numbering them
  */
-static void _node_free(node_t *node) {
-    if (node) {
+static unsigned _node_number(node_t *node, unsigned count) {
+    for (; node; node = node->next) {
+        node->id = count++;
         switch (node->type) {
             case T_QUANTIFIER:
-                _node_free(node->quantifier.child);
+                count = _node_number(node->quantifier.child, count);
                 break;
             case T_ALTERNATION:
-                _node_free(node->alternation.child);
+                count = _node_number(node->alternation.child, count);
                 break;
             case T_GROUP:
-                _node_free(node->group.child);
+                count = _node_number(node->group.child, count);
                 break;
             default:
                 ;
         }
-        _node_free(node->next);
-        free(node);
     }
+    return count;
 }
+
 void regexx_free(regexx_t *re) {
-    _node_free(re->head);
+    size_t i;
+
+    if (re == NULL)
+        return;
+    for (i=0; i<re->pattern_count; i++)
+        free(re->patterns[i].first);
+    free(re->patterns);
+    free(re->macros);
+    free(re->error_msg.string);
+    _compiled_free(re);
+    _arena_free(re);
+    _prog_free(&re->prog);
+    _scratch_release(&re->scratch);
     free(re);
 }
 
@@ -457,12 +1180,7 @@ node_t *_add_node(regex_t *re)
 {
     node_t *result;
     
-    result = malloc(sizeof(node_t));
-    if (result == NULL) {
-        abort();
-    }
-    memset(result, 0, sizeof(*result));
-    
+    result = _node_new(re);
     result->prev = re->tail;
     re->tail->next = result;
     re->tail = result;
@@ -488,11 +1206,10 @@ int _peek_char(const char *pattern, const size_t *offset, size_t length) {
  * this mechanism that we know that a chain of rules has ended in a proper match.
  * Only a T_TRUE evaluation results in a match of a chain.
  */
-void _node_terminate(node_t *node) {
+void _node_terminate(regex_t *re, node_t *node) {
     node_t *terminate;
     
-    terminate = malloc(sizeof(node_t));
-    memset(terminate, 0, sizeof(node_t));
+    terminate = _node_new(re);
     terminate->type = T_TRUE;
     terminate->prev = node;
 
@@ -808,7 +1525,7 @@ static size_t _parse_integer(const char *pattern, size_t *offset, size_t length)
 static int _remove_self(regex_t *re, node_t *node) {
     re->tail = node->prev;
     node->prev->next = NULL;
-    free(node);
+    _node_release(re, node);
     return 0;
 }
 /**
@@ -817,11 +1534,20 @@ static int _remove_self(regex_t *re, node_t *node) {
  * string node.
  */
 static int _add_char(regex_t *re, node_t *node, char c) {
+    bool is_folded = false;
+
+    if (re->is_case_insensitive) {
+        c = (char)_case_fold(c & 0xFF);
+        is_folded = (unsigned)((c & 0xFF) - 'a') < 26;
+    }
+
     if (node->prev && node->prev->type == T_STRING && node->prev->string.length < sizeof(node->prev->string.chars)) {
         node_t *prev = node->prev;
         
         /* Append to the end of the previous string */
         prev->string.chars[node->prev->string.length++] = c;
+        if (is_folded)
+            prev->string.is_case_insensitive = true;
         
         /* keep nul-terminated for debugging reasons */
         if (prev->string.length < sizeof(prev->string.chars))
@@ -830,6 +1556,7 @@ static int _add_char(regex_t *re, node_t *node, char c) {
     } else {
         node->type = T_STRING;
         node->string.length = 1;
+        node->string.is_case_insensitive = is_folded;
         node->string.chars[0] = c;
         /* keep nul-terminated for debugging reasons */
         node->string.chars[1] = '\0';
@@ -861,7 +1588,7 @@ static int _add_quantifier(regex_t *re, size_t offset, node_t *node, size_t min,
     node->quantifier.child->prev = NULL;
     
     /* Add a 'terminate' to the child chain */
-    _node_terminate(node->quantifier.child);
+    _node_terminate(re, node->quantifier.child);
                     
     return 0;
 fail:
@@ -1051,7 +1778,7 @@ static int _parse_next_node(regexx_t *re, const char *pattern, size_t *r_offset,
                 node->prev->quantifier.is_lazy = true;
                 node->prev->next = NULL;
                 re->tail = node->prev;
-                free(node);
+                _node_release(re, node);
             } else {
                 if (_add_quantifier(re, offset, node, 0, 1) != 0)
                     goto fail;
@@ -1098,7 +1825,7 @@ static int _parse_next_node(regexx_t *re, const char *pattern, size_t *r_offset,
                     _add_char(re, node, _charclass_first_char(charclass));
                 } else {
                     node->type = T_CHARCLASS;
-                    node->charclass = charclass;
+                    node->charclass = re->is_case_insensitive ? _charclass_fold(charclass) : charclass;
                 }
             }
             break;
@@ -1188,6 +1915,8 @@ static int _parse_next_node(regexx_t *re, const char *pattern, size_t *r_offset,
                 c = _next_char(pattern, &offset, length);
             }
             
+            if (re->is_case_insensitive)
+                charclass = _charclass_fold(charclass);
             if (is_inverted)
                 charclass = _invert(charclass);
             node->charclass = charclass;
@@ -1206,6 +1935,213 @@ fail:
     return -1;
 }
 
+/* Once the delta has more than DELTA_MIN patterns, and more than
+ * 1/DELTA_RATIO as many as were compiled, everything is compiled again */
+#define DELTA_MIN 64
+#define DELTA_RATIO 32
+
+/**
+ * A merge, compiling all the patterns of a set again on a thread of its
+ * own, while the set goes on searching the old automata and the delta.
+ * The thread only has its own copies to work from, so the set can go on
+ * changing meanwhile.
+ */
+typedef struct mergejob_t {
+    /* The set being built, from the first `count` patterns */
+    regexx_t *re;
+    struct {
+        const char *source;     /* in the arena of the set merging */
+        size_t id;
+        unsigned flags;
+    } *patterns;
+    size_t count;
+
+    /* What compiling returned, once `is_done` is set */
+    int result;
+    long is_done;
+#if defined(_WIN32)
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+} mergejob_t;
+
+#if defined(_WIN32)
+static DWORD WINAPI _merge_worker(LPVOID arg) {
+#else
+static void *_merge_worker(void *arg) {
+#endif
+    mergejob_t *job = (mergejob_t *)arg;
+    size_t i;
+
+    job->result = 0;
+    for (i=0; i<job->count && job->result == 0; i++)
+        job->result = regexx_add_pattern(job->re, job->patterns[i].source, job->patterns[i].id, job->patterns[i].flags);
+    if (job->result == 0)
+        job->result = _compile(job->re, NULL, NULL);
+    ATOMIC_EXCHANGE(&job->is_done, 1);
+    return 0;
+}
+
+/**
+ * Starts compiling all the patterns again on another thread.
+ * @return 0 if it started, -1 if there's no thread for it
+ */
+static int _merge_start(regexx_t *re) {
+    mergejob_t *job;
+    regexx_t *merged;
+    size_t i;
+
+    merged = regexx_create(re->flags);
+    merged->alloc = re->alloc;
+    merged->release = re->release;
+    merged->alloc_ctx = re->alloc_ctx;
+    merged->is_dot_match_newline = re->is_dot_match_newline;
+    merged->cache_size = re->cache_size;
+    for (i=0; i<re->macro_count; i++)
+        _macro_new(merged, re->macros[i].name, re->macros[i].value);
+
+    job = calloc(1, sizeof(*job));
+    if (job == NULL)
+        abort();
+    job->re = merged;
+    job->count = re->pattern_count;
+    job->patterns = malloc(job->count * sizeof(job->patterns[0]));
+    if (job->patterns == NULL)
+        abort();
+    for (i=0; i<job->count; i++) {
+        job->patterns[i].source = re->patterns[i].source;
+        job->patterns[i].id = re->patterns[i].id;
+        job->patterns[i].flags = re->patterns[i].flags;
+    }
+
+#if defined(_WIN32)
+    job->thread = CreateThread(NULL, 0, _merge_worker, job, 0, NULL);
+    if (job->thread != NULL) {
+#else
+    if (pthread_create(&job->thread, NULL, _merge_worker, job) == 0) {
+#endif
+        re->merge = job;
+        return 0;
+    }
+    regexx_free(merged);
+    free(job->patterns);
+    free(job);
+    return -1;
+}
+
+/** Waits for the merge's thread, and frees the merge, but not its set */
+static regexx_t *_merge_join(mergejob_t *job) {
+    regexx_t *merged = job->re;
+
+#if defined(_WIN32)
+    WaitForSingleObject(job->thread, INFINITE);
+    CloseHandle(job->thread);
+#else
+    pthread_join(job->thread, NULL);
+#endif
+    free(job->patterns);
+    free(job);
+    return merged;
+}
+
+/** Throws away any merge, waiting for it to finish first */
+static void _merge_free(regexx_t *re) {
+    if (re->merge == NULL)
+        return;
+    regexx_free(_merge_join(re->merge));
+    re->merge = NULL;
+}
+
+/**
+ * Once the merge is done (or after waiting for it), swaps the set it
+ * built for ours. Our patterns, and what they're parsed and compiled
+ * into, go with the old set to be freed, except that the ones added
+ * since the merge started are added again, to the new set's delta.
+ * The scratch, error and settings stay, being the set's rather than
+ * its patterns'.
+ */
+static void _merge_finish(regexx_t *re, bool is_waiting) {
+    regexx_t *merged;
+    regexx_t swap;
+    int result;
+    size_t i;
+
+    if (re->merge == NULL || (!is_waiting && !ATOMIC_LOAD(&re->merge->is_done)))
+        return;
+    result = re->merge->result;
+    merged = _merge_join(re->merge);
+    re->merge = NULL;
+
+    if (result != 0) {
+        /* As when compiling everything in `regexx_add_pattern()` fails,
+         * the patterns are evaluated one-by-one */
+        _error_msg(re, "%s", regexx_get_error_msg(merged));
+        regexx_free(merged);
+        _compiled_free(re);
+        return;
+    }
+
+    swap = *re;
+    *re = *merged;
+    *merged = swap;
+    re->flags = swap.flags;
+    re->cache_size = swap.cache_size;
+    re->alloc = swap.alloc;
+    re->release = swap.release;
+    re->alloc_ctx = swap.alloc_ctx;
+    re->step_limit = swap.step_limit;
+    re->usec_limit = swap.usec_limit;
+    re->generation = swap.generation + 1;
+    merged->error_msg = re->error_msg;
+    re->error_msg = swap.error_msg;
+    merged->scratch = re->scratch;
+    re->scratch = swap.scratch;
+
+    for (i=re->pattern_count; i<merged->pattern_count; i++)
+        regexx_add_pattern(re, merged->patterns[i].source, merged->patterns[i].id, merged->patterns[i].flags);
+    regexx_free(merged);
+}
+
+/**
+ * Adds the newest pattern of a compiled set to the delta, which extends
+ * what it compiled with it. Once it's time to compile everything again,
+ * a merge starts doing that on another thread, and until it's done,
+ * the delta goes on growing.
+ * @return 0 if the new pattern can be searched for, -1 if not
+ */
+static int _delta_add(regexx_t *re, const char *pattern, size_t id, unsigned flags) {
+    size_t index = re->pattern_count - 1;
+    size_t count = re->pattern_count - re->compiled_count;
+    regexx_t *delta = re->delta;
+
+    if (re->merge == NULL && count > DELTA_MIN && count > re->compiled_count / DELTA_RATIO) {
+        if (_merge_start(re) != 0)
+            return _compile(re, NULL, NULL);
+    }
+
+    /* Neither the automata nor the counts they go by include it */
+    re->residual_count -= re->patterns[index].is_residual;
+    re->anchored_count -= re->patterns[index].is_anchored;
+
+    /* Scratch has to catch up with everything for a new delta, to get
+     * scratch for it, and after that only with the delta */
+    if (delta == NULL) {
+        delta = regexx_create(re->flags | REGEXX_LAZY_DFA);
+        delta->alloc = re->alloc;
+        delta->release = re->release;
+        delta->alloc_ctx = re->alloc_ctx;
+        delta->is_dot_match_newline = re->is_dot_match_newline;
+        delta->is_delta = true;
+        re->delta = delta;
+        re->generation++;
+    }
+    delta->macros = re->macros;
+    delta->macro_count = re->macro_count;
+    delta->cache_size = re->cache_size;
+    return regexx_add_pattern(delta, pattern, id, flags);
+}
+
 int regexx_add_pattern(regexx_t *re, const char *pattern, size_t id, unsigned flags) {
 
     size_t length;
@@ -1213,8 +2149,10 @@ int regexx_add_pattern(regexx_t *re, const char *pattern, size_t id, unsigned fl
 
     if (re == NULL)
         return -1;
+    _merge_finish(re, false);
     
     length = pattern?strlen(pattern):0;
+    re->is_case_insensitive = ((re->flags | flags) & REGEXX_IGNORECASE) != 0;
     
     /*
      * Parse the chain of subexpressions left to right
@@ -1227,21 +2165,40 @@ int regexx_add_pattern(regexx_t *re, const char *pattern, size_t id, unsigned fl
             goto fail;
     }
 
-    _node_terminate(re->tail);
+    _node_terminate(re, re->tail);
     
     /* Append to our list of patterns */
     re->patterns = realloc(re->patterns, sizeof(re->patterns[0]) * (re->pattern_count+1));
+    if (re->patterns == NULL)
+        abort();
     re->patterns[re->pattern_count].head = re->head;
     re->patterns[re->pattern_count].id = id;
+    re->patterns[re->pattern_count].source = _arena_strdup(re, pattern ? pattern : "");
+    re->patterns[re->pattern_count].flags = flags;
+    re->patterns[re->pattern_count].node_count = _node_number(re->head, 0);
     re->pattern_count++;
+    _pattern_lower(re, re->pattern_count - 1);
+    _pattern_first(re, re->pattern_count - 1);
+
+    /* Any DFA from `regexx_compile()` no longer includes all the
+     * patterns, so the new one goes into the delta, or if it can't, we
+     * go back to evaluating them one-by-one */
+    if (re->is_delta)
+        _delta_extend(re, re->pattern_count - 1);
+    else if (re->dfa == NULL || _delta_add(re, pattern, id, flags) != 0)
+        _compiled_free(re);
     
     /* Add a new head */
-    re->head = malloc(sizeof(node_t));
-    memset(re->head, 0, sizeof(node_t));
+    re->head = _node_new(re);
     re->head->type = T_ROOT;
     re->tail = re->head;
     return 0;
 fail:
+    /* Start the next pattern afresh, rather than after this one's
+     * partial parse (whose nodes stay in the arena until freed) */
+    re->head = _node_new(re);
+    re->head->type = T_ROOT;
+    re->tail = re->head;
     return -1;
 }
 
@@ -1249,405 +2206,6927 @@ fail:
 
 
 
-static bool _node_eval(node_t *node, const char *text, size_t offset, size_t length, size_t *next_offset) {
-    size_t offset2 = offset;
-    size_t count;
-    size_t longest;
-    
-    if (offset >= length && (node->type != T_QUANTIFIER || node->quantifier.min != 0)) {
-        if (node->type != T_TRUE && node->type != T_ANCHOR_END)
-            return false;
+/**
+ * What evaluating a pattern by backtracking needs, besides the node and
+ * offset. The calls still to return are kept on a stack of frames in the
+ * scratch memory, rather than on the C stack, so long inputs can't
+ * overflow it.
+ *
+ * With REGEXX_MEMOIZE, `memo` holds the result for each node and each
+ * offset from `base` (much like RE2's BitState, though we need the end of
+ * the match rather than one bit): MEMO_UNKNOWN, MEMO_NOMATCH, or
+ * MEMO_MATCH plus the length from `base` to the end.
+ */
+typedef struct evalctx_t {
+    const char *text;
+    size_t length;
+    scratch_t *scratch;
+    budget_t *budget;
+    size_t depth;       /* frames in use */
+    unsigned *memo;
+    size_t base;
+    size_t span;        /* offsets from `base` to `length` inclusive */
+
+    /* The result of the latest call to return */
+    bool is_matched;
+    size_t end;
+} evalctx_t;
+
+#define MEMO_UNKNOWN    0
+#define MEMO_NOMATCH    1
+#define MEMO_MATCH      2
+
+/* Memoize only when this many results (node count times offsets) or
+ * fewer are needed, so the memo stays small enough to clear each time */
+#define MEMO_MAX        (256 * 1024)
+
+/**
+ * Starts evaluating the chain from `node` at `offset`, by pushing a frame,
+ * unless the result is already memoized, in which case that's the result.
+ */
+static void _eval_call(evalctx_t *ctx, node_t *node, size_t offset) {
+    scratch_t *scratch = ctx->scratch;
+    evalframe_t *frame;
+
+    if (ctx->memo) {
+        unsigned memo = ctx->memo[node->id * ctx->span + (offset - ctx->base)];
+        if (memo != MEMO_UNKNOWN) {
+            ctx->is_matched = (memo != MEMO_NOMATCH);
+            ctx->end = ctx->base + (memo - MEMO_MATCH);
+            return;
+        }
     }
-    
- 
-    
-    switch (node->type) {
-        case T_TRUE:
-            *next_offset = offset;
-            return true;
-        case T_ROOT:
-            return _node_eval(node->next, text, offset, length, next_offset);
-        case T_ANCHOR_BEGIN:
-            if (offset != 0)
-                return false;
-            return _node_eval(node->next, text, offset, length, next_offset);
-        case T_ANCHOR_END:   /* '$' at end of regex */
-            if (offset != length)
-                return false;
-            return _node_eval(node->next, text, offset, length, next_offset);
-        case T_ALTERNATION:
-            if (_node_eval(node->alternation.child, text, offset, length, &offset2)) {
-                size_t offset3;
-                if (_node_eval(node->next, text, offset, length, &offset3)) {
-                    if (offset2 > offset3) {
-                        *next_offset = offset2;
-                        return true;
-                    } else {
-                        *next_offset = offset3;
-                        return true;
-                    }
-                } else {
-                    *next_offset = offset2;
-                    return true;
-                }
-            } else
-                return _node_eval(node->next, text, offset, length, next_offset);
-        case T_GROUP:
-            /* Match group.
-             * Also handle "lookaround" */
-            if (_node_eval(node->group.child, text, offset, length, &offset2)) {
-                if (node->group.is_inverted)
-                    return false;
-                if (node->group.is_lookahead)
-                    offset2 = offset; /* remove what was matched */
-                return _node_eval(node->next, text, offset2, length, next_offset);
-            } else {
-                if (!node->group.is_inverted)
-                    return false;
-                if (node->group.is_lookahead)
-                    offset2 = offset; /* remove what was matched */
-                return _node_eval(node->next, text, offset2, length, next_offset);
-            }
-        case T_QUANTIFIER:
-            longest = 0;
-            
-            /* Do the minimum number of steps
-             * `offset` will be set to the next character after a successful match */
-            for (count=0; count==SIZE_MAX || count<node->quantifier.min; count++) {
-                bool x;
-                x = _node_eval(node->quantifier.child, text, offset, length, &offset);
-                if (!x)
-                    return false;
-            }
-            
-            /* if lazy and rest of chain matches, then stop right here 
-             * `longest` will be set to the last character of a successful match,
-             * which will be used below in case no other matches are found */
-            if (_node_eval(node->next, text, offset, length, &longest)) {
-                if (node->quantifier.is_lazy) {
-                    *next_offset = longest;
-                    return true;
-                }
-            }
 
-            /* Do up to the maximum number of steps */
-            for (; count==SIZE_MAX || count<node->quantifier.max; count++) {
-                bool x;
+    if (ctx->depth >= scratch->frame_max) {
+        scratch->frame_max = scratch->frame_max * 2 + 64;
+        scratch->frames = realloc(scratch->frames, scratch->frame_max * sizeof(scratch->frames[0]));
+        if (scratch->frames == NULL)
+            abort();
+    }
+    frame = &scratch->frames[ctx->depth++];
+    frame->node = node;
+    frame->offset = offset;
+    frame->step = 0;
+}
+
+/**
+ * Has the frame evaluate `node` at `offset` instead, for when its result
+ * would be the same, rather than pushing another frame. The memo then
+ * only gets the result for where the frame ends up.
+ */
+static void _eval_jump(evalframe_t *frame, node_t *node, size_t offset) {
+    frame->node = node;
+    frame->offset = offset;
+    frame->step = 0;
+}
+
+/** Pops the top frame, with its result */
+static void _eval_return(evalctx_t *ctx, bool is_matched, size_t end) {
+    const evalframe_t *frame = &ctx->scratch->frames[--ctx->depth];
 
+    if (ctx->memo) {
+        unsigned *memo = &ctx->memo[frame->node->id * ctx->span + (frame->offset - ctx->base)];
+        *memo = is_matched ? (unsigned)(end - ctx->base) + MEMO_MATCH : MEMO_NOMATCH;
+    }
+    ctx->is_matched = is_matched;
+    ctx->end = end;
+}
 
-                x = _node_eval(node->quantifier.child, text, offset, length, &offset2);
-                if (!x)
-                    break;
-                
-                x = _node_eval(node->next, text, offset2, length, &longest);
-                if (x && node->quantifier.is_lazy)
-                    break;
-                offset = offset2;
-            }
-            
-            if (longest) {
-                *next_offset = longest;
-                return true;
-            }
+/**
+ * Compares text with a string that was folded to lowercase when parsed,
+ * ignoring case. SSE2 folds 16 bytes at a time: adding 0x80 - 'A' moves
+ * 'A'-'Z' to the bottom of the signed range, where one compare finds them.
+ */
+static bool _case_equal(const unsigned char *text, const unsigned char *folded, size_t length) {
+    size_t i = 0;
+
+#ifdef PREFILTER_X86
+    const __m128i shift = _mm_set1_epi8((char)(0x80 - 'A'));
+    const __m128i bound = _mm_set1_epi8((char)(0x80 + 26));
+    const __m128i bit = _mm_set1_epi8(0x20);
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i chars = _mm_loadu_si128((const __m128i *)(text + i));
+        __m128i is_upper = _mm_cmplt_epi8(_mm_add_epi8(chars, shift), bound);
+
+        chars = _mm_or_si128(chars, _mm_and_si128(is_upper, bit));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(chars, _mm_loadu_si128((const __m128i *)(folded + i)))) != 0xFFFF)
             return false;
-            
+    }
+#endif
+    for (; i < length; i++) {
+        if (_case_fold(text[i]) != folded[i])
+            return false;
+    }
+    return true;
+}
+
+/**
+ * For nodes that just match something at the offset, how many bytes that
+ * takes.
+ * @return the number of bytes, or SIZE_MAX if it doesn't match here
+ */
+static size_t _eval_width(const evalctx_t *ctx, const node_t *node, size_t offset) {
+    const char *text = ctx->text;
 
+    switch (node->type) {
+        case T_ROOT:
+            return 0;
+        case T_ANCHOR_BEGIN:
+            return (offset == 0) ? 0 : SIZE_MAX;
+        case T_ANCHOR_END:   /* '$' at end of regex */
+            return (offset == ctx->length) ? 0 : SIZE_MAX;
         case T_STRING:
-            if (node->string.length > (length-offset)) {
+            if (node->string.length > (ctx->length - offset)) {
                 /* Pattern longer than remaining characters */
-                return false;
+                return SIZE_MAX;
             }
             if (node->string.is_case_insensitive) {
-                /* FIXME: make this case insensitive */
-                if (memcmp(text+offset, node->string.chars, node->string.length) != 0) {
-                    /* the characters didn't match */
-                    return false;
-                }
-            } else {
-                if (memcmp(text+offset, node->string.chars, node->string.length) != 0) {
-                    /* the characters didn't match */
-                    return false;
-                }
-            }
-            return _node_eval(node->next, text, offset+node->string.length, length, next_offset);
+                if (!_case_equal((const unsigned char *)text + offset, (const unsigned char *)node->string.chars, node->string.length))
+                    return SIZE_MAX;
+            } else if (memcmp(text+offset, node->string.chars, node->string.length) != 0)
+                return SIZE_MAX;
+            return node->string.length;
         case T_DOT_ALL:
-            return _node_eval(node->next, text, offset+1, length, next_offset);
+            return 1;
         case T_DOT_NONEWLINE:
             if (text[offset] == '\n' || text[offset] == '\r')
-                return false;
-            return _node_eval(node->next, text, offset+1, length, next_offset);
+                return SIZE_MAX;
+            return 1;
         case T_CHARCLASS:
             if (!_charclass_match_char(&node->charclass, text[offset]))
-                return false;
-            return _node_eval(node->next, text, offset+1, length, next_offset);
+                return SIZE_MAX;
+            return 1;
         default:
             fprintf(stderr, "[-] programming err\n");
             abort();
     }
-    return 0;
 }
 
+/* The steps of a quantifier's frame */
+#define QUANT_START     0
+#define QUANT_MIN       1   /* do a required repetition */
+#define QUANT_MIN_DONE  2   /* ... which returned */
+#define QUANT_REST      3   /* the rest of the chain returned, after those */
+#define QUANT_MORE      4   /* do an optional repetition */
+#define QUANT_MORE_DONE 5   /* ... which returned */
+#define QUANT_MORE_REST 6   /* the rest of the chain returned, after that */
+
 /**
- * Keep track of line numbers, and the character offset in the current line, for each
- * token.
- * TODO: this needs to be integrated into `lex` parsing instead of a separate step
+ * Starts a quantifier's repetition at `offset`. Most repeat a single node
+ * (like `.*` or `[0-9]+`), which is evaluated right here rather than
+ * taking a frame.
+ * @return true if it's done, with the result, or false if a call was
+ *  made, so the frame resumes when it returns
  */
-static void _set_offsets(regexx_t *re, const char *buf, size_t offset, size_t token_length) {
-    size_t i;
-    
-    for (i=0; i<token_length; i++) {
-        if (buf[offset + i] == '\n') {
-            re->offsets.line_number++;
-            re->offsets.char_number = 0;
-        } else
-            re->offsets.char_number++;
+static bool _eval_repeat(evalctx_t *ctx, node_t *child, size_t offset) {
+    size_t width;
+
+    switch (child->type) {
+        case T_ALTERNATION:
+        case T_GROUP:
+        case T_QUANTIFIER:
+        case T_TRUE:
+            _eval_call(ctx, child, offset);
+            return false;
+        default:
+            if (child->next->type != T_TRUE) {
+                _eval_call(ctx, child, offset);
+                return false;
+            }
     }
+
+    if (offset >= ctx->length && child->type != T_ANCHOR_END)
+        width = SIZE_MAX;
+    else
+        width = _eval_width(ctx, child, offset);
+    ctx->is_matched = (width != SIZE_MAX);
+    ctx->end = offset + width;
+    return true;
 }
 
-struct regexxtoken_t regexx_lex_token(regexx_t *re, const char *subject, size_t *subject_offset, size_t subject_length) {
-    struct regexxtoken_t result = {REGEXX_NOT_FOUND, 0, 0 , 0, 0};
-    size_t i;
-    size_t longest = 0;
-    
-    result.line_number = re->offsets.line_number;
-    result.char_number = re->offsets.char_number;
-    
-    /* Make sure input is valid */
-    if (re == NULL || re->head == NULL || subject == NULL)
-        return result;
+/**
+ * Moves a quantifier's frame along: first the minimum number of
+ * repetitions, then the rest of the chain after each optional one,
+ * remembering the longest match (or stopping at the first, if lazy).
+ */
+static void _eval_quantifier(evalctx_t *ctx, evalframe_t *frame) {
+    node_t *node = frame->node;
 
-    if (subject_length == SIZE_MAX)
-        subject_length = strlen(subject);
-    
-    /* Search for all patterns that have been compile */
-    for (i=0; i<re->pattern_count; i++) {
-        node_t *head = re->patterns[i].head;
-        bool is_matched;
-        size_t end;
-        
-        is_matched = _node_eval(head->next, subject, *subject_offset, subject_length, &end);
-        if (is_matched && longest < end) {
-            result.id = re->patterns[i].id;
-            result.length = end - *subject_offset;
-            _set_offsets(re, subject, *subject_offset, result.length);
-            result.string = subject + *subject_offset;
-            longest = end;
+    for (;;) {
+        switch (frame->step) {
+            case QUANT_START:
+                frame->count = 0;
+                frame->at = frame->offset;
+                frame->step = QUANT_MIN;
+                break;
+            case QUANT_MIN:
+                if (frame->count < node->quantifier.min) {
+                    frame->step = QUANT_MIN_DONE;
+                    if (!_eval_repeat(ctx, node->quantifier.child, frame->at))
+                        return;
+                } else {
+                    frame->step = QUANT_REST;
+                    _eval_call(ctx, node->next, frame->at);
+                    return;
+                }
+                break;
+            case QUANT_MIN_DONE:
+                if (!ctx->is_matched) {
+                    _eval_return(ctx, false, 0);
+                    return;
+                }
+                frame->at = ctx->end;
+                frame->count++;
+                frame->step = QUANT_MIN;
+                break;
+            case QUANT_REST:
+                frame->end = 0;
+                if (ctx->is_matched) {
+                    frame->end = ctx->end;
+                    if (node->quantifier.is_lazy) {
+                        _eval_return(ctx, true, frame->end);
+                        return;
+                    }
+                }
+                frame->step = QUANT_MORE;
+                break;
+            case QUANT_MORE:
+                if (frame->count >= node->quantifier.max)
+                    goto done;
+                frame->step = QUANT_MORE_DONE;
+                if (!_eval_repeat(ctx, node->quantifier.child, frame->at))
+                    return;
+                break;
+            case QUANT_MORE_DONE:
+                if (!ctx->is_matched)
+                    goto done;
+                if (ctx->end == frame->at)
+                    goto done; /* matched nothing, so would repeat forever */
+                frame->repeat = ctx->end;
+                frame->step = QUANT_MORE_REST;
+                _eval_call(ctx, node->next, frame->repeat);
+                return;
+            default: /* QUANT_MORE_REST */
+                if (ctx->is_matched) {
+                    frame->end = ctx->end;
+                    if (node->quantifier.is_lazy)
+                        goto done;
+                }
+                frame->at = frame->repeat;
+                frame->count++;
+                frame->step = QUANT_MORE;
+                break;
         }
     }
-    
-    /* If there was a match, return the longest */
-    if (longest) {
-        *subject_offset = longest;
-        return result;
-    } else {
-        result.id = REGEXX_NOT_FOUND;
-        return result;
-    }
+
+done:
+    if (frame->end)
+        _eval_return(ctx, true, frame->end);
+    else
+        _eval_return(ctx, false, 0);
 }
 
-size_t regexx_match(regexx_t *re, const char *input, size_t in_offset, size_t in_length, size_t *out_offset, size_t *out_length) {
-    size_t i;
+/**
+ * Evaluates the chain from `node` at `offset` by backtracking. Each node
+ * that needs to do something after a call returns is a frame on the
+ * stack, which resumes at `step` then; others just move their frame on. The result for a node and offset only depends on those, which
+ * is what makes memoizing possible, so that each pair is evaluated at
+ * most once, making the time polynomial instead of exponential.
+ * @return true on a match, with `*next_offset` set to where it ends
+ */
+static bool _node_eval(evalctx_t *ctx, node_t *node, size_t offset, size_t *next_offset) {
+    ctx->depth = 0;
+    _eval_call(ctx, node, offset);
 
-    if (in_length == SIZE_MAX)
-        in_length = strlen(input);
-    
-    /* Make sure input is valid */
-    if (re == NULL || re->head == NULL || input == NULL)
-        return -1;
-    
-    /* Search for all patterns that have been compile */
-    for (i=0; i<re->pattern_count; i++) {
-        size_t offset;
-        node_t *head = re->patterns[i].head;
-        size_t id = re->patterns[i].id;
-        
-        /* For all bytes, see if there is a match at this location,
-         * until we find one, then stop. */
-        for (offset=in_offset; offset<in_length; offset++) {
-            bool is_matched;
-            size_t end;
-        
-            is_matched = _node_eval(head->next, input, offset, in_length, &end);
-            if (is_matched) {
-                *out_offset = offset;
-                *out_length = end - offset;
-                return id; 
+    while (ctx->depth) {
+        evalframe_t *frame = &ctx->scratch->frames[ctx->depth - 1];
+        node_t *top = frame->node;
+
+        if (_budget_spend(ctx->budget, 1)) {
+            ctx->depth = 0;
+            return false;
+        }
+
+        /* Nothing is left for a node that matches a byte, but groups,
+         * alternations and quantifiers might still match nothing */
+        if (frame->step == 0 && frame->offset >= ctx->length
+            && (top->type == T_DOT_ALL || top->type == T_DOT_NONEWLINE || top->type == T_CHARCLASS)) {
+            _eval_return(ctx, false, 0);
+            continue;
+        }
+
+        switch (top->type) {
+            case T_TRUE:
+                _eval_return(ctx, true, frame->offset);
+                break;
+            case T_ALTERNATION:
+                switch (frame->step) {
+                    case 0:
+                        frame->step = 1;
+                        _eval_call(ctx, top->alternation.child, frame->offset);
+                        break;
+                    case 1:     /* the left side returned, so try the right */
+                        if (!ctx->is_matched) {
+                            _eval_jump(frame, top->next, frame->offset);
+                            break;
+                        }
+                        frame->end = ctx->end;
+                        frame->step = 2;
+                        _eval_call(ctx, top->next, frame->offset);
+                        break;
+                    default:    /* both sides, so the longer */
+                        if (!ctx->is_matched || frame->end > ctx->end)
+                            _eval_return(ctx, true, frame->end);
+                        else
+                            _eval_return(ctx, true, ctx->end);
+                }
+                break;
+            case T_GROUP:
+                /* Match group.
+                 * Also handle "lookaround" */
+                switch (frame->step) {
+                    case 0:
+                        frame->step = 1;
+                        _eval_call(ctx, top->group.child, frame->offset);
+                        break;
+                    default: {
+                        size_t at = frame->offset;
+
+                        if (ctx->is_matched == top->group.is_inverted) {
+                            _eval_return(ctx, false, 0);
+                            break;
+                        }
+                        if (ctx->is_matched && !top->group.is_lookahead)
+                            at = ctx->end;
+                        _eval_jump(frame, top->next, at);
+                    }
+                }
+                break;
+            case T_QUANTIFIER:
+                _eval_quantifier(ctx, frame);
+                break;
+            default: {
+                size_t width = _eval_width(ctx, top, frame->offset);
+
+                if (width == SIZE_MAX)
+                    _eval_return(ctx, false, 0);
+                else
+                    _eval_jump(frame, top->next, frame->offset + width);
             }
         }
     }
-    return REGEXX_NOT_FOUND;
+
+    if (ctx->is_matched)
+        *next_offset = ctx->end;
+    return ctx->is_matched;
 }
 
 
-static void _node_print_chars(const char *str, size_t length, buf_t *buf) {
-    size_t i;
-    for (i=0; i<length; i++) {
-        char c = str[i];
-        if (strchr(".^$*+?()[{}\\|", c)) {
-            _appendf(buf, "\\%c", c);
-        } else {
-            switch (c & 0xFF) {
-            case '\a': _appendf(buf, "\\a"); break;
-            case '\b': _appendf(buf, "\\b"); break;
-            case '\t': _appendf(buf, "\\t"); break;
-            case '\f': _appendf(buf, "\\f"); break;
-            case '\v': _appendf(buf, "\\v"); break;
-            case '\r': _appendf(buf, "\\r"); break;
-            case '\n': _appendf(buf, "\\n"); break;
+/****************************************************************************
+ * Compilation
+ *
+ * `regexx_compile()` lowers the parse trees of all the patterns into a single
+ * Thompson NFA program, then does subset construction over it to produce
+ * one DFA for the whole set. Each DFA state remembers which pattern (if
+ * any) matches when we reach it, so matching becomes one table lookup per
+ * input byte no matter how many patterns there are.
+ *
+ * Some features can't be expressed in a DFA, namely lazy quantifiers and
+ * lookahead. Patterns using these are marked `is_residual` and are still
+ * evaluated with `_node_eval()`, with the results merged with the DFA.
+ ****************************************************************************/
+
+/* Patterns whose NFA would be larger than this (such as from large
+ * counted repetitions) are left to the backtracking engine */
+#define NFA_PATTERN_MAX 65536
+
+/* Give up building the DFA beyond this many states */
+#define DFA_STATE_MAX 65536
+
+/* The default size of the state cache for REGEXX_LAZY_DFA */
+#define DFA_CACHE_SIZE (2 * 1024 * 1024)
+
+/**
+ * Things we learn about a parse tree before lowering it to the NFA.
+ */
+typedef struct nodeinfo_t {
+    bool is_lazy;
+    bool is_lookahead;
+    bool is_unsupported;
+} nodeinfo_t;
+
+static size_t _size_add(size_t lhs, size_t rhs) {
+    return (lhs > SIZE_MAX - rhs) ? SIZE_MAX : lhs + rhs;
+}
+static size_t _size_mul(size_t lhs, size_t rhs) {
+    return (rhs && lhs > SIZE_MAX / rhs) ? SIZE_MAX : lhs * rhs;
+}
+
+/**
+ * Walk a chain (and its children), finding which features are used and
+ * returning the number of NFA instructions it'll expand into.
+ */
+static size_t _node_analyze(const node_t *node, nodeinfo_t *info) {
+    size_t result = 0;
+
+    for (; node; node = node->next) {
+        switch (node->type) {
+            case T_TRUE:
+                return result;
+            case T_ROOT:
+                break;
+            case T_ANCHOR_BEGIN:
+            case T_ANCHOR_END:
+            case T_DOT_ALL:
+            case T_DOT_NONEWLINE:
+            case T_CHARCLASS:
+                result = _size_add(result, 1);
+                break;
+            case T_STRING:
+                result = _size_add(result, node->string.length);
+                break;
+            case T_ALTERNATION:
+                result = _size_add(result, 1);
+                result = _size_add(result, _node_analyze(node->alternation.child, info));
+                break;
+            case T_GROUP:
+                if (node->group.is_lookahead) {
+                    /* Lowered forwards and backwards, plus the OP_LOOK
+                     * and the two OP_MATCH instructions */
+                    info->is_lookahead = true;
+                    result = _size_add(result, _size_add(_size_mul(_node_analyze(node->group.child, info), 2), 3));
+                } else
+                    result = _size_add(result, _node_analyze(node->group.child, info));
+                break;
+            case T_QUANTIFIER: {
+                size_t child = _node_analyze(node->quantifier.child, info);
+                size_t min = node->quantifier.min;
+                size_t max = node->quantifier.max;
+                if (node->quantifier.is_lazy)
+                    info->is_lazy = true;
+                if (max == SIZE_MAX)
+                    result = _size_add(result, _size_add(_size_mul(child, min?min:1), 1));
+                else
+                    result = _size_add(result, _size_add(_size_mul(child, max), max - min));
+            } break;
             default:
-                _appendf(buf, "%c", c);
+                info->is_unsupported = true;
+                return result;
+        }
+    }
+    return result;
+}
+
+/**
+ * Whether a chain is nothing but a (non-empty) string, which must be case
+ * sensitive unless the Aho-Corasick automaton is `is_folded` too.
+ */
+static bool _node_is_literal(const node_t *node, bool is_folded) {
+    size_t length = 0;
+
+    for (; node && node->type != T_TRUE; node = node->next) {
+        if (node->type == T_ROOT)
+            continue;
+        if (node->type != T_STRING || (node->string.is_case_insensitive && !is_folded))
+            return false;
+        length += node->string.length;
+    }
+    return length != 0;
+}
+
+/**
+ * The most bytes a chain can match, or SIZE_MAX if there's no limit.
+ */
+static size_t _node_max_length(const node_t *node) {
+    size_t result = 0;
+
+    for (; node && node->type != T_TRUE; node = node->next) {
+        switch (node->type) {
+            case T_ROOT:
+            case T_ANCHOR_BEGIN:
+            case T_ANCHOR_END:
+                break;
+            case T_DOT_ALL:
+            case T_DOT_NONEWLINE:
+            case T_CHARCLASS:
+                result = _size_add(result, 1);
                 break;
+            case T_STRING:
+                result = _size_add(result, node->string.length);
+                break;
+            case T_ALTERNATION: {
+                size_t lhs = _node_max_length(node->alternation.child);
+                size_t rhs = _node_max_length(node->next);
+                return _size_add(result, (lhs > rhs) ? lhs : rhs);
             }
+            case T_GROUP:
+                if (!node->group.is_lookahead)
+                    result = _size_add(result, _node_max_length(node->group.child));
+                break;
+            case T_QUANTIFIER: {
+                size_t child = _node_max_length(node->quantifier.child);
+                if (node->quantifier.max == SIZE_MAX)
+                    result = child ? SIZE_MAX : result;
+                else
+                    result = _size_add(result, _size_mul(child, node->quantifier.max));
+            } break;
+            default:
+                return SIZE_MAX;
         }
     }
+    return result;
 }
 
-
 /**
- * Recursively print the nodes
+ * A fragment of the NFA under construction. The exits that haven't been
+ * connected yet are kept as a linked list running through the unused
+ * `out` fields, where each entry is `pc*2` for `out` or `pc*2+1` for
+ * `out1`.
  */
-static const char *_node_print(node_t *node, buf_t *buf) {
-    buf_t buf2[1] = {0,0};
-    if (buf == NULL)
-        buf = buf2; /* for debugging */
+typedef struct frag_t {
+    unsigned start;     /* NFA_NONE when the fragment is empty */
+    unsigned holes;
+    unsigned tail;
+} frag_t;
 
-    while (node) {
-    switch (node->type) {
-        case T_TRUE:
-            return buf->string;
-            break;
-        case T_ROOT:
-            break;
-        case T_DOT_ALL:
-        case T_DOT_NONEWLINE:
-            _appendf(buf, ".");
-            break;
-        case T_ANCHOR_BEGIN:
-            _appendf(buf, "^");
-            break;
-        case T_ANCHOR_END:
+static const frag_t _frag_empty = {NFA_NONE, NFA_NONE, NFA_NONE};
+
+static unsigned *_hole_field(prog_t *prog, unsigned hole) {
+    nfainst_t *inst = &prog->insts[hole >> 1];
+    return (hole & 1) ? &inst->out1 : &inst->out;
+}
+
+/** Connects all the dangling exits of the fragment to `target` */
+static void _frag_patch(prog_t *prog, frag_t frag, unsigned target) {
+    unsigned hole = frag.holes;
+    while (hole != NFA_NONE) {
+        unsigned *field = _hole_field(prog, hole);
+        hole = *field;
+        *field = target;
+    }
+}
+
+/** Combines two lists of dangling exits */
+static frag_t _frag_holes(prog_t *prog, frag_t lhs, frag_t rhs) {
+    if (lhs.holes == NFA_NONE) {
+        lhs.holes = rhs.holes;
+        lhs.tail = rhs.tail;
+    } else if (rhs.holes != NFA_NONE) {
+        *_hole_field(prog, lhs.tail) = rhs.holes;
+        lhs.tail = rhs.tail;
+    }
+    return lhs;
+}
+
+static unsigned _prog_emit(prog_t *prog, unsigned op, unsigned arg) {
+    nfainst_t *inst;
+
+    if (prog->count >= prog->max) {
+        prog->max = prog->max * 2 + 64;
+        prog->insts = realloc(prog->insts, prog->max * sizeof(prog->insts[0]));
+        if (prog->insts == NULL)
+            abort();
+    }
+    inst = &prog->insts[prog->count];
+    inst->op = (unsigned char)op;
+    inst->out = NFA_NONE;
+    inst->out1 = NFA_NONE;
+    inst->arg = arg;
+    return prog->count++;
+}
+
+/** Emits a single instruction as a fragment, with `out` dangling */
+static frag_t _frag_inst(prog_t *prog, unsigned op, unsigned arg) {
+    frag_t result;
+    result.start = _prog_emit(prog, op, arg);
+    result.holes = result.start * 2;
+    result.tail = result.holes;
+    return result;
+}
+
+static frag_t _frag_concat(prog_t *prog, frag_t first, frag_t second) {
+    if (first.start == NFA_NONE)
+        return second;
+    if (second.start == NFA_NONE)
+        return first;
+    _frag_patch(prog, first, second.start);
+    first.holes = second.holes;
+    first.tail = second.tail;
+    return first;
+}
+
+/** Either `preferred` or `other`. Either can be empty. */
+static frag_t _frag_split(prog_t *prog, frag_t preferred, frag_t other) {
+    frag_t result;
+    frag_t exits[2];
+    unsigned pc;
+    unsigned i;
+
+    pc = _prog_emit(prog, OP_SPLIT, 0);
+    result.start = pc;
+    result.holes = NFA_NONE;
+    result.tail = NFA_NONE;
+    exits[0] = preferred;
+    exits[1] = other;
+    for (i=0; i<2; i++) {
+        if (exits[i].start == NFA_NONE) {
+            frag_t hole;
+            hole.start = pc;
+            hole.holes = pc * 2 + i;
+            hole.tail = hole.holes;
+            result = _frag_holes(prog, result, hole);
+        } else {
+            if (i == 0)
+                prog->insts[pc].out = exits[i].start;
+            else
+                prog->insts[pc].out1 = exits[i].start;
+            result = _frag_holes(prog, result, exits[i]);
+        }
+    }
+    return result;
+}
+
+/** Adds the charclass to the shared table, returning its index */
+static unsigned _prog_class(prog_t *prog, charclass_t charclass) {
+    unsigned i;
+    for (i=0; i<prog->class_count; i++) {
+        if (_charclass_is_equal(prog->classes[i], charclass))
+            return i;
+    }
+    prog->classes = realloc(prog->classes, (prog->class_count + 1) * sizeof(prog->classes[0]));
+    if (prog->classes == NULL)
+        abort();
+    prog->classes[prog->class_count] = charclass;
+    return prog->class_count++;
+}
+
+static frag_t _lower_chain(prog_t *prog, const node_t *node, bool is_reverse);
+
+/**
+ * Lowers `{min,max}` repetition by making copies of the child.
+ */
+static frag_t _lower_quantifier(prog_t *prog, const node_t *node, bool is_reverse) {
+    const node_t *child = node->quantifier.child;
+    size_t min = node->quantifier.min;
+    size_t max = node->quantifier.max;
+    bool is_greedy = !node->quantifier.is_lazy;
+    frag_t result = _frag_empty;
+    size_t i;
+
+    if (max == SIZE_MAX) {
+        frag_t body;
+        frag_t loop;
+        unsigned pc;
+
+        /* `x{3,}` becomes `xxx+`, where the last copy loops back on itself */
+        for (i=1; i<min; i++) {
+            frag_t copy = _lower_chain(prog, child, is_reverse);
+            result = is_reverse ? _frag_concat(prog, copy, result) : _frag_concat(prog, result, copy);
+        }
+        body = _lower_chain(prog, child, is_reverse);
+        if (body.start == NFA_NONE)
+            return result;
+        pc = _prog_emit(prog, OP_SPLIT, 0);
+        _frag_patch(prog, body, pc);
+        if (is_greedy)
+            prog->insts[pc].out = body.start;
+        else
+            prog->insts[pc].out1 = body.start;
+        loop.start = min ? body.start : pc;
+        loop.holes = pc * 2 + (is_greedy?1:0);
+        loop.tail = loop.holes;
+        return is_reverse ? _frag_concat(prog, loop, result) : _frag_concat(prog, result, loop);
+    } else {
+        frag_t optional = _frag_empty;
+
+        for (i=0; i<min; i++) {
+            frag_t copy = _lower_chain(prog, child, is_reverse);
+            result = is_reverse ? _frag_concat(prog, copy, result) : _frag_concat(prog, result, copy);
+        }
+
+        /* `x{0,3}` becomes `(x(x(x)?)?)?`, built inside out */
+        for (i=min; i<max; i++) {
+            frag_t copy = _lower_chain(prog, child, is_reverse);
+            copy = is_reverse ? _frag_concat(prog, optional, copy) : _frag_concat(prog, copy, optional);
+            if (copy.start == NFA_NONE)
+                break;
+            if (is_greedy)
+                optional = _frag_split(prog, copy, _frag_empty);
+            else
+                optional = _frag_split(prog, _frag_empty, copy);
+        }
+        return is_reverse ? _frag_concat(prog, optional, result) : _frag_concat(prog, result, optional);
+    }
+}
+
+/**
+ * Lowers the body of a lookahead on its own, ending in an OP_MATCH that
+ * belongs to no pattern, returning where it starts.
+ */
+static unsigned _lower_body(prog_t *prog, const node_t *child, bool is_reverse) {
+    frag_t frag;
+    unsigned match;
+
+    frag = _lower_chain(prog, child, is_reverse);
+    match = _prog_emit(prog, OP_MATCH, NFA_NONE);
+    if (frag.start == NFA_NONE)
+        return match;
+    _frag_patch(prog, frag, match);
+    return frag.start;
+}
+
+/**
+ * Lowers `(?=...)` or `(?!...)` into a lookahead table entry, with an
+ * OP_LOOK instruction that checks it. The body may contain more
+ * lookaheads, so the entry is reserved before lowering it.
+ */
+static frag_t _lower_lookahead(prog_t *prog, const node_t *node) {
+    unsigned index = prog->look_count;
+    unsigned forward;
+    unsigned reverse;
+
+    prog->looks = realloc(prog->looks, (prog->look_count + 1) * sizeof(prog->looks[0]));
+    if (prog->looks == NULL)
+        abort();
+    prog->look_count++;
+
+    forward = _lower_body(prog, node->group.child, false);
+    reverse = _lower_body(prog, node->group.child, true);
+    prog->looks[index].forward = forward;
+    prog->looks[index].reverse = reverse;
+    prog->looks[index].is_inverted = node->group.is_inverted;
+    prog->looks[index].is_bounded = _node_max_length(node->group.child) != SIZE_MAX;
+    return _frag_inst(prog, OP_LOOK, index);
+}
+
+/**
+ * Lowers a single node (but not the rest of its chain).
+ */
+static frag_t _lower_node(prog_t *prog, const node_t *node, bool is_reverse) {
+    frag_t result = _frag_empty;
+    size_t i;
+
+    switch (node->type) {
+        case T_ANCHOR_BEGIN:
+            return _frag_inst(prog, OP_BEGIN, 0);
+        case T_ANCHOR_END:
+            return _frag_inst(prog, OP_END, 0);
+        case T_DOT_ALL:
+            return _frag_inst(prog, OP_CLASS, _prog_class(prog, _dot_all));
+        case T_DOT_NONEWLINE: {
+            charclass_t charclass = {0,0,0,0};
+            _charclass_add_char(&charclass, '\n');
+            _charclass_add_char(&charclass, '\r');
+            return _frag_inst(prog, OP_CLASS, _prog_class(prog, _invert(charclass)));
+        }
+        case T_CHARCLASS:
+            return _frag_inst(prog, OP_CLASS, _prog_class(prog, node->charclass));
+        case T_STRING:
+            for (i=0; i<node->string.length; i++) {
+                unsigned byte = node->string.chars[i] & 0xFF;
+                frag_t c;
+
+                /* Ignoring case, a letter is a class of both */
+                if (node->string.is_case_insensitive && byte - 'a' < 26) {
+                    charclass_t charclass = {0,0,0,0};
+                    _charclass_add_char(&charclass, byte);
+                    c = _frag_inst(prog, OP_CLASS, _prog_class(prog, _charclass_fold(charclass)));
+                } else
+                    c = _frag_inst(prog, OP_BYTE, byte);
+                result = is_reverse ? _frag_concat(prog, c, result) : _frag_concat(prog, result, c);
+            }
+            return result;
+        case T_GROUP:
+            if (node->group.is_lookahead)
+                return _lower_lookahead(prog, node);
+            return _lower_chain(prog, node->group.child, is_reverse);
+        case T_QUANTIFIER:
+            return _lower_quantifier(prog, node, is_reverse);
+        default:
+            return result;
+    }
+}
+
+/**
+ * Lowers a chain of nodes up to its T_TRUE terminator. An alternation
+ * node means "either my child chain or the rest of this chain".
+ */
+static frag_t _lower_chain(prog_t *prog, const node_t *node, bool is_reverse) {
+    frag_t result = _frag_empty;
+
+    for (; node && node->type != T_TRUE; node = node->next) {
+        frag_t next;
+
+        if (node->type == T_ROOT)
+            continue;
+        if (node->type == T_ALTERNATION) {
+            frag_t lhs = _lower_chain(prog, node->alternation.child, is_reverse);
+            frag_t rhs = _lower_chain(prog, node->next, is_reverse);
+            next = _frag_split(prog, lhs, rhs);
+            return is_reverse ? _frag_concat(prog, next, result) : _frag_concat(prog, result, next);
+        }
+        next = _lower_node(prog, node, is_reverse);
+        result = is_reverse ? _frag_concat(prog, next, result) : _frag_concat(prog, result, next);
+    }
+    return result;
+}
+
+/**
+ * Lowers a pattern's tree (backwards, with `is_reverse`), terminated with
+ * a match instruction for the pattern, returning the instruction where
+ * it starts.
+ */
+static unsigned _lower_pattern(prog_t *prog, const node_t *head, unsigned index, bool is_reverse) {
+    frag_t frag;
+    unsigned match;
+
+    frag = _lower_chain(prog, head, is_reverse);
+    match = _prog_emit(prog, OP_MATCH, index);
+    if (frag.start == NFA_NONE)
+        return match;
+    _frag_patch(prog, frag, match);
+    return frag.start;
+}
+
+static void _prog_free(prog_t *prog) {
+    free(prog->insts);
+    free(prog->classes);
+    free(prog->looks);
+    memset(prog, 0, sizeof(*prog));
+}
+
+/**
+ * Lowers a newly added pattern into the NFA program shared by all the
+ * patterns, and decides whether the DFA can handle it or whether it'll
+ * be left over (residual) for the Pike VM or backtracking.
+ */
+static void _pattern_lower(regexx_t *re, size_t index) {
+    nodeinfo_t info = {0};
+    size_t size;
+
+    size = _node_analyze(re->patterns[index].head, &info);
+    re->patterns[index].is_lazy = info.is_lazy;
+    if (info.is_unsupported || size > NFA_PATTERN_MAX)
+        re->patterns[index].start = NFA_NONE;
+    else
+        re->patterns[index].start = _lower_pattern(&re->prog, re->patterns[index].head, (unsigned)index, false);
+    re->patterns[index].is_residual = info.is_lazy || info.is_lookahead
+            || re->patterns[index].start == NFA_NONE;
+    re->patterns[index].is_literal = !re->patterns[index].is_residual
+            && _node_is_literal(re->patterns[index].head, (re->flags & REGEXX_IGNORECASE) != 0);
+    re->patterns[index].reverse = NFA_NONE;
+    if (!re->patterns[index].is_residual && !re->patterns[index].is_literal)
+        re->patterns[index].reverse = _lower_pattern(&re->prog, re->patterns[index].head, (unsigned)index, true);
+    if (re->patterns[index].is_residual)
+        re->residual_count++;
+}
+
+static void _sparseset_init(sparseset_t *set, unsigned max) {
+    set->dense = malloc((max + 1) * sizeof(unsigned));
+    set->sparse = malloc((max + 1) * sizeof(unsigned));
+    if (set->dense == NULL || set->sparse == NULL)
+        abort();
+    set->count = 0;
+    set->max = max;
+}
+
+static void _sparseset_free(sparseset_t *set) {
+    free(set->dense);
+    free(set->sparse);
+    memset(set, 0, sizeof(*set));
+}
+
+static bool _sparseset_contains(const sparseset_t *set, unsigned x) {
+    unsigned i = set->sparse[x];
+    return i < set->count && set->dense[i] == x;
+}
+
+static void _sparseset_add(sparseset_t *set, unsigned x) {
+    set->sparse[x] = set->count;
+    set->dense[set->count++] = x;
+}
+
+/* Which zero-width assertions can be passed when following epsilons */
+#define CLOSE_BEGIN 0x01
+#define CLOSE_END   0x02
+
+/**
+ * Adds `pc` and everything reachable from it through epsilon transitions
+ * to the set. The `stack` must have room for twice the program size.
+ */
+static void _nfa_closure(const prog_t *prog, sparseset_t *set, unsigned *stack, unsigned pc, unsigned flags) {
+    size_t depth = 0;
+
+    stack[depth++] = pc;
+    while (depth) {
+        const nfainst_t *inst;
+
+        pc = stack[--depth];
+        if (pc == NFA_NONE || _sparseset_contains(set, pc))
+            continue;
+        _sparseset_add(set, pc);
+
+        inst = &prog->insts[pc];
+        switch (inst->op) {
+            case OP_SPLIT:
+                stack[depth++] = inst->out1;
+                stack[depth++] = inst->out;
+                break;
+            case OP_BEGIN:
+                if (flags & CLOSE_BEGIN)
+                    stack[depth++] = inst->out;
+                break;
+            case OP_END:
+                if (flags & CLOSE_END)
+                    stack[depth++] = inst->out;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+/** Whether an instruction moves forward on byte `c` */
+static bool _nfa_consumes(const prog_t *prog, const nfainst_t *inst, unsigned c) {
+    return (inst->op == OP_BYTE && inst->arg == c)
+        || (inst->op == OP_CLASS && _charclass_match_char(&prog->classes[inst->arg], c));
+}
+
+static int _unsigned_compare(const void *lhs, const void *rhs) {
+    unsigned x = *(const unsigned *)lhs;
+    unsigned y = *(const unsigned *)rhs;
+    return (x > y) - (x < y);
+}
+
+static unsigned _dfa_hash(const unsigned *set, size_t count) {
+    unsigned hash = 2166136261U;
+    size_t i;
+    for (i=0; i<count; i++) {
+        hash ^= set[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static void _dfa_free(dfa_t *dfa) {
+    if (dfa == NULL)
+        return;
+    if (!dfa->is_borrowed) {
+        free(dfa->trans);
+        free(dfa->accept);
+        free(dfa->accept_eof);
+    }
+    free(dfa->sets);
+    free(dfa->set_offsets);
+    free(dfa->table);
+    free(dfa->starts);
+    free(dfa->stack);
+    free(dfa->list);
+    free(dfa->seeds);
+    free(dfa->seed_offsets);
+    if (dfa->set.dense)
+        _sparseset_free(&dfa->set);
+    if (dfa->tmp.dense)
+        _sparseset_free(&dfa->tmp);
+#ifdef JIT_X86
+    if (dfa->jit_code)
+        munmap(dfa->jit_code, dfa->jit_size);
+#endif
+    free(dfa);
+}
+
+/** Returns the NFA set of a state being built */
+static const unsigned *_dfa_set(const dfa_t *dfa, unsigned state, size_t *count) {
+    *count = dfa->set_offsets[state + 1] - dfa->set_offsets[state];
+    return dfa->sets + dfa->set_offsets[state];
+}
+
+/** Grows the open-addressing hash table from sets to states */
+static void _dfa_rehash(dfa_t *dfa, unsigned size) {
+    unsigned state;
+
+    if (size != dfa->table_size) {
+        free(dfa->table);
+        dfa->table = malloc(size * sizeof(dfa->table[0]));
+        if (dfa->table == NULL)
+            abort();
+        dfa->table_size = size;
+    }
+    memset(dfa->table, 0, size * sizeof(dfa->table[0]));
+    for (state=1; state<dfa->state_count; state++) {
+        size_t count;
+        const unsigned *set = _dfa_set(dfa, state, &count);
+        unsigned i = _dfa_hash(set, count) & (size - 1);
+        while (dfa->table[i])
+            i = (i + 1) & (size - 1);
+        dfa->table[i] = state;
+    }
+}
+
+/**
+ * Whether an instruction goes into a state's kernel: the ones that consume
+ * bytes or match, and the anchor that could still pass at the end of the
+ * input, so that equivalent closures map to the same state.
+ */
+static bool _dfa_keeps(const dfa_t *dfa, unsigned op) {
+    switch (op) {
+        case OP_BYTE:
+        case OP_CLASS:
+        case OP_MATCH:
+            return true;
+        case OP_END:
+            return dfa->kind != DFA_REVERSE;
+        case OP_BEGIN:
+            return dfa->kind == DFA_REVERSE;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Which patterns match in a plain (longest or reverse) state, and which
+ * would match if this were the end of the input, as 1 + the lowest
+ * pattern number, or 0 if none.
+ */
+static void _dfa_accepts(const dfa_t *dfa, const prog_t *prog, const unsigned *kernel, size_t count, sparseset_t *tmp, unsigned *stack, unsigned *r_accept, unsigned *r_accept_eof) {
+    unsigned eof_op = (dfa->kind == DFA_REVERSE) ? OP_BEGIN : OP_END;
+    unsigned eof_flag = (dfa->kind == DFA_REVERSE) ? CLOSE_BEGIN : CLOSE_END;
+    unsigned accept = 0;
+    unsigned accept_eof;
+    size_t i;
+
+    tmp->count = 0;
+    for (i=0; i<count; i++) {
+        const nfainst_t *inst = &prog->insts[kernel[i]];
+        if (inst->op == OP_MATCH && (accept == 0 || inst->arg + 1 < accept))
+            accept = inst->arg + 1;
+        if (inst->op == eof_op)
+            _nfa_closure(prog, tmp, stack, inst->out, eof_flag);
+    }
+    accept_eof = accept;
+    for (i=0; i<tmp->count; i++) {
+        const nfainst_t *inst = &prog->insts[tmp->dense[i]];
+        if (inst->op == OP_MATCH && (accept_eof == 0 || inst->arg + 1 < accept_eof))
+            accept_eof = inst->arg + 1;
+    }
+    *r_accept = accept;
+    *r_accept_eof = accept_eof;
+}
+
+/**
+ * The same for a leftmost state, where a match only counts for the first
+ * group that has one, the earliest start.
+ */
+static void _dfa_accepts_leftmost(const dfa_t *dfa, const prog_t *prog, const unsigned *kernel, size_t count, sparseset_t *tmp, unsigned *stack, unsigned *r_accept, unsigned *r_accept_eof) {
+    size_t i = 1;
+
+    *r_accept = 0;
+    *r_accept_eof = 0;
+    while (i < count) {
+        size_t end;
+        unsigned accept;
+        unsigned accept_eof;
+
+        for (end=i; kernel[end] != DFA_MARK; end++)
+            ;
+        _dfa_accepts(dfa, prog, kernel + i, end - i, tmp, stack, &accept, &accept_eof);
+        if (*r_accept == 0)
+            *r_accept = accept;
+        if (*r_accept_eof == 0)
+            *r_accept_eof = accept_eof;
+        i = end + 1;
+    }
+}
+
+/**
+ * Finds the DFA state for a kernel of NFA instructions, creating the
+ * state if it doesn't exist yet.
+ * @return the state number, or NFA_NONE if there are already
+ *  `state_limit` states
+ */
+static unsigned _dfa_add(dfa_t *dfa, const prog_t *prog, const unsigned *kernel, size_t count, sparseset_t *tmp, unsigned *stack) {
+    unsigned hash;
+    unsigned i;
+    unsigned state;
+    unsigned accept;
+    unsigned accept_eof;
+
+    /* Look for an existing state */
+    hash = _dfa_hash(kernel, count);
+    if (dfa->table_size) {
+        for (i = hash & (dfa->table_size - 1); dfa->table[i]; i = (i + 1) & (dfa->table_size - 1)) {
+            size_t count2;
+            const unsigned *set2 = _dfa_set(dfa, dfa->table[i], &count2);
+            if (count == count2 && memcmp(kernel, set2, count * sizeof(kernel[0])) == 0)
+                return dfa->table[i];
+        }
+    }
+
+    /* Create a new one */
+    if (dfa->state_count >= dfa->state_limit)
+        return NFA_NONE;
+    if (dfa->state_count + 1 >= dfa->state_max) {
+        dfa->state_max = dfa->state_max * 2 + 16;
+        dfa->trans = realloc(dfa->trans, (size_t)dfa->state_max * dfa->class_count * sizeof(dfa->trans[0]));
+        dfa->accept = realloc(dfa->accept, dfa->state_max * sizeof(dfa->accept[0]));
+        dfa->accept_eof = realloc(dfa->accept_eof, dfa->state_max * sizeof(dfa->accept_eof[0]));
+        dfa->set_offsets = realloc(dfa->set_offsets, (dfa->state_max + 1) * sizeof(dfa->set_offsets[0]));
+        if (dfa->trans == NULL || dfa->accept == NULL || dfa->accept_eof == NULL || dfa->set_offsets == NULL)
+            abort();
+    }
+    if (dfa->sets_length + count > dfa->sets_max) {
+        dfa->sets_max = (dfa->sets_length + count) * 2;
+        dfa->sets = realloc(dfa->sets, dfa->sets_max * sizeof(dfa->sets[0]));
+        if (dfa->sets == NULL)
+            abort();
+    }
+    state = dfa->state_count++;
+    memcpy(dfa->sets + dfa->sets_length, kernel, count * sizeof(kernel[0]));
+    dfa->sets_length += count;
+    dfa->set_offsets[state + 1] = dfa->sets_length;
+    memset(dfa->trans + (size_t)state * dfa->class_count, 0xFF, dfa->class_count * sizeof(dfa->trans[0]));
+
+    if (dfa->kind == DFA_LEFTMOST)
+        _dfa_accepts_leftmost(dfa, prog, kernel, count, tmp, stack, &accept, &accept_eof);
+    else
+        _dfa_accepts(dfa, prog, kernel, count, tmp, stack, &accept, &accept_eof);
+    dfa->accept[state] = accept;
+    dfa->accept_eof[state] = accept_eof;
+
+    if (dfa->state_count * 2 > dfa->table_size)
+        _dfa_rehash(dfa, dfa->table_size ? dfa->table_size * 2 : 1024);
+    else {
+        for (i = hash & (dfa->table_size - 1); dfa->table[i]; i = (i + 1) & (dfa->table_size - 1))
+            ;
+        dfa->table[i] = state;
+    }
+    return state;
+}
+
+/**
+ * Finds the DFA state for the closure `set` of NFA instructions, creating
+ * the state if it doesn't exist yet. The set is sorted in place, and only
+ * the instructions that matter are kept.
+ * @return the state number, 0 for the dead state, or NFA_NONE if there
+ *  are already `state_limit` states
+ */
+static unsigned _dfa_intern(dfa_t *dfa, const prog_t *prog, sparseset_t *set, sparseset_t *tmp, unsigned *stack) {
+    unsigned *kernel = set->dense;
+    size_t count = 0;
+    unsigned i;
+
+    for (i=0; i<set->count; i++) {
+        if (_dfa_keeps(dfa, prog->insts[set->dense[i]].op))
+            kernel[count++] = set->dense[i];
+    }
+    if (count == 0)
+        return 0;
+    qsort(kernel, count, sizeof(kernel[0]), _unsigned_compare);
+    return _dfa_add(dfa, prog, kernel, count, tmp, stack);
+}
+
+/**
+ * Leftmost mode: appends the kernel of the group of NFA instructions the
+ * closures added to `set` since `before`, sorted and followed by a mark,
+ * to `list`, unless it's empty.
+ * @return the number appended
+ */
+static size_t _dfa_group(const dfa_t *dfa, const prog_t *prog, unsigned before, unsigned *list, bool *is_matched) {
+    const sparseset_t *set = &dfa->set;
+    size_t count = 0;
+    unsigned i;
+
+    for (i=before; i<set->count; i++) {
+        unsigned op = prog->insts[set->dense[i]].op;
+        if (!_dfa_keeps(dfa, op))
+            continue;
+        list[count++] = set->dense[i];
+        if (op == OP_MATCH)
+            *is_matched = true;
+    }
+    if (count == 0)
+        return 0;
+    qsort(list, count, sizeof(list[0]), _unsigned_compare);
+    list[count++] = DFA_MARK;
+    return count;
+}
+
+/**
+ * Leftmost mode: works out, for each byte class, where the threads that
+ * start at a byte of that class go, since every state needs that while
+ * seeding.
+ */
+static void _dfa_seeds(dfa_t *dfa, const prog_t *prog) {
+    sparseset_t *set = &dfa->set;
+    sparseset_t *next = &dfa->tmp;
+    size_t total = 0;
+    unsigned k;
+    size_t i;
+
+    set->count = 0;
+    for (i=0; i<dfa->start_count; i++)
+        _nfa_closure(prog, set, dfa->stack, dfa->starts[i], 0);
+
+    dfa->seed_offsets = malloc((dfa->class_count + 1) * sizeof(dfa->seed_offsets[0]));
+    if (dfa->seed_offsets == NULL)
+        abort();
+    for (k=0; k<dfa->class_count; k++) {
+        next->count = 0;
+        for (i=0; i<set->count; i++) {
+            const nfainst_t *inst = &prog->insts[set->dense[i]];
+            if (_nfa_consumes(prog, inst, dfa->class_byte[k]))
+                _nfa_closure(prog, next, dfa->stack, inst->out, 0);
+        }
+        dfa->seeds = realloc(dfa->seeds, (total + next->count + 1) * sizeof(dfa->seeds[0]));
+        if (dfa->seeds == NULL)
+            abort();
+        memcpy(dfa->seeds + total, next->dense, next->count * sizeof(dfa->seeds[0]));
+        dfa->seed_offsets[k] = total;
+        total += next->count;
+    }
+    dfa->seed_offsets[k] = total;
+}
+
+/**
+ * Leftmost mode: the state to start searching from. While seeding, the
+ * threads starting at the current byte are implied, rather than kept in
+ * the state, except that at the start of the input they could pass a '^',
+ * so they get a group. That group keeps only instructions that consume
+ * bytes, since a match (or '$') there would be empty.
+ */
+static unsigned _dfa_seed(dfa_t *dfa, const prog_t *prog, unsigned flags) {
+    unsigned *list = dfa->list;
+    size_t length = 1;
+    size_t i;
+
+    list[0] = DFA_SEEDING;
+    if (flags) {
+        dfa->set.count = 0;
+        for (i=0; i<dfa->start_count; i++)
+            _nfa_closure(prog, &dfa->set, dfa->stack, dfa->starts[i], flags);
+        for (i=0; i<dfa->set.count; i++) {
+            unsigned op = prog->insts[dfa->set.dense[i]].op;
+            if (op == OP_BYTE || op == OP_CLASS)
+                list[length++] = dfa->set.dense[i];
+        }
+        if (length > 1) {
+            qsort(list + 1, length - 1, sizeof(list[0]), _unsigned_compare);
+            list[length++] = DFA_MARK;
+        }
+    }
+    return _dfa_add(dfa, prog, list, length, &dfa->tmp, dfa->stack);
+}
+
+/**
+ * Leftmost mode: builds (or finds) the state reached from `state` on byte
+ * `c`. Each group of threads moves forward separately, in order, and an
+ * instruction one group reaches isn't added again for a later one, since
+ * the earlier start is better. The threads that started at `c` come
+ * last. The first group to reach a match cuts off those after it, and
+ * stops the seeding, since anything else would start later.
+ * @return the next state, or NFA_NONE if the DFA is full
+ */
+static unsigned _dfa_step_leftmost(dfa_t *dfa, const prog_t *prog, unsigned state, unsigned c) {
+    size_t count;
+    const unsigned *kernel = _dfa_set(dfa, state, &count);
+    unsigned *list = dfa->list;
+    bool is_seeding = (kernel[0] == DFA_SEEDING);
+    bool is_matched = false;
+    size_t length = 1;
+    size_t i = 1;
+
+    dfa->set.count = 0;
+    while (i < count && !is_matched) {
+        unsigned before = dfa->set.count;
+
+        for (; kernel[i] != DFA_MARK; i++) {
+            const nfainst_t *inst = &prog->insts[kernel[i]];
+            if (_nfa_consumes(prog, inst, c))
+                _nfa_closure(prog, &dfa->set, dfa->stack, inst->out, 0);
+        }
+        i++;
+        length += _dfa_group(dfa, prog, before, list + length, &is_matched);
+    }
+    if (is_seeding && !is_matched) {
+        unsigned before = dfa->set.count;
+        unsigned k = dfa->byte_class[c];
+
+        for (i=dfa->seed_offsets[k]; i<dfa->seed_offsets[k + 1]; i++) {
+            if (!_sparseset_contains(&dfa->set, dfa->seeds[i]))
+                _sparseset_add(&dfa->set, dfa->seeds[i]);
+        }
+        length += _dfa_group(dfa, prog, before, list + length, &is_matched);
+    }
+    if (is_matched)
+        is_seeding = false;
+    if (!is_seeding && length == 1)
+        return 0;
+    list[0] = is_seeding ? DFA_SEEDING : DFA_NOSEED;
+    return _dfa_add(dfa, prog, list, length, &dfa->tmp, dfa->stack);
+}
+
+/**
+ * Builds (or finds) the state reached from `state` on byte `c`.
+ * @return the next state, or NFA_NONE if the DFA is full
+ */
+static unsigned _dfa_step(dfa_t *dfa, const prog_t *prog, unsigned state, unsigned c, sparseset_t *set, sparseset_t *tmp, unsigned *stack) {
+    size_t count;
+    const unsigned *kernel;
+    size_t i;
+
+    if (dfa->kind == DFA_LEFTMOST)
+        return _dfa_step_leftmost(dfa, prog, state, c);
+
+    kernel = _dfa_set(dfa, state, &count);
+    set->count = 0;
+    for (i=0; i<count; i++) {
+        if (_nfa_consumes(prog, &prog->insts[kernel[i]], c))
+            _nfa_closure(prog, set, stack, prog->insts[kernel[i]].out, 0);
+    }
+    return _dfa_intern(dfa, prog, set, tmp, stack);
+}
+
+/**
+ * (Re)creates the two start states, from the closure of all the
+ * pattern starts. For a reverse DFA, the "begin" start state is for
+ * starting at the end of the input, where '$' matches.
+ */
+static void _dfa_start(dfa_t *dfa, const prog_t *prog, sparseset_t *set, sparseset_t *tmp, unsigned *stack) {
+    unsigned flags = (dfa->kind == DFA_REVERSE) ? CLOSE_END : CLOSE_BEGIN;
+    size_t i;
+
+    if (dfa->kind == DFA_LEFTMOST) {
+        dfa->start_begin = _dfa_seed(dfa, prog, flags);
+        dfa->start = _dfa_seed(dfa, prog, 0);
+        return;
+    }
+    set->count = 0;
+    for (i=0; i<dfa->start_count; i++)
+        _nfa_closure(prog, set, stack, dfa->starts[i], flags);
+    dfa->start_begin = _dfa_intern(dfa, prog, set, tmp, stack);
+    set->count = 0;
+    for (i=0; i<dfa->start_count; i++)
+        _nfa_closure(prog, set, stack, dfa->starts[i], 0);
+    dfa->start = _dfa_intern(dfa, prog, set, tmp, stack);
+}
+
+/**
+ * Splits the byte classes so that the bytes in `set` and those outside
+ * it never share a class, then renumbers them in order of their first byte.
+ */
+static void _byte_classes_split(unsigned char *byte_class, unsigned *count, const charclass_t *set) {
+    unsigned inside[256];       /* old class -> new class for its bytes in the set */
+    unsigned split[256];        /* byte -> class, before compacting */
+    unsigned compact[512];      /* class before compacting -> final class */
+    unsigned c;
+
+    for (c=0; c<*count; c++)
+        inside[c] = NFA_NONE;
+    for (c=0; c<256; c++) {
+        unsigned old = byte_class[c];
+        if (_charclass_match_char(set, c)) {
+            if (inside[old] == NFA_NONE)
+                inside[old] = (*count)++;
+            split[c] = inside[old];
+        } else
+            split[c] = old;
+    }
+
+    /* Classes entirely inside the set left their old numbers unused */
+    for (c=0; c<*count; c++)
+        compact[c] = NFA_NONE;
+    *count = 0;
+    for (c=0; c<256; c++) {
+        if (compact[split[c]] == NFA_NONE)
+            compact[split[c]] = (*count)++;
+        byte_class[c] = (unsigned char)compact[split[c]];
+    }
+}
+
+/**
+ * Partitions the byte alphabet into equivalence classes: bytes that every
+ * instruction in the program treats alike. DFA rows then need a column
+ * per class instead of per byte.
+ * @return the number of classes
+ */
+static unsigned _prog_byte_classes(const prog_t *prog, unsigned char *byte_class, unsigned char *class_byte) {
+    charclass_t seen = {0,0,0,0};
+    unsigned count = 1;
+    unsigned i;
+    unsigned c;
+
+    memset(byte_class, 0, 256);
+    for (i=0; i<prog->class_count; i++)
+        _byte_classes_split(byte_class, &count, &prog->classes[i]);
+    for (i=0; i<prog->count; i++) {
+        const nfainst_t *inst = &prog->insts[i];
+        charclass_t single = {0,0,0,0};
+
+        if (inst->op != OP_BYTE || _charclass_match_char(&seen, inst->arg))
+            continue;
+        _charclass_add_char(&seen, inst->arg);
+        _charclass_add_char(&single, inst->arg);
+        _byte_classes_split(byte_class, &count, &single);
+    }
+
+    for (c=256; c-- > 0; )
+        class_byte[byte_class[c]] = (unsigned char)c;
+    return count;
+}
+
+/**
+ * Creates a DFA with just the dead state and the start states.
+ */
+static dfa_t *_dfa_create(const prog_t *prog, const unsigned *starts, size_t start_count, unsigned state_limit, unsigned kind) {
+    dfa_t *dfa;
+
+    dfa = calloc(1, sizeof(*dfa));
+    if (dfa == NULL)
+        abort();
+    dfa->kind = kind;
+    _sparseset_init(&dfa->set, prog->count);
+    _sparseset_init(&dfa->tmp, prog->count);
+    dfa->stack = malloc((prog->count * 2 + 1) * sizeof(dfa->stack[0]));
+    dfa->starts = malloc((start_count + 1) * sizeof(dfa->starts[0]));
+
+    /* A kernel, with its header and a mark after each group */
+    dfa->list = malloc((prog->count * 2 + 3) * sizeof(dfa->list[0]));
+    if (dfa->stack == NULL || dfa->starts == NULL || dfa->list == NULL)
+        abort();
+    memcpy(dfa->starts, starts, start_count * sizeof(starts[0]));
+    dfa->start_count = start_count;
+    dfa->start_max = start_count + 1;
+    dfa->state_limit = state_limit;
+
+    /* State 0 is the dead state, with an empty set, that transitions
+     * only to itself */
+    dfa->state_max = 16;
+    dfa->class_count = _prog_byte_classes(prog, dfa->byte_class, dfa->class_byte);
+    dfa->class_inst_count = prog->count;
+    dfa->class_set_count = prog->class_count;
+    dfa->trans = calloc((size_t)dfa->state_max * dfa->class_count, sizeof(dfa->trans[0]));
+    dfa->accept = calloc(dfa->state_max, sizeof(dfa->accept[0]));
+    dfa->accept_eof = calloc(dfa->state_max, sizeof(dfa->accept_eof[0]));
+    dfa->set_offsets = calloc(dfa->state_max + 1, sizeof(dfa->set_offsets[0]));
+    if (dfa->trans == NULL || dfa->accept == NULL || dfa->accept_eof == NULL || dfa->set_offsets == NULL)
+        abort();
+    dfa->state_count = 1;
+
+    if (kind == DFA_LEFTMOST)
+        _dfa_seeds(dfa, prog);
+    _dfa_start(dfa, prog, &dfa->set, &dfa->tmp, dfa->stack);
+    return dfa;
+}
+
+/**
+ * Subset construction: starting from the start states, keep creating
+ * states for every byte transition until no new states appear.
+ * @return 0 on success, -1 if the DFA would have too many states
+ */
+static int _dfa_build(dfa_t *dfa, const prog_t *prog) {
+    unsigned state;
+
+    /* New states get appended as we go, so this loop ends once all
+     * the states have their transitions filled in */
+    for (state=1; state<dfa->state_count; state++) {
+        unsigned k;
+
+        for (k=0; k<dfa->class_count; k++) {
+            unsigned next = _dfa_step(dfa, prog, state, dfa->class_byte[k], &dfa->set, &dfa->tmp, dfa->stack);
+            if (next == NFA_NONE)
+                return -1;
+            dfa->trans[(size_t)state * dfa->class_count + k] = next;
+        }
+    }
+
+    /* The sets are only needed while building */
+    free(dfa->sets);
+    free(dfa->set_offsets);
+    free(dfa->table);
+    free(dfa->stack);
+    free(dfa->list);
+    _sparseset_free(&dfa->set);
+    _sparseset_free(&dfa->tmp);
+    dfa->sets = NULL;
+    dfa->set_offsets = NULL;
+    dfa->table = NULL;
+    dfa->stack = NULL;
+    dfa->list = NULL;
+    return 0;
+}
+
+/**
+ * Lazy mode: the cache is full, so throws away all the states but the
+ * dead one, then rebuilds the start states, and `state`, which we need
+ * to carry on from.
+ * @return the new number of `state`
+ */
+static unsigned _dfa_flush(dfa_t *dfa, const prog_t *prog, unsigned state) {
+    size_t count;
+    const unsigned *kernel = _dfa_set(dfa, state, &count);
+    unsigned *saved;
+
+    saved = malloc((count + 1) * sizeof(saved[0]));
+    if (saved == NULL)
+        abort();
+    memcpy(saved, kernel, count * sizeof(saved[0]));
+
+    dfa->state_count = 1;
+    dfa->sets_length = 0;
+    dfa->flush_count++;
+    _dfa_rehash(dfa, dfa->table_size);
+
+    _dfa_start(dfa, prog, &dfa->set, &dfa->tmp, dfa->stack);
+    state = (count == 0) ? 0 : _dfa_add(dfa, prog, saved, count, &dfa->tmp, dfa->stack);
+    free(saved);
+    return state;
+}
+
+/**
+ * Lazy mode: adds a pattern that starts at `start`, in a program that
+ * has grown to hold it since the DFA was created. The byte classes are
+ * split further for just its instructions, and all the states are thrown
+ * away, start states included. Those depend on every pattern, so they
+ * aren't built until `_dfa_restart()`, before the next scan, and adding
+ * costs no more for having more patterns already.
+ */
+static void _dfa_extend(dfa_t *dfa, const prog_t *prog, unsigned start) {
+    unsigned count = dfa->class_count;
+    unsigned i;
+
+    /* The working memory is sized by the program */
+    if (prog->count > dfa->set.max) {
+        unsigned max = prog->count * 2;
+
+        _sparseset_free(&dfa->set);
+        _sparseset_free(&dfa->tmp);
+        _sparseset_init(&dfa->set, max);
+        _sparseset_init(&dfa->tmp, max);
+        dfa->stack = realloc(dfa->stack, (max * 2 + 1) * sizeof(dfa->stack[0]));
+        dfa->list = realloc(dfa->list, (max * 2 + 3) * sizeof(dfa->list[0]));
+        if (dfa->stack == NULL || dfa->list == NULL)
+            abort();
+    }
+    if (dfa->start_count + 1 > dfa->start_max) {
+        dfa->start_max = dfa->start_count * 2 + 16;
+        dfa->starts = realloc(dfa->starts, dfa->start_max * sizeof(dfa->starts[0]));
+        if (dfa->starts == NULL)
+            abort();
+    }
+    dfa->starts[dfa->start_count++] = start;
+
+    for (i=dfa->class_set_count; i<prog->class_count; i++)
+        _byte_classes_split(dfa->byte_class, &count, &prog->classes[i]);
+    for (i=dfa->class_inst_count; i<prog->count; i++) {
+        charclass_t single;
+        unsigned c;
+
+        if (prog->insts[i].op != OP_BYTE)
+            continue;
+
+        /* Usually an earlier pattern gave the byte a class of its own */
+        for (c=0; c<256; c++) {
+            if (c != prog->insts[i].arg && dfa->byte_class[c] == dfa->byte_class[prog->insts[i].arg])
+                break;
+        }
+        if (c == 256)
+            continue;
+        memset(&single, 0, sizeof(single));
+        _charclass_add_char(&single, prog->insts[i].arg);
+        _byte_classes_split(dfa->byte_class, &count, &single);
+    }
+    dfa->class_inst_count = prog->count;
+    dfa->class_set_count = prog->class_count;
+
+    /* More classes make the rows wider, but they're all empty now */
+    if (count != dfa->class_count) {
+        unsigned c;
+
+        dfa->class_count = count;
+        for (c=256; c-- > 0; )
+            dfa->class_byte[dfa->byte_class[c]] = (unsigned char)c;
+        free(dfa->trans);
+        dfa->trans = calloc((size_t)dfa->state_max * count, sizeof(dfa->trans[0]));
+        if (dfa->trans == NULL)
+            abort();
+    }
+
+    dfa->state_count = 1;
+    dfa->sets_length = 0;
+    if (dfa->table)
+        _dfa_rehash(dfa, dfa->table_size);
+    free(dfa->seeds);
+    free(dfa->seed_offsets);
+    dfa->seeds = NULL;
+    dfa->seed_offsets = NULL;
+    dfa->is_stale = true;
+}
+
+/** Builds the start states (and seeds) that `_dfa_extend()` threw away */
+static void _dfa_restart(dfa_t *dfa, const prog_t *prog) {
+    if (dfa->kind == DFA_LEFTMOST)
+        _dfa_seeds(dfa, prog);
+    _dfa_start(dfa, prog, &dfa->set, &dfa->tmp, dfa->stack);
+    dfa->is_stale = false;
+}
+
+/**
+ * Lazy mode: the transition from `*state` on byte `c` hasn't been built
+ * yet, so build it now. If the cache is full, flush it, in which case
+ * all state numbers change, including `*state`.
+ */
+static unsigned _dfa_miss(dfa_t *dfa, const prog_t *prog, unsigned *state, unsigned c) {
+    unsigned next;
+
+    next = _dfa_step(dfa, prog, *state, c, &dfa->set, &dfa->tmp, dfa->stack);
+    if (next == NFA_NONE) {
+        *state = _dfa_flush(dfa, prog, *state);
+        next = _dfa_step(dfa, prog, *state, c, &dfa->set, &dfa->tmp, dfa->stack);
+    }
+    dfa->trans[(size_t)*state * dfa->class_count + dfa->byte_class[c]] = next;
+    return next;
+}
+
+/**
+ * Leftmost mode: from here on, matches that start after the current byte
+ * don't matter, so stop starting new threads.
+ * @return the state without it, which may have to be built
+ */
+static unsigned _dfa_unseed(dfa_t *dfa, const prog_t *prog, unsigned state) {
+    size_t count;
+    const unsigned *kernel = _dfa_set(dfa, state, &count);
+    unsigned next;
+
+    if (kernel[0] != DFA_SEEDING)
+        return state;
+    if (count == 1)
+        return 0;
+    memcpy(dfa->list, kernel, count * sizeof(kernel[0]));
+    dfa->list[0] = DFA_NOSEED;
+    next = _dfa_add(dfa, prog, dfa->list, count, &dfa->tmp, dfa->stack);
+    if (next == NFA_NONE)
+        return _dfa_unseed(dfa, prog, _dfa_flush(dfa, prog, state));
+    return next;
+}
+
+/**
+ * The partition of DFA states used while minimizing. The states of each
+ * block are contiguous in `elements`, with the ones marked as having a
+ * transition into the current splitter moved to the front.
+ */
+typedef struct partition_t {
+    unsigned *elements;
+    unsigned *location;     /* state -> index in `elements` */
+    unsigned *block_of;     /* state -> block */
+    unsigned *first;        /* block -> its first element */
+    unsigned *end;
+    unsigned *marked;       /* block -> how many of its elements are marked */
+    unsigned count;
+} partition_t;
+
+static void _partition_mark(partition_t *p, unsigned state) {
+    unsigned b = p->block_of[state];
+    unsigned i = p->location[state];
+    unsigned j = p->first[b] + p->marked[b];
+    unsigned other;
+
+    if (i < j)
+        return; /* already marked */
+    other = p->elements[j];
+    p->elements[j] = state;
+    p->location[state] = j;
+    p->elements[i] = other;
+    p->location[other] = i;
+    p->marked[b]++;
+}
+
+/** For sorting states by which patterns they accept: (accept, accept_eof, state) */
+static int _accept_compare(const void *lhs, const void *rhs) {
+    const unsigned *x = lhs;
+    const unsigned *y = rhs;
+    unsigned i;
+    for (i=0; i<3; i++) {
+        if (x[i] != y[i])
+            return (x[i] > y[i]) - (x[i] < y[i]);
+    }
+    return 0;
+}
+
+/**
+ * Hopcroft's algorithm: merges states that no input can tell apart. Blocks
+ * start out grouped by which pattern they accept (normally and at the end
+ * of input), so states for different patterns are never merged. Then
+ * each (block, byte class) splitter separates the states that go into
+ * the block from those that don't, until nothing changes.
+ */
+static void _dfa_minimize(dfa_t *dfa) {
+    unsigned n = dfa->state_count;
+    unsigned classes = dfa->class_count;
+    size_t edges = (size_t)n * classes;
+    partition_t p;
+    unsigned *inv_first;    /* [class * (n+1) + state] -> first predecessor */
+    unsigned *inv;
+    unsigned *splitters;    /* stack of (block, class) pairs */
+    size_t splitter_count = 0;
+    size_t splitter_max;
+    unsigned *touched;
+    unsigned *states;
+    unsigned *renumber;
+    unsigned *trans;
+    unsigned *accept;
+    unsigned *accept_eof;
+    unsigned *keys;
+    unsigned b;
+    unsigned s;
+    unsigned k;
+    size_t i;
+
+    dfa->built_count = n;
+
+    p.elements = malloc(n * sizeof(unsigned));
+    p.location = malloc(n * sizeof(unsigned));
+    p.block_of = malloc(n * sizeof(unsigned));
+    p.first = malloc(n * sizeof(unsigned));
+    p.end = malloc(n * sizeof(unsigned));
+    p.marked = calloc(n, sizeof(unsigned));
+    inv_first = calloc((size_t)classes * (n + 1), sizeof(unsigned));
+    inv = malloc(edges * sizeof(unsigned));
+    touched = malloc(n * sizeof(unsigned));
+    states = malloc(n * sizeof(unsigned));
+    splitter_max = (edges + classes) * 2;
+    splitters = malloc(splitter_max * sizeof(unsigned));
+    if (p.elements == NULL || p.location == NULL || p.block_of == NULL || p.first == NULL
+        || p.end == NULL || p.marked == NULL || inv_first == NULL || inv == NULL
+        || touched == NULL || states == NULL || splitters == NULL)
+        abort();
+
+    /* Predecessors, for each class and target state, counted then filled */
+    for (s=0; s<n; s++) {
+        for (k=0; k<classes; k++)
+            inv_first[(size_t)k * (n + 1) + dfa->trans[(size_t)s * classes + k] + 1]++;
+    }
+    for (k=0; k<classes; k++) {
+        unsigned *row = inv_first + (size_t)k * (n + 1);
+        for (s=0; s<n; s++)
+            row[s + 1] += row[s];
+    }
+    for (s=0; s<n; s++) {
+        for (k=0; k<classes; k++) {
+            unsigned *row = inv_first + (size_t)k * (n + 1);
+            unsigned t = dfa->trans[(size_t)s * classes + k];
+            inv[(size_t)k * n + row[t]++] = s;
+        }
+    }
+    for (k=0; k<classes; k++) {
+        /* Filling shifted each entry to the start of the next */
+        unsigned *row = inv_first + (size_t)k * (n + 1);
+        memmove(row + 1, row, n * sizeof(row[0]));
+        row[0] = 0;
+    }
+
+    /* The initial blocks: states that accept the same patterns */
+    keys = malloc((size_t)n * 3 * sizeof(unsigned));
+    if (keys == NULL)
+        abort();
+    for (s=0; s<n; s++) {
+        keys[s * 3 + 0] = dfa->accept[s];
+        keys[s * 3 + 1] = dfa->accept_eof[s];
+        keys[s * 3 + 2] = s;
+    }
+    qsort(keys, n, 3 * sizeof(unsigned), _accept_compare);
+    for (s=0; s<n; s++)
+        p.elements[s] = keys[s * 3 + 2];
+    free(keys);
+    p.count = 0;
+    for (i=0; i<n; i++) {
+        s = p.elements[i];
+        if (i == 0 || dfa->accept[s] != dfa->accept[p.elements[i-1]]
+            || dfa->accept_eof[s] != dfa->accept_eof[p.elements[i-1]]) {
+            if (p.count)
+                p.end[p.count - 1] = (unsigned)i;
+            p.first[p.count++] = (unsigned)i;
+        }
+        p.location[s] = (unsigned)i;
+        p.block_of[s] = p.count - 1;
+    }
+    p.end[p.count - 1] = n;
+    for (b=0; b<p.count; b++) {
+        for (k=0; k<classes; k++) {
+            splitters[splitter_count++] = b;
+            splitters[splitter_count++] = k;
+        }
+    }
+
+    while (splitter_count) {
+        unsigned splitter;
+        unsigned state_count = 0;
+        unsigned touched_count = 0;
+
+        k = splitters[--splitter_count];
+        splitter = splitters[--splitter_count];
+
+        /* Mark every state with a transition on `k` into the splitter.
+         * Marking moves states around, so copy the splitter's first. */
+        for (i=p.first[splitter]; i<p.end[splitter]; i++)
+            states[state_count++] = p.elements[i];
+        for (i=0; i<state_count; i++) {
+            const unsigned *row = inv_first + (size_t)k * (n + 1);
+            unsigned j;
+
+            for (j=row[states[i]]; j<row[states[i] + 1]; j++) {
+                unsigned pred = inv[(size_t)k * n + j];
+                b = p.block_of[pred];
+                if (p.marked[b] == 0)
+                    touched[touched_count++] = b;
+                _partition_mark(&p, pred);
+            }
+        }
+
+        /* Split each block that's only partly marked. The smaller half
+         * gets the new block number, and goes on the stack for every
+         * class: if the old block was there already, it still stands for
+         * the larger half, and if not, the smaller half is enough. */
+        for (i=0; i<touched_count; i++) {
+            unsigned middle;
+            unsigned nb;
+
+            b = touched[i];
+            middle = p.first[b] + p.marked[b];
+            p.marked[b] = 0;
+            if (middle == p.end[b])
+                continue;
+            nb = p.count++;
+            if (middle - p.first[b] <= p.end[b] - middle) {
+                p.first[nb] = p.first[b];
+                p.end[nb] = middle;
+                p.first[b] = middle;
+            } else {
+                p.first[nb] = middle;
+                p.end[nb] = p.end[b];
+                p.end[b] = middle;
+            }
+            p.marked[nb] = 0;
+            for (s=p.first[nb]; s<p.end[nb]; s++)
+                p.block_of[p.elements[s]] = nb;
+            if (splitter_count + 2 * classes > splitter_max) {
+                splitter_max = splitter_max * 2;
+                splitters = realloc(splitters, splitter_max * sizeof(unsigned));
+                if (splitters == NULL)
+                    abort();
+            }
+            for (k=0; k<classes; k++) {
+                splitters[splitter_count++] = nb;
+                splitters[splitter_count++] = k;
+            }
+        }
+    }
+
+    /* Number the blocks, keeping the dead state's block as state 0 */
+    renumber = malloc(p.count * sizeof(unsigned));
+    if (renumber == NULL)
+        abort();
+    for (b=0; b<p.count; b++)
+        renumber[b] = NFA_NONE;
+    renumber[p.block_of[0]] = 0;
+    s = 1;
+    for (i=0; i<n; i++) {
+        b = p.block_of[i];
+        if (renumber[b] == NFA_NONE)
+            renumber[b] = s++;
+    }
+
+    trans = malloc((size_t)p.count * classes * sizeof(unsigned));
+    accept = malloc(p.count * sizeof(unsigned));
+    accept_eof = malloc(p.count * sizeof(unsigned));
+    if (trans == NULL || accept == NULL || accept_eof == NULL)
+        abort();
+    for (b=0; b<p.count; b++) {
+        unsigned from = p.elements[p.first[b]];
+        unsigned to = renumber[b];
+
+        for (k=0; k<classes; k++)
+            trans[(size_t)to * classes + k] = renumber[p.block_of[dfa->trans[(size_t)from * classes + k]]];
+        accept[to] = dfa->accept[from];
+        accept_eof[to] = dfa->accept_eof[from];
+    }
+    dfa->start_begin = renumber[p.block_of[dfa->start_begin]];
+    dfa->start = renumber[p.block_of[dfa->start]];
+    free(dfa->trans);
+    free(dfa->accept);
+    free(dfa->accept_eof);
+    dfa->trans = trans;
+    dfa->accept = accept;
+    dfa->accept_eof = accept_eof;
+    dfa->state_count = p.count;
+    dfa->state_max = p.count;
+
+    free(renumber);
+    free(p.elements);
+    free(p.location);
+    free(p.block_of);
+    free(p.first);
+    free(p.end);
+    free(p.marked);
+    free(inv_first);
+    free(inv);
+    free(touched);
+    free(states);
+    free(splitters);
+}
+
+/**
+ * A trie of the literals, before it's packed into the double array
+ */
+typedef struct trienode_t {
+    unsigned first_child;
+    unsigned next_sibling;
+    unsigned match;
+    unsigned cell;          /* where it is in the double array */
+    unsigned char c;
+} trienode_t;
+
+static void _literals_free(literals_t *literals) {
+    if (literals == NULL)
+        return;
+    if (!literals->is_borrowed) {
+        free(literals->cells);
+        free(literals->fails);
+        free(literals->infos);
+        free(literals->dense);
+    }
+    free(literals);
+}
+
+/**
+ * The double array while it's being built, with the unused cells in a
+ * list, so that finding room for a state's transitions doesn't have to
+ * wade through all the cells already used.
+ */
+typedef struct literalsbuild_t {
+    literals_t *literals;
+    unsigned *next_free;
+    unsigned *prev_free;
+    unsigned free_head;
+    unsigned free_tail;
+} literalsbuild_t;
+
+/** Makes sure cells up to `index` exist, adding new ones to the free list */
+static void _literals_grow(literalsbuild_t *build, size_t index) {
+    literals_t *literals = build->literals;
+    unsigned i;
+    size_t count;
+
+    if (index < literals->cell_count)
+        return;
+    count = (index + 1) * 2 + 256;
+    literals->cells = realloc(literals->cells, count * sizeof(literals->cells[0]));
+    literals->fails = realloc(literals->fails, count * sizeof(literals->fails[0]));
+    literals->infos = realloc(literals->infos, count * sizeof(literals->infos[0]));
+    build->next_free = realloc(build->next_free, count * sizeof(build->next_free[0]));
+    build->prev_free = realloc(build->prev_free, count * sizeof(build->prev_free[0]));
+    if (literals->cells == NULL || literals->fails == NULL || literals->infos == NULL
+        || build->next_free == NULL || build->prev_free == NULL || count > LITERALS_PARENT)
+        abort();
+    for (i=literals->cell_count; i<count; i++) {
+        memset(&literals->cells[i], 0, sizeof(literals->cells[i]));
+        memset(&literals->infos[i], 0, sizeof(literals->infos[i]));
+        literals->fails[i] = 0;
+        literals->cells[i].check = NFA_NONE;
+        literals->infos[i].output = NFA_NONE;
+
+        build->prev_free[i] = build->free_tail;
+        build->next_free[i] = NFA_NONE;
+        if (build->free_tail == NFA_NONE)
+            build->free_head = i;
+        else
+            build->next_free[build->free_tail] = i;
+        build->free_tail = i;
+    }
+    literals->cell_count = (unsigned)count;
+}
+
+/** Takes a cell off the free list */
+static void _literals_use(literalsbuild_t *build, unsigned index, unsigned parent) {
+    unsigned prev = build->prev_free[index];
+    unsigned next = build->next_free[index];
+
+    if (prev == NFA_NONE)
+        build->free_head = next;
+    else
+        build->next_free[prev] = next;
+    if (next == NFA_NONE)
+        build->free_tail = prev;
+    else
+        build->prev_free[next] = prev;
+    build->literals->cells[index].check = parent;
+}
+
+/** Follows the transition from `state` on byte `c`, or returns NFA_NONE */
+static unsigned _literals_goto(const literals_t *literals, unsigned state, unsigned c) {
+    unsigned next = literals->cells[state].base + c;
+    if (next < literals->cell_count && (literals->cells[next].check & LITERALS_PARENT) == state)
+        return next;
+    return NFA_NONE;
+}
+
+/**
+ * Follows the transition from `state` on byte `c`, or else from its
+ * failure states, as the search does
+ */
+static unsigned _literals_next(const literals_t *literals, unsigned state, unsigned c) {
+    for (;;) {
+        unsigned next = _literals_goto(literals, state, c);
+        if (next != NFA_NONE)
+            return next;
+        if (state == 0)
+            return 0;
+        state = literals->fails[state];
+    }
+}
+
+/**
+ * Works out the full transitions of the first states, as many of the
+ * trie's levels as fit in LITERALS_DENSE_MAX (but at least the root).
+ * The states are placed breadth first, so the first cells hold the top
+ * levels, along with some deeper states that filled in gaps.
+ */
+static void _literals_densify(literals_t *literals) {
+    unsigned *level_end;
+    unsigned class_byte[256];
+    bool is_used[256];
+    unsigned other = NFA_NONE;
+    unsigned depth;
+    unsigned i;
+    unsigned c;
+
+    /* One class for each byte in a literal, with the uppercase letters
+     * in the lowercase ones' when ignoring case, and one more for all
+     * the other bytes, if there are any */
+    memset(is_used, 0, sizeof(is_used));
+    for (i=1; i<literals->cell_count; i++) {
+        unsigned parent = literals->cells[i].check;
+
+        if (parent != NFA_NONE)
+            is_used[i - literals->cells[parent & LITERALS_PARENT].base] = true;
+    }
+    literals->class_count = 0;
+    for (c=0; c<256; c++) {
+        if (is_used[c]) {
+            class_byte[literals->class_count] = c;
+            literals->byte_class[c] = (unsigned char)literals->class_count++;
+        }
+    }
+    for (c=0; c<256; c++) {
+        if (is_used[c])
+            continue;
+        if (literals->is_folded && is_used[_case_fold(c)]) {
+            literals->byte_class[c] = literals->byte_class[_case_fold(c)];
+            continue;
+        }
+        if (other == NFA_NONE) {
+            other = literals->class_count++;
+            class_byte[other] = c;
+        }
+        literals->byte_class[c] = (unsigned char)other;
+    }
+
+    /* How far into the cells each level of the trie reaches */
+    level_end = calloc(literals->max_length + 1, sizeof(level_end[0]));
+    if (level_end == NULL)
+        abort();
+    for (i=0; i<literals->cell_count; i++) {
+        if (literals->cells[i].check != NFA_NONE && i + 1 > level_end[literals->infos[i].depth])
+            level_end[literals->infos[i].depth] = i + 1;
+    }
+    literals->dense_count = 1;
+    for (depth=0; depth<=literals->max_length; depth++) {
+        if (level_end[depth] < literals->dense_count)
+            continue;
+        if ((size_t)level_end[depth] * literals->class_count * sizeof(literals->dense[0]) > LITERALS_DENSE_MAX
+            || level_end[depth] > LITERALS_ESCAPE)
+            break;
+        literals->dense_count = level_end[depth];
+    }
+    free(level_end);
+
+    literals->dense = malloc((size_t)literals->dense_count * literals->class_count * sizeof(literals->dense[0]));
+    if (literals->dense == NULL)
+        abort();
+    for (i=0; i<literals->dense_count; i++) {
+        unsigned short *row = &literals->dense[(size_t)i * literals->class_count];
+        unsigned k;
+
+        for (k=0; k<literals->class_count; k++) {
+            unsigned next = literals->cells[i].check == NFA_NONE ? 0 : _literals_next(literals, i, class_byte[k]);
+            row[k] = (unsigned short)(next < literals->dense_count ? next : LITERALS_ESCAPE);
+        }
+    }
+}
+
+/**
+ * Builds the Aho-Corasick automaton for all the patterns marked as
+ * literals: first as a trie, then packed into a double array breadth
+ * first, adding the failure links along the way.
+ */
+static literals_t *_literals_create(regexx_t *re) {
+    literalsbuild_t build = {0};
+    literals_t *literals;
+    trienode_t *nodes;
+    unsigned node_count = 1;
+    unsigned node_max = 256;
+    unsigned *queue;
+    unsigned head = 0;
+    unsigned tail = 0;
+    size_t i;
+
+    literals = calloc(1, sizeof(*literals));
+    nodes = malloc(node_max * sizeof(nodes[0]));
+    if (literals == NULL || nodes == NULL)
+        abort();
+    memset(&nodes[0], 0, sizeof(nodes[0]));
+    nodes[0].first_child = NFA_NONE;
+    nodes[0].next_sibling = NFA_NONE;
+
+    for (i=0; i<re->pattern_count; i++) {
+        const node_t *node;
+        unsigned current = 0;
+        unsigned length = 0;
+
+        if (!re->patterns[i].is_literal)
+            continue;
+        for (node=re->patterns[i].head; node && node->type != T_TRUE; node = node->next) {
+            unsigned j;
+
+            if (node->type != T_STRING)
+                continue;
+            for (j=0; j<node->string.length; j++) {
+                unsigned char c = (unsigned char)node->string.chars[j];
+                unsigned child;
+
+                for (child=nodes[current].first_child; child != NFA_NONE; child = nodes[child].next_sibling) {
+                    if (nodes[child].c == c)
+                        break;
+                }
+                if (child == NFA_NONE) {
+                    if (node_count >= node_max) {
+                        node_max *= 2;
+                        nodes = realloc(nodes, node_max * sizeof(nodes[0]));
+                        if (nodes == NULL)
+                            abort();
+                    }
+                    child = node_count++;
+                    nodes[child].first_child = NFA_NONE;
+                    nodes[child].next_sibling = nodes[current].first_child;
+                    nodes[child].match = 0;
+                    nodes[child].c = c;
+                    nodes[current].first_child = child;
+                }
+                current = child;
+            }
+            length += node->string.length;
+        }
+        if (nodes[current].match == 0)
+            nodes[current].match = (unsigned)i + 1;
+        if (length > literals->max_length)
+            literals->max_length = length;
+    }
+
+    /* The root is cell 0 */
+    build.literals = literals;
+    build.free_head = NFA_NONE;
+    build.free_tail = NFA_NONE;
+    _literals_grow(&build, 256);
+    _literals_use(&build, 0, 0);
+    nodes[0].cell = 0;
+
+    queue = malloc(node_count * sizeof(queue[0]));
+    if (queue == NULL)
+        abort();
+    queue[tail++] = 0;
+    while (head < tail) {
+        unsigned parent = queue[head++];
+        unsigned state = nodes[parent].cell;
+        unsigned first = NFA_NONE;
+        unsigned child;
+        unsigned base;
+        unsigned cell;
+
+        if (nodes[parent].first_child == NFA_NONE)
+            continue;
+        for (child=nodes[parent].first_child; child != NFA_NONE; child = nodes[child].next_sibling) {
+            if (first == NFA_NONE || nodes[child].c < nodes[first].c)
+                first = child;
+        }
+
+        /* Find a base where all the children fit into unused cells,
+         * trying to put the first child in each unused cell in turn */
+        for (cell=build.free_head; ; cell=build.next_free[cell]) {
+            if (cell == NFA_NONE) {
+                cell = literals->cell_count;
+                _literals_grow(&build, cell);
+            }
+            if (cell <= nodes[first].c)
+                continue; /* the base would be negative, or the child be the root */
+            base = cell - nodes[first].c;
+            for (child=nodes[parent].first_child; child != NFA_NONE; child = nodes[child].next_sibling) {
+                unsigned index = base + nodes[child].c;
+                _literals_grow(&build, index);
+                if (literals->cells[index].check != NFA_NONE)
+                    break;
+            }
+            if (child == NFA_NONE)
+                break;
+        }
+        literals->cells[state].base = base;
+
+        for (child=nodes[parent].first_child; child != NFA_NONE; child = nodes[child].next_sibling) {
+            unsigned c = nodes[child].c;
+            unsigned index = base + c;
+            literalinfo_t *info;
+            unsigned fail = 0;
+
+            _literals_use(&build, index, state);
+            info = &literals->infos[index];
+            info->match = nodes[child].match;
+            info->depth = literals->infos[state].depth + 1;
+            nodes[child].cell = index;
+
+            /* The failure link: the longest proper suffix in the trie.
+             * Shallower states are all finished by now. */
+            if (state != 0)
+                fail = _literals_next(literals, literals->fails[state], c);
+            literals->fails[index] = fail;
+            info->output = info->match ? index : literals->infos[fail].output;
+            if (info->output != NFA_NONE)
+                literals->cells[index].check |= LITERALS_OUTPUT;
+            queue[tail++] = child;
+        }
+    }
+
+    free(queue);
+    free(nodes);
+    free(build.next_free);
+    free(build.prev_free);
+
+    literals->is_folded = (re->flags & REGEXX_IGNORECASE) != 0;
+    _literals_densify(literals);
+    return literals;
+}
+
+/**
+ * Finds the longest literal starting exactly at `offset`, by walking
+ * down the trie.
+ */
+static bool _literals_at(const literals_t *literals, const unsigned char *text, size_t offset, size_t length, size_t *r_end, size_t *r_index) {
+    unsigned state = 0;
+    unsigned match = 0;
+    size_t end = 0;
+    size_t i;
+
+    for (i=offset; i<length; i++) {
+        state = _literals_goto(literals, state, literals->is_folded ? _case_fold(text[i]) : text[i]);
+        if (state == NFA_NONE)
+            break;
+        if (literals->infos[state].match) {
+            match = literals->infos[state].match;
+            end = i + 1;
+        }
+    }
+    if (match == 0)
+        return false;
+    *r_end = end;
+    *r_index = match - 1;
+    return true;
+}
+
+/**
+ * Finds the leftmost (then longest) literal at or after `offset`, in one
+ * pass with the Aho-Corasick automaton. A match is seen when it ends, so
+ * after the first one, keep going until no literal that starts by then
+ * could still be ending.
+ */
+static bool _literals_search(const literals_t *literals, budget_t *budget, const unsigned char *text, size_t offset, size_t length, size_t *r_start, size_t *r_end, size_t *r_index) {
+    const literalcell_t *cells = literals->cells;
+    const unsigned *fails = literals->fails;
+    const literalinfo_t *infos = literals->infos;
+    const unsigned short *dense = literals->dense;
+    unsigned dense_count = literals->dense_count;
+    unsigned class_count = literals->class_count;
+    unsigned state = 0;
+    size_t best_start = SIZE_MAX;
+    size_t best_end = 0;
+    unsigned best_match = 0;
+    size_t charged = offset;
+    size_t i;
+
+    for (i=offset; i<length; i++) {
+        unsigned c = literals->is_folded ? _case_fold(text[i]) : text[i];
+
+        if (i - charged >= BUDGET_INTERVAL) {
+            if (_budget_spend(budget, i - charged))
+                return false;
+            charged = i;
+        }
+
+        for (;;) {
+            unsigned next;
+
+            if (state < dense_count) {
+                next = dense[(size_t)state * class_count + literals->byte_class[c]];
+                if (next != LITERALS_ESCAPE) {
+                    state = next;
+                    break;
+                }
+            }
+            next = cells[state].base + c;
+            if (next < literals->cell_count && (cells[next].check & LITERALS_PARENT) == state) {
+                state = next;
+                break;
+            }
+            if (state == 0)
+                break;
+            state = fails[state];
+        }
+
+        if (cells[state].check & LITERALS_OUTPUT) {
+            /* The longest literal ending here starts earliest */
+            unsigned output = infos[state].output;
+            size_t start = i + 1 - infos[output].depth;
+            if (start < best_start || (start == best_start && i + 1 > best_end)) {
+                best_start = start;
+                best_end = i + 1;
+                best_match = infos[output].match;
+            }
+        }
+        if (best_match && i + 1 - best_start >= literals->max_length)
+            break;
+    }
+    if (_budget_spend(budget, i - charged))
+        return false;
+    if (best_match == 0)
+        return false;
+    *r_start = best_start;
+    *r_end = best_end;
+    *r_index = best_match - 1;
+    return true;
+}
+
+/**
+ * Gets the string that every match of the pattern must begin with,
+ * returning its length (0 if there isn't one).
+ */
+static size_t _node_prefix(const node_t *node, unsigned char *prefix, size_t max, bool *r_is_folded) {
+    size_t length = 0;
+
+    *r_is_folded = false;
+    for (; node && node->type != T_TRUE; node = node->next) {
+        size_t i;
+
+        if (node->type == T_ROOT || node->type == T_ANCHOR_BEGIN)
+            continue;
+        if (node->type != T_STRING)
+            break;
+        if (node->string.is_case_insensitive)
+            *r_is_folded = true;
+        for (i=0; i<node->string.length && length<max; i++)
+            prefix[length++] = (unsigned char)node->string.chars[i];
+        if (length == max)
+            break;
+    }
+    return length;
+}
+
+/**
+ * Adds the bytes that can begin a match of the chain to `first`, looking
+ * through whatever can match nothing, like a quantifier with a minimum
+ * of zero, to what comes after it.
+ * @return true if the chain can match without consuming any bytes
+ */
+static bool _node_first(const node_t *node, charclass_t *first) {
+    for (; node && node->type != T_TRUE; node = node->next) {
+        switch (node->type) {
+            case T_ROOT:
+            case T_ANCHOR_BEGIN:
+            case T_ANCHOR_END:
+                break;
+            case T_STRING: {
+                unsigned c = node->string.chars[0] & 0xFF;
+
+                if (node->string.length == 0)
+                    break;
+                _charclass_add_char(first, c);
+                if (node->string.is_case_insensitive) {
+                    _charclass_add_char(first, toupper(c));
+                    _charclass_add_char(first, tolower(c));
+                }
+                return false;
+            }
+            case T_DOT_NONEWLINE: {
+                charclass_t charclass = {0,0,0,0};
+                _charclass_add_char(&charclass, '\n');
+                _charclass_add_char(&charclass, '\r');
+                *first = _charclass_merge(*first, _invert(charclass));
+                return false;
+            }
+            case T_CHARCLASS:
+                *first = _charclass_merge(*first, node->charclass);
+                return false;
+            case T_ALTERNATION: {
+                bool lhs = _node_first(node->alternation.child, first);
+                bool rhs = _node_first(node->next, first);
+                return lhs || rhs;
+            }
+            case T_GROUP:
+                if (node->group.is_lookahead)
+                    break;
+                if (!_node_first(node->group.child, first))
+                    return false;
+                break;
+            case T_QUANTIFIER:
+                if (!_node_first(node->quantifier.child, first) && node->quantifier.min != 0)
+                    return false;
+                break;
+            default:
+                *first = _dot_all;
+                return false;
+        }
+    }
+    return true;
+}
+
+/** Whether the string at `text` could begin with a prefix in the filter */
+static bool _prefilter_check(const prefilter_t *prefilter, const unsigned char *text) {
+    unsigned buckets = 0xFF;
+    unsigned k;
+
+    for (k=0; k<prefilter->width; k++)
+        buckets &= prefilter->lo[k][text[k] & 0xF] & prefilter->hi[k][text[k] >> 4];
+    return buckets != 0;
+}
+
+/**
+ * The plain C version: checks every offset in turn.
+ * @return the first candidate at or after `offset`, or `length` if none
+ */
+static size_t _prefilter_next_scalar(const prefilter_t *prefilter, const unsigned char *text, size_t offset, size_t length) {
+    if (length < prefilter->width)
+        return length;
+    for (; offset <= length - prefilter->width; offset++) {
+        if (_prefilter_check(prefilter, text + offset))
+            return offset;
+    }
+    return length;
+}
+
+/**
+ * When every prefix begins with the same byte, `memchr()` (which the C
+ * library already vectorizes) finds each place to check.
+ */
+static size_t _prefilter_next_memchr(const prefilter_t *prefilter, const unsigned char *text, size_t offset, size_t length) {
+    size_t last;
+
+    if (length < prefilter->width)
+        return length;
+    last = length - prefilter->width;
+    while (offset <= last) {
+        const unsigned char *p = memchr(text + offset, prefilter->firsts[0], last + 1 - offset);
+        if (p == NULL)
+            break;
+        offset = (size_t)(p - text);
+        if (_prefilter_check(prefilter, text + offset))
+            return offset;
+        offset++;
+    }
+    return length;
+}
+
+#ifdef PREFILTER_X86
+/**
+ * SSE2: compares 16 bytes at a time against each distinct first byte,
+ * then checks each hit against the full tables.
+ */
+static size_t _prefilter_next_sse2(const prefilter_t *prefilter, const unsigned char *text, size_t offset, size_t length) {
+    size_t last;
+
+    if (length < prefilter->width)
+        return length;
+    last = length - prefilter->width;
+    while (offset + 16 <= last + 1) {
+        __m128i chars = _mm_loadu_si128((const __m128i *)(text + offset));
+        __m128i hits = _mm_setzero_si128();
+        unsigned mask;
+        unsigned i;
+
+        for (i=0; i<prefilter->first_count; i++)
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chars, _mm_set1_epi8((char)prefilter->firsts[i])));
+        for (mask = (unsigned)_mm_movemask_epi8(hits); mask; mask &= mask - 1) {
+            unsigned bit = 0;
+            while (!(mask & (1U << bit)))
+                bit++;
+            if (_prefilter_check(prefilter, text + offset + bit))
+                return offset + bit;
+        }
+        offset += 16;
+    }
+    return _prefilter_next_scalar(prefilter, text, offset, length);
+}
+
+/**
+ * SSSE3: the nibble lookups for 16 offsets at once, with `pshufb`.
+ */
+PREFILTER_TARGET("ssse3")
+static size_t _prefilter_next_ssse3(const prefilter_t *prefilter, const unsigned char *text, size_t offset, size_t length) {
+    __m128i lo[PREFILTER_WIDTH];
+    __m128i hi[PREFILTER_WIDTH];
+    __m128i nibble = _mm_set1_epi8(0x0F);
+    size_t last;
+    unsigned k;
+
+    if (length < prefilter->width)
+        return length;
+    last = length - prefilter->width;
+    for (k=0; k<prefilter->width; k++) {
+        lo[k] = _mm_loadu_si128((const __m128i *)prefilter->lo[k]);
+        hi[k] = _mm_loadu_si128((const __m128i *)prefilter->hi[k]);
+    }
+    while (offset + 16 <= last + 1) {
+        __m128i buckets = _mm_set1_epi8((char)0xFF);
+        unsigned mask;
+
+        for (k=0; k<prefilter->width; k++) {
+            __m128i chars = _mm_loadu_si128((const __m128i *)(text + offset + k));
+            __m128i l = _mm_shuffle_epi8(lo[k], _mm_and_si128(chars, nibble));
+            __m128i h = _mm_shuffle_epi8(hi[k], _mm_and_si128(_mm_srli_epi16(chars, 4), nibble));
+            buckets = _mm_and_si128(buckets, _mm_and_si128(l, h));
+        }
+        mask = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(buckets, _mm_setzero_si128())) & 0xFFFF;
+        if (mask) {
+            unsigned bit = 0;
+            while (!(mask & (1U << bit)))
+                bit++;
+            return offset + bit;
+        }
+        offset += 16;
+    }
+    return _prefilter_next_scalar(prefilter, text, offset, length);
+}
+
+/**
+ * AVX2: the same as SSSE3, but 32 offsets at once. The shuffle works
+ * within each 128-bit half, so both halves get a copy of the tables.
+ */
+PREFILTER_TARGET("avx2")
+static size_t _prefilter_next_avx2(const prefilter_t *prefilter, const unsigned char *text, size_t offset, size_t length) {
+    __m256i lo[PREFILTER_WIDTH];
+    __m256i hi[PREFILTER_WIDTH];
+    __m256i nibble = _mm256_set1_epi8(0x0F);
+    size_t last;
+    unsigned k;
+
+    if (length < prefilter->width)
+        return length;
+    last = length - prefilter->width;
+    for (k=0; k<prefilter->width; k++) {
+        lo[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)prefilter->lo[k]));
+        hi[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)prefilter->hi[k]));
+    }
+    while (offset + 32 <= last + 1) {
+        __m256i buckets = _mm256_set1_epi8((char)0xFF);
+        unsigned mask;
+
+        for (k=0; k<prefilter->width; k++) {
+            __m256i chars = _mm256_loadu_si256((const __m256i *)(text + offset + k));
+            __m256i l = _mm256_shuffle_epi8(lo[k], _mm256_and_si256(chars, nibble));
+            __m256i h = _mm256_shuffle_epi8(hi[k], _mm256_and_si256(_mm256_srli_epi16(chars, 4), nibble));
+            buckets = _mm256_and_si256(buckets, _mm256_and_si256(l, h));
+        }
+        mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(buckets, _mm256_setzero_si256()));
+        if (mask) {
+            unsigned bit = 0;
+            while (!(mask & (1U << bit)))
+                bit++;
+            return offset + bit;
+        }
+        offset += 32;
+    }
+    return _prefilter_next_ssse3(prefilter, text, offset, length);
+}
+
+/** Which instructions this CPU (and OS) supports */
+static bool _cpu_has(const char *feature) {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    if (strcmp(feature, "ssse3") == 0)
+        return (info[2] & (1 << 9)) != 0;
+    /* AVX2 needs the OS to save the YMM registers (OSXSAVE, XCR0) */
+    if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    if (strcmp(feature, "ssse3") == 0)
+        return __builtin_cpu_supports("ssse3");
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+/**
+ * Picks the fastest way to search for candidates this CPU supports.
+ */
+/**
+ * Where a prefilter search can stop when only candidates up to `limit`
+ * matter, since the last of them is checked `width` bytes on.
+ */
+static size_t _prefilter_bound(const prefilter_t *prefilter, size_t limit, size_t length) {
+    if (limit >= length || length - limit <= prefilter->width)
+        return length;
+    return limit + prefilter->width;
+}
+
+static void _prefilter_choose(prefilter_t *prefilter) {
+    prefilter->next = _prefilter_next_scalar;
+    if (prefilter->first_count == 1)
+        prefilter->next = _prefilter_next_memchr;
+#ifdef PREFILTER_X86
+    else if (_cpu_has("avx2"))
+        prefilter->next = _prefilter_next_avx2;
+    else if (_cpu_has("ssse3"))
+        prefilter->next = _prefilter_next_ssse3;
+    else if (prefilter->first_count)
+        prefilter->next = _prefilter_next_sse2;
+#endif
+}
+
+/**
+ * Builds a prefilter one byte wide that finds any byte in the set. Each
+ * high nibble gets its own bucket, until there are more than 8 of them
+ * and some have to share, when the tables find a few more bytes than
+ * were asked for.
+ * @return NULL if the set has every byte, so nothing can be skipped
+ */
+static prefilter_t *_prefilter_from_set(charclass_t set) {
+    prefilter_t *prefilter;
+    unsigned count = 0;
+    unsigned c;
+
+    if (_charclass_count(set) == 256)
+        return NULL;
+    prefilter = calloc(1, sizeof(*prefilter));
+    if (prefilter == NULL)
+        abort();
+    prefilter->width = 1;
+    for (c=0; c<256; c++) {
+        unsigned bucket = 1U << ((c >> 4) % 8);
+
+        if (!_charclass_match_char(&set, c))
+            continue;
+        prefilter->lo[0][c & 0xF] |= bucket;
+        prefilter->hi[0][c >> 4] |= bucket;
+        if (count < PREFILTER_MAX)
+            prefilter->firsts[count] = (unsigned char)c;
+        count++;
+    }
+
+    /* Too many for SSE2 to compare against one at a time */
+    prefilter->first_count = (count <= PREFILTER_MAX) ? count : 0;
+    _prefilter_choose(prefilter);
+    return prefilter;
+}
+
+/**
+ * Without leading strings, the next best thing is the set of bytes that
+ * can begin a match of any pattern the offset-by-offset search evaluates.
+ */
+static prefilter_t *_prefilter_starts(regexx_t *re) {
+    charclass_t first = {0,0,0,0};
+    size_t i;
+
+    for (i=0; i<re->pattern_count; i++) {
+        if (re->patterns[i].is_literal || re->patterns[i].is_anchored)
+            continue;
+        _node_first(re->patterns[i].head, &first);
+    }
+    return _prefilter_from_set(first);
+}
+
+/**
+ * Builds the prefilter, if every pattern the offset-by-offset search
+ * evaluates begins with a string, and there aren't too many of them,
+ * or otherwise from the bytes they can begin with. Plain string patterns
+ * are left out, since Aho-Corasick finds those, and so are those anchored
+ * with '^', which are only tried at offset 0.
+ * @return NULL if no patterns are left, or nothing can be skipped
+ */
+static prefilter_t *_prefilter_create(regexx_t *re) {
+    unsigned char prefixes[PREFILTER_MAX][PREFILTER_WIDTH];
+    bool is_folded[PREFILTER_MAX];
+    unsigned char firsts[2 * PREFILTER_MAX];
+    unsigned first_count = 0;
+    unsigned count = 0;
+    unsigned width = PREFILTER_WIDTH;
+    prefilter_t *prefilter;
+    size_t i;
+    unsigned j;
+    unsigned k;
+
+    for (i=0; i<re->pattern_count; i++) {
+        unsigned char prefix[PREFILTER_WIDTH];
+        bool is_prefix_folded;
+        size_t length;
+
+        if (re->patterns[i].is_literal || re->patterns[i].is_anchored)
+            continue;
+        length = _node_prefix(re->patterns[i].head, prefix, PREFILTER_WIDTH, &is_prefix_folded);
+        if (length == 0)
+            return _prefilter_starts(re);
+        if (length < width)
+            width = (unsigned)length;
+        for (j=0; j<count; j++) {
+            if (memcmp(prefixes[j], prefix, length) == 0)
+                break;
+        }
+        if (j < count) {
+            is_folded[j] |= is_prefix_folded;
+            continue;
+        }
+        if (count >= PREFILTER_MAX)
+            return _prefilter_starts(re);
+        memset(prefixes[count], 0, PREFILTER_WIDTH);
+        memcpy(prefixes[count], prefix, length);
+        is_folded[count++] = is_prefix_folded;
+    }
+    if (count == 0)
+        return NULL;
+
+    prefilter = calloc(1, sizeof(*prefilter));
+    if (prefilter == NULL)
+        abort();
+    prefilter->width = width;
+    for (j=0; j<count; j++) {
+        unsigned bucket = 1U << (j % 8);
+
+        /* A caseless prefix is in lowercase, and its uppercase letters differ only in the high nibble */
+        for (k=0; k<width; k++) {
+            unsigned c = prefixes[j][k];
+
+            prefilter->lo[k][c & 0xF] |= bucket;
+            prefilter->hi[k][c >> 4] |= bucket;
+            if (is_folded[j] && c - 'a' < 26)
+                prefilter->hi[k][(c - ('a' - 'A')) >> 4] |= bucket;
+        }
+        if (memchr(firsts, prefixes[j][0], first_count) == NULL)
+            firsts[first_count++] = prefixes[j][0];
+        if (is_folded[j] && (unsigned)(prefixes[j][0] - 'a') < 26U && memchr(firsts, prefixes[j][0] - ('a' - 'A'), first_count) == NULL)
+            firsts[first_count++] = (unsigned char)(prefixes[j][0] - ('a' - 'A'));
+    }
+    /* Too many for SSE2 to compare against one at a time */
+    if (first_count <= PREFILTER_MAX) {
+        memcpy(prefilter->firsts, firsts, first_count);
+        prefilter->first_count = first_count;
+    }
+
+    _prefilter_choose(prefilter);
+    return prefilter;
+}
+
+/**
+ * Works out where a newly added pattern can start matching.
+ */
+static void _pattern_first(regexx_t *re, size_t index) {
+    const node_t *node = re->patterns[index].head;
+    charclass_t first = {0,0,0,0};
+
+    while (node && node->type == T_ROOT)
+        node = node->next;
+    re->patterns[index].is_anchored = node && node->type == T_ANCHOR_BEGIN;
+    if (re->patterns[index].is_anchored)
+        re->anchored_count++;
+    _node_first(re->patterns[index].head, &first);
+    re->patterns[index].first = _prefilter_from_set(first);
+}
+
+/** How many states of a lazy DFA fit in a cache of `size` bytes */
+static unsigned _dfa_cache_limit(const dfa_t *dfa, size_t size) {
+    size_t limit;
+
+    /* Each state costs a row of transitions, plus roughly as much
+     * again for its NFA set and accept flags */
+    limit = size / (dfa->class_count * sizeof(unsigned) + 16 * sizeof(unsigned));
+    if (limit < 16)
+        limit = 16;
+    if (limit > DFA_STATE_MAX)
+        limit = DFA_STATE_MAX;
+    return (unsigned)limit;
+}
+
+/**
+ * Creates a DFA that only builds states when the input reaches them,
+ * as many as fit in the cache.
+ */
+static dfa_t *_dfa_create_lazy(regexx_t *re, const unsigned *starts, size_t start_count, unsigned kind) {
+    dfa_t *dfa;
+
+    dfa = _dfa_create(&re->prog, starts, start_count, DFA_STATE_MAX, kind);
+    dfa->is_lazy = true;
+    dfa->state_limit = _dfa_cache_limit(dfa, re->cache_size);
+    return dfa;
+}
+
+/****************************************************************************
+ * JIT
+ *
+ * With REGEXX_JIT, the longest-match DFA that `regexx_lex_token()` runs is
+ * compiled to x86-64 machine code. Each state is a block of code that
+ * reads the next byte, looks up its class, and jumps straight to the
+ * block of the next state: by comparing against each class when few of
+ * them lead anywhere, or else through a table of the block offsets. So
+ * the state lives in the program counter, instead of being a row
+ * loaded from the transition table for each byte.
+ *
+ * The code is written into a buffer, then copied to memory from `mmap()`
+ * that's made executable (and no longer writable) with `mprotect()`. If
+ * that's not possible, or this isn't x86-64, the DFA is interpreted as
+ * usual.
+ ****************************************************************************/
+
+/* States with at most this many other states to go to test for each,
+ * the rest jump through a table */
+#define JIT_TARGET_MAX 4
+
+#ifdef JIT_X86
+
+/** The code being emitted, with jumps to labels patched at the end */
+typedef struct jitbuf_t {
+    unsigned char *code;
+    size_t length;
+    size_t max;
+
+    /* Where each label is, and the rel32 fields to point at them */
+    size_t *labels;
+    struct {
+        size_t at;
+        size_t label;
+        size_t base;    /* tables: relative to this, not the next instruction */
+    } *fixups;
+    size_t fixup_count;
+    size_t fixup_max;
+} jitbuf_t;
+
+static void _jit_bytes(jitbuf_t *buf, const void *bytes, size_t count) {
+    if (buf->length + count > buf->max) {
+        buf->max = (buf->max + count) * 2;
+        buf->code = realloc(buf->code, buf->max);
+        if (buf->code == NULL)
+            abort();
+    }
+    memcpy(buf->code + buf->length, bytes, count);
+    buf->length += count;
+}
+
+static void _jit_u32(jitbuf_t *buf, unsigned value) {
+    unsigned char bytes[4];
+
+    bytes[0] = (unsigned char)(value >> 0);
+    bytes[1] = (unsigned char)(value >> 8);
+    bytes[2] = (unsigned char)(value >> 16);
+    bytes[3] = (unsigned char)(value >> 24);
+    _jit_bytes(buf, bytes, 4);
+}
+
+/**
+ * Emits a 32-bit offset to a label, relative to `base`, or when that's
+ * ~0 to the end of the offset (as for jumps).
+ */
+static void _jit_ref(jitbuf_t *buf, size_t label, size_t base) {
+    if (buf->fixup_count >= buf->fixup_max) {
+        buf->fixup_max = buf->fixup_max * 2 + 64;
+        buf->fixups = realloc(buf->fixups, buf->fixup_max * sizeof(buf->fixups[0]));
+        if (buf->fixups == NULL)
+            abort();
+    }
+    buf->fixups[buf->fixup_count].at = buf->length;
+    buf->fixups[buf->fixup_count].label = label;
+    buf->fixups[buf->fixup_count].base = (base == ~(size_t)0) ? buf->length + 4 : base;
+    buf->fixup_count++;
+    _jit_u32(buf, 0);
+}
+
+/** Emits an instruction ending with a 32-bit offset to a label */
+static void _jit_op_ref(jitbuf_t *buf, const char *op, size_t op_length, size_t label) {
+    _jit_bytes(buf, op, op_length);
+    _jit_ref(buf, label, ~(size_t)0);
+}
+
+static void _jit_align(jitbuf_t *buf) {
+    static const unsigned char int3 = 0xCC;
+
+    while (buf->length % 8)
+        _jit_bytes(buf, &int3, 1);
+}
+
+/**
+ * Writes where the code for each state is to `/tmp/perf-<pid>.map`, so
+ * `perf` can put names to samples in it.
+ */
+static void _jit_perf_map(const dfa_t *dfa, const size_t *starts) {
+    char filename[64];
+    FILE *fp;
+    unsigned s;
+
+    snprintf(filename, sizeof(filename), "/tmp/perf-%d.map", (int)getpid());
+    fp = fopen(filename, "a");
+    if (fp == NULL)
+        return;
+    fprintf(fp, "%lx %lx regexx_jit_%p_entry\n",
+            (unsigned long)(size_t)dfa->jit_code, (unsigned long)starts[1], (void *)dfa);
+    for (s=1; s<dfa->state_count; s++) {
+        fprintf(fp, "%lx %lx regexx_jit_%p_state%u\n",
+                (unsigned long)((size_t)dfa->jit_code + starts[s]),
+                (unsigned long)(starts[s + 1] - starts[s]), (void *)dfa, s);
+    }
+    fclose(fp);
+}
+
+/**
+ * Compiles an eager DFA to machine code, setting `dfa->jit`, or leaves it
+ * NULL if the memory can't be had.
+ */
+static void _jit_create(dfa_t *dfa) {
+    /* mov r8,[rdi]; mov rsi,[rdi+8]; mov rdx,[rdi+16]; mov eax,[rdi+24];
+     * mov r10d,[rdi+28]; mov r11,[rdi+32] */
+    static const unsigned char prologue[] = {
+        0x4C, 0x8B, 0x07, 0x48, 0x8B, 0x77, 0x08, 0x48, 0x8B, 0x57, 0x10,
+        0x8B, 0x47, 0x18, 0x44, 0x8B, 0x57, 0x1C, 0x4C, 0x8B, 0x5F, 0x20};
+    /* movsxd rax,[rcx+rax*4]; add rax,rcx; jmp rax */
+    static const unsigned char dispatch[] = {
+        0x48, 0x63, 0x04, 0x81, 0x48, 0x01, 0xC8, 0xFF, 0xE0};
+    /* movzx eax,byte [r8+rsi]; inc rsi; movzx eax,byte [r9+rax] */
+    static const unsigned char next_class[] = {
+        0x41, 0x0F, 0xB6, 0x04, 0x30, 0x48, 0xFF, 0xC6,
+        0x41, 0x0F, 0xB6, 0x04, 0x01};
+    /* xor ecx,ecx; then: mov [rdi+8],rsi; mov [rdi+24],ecx;
+     * mov [rdi+28],r10d; mov [rdi+32],r11; ret */
+    static const unsigned char dead[] = {0x31, 0xC9};
+    static const unsigned char epilogue[] = {
+        0x48, 0x89, 0x77, 0x08, 0x89, 0x4F, 0x18, 0x44, 0x89, 0x57, 0x1C,
+        0x4C, 0x89, 0x5F, 0x20, 0xC3};
+    jitbuf_t buf[1] = {{0}};
+    unsigned state_count = dfa->state_count;
+    unsigned class_count = dfa->class_count;
+    size_t label_dead = 2 * (size_t)state_count;
+    size_t label_exit = label_dead + 1;
+    size_t label_classes = label_dead + 2;
+    size_t label_dispatch = label_dead + 3;
+    size_t label_tables = label_dead + 4;   /* + state */
+    size_t *starts;
+    unsigned char *code;
+    unsigned s;
+    unsigned k;
+    size_t i;
+
+    buf->labels = malloc((label_tables + state_count) * sizeof(buf->labels[0]));
+    starts = malloc((state_count + 1) * sizeof(starts[0]));
+    if (buf->labels == NULL || starts == NULL)
+        abort();
+
+    /* Load the registers and jump to the block of the starting state:
+     * r8 = text, rsi = i, rdx = stop, r9 = byte classes, r10d = accept,
+     * r11 = end */
+    _jit_bytes(buf, prologue, sizeof(prologue));
+    _jit_op_ref(buf, "\x4C\x8D\x0D", 3, label_classes);     /* lea r9,[rip+classes] */
+    _jit_op_ref(buf, "\x48\x8D\x0D", 3, label_dispatch);    /* lea rcx,[rip+dispatch] */
+    _jit_bytes(buf, dispatch, sizeof(dispatch));
+
+    /* The states, where the label `state_count + s` records the match
+     * when state `s` accepts, then falls through to label `s` */
+    for (s=1; s<state_count; s++) {
+        const unsigned *trans = dfa->trans + (size_t)s * class_count;
+        unsigned targets[JIT_TARGET_MAX];
+        unsigned target_count = 0;
+        unsigned char op[8];
+        unsigned t;
+
+        starts[s] = buf->length;
+        buf->labels[state_count + s] = buf->length;
+        if (dfa->accept[s]) {
+            /* mov r10d,accept; mov r11,rsi */
+            _jit_bytes(buf, "\x41\xBA", 2);
+            _jit_u32(buf, dfa->accept[s]);
+            _jit_bytes(buf, "\x49\x89\xF3", 3);
+        }
+        buf->labels[s] = buf->length;
+
+        /* cmp rsi,rdx; jae exit; mov ecx,s */
+        _jit_bytes(buf, "\x48\x39\xD6", 3);
+        _jit_bytes(buf, "\x72\x0A", 2);                 /* jb over the exit */
+        op[0] = 0xB9;
+        op[1] = (unsigned char)(s >> 0);
+        op[2] = (unsigned char)(s >> 8);
+        op[3] = (unsigned char)(s >> 16);
+        op[4] = (unsigned char)(s >> 24);
+        _jit_bytes(buf, op, 5);
+        _jit_op_ref(buf, "\xE9", 1, label_exit);
+        _jit_bytes(buf, next_class, sizeof(next_class));
+
+        /* The states this one goes to, up to the limit */
+        for (k=0; k<class_count && target_count <= JIT_TARGET_MAX; k++) {
+            if (trans[k] == 0)
+                continue;
+            for (t=0; t<target_count; t++) {
+                if (targets[t] == trans[k])
+                    break;
+            }
+            if (t < target_count)
+                continue;
+            if (target_count == JIT_TARGET_MAX) {
+                target_count++;
+                break;
+            }
+            targets[target_count++] = trans[k];
+        }
+
+        if (target_count <= JIT_TARGET_MAX && class_count <= 64) {
+            /* A branch for each state it goes to: for a single class,
+             * cmp eax,k; je; otherwise mov rcx,classes; bt rcx,rax; jc.
+             * So a state that loops on many classes (like `[a-z]+`) has
+             * one branch that's taken, predictably, for all of them. */
+            for (t=0; t<target_count; t++) {
+                unsigned to = targets[t];
+                unsigned long long mask = 0;
+                unsigned count = 0;
+                unsigned only = 0;
+
+                for (k=0; k<class_count; k++) {
+                    if (trans[k] == to) {
+                        mask |= 1ULL << k;
+                        only = k;
+                        count++;
+                    }
+                }
+                if (count == 1) {
+                    op[0] = 0x83;
+                    op[1] = 0xF8;
+                    op[2] = (unsigned char)only;
+                    _jit_bytes(buf, op, 3);
+                    _jit_op_ref(buf, "\x0F\x84", 2, dfa->accept[to] ? state_count + to : to);
+                } else {
+                    _jit_bytes(buf, "\x48\xB9", 2);
+                    _jit_u32(buf, (unsigned)mask);
+                    _jit_u32(buf, (unsigned)(mask >> 32));
+                    _jit_bytes(buf, "\x48\x0F\xA3\xC1", 4);
+                    _jit_op_ref(buf, "\x0F\x82", 2, dfa->accept[to] ? state_count + to : to);
+                }
+            }
+            _jit_op_ref(buf, "\xE9", 1, label_dead);
+        } else {
+            /* lea rcx,[rip+table]; then the same as the dispatch */
+            _jit_op_ref(buf, "\x48\x8D\x0D", 3, label_tables + s);
+            _jit_bytes(buf, dispatch, sizeof(dispatch));
+        }
+    }
+    starts[state_count] = buf->length;
+
+    buf->labels[label_dead] = buf->length;
+    _jit_bytes(buf, dead, sizeof(dead));
+    buf->labels[label_exit] = buf->length;
+    _jit_bytes(buf, epilogue, sizeof(epilogue));
+
+    /* The tables */
+    _jit_align(buf);
+    buf->labels[label_classes] = buf->length;
+    _jit_bytes(buf, dfa->byte_class, 256);
+    buf->labels[label_dispatch] = buf->length;
+    _jit_ref(buf, label_dead, buf->labels[label_dispatch]);
+    for (s=1; s<state_count; s++)
+        _jit_ref(buf, s, buf->labels[label_dispatch]);
+    for (s=1; s<state_count; s++) {
+        const unsigned *trans = dfa->trans + (size_t)s * class_count;
+        size_t base = buf->length;
+
+        buf->labels[label_tables + s] = base;
+        for (k=0; k<class_count; k++) {
+            unsigned to = trans[k];
+
+            if (to == 0)
+                _jit_ref(buf, label_dead, base);
+            else
+                _jit_ref(buf, dfa->accept[to] ? state_count + to : to, base);
+        }
+    }
+
+    for (i=0; i<buf->fixup_count; i++) {
+        size_t at = buf->fixups[i].at;
+        unsigned value = (unsigned)(buf->labels[buf->fixups[i].label] - buf->fixups[i].base);
+
+        buf->code[at + 0] = (unsigned char)(value >> 0);
+        buf->code[at + 1] = (unsigned char)(value >> 8);
+        buf->code[at + 2] = (unsigned char)(value >> 16);
+        buf->code[at + 3] = (unsigned char)(value >> 24);
+    }
+
+    /* Copy it to executable memory, or fall back to interpreting */
+    code = mmap(NULL, buf->length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code != MAP_FAILED) {
+        memcpy(code, buf->code, buf->length);
+        if (mprotect(code, buf->length, PROT_READ | PROT_EXEC) == 0) {
+            dfa->jit_code = code;
+            dfa->jit_size = buf->length;
+            dfa->jit = (jitfn_t)(size_t)code;
+            _jit_perf_map(dfa, starts);
+        } else
+            munmap(code, buf->length);
+    }
+
+    free(starts);
+    free(buf->code);
+    free(buf->labels);
+    free(buf->fixups);
+}
+
+#else
+
+static void _jit_create(dfa_t *dfa) {
+    (void)dfa;
+}
+
+#endif
+
+/**
+ * `_dfa_longest()` with the DFA compiled to machine code, which runs in
+ * stretches of BUDGET_INTERVAL bytes, so the steps can be charged.
+ */
+static bool _jit_longest(const dfa_t *dfa, budget_t *budget, const unsigned char *text, size_t offset, size_t length, size_t *r_end, size_t *r_index) {
+    jitrun_t run;
+
+    run.text = text;
+    run.i = offset;
+    run.state = (offset == 0) ? dfa->start_begin : dfa->start;
+    run.accept = 0;
+    run.end = 0;
+    do {
+        size_t from = run.i;
+
+        run.stop = (length - run.i > BUDGET_INTERVAL) ? run.i + BUDGET_INTERVAL : length;
+        if (run.state && run.i < length)
+            dfa->jit(&run);
+        if (_budget_spend(budget, run.i - from))
+            return false;
+    } while (run.state && run.i < length);
+
+    if (run.i == length && run.state && dfa->accept_eof[run.state] && run.i > offset) {
+        run.accept = dfa->accept_eof[run.state];
+        run.end = run.i;
+    }
+    if (run.accept == 0)
+        return false;
+    *r_end = run.end;
+    *r_index = run.accept - 1;
+    return true;
+}
+
+/**
+ * Does `regexx_compile()`, except with the DFA and Aho-Corasick automaton
+ * from `regexx_deserialize()`, if given, instead of building them.
+ */
+static int _compile(regexx_t *re, dfa_t *dfa, literals_t *literals) {
+    unsigned *starts;
+    size_t start_count = 0;
+    bool is_literal = false;
+    bool is_lazy;
+    size_t i;
+
+    _compiled_free(re);
+    re->compiled_count = re->pattern_count;
+    re->residual_count = 0;
+    re->anchored_count = 0;
+    for (i=0; i<re->pattern_count; i++) {
+        re->residual_count += re->patterns[i].is_residual;
+        re->anchored_count += re->patterns[i].is_anchored;
+    }
+
+    starts = malloc((re->pattern_count + 1) * sizeof(starts[0]));
+    if (starts == NULL)
+        abort();
+
+    /* The patterns were lowered as they were added, so the DFA starts
+     * from all of them that it can handle, except plain strings, which
+     * go into the Aho-Corasick automaton */
+    for (i=0; i<re->pattern_count; i++) {
+        if (re->patterns[i].is_literal)
+            is_literal = true;
+        else if (!re->patterns[i].is_residual)
+            starts[start_count++] = re->patterns[i].start;
+    }
+    if (literals)
+        re->literals = literals;
+    else if (is_literal)
+        re->literals = _literals_create(re);
+    if (re->literals)
+        re->literals->is_folded = (re->flags & REGEXX_IGNORECASE) != 0;
+
+    /* Either build the entire DFA now, or (lazy mode) just enough to
+     * start with, within the cache limit */
+    is_lazy = (re->flags & REGEXX_LAZY_DFA) != 0;
+    if (dfa)
+        re->dfa = dfa;
+    else if (is_lazy)
+        re->dfa = _dfa_create_lazy(re, starts, start_count, DFA_LONGEST);
+    else {
+        re->dfa = _dfa_create(&re->prog, starts, start_count, DFA_STATE_MAX, DFA_LONGEST);
+        if (_dfa_build(re->dfa, &re->prog) != 0) {
+            _dfa_free(re->dfa);
+            re->dfa = NULL;
+        } else
+            _dfa_minimize(re->dfa);
+    }
+    if (re->dfa && !re->dfa->is_lazy && (re->flags & REGEXX_JIT))
+        _jit_create(re->dfa);
+    if (re->dfa == NULL) {
+        _error_msg(re, "DFA too large (more than %u states), try REGEXX_LAZY_DFA", (unsigned)DFA_STATE_MAX);
+        _literals_free(re->literals);
+        re->literals = NULL;
+        free(starts);
+        return -1;
+    }
+
+    /* For searching, the leftmost DFA finds where the first match ends in
+     * one pass, and the reverse DFA where it starts. Their states depend
+     * on the input, so there could be too many to build them all now. */
+    if (start_count) {
+        re->search = _dfa_create_lazy(re, starts, start_count, DFA_LEFTMOST);
+        start_count = 0;
+        for (i=0; i<re->pattern_count; i++) {
+            if (!re->patterns[i].is_literal && !re->patterns[i].is_residual)
+                starts[start_count++] = re->patterns[i].reverse;
+        }
+        re->reverse = _dfa_create_lazy(re, starts, start_count, DFA_REVERSE);
+    }
+    free(starts);
+    re->prefilter = _prefilter_create(re);
+    return 0;
+}
+
+int regexx_compile(regexx_t *re) {
+    if (re == NULL)
+        return -1;
+    return _compile(re, NULL, NULL);
+}
+
+/**
+ * Adds the newest pattern of a delta to what it compiled, without going
+ * over the other patterns again: the DFAs only split their byte classes
+ * for it, and leave their start states for the next scan to build. The
+ * Aho-Corasick automaton can't be added to, so plain strings go into the
+ * DFAs too, and the prefilter just looks for the bytes a pattern can
+ * begin with.
+ */
+static void _delta_extend(regexx_t *delta, size_t index) {
+    const node_t *head = delta->patterns[index].head;
+    unsigned start;
+    unsigned reverse;
+
+    if (delta->patterns[index].is_literal) {
+        delta->patterns[index].is_literal = false;
+        delta->patterns[index].reverse = _lower_pattern(&delta->prog, head, (unsigned)index, true);
+    }
+    if (!delta->patterns[index].is_anchored)
+        _node_first(head, &delta->firsts);
+
+    /* The first pattern is compiled like any other */
+    if (delta->dfa == NULL) {
+        _compile(delta, NULL, NULL);
+        return;
+    }
+    delta->compiled_count = delta->pattern_count;
+    delta->generation++;
+    free(delta->prefilter);
+    delta->prefilter = _prefilter_from_set(delta->firsts);
+    if (delta->patterns[index].is_residual)
+        return;
+
+    start = delta->patterns[index].start;
+    reverse = delta->patterns[index].reverse;
+    _dfa_extend(delta->dfa, &delta->prog, start);
+    delta->dfa->state_limit = _dfa_cache_limit(delta->dfa, delta->cache_size);
+    if (delta->search == NULL) {
+        /* Until now, there were only patterns it doesn't search for */
+        delta->search = _dfa_create_lazy(delta, &start, 1, DFA_LEFTMOST);
+        delta->reverse = _dfa_create_lazy(delta, &reverse, 1, DFA_REVERSE);
+        return;
+    }
+    _dfa_extend(delta->search, &delta->prog, start);
+    delta->search->state_limit = _dfa_cache_limit(delta->search, delta->cache_size);
+    _dfa_extend(delta->reverse, &delta->prog, reverse);
+    delta->reverse->state_limit = _dfa_cache_limit(delta->reverse, delta->cache_size);
+}
+
+size_t regexx_get_class_count(regexx_t *re) {
+    if (re == NULL || re->dfa == NULL)
+        return 0;
+    return re->dfa->class_count;
+}
+
+int regexx_get_state_counts(regexx_t *re, size_t *built, size_t *minimized) {
+    if (re == NULL || re->dfa == NULL)
+        return -1;
+    if (built)
+        *built = re->dfa->is_lazy ? re->dfa->state_count : re->dfa->built_count;
+    if (minimized)
+        *minimized = re->dfa->state_count;
+    return 0;
+}
+
+int regexx_set_cache_size(regexx_t *re, size_t bytes) {
+    if (re == NULL)
+        return -1;
+    re->cache_size = bytes;
+    return 0;
+}
+
+int regexx_set_limits(regexx_t *re, size_t step_limit, uint64_t usec_limit) {
+    if (re == NULL)
+        return -1;
+    re->step_limit = step_limit;
+    re->usec_limit = usec_limit;
+    return 0;
+}
+
+void regexx_cancel(regexx_t *re) {
+    if (re)
+        ATOMIC_EXCHANGE(&re->scratch.budget.is_cancelled, 1);
+}
+
+void regexx_scratch_cancel(regexx_scratch_t *scratch) {
+    if (scratch)
+        ATOMIC_EXCHANGE(&scratch->budget.is_cancelled, 1);
+}
+
+/* How `_pike_run()` chooses between matches */
+#define PIKE_ANCHORED   0x01    /* only threads starting at the first offset */
+#define PIKE_LONGEST    0x02    /* the longest match, instead of the first by priority */
+#define PIKE_ANY        0x08    /* stop at the first match found, even an empty one */
+
+/**
+ * What one search with the Pike VM needs to know, shared with the
+ * lookaheads it evaluates, which run one level deeper.
+ */
+typedef struct pikectx_t {
+    const prog_t *prog;
+    scratch_t *scratch;
+    budget_t *budget;
+    const unsigned char *text;
+    size_t base;        /* lookahead results are kept for offsets from here */
+    size_t length;
+    const prefilter_t *first; /* where unanchored searches can start */
+    size_t limit;       /* no threads start after this */
+} pikectx_t;
+
+static void _scratch_free_vms(scratch_t *scratch) {
+    size_t i;
+
+    for (i=0; i<scratch->vm_count; i++) {
+        pikevm_t *vm = scratch->vms[i];
+        _sparseset_free(&vm->lists[0].pcs);
+        _sparseset_free(&vm->lists[1].pcs);
+        free(vm->lists[0].starts);
+        free(vm->lists[1].starts);
+        free(vm->stack);
+        free(vm);
+    }
+    free(scratch->vms);
+    scratch->vms = NULL;
+    scratch->vm_count = 0;
+}
+
+static void _scratch_free(scratch_t *scratch) {
+    _scratch_free_vms(scratch);
+    free(scratch->look_stamps);
+    free(scratch->look_values);
+    free(scratch->memo);
+    free(scratch->frames);
+    memset(scratch, 0, sizeof(*scratch));
+}
+
+/**
+ * Gets the Pike VM memory for a level of lookahead nesting, sized for the
+ * current program. These are allocated separately, so a pointer stays
+ * valid while deeper levels get added.
+ */
+static pikevm_t *_scratch_vm(scratch_t *scratch, const prog_t *prog, unsigned depth) {
+    pikevm_t *vm;
+    unsigned i;
+
+    if (scratch->prog_size != prog->count) {
+        /* Patterns were added since this was last used */
+        _scratch_free_vms(scratch);
+        scratch->prog_size = prog->count;
+    }
+    if (depth < scratch->vm_count)
+        return scratch->vms[depth];
+
+    scratch->vms = realloc(scratch->vms, (depth + 1) * sizeof(scratch->vms[0]));
+    if (scratch->vms == NULL)
+        abort();
+    while (scratch->vm_count <= depth) {
+        vm = malloc(sizeof(*vm));
+        if (vm == NULL)
+            abort();
+        for (i=0; i<2; i++) {
+            _sparseset_init(&vm->lists[i].pcs, prog->count);
+            vm->lists[i].starts = malloc((prog->count + 1) * sizeof(vm->lists[i].starts[0]));
+            if (vm->lists[i].starts == NULL)
+                abort();
+        }
+        vm->stack = malloc((prog->count * 2 + 1) * sizeof(vm->stack[0]));
+        if (vm->stack == NULL)
+            abort();
+        scratch->vms[scratch->vm_count++] = vm;
+    }
+    return scratch->vms[depth];
+}
+
+/** A copy of a lazy DFA, with an empty cache of its own */
+static dfa_t *_dfa_clone_lazy(const dfa_t *dfa, const prog_t *prog) {
+    dfa_t *clone;
+
+    clone = _dfa_create(prog, dfa->starts, dfa->start_count, DFA_STATE_MAX, dfa->kind);
+    clone->is_lazy = true;
+    clone->state_limit = dfa->state_limit;
+    return clone;
+}
+
+/** Frees the DFAs that are the scratch's own */
+static void _scratch_free_dfas(regexx_scratch_t *sc) {
+    if (sc->is_cloned) {
+        /* (an eager DFA is shared, and may already be gone) */
+        if (sc->is_dfa_cloned)
+            _dfa_free(sc->dfa);
+        _dfa_free(sc->search);
+        _dfa_free(sc->reverse);
+    }
+    sc->dfa = NULL;
+    sc->search = NULL;
+    sc->reverse = NULL;
+    sc->is_dfa_cloned = false;
+}
+
+/** Frees what the scratch holds, but not the scratch itself */
+static void _scratch_release(regexx_scratch_t *sc) {
+    _scratch_free(&sc->work);
+    _scratch_free_dfas(sc);
+    regexx_scratch_free(sc->delta);
+    sc->delta = NULL;
+    while (sc->offsets.next)
+        _lex_pop(&sc->offsets);
+}
+
+/**
+ * Catches up with `regexx_compile()` building new DFAs (or adding a
+ * pattern throwing them away, or extending a delta's) since the scratch
+ * was last used.
+ */
+static void _scratch_sync(const regexx_t *re, regexx_scratch_t *sc) {
+    _scratch_free_dfas(sc);
+    sc->dfa = re->dfa;
+    sc->search = re->search;
+    sc->reverse = re->reverse;
+    if (sc->is_cloned) {
+        if (re->dfa && re->dfa->is_lazy) {
+            sc->dfa = _dfa_clone_lazy(re->dfa, &re->prog);
+            sc->is_dfa_cloned = true;
+        }
+        if (re->search)
+            sc->search = _dfa_clone_lazy(re->search, &re->prog);
+        if (re->reverse)
+            sc->reverse = _dfa_clone_lazy(re->reverse, &re->prog);
+    } else {
+        /* Those of the `regexx_t`, which might need their start states
+         * since a pattern was added to them */
+        if (re->dfa && re->dfa->is_stale)
+            _dfa_restart(re->dfa, &re->prog);
+        if (re->search && re->search->is_stale)
+            _dfa_restart(re->search, &re->prog);
+        if (re->reverse && re->reverse->is_stale)
+            _dfa_restart(re->reverse, &re->prog);
+    }
+    if (re->delta) {
+        if (sc->delta == NULL) {
+            sc->delta = calloc(1, sizeof(*sc->delta));
+            if (sc->delta == NULL)
+                abort();
+            sc->delta->is_cloned = sc->is_cloned;
+        }
+        _scratch_sync(re->delta, sc->delta);
+    } else {
+        regexx_scratch_free(sc->delta);
+        sc->delta = NULL;
+    }
+    sc->generation = re->generation;
+}
+
+/** Gets the scratch ready for a scan, with none of the budget used */
+static void _scratch_begin(const regexx_t *re, regexx_scratch_t *sc) {
+    if (sc->generation != re->generation)
+        _scratch_sync(re, sc);
+    else if (re->delta && sc->delta->generation != re->delta->generation)
+        _scratch_sync(re->delta, sc->delta);
+    sc->budget.step_limit = re->step_limit;
+    sc->budget.usec_limit = re->usec_limit;
+    _budget_start(&sc->budget);
+}
+
+regexx_scratch_t *regexx_scratch_create(const regexx_t *re) {
+    regexx_scratch_t *sc;
+
+    if (re == NULL)
+        return NULL;
+    sc = calloc(1, sizeof(*sc));
+    if (sc == NULL)
+        abort();
+    sc->is_cloned = true;
+    sc->offsets.line_number = 1;
+    _scratch_sync(re, sc);
+
+    /* What every Pike VM scan needs, so the first doesn't allocate */
+    if (re->prog.count)
+        _scratch_vm(&sc->work, &re->prog, 0);
+    if (re->delta && re->delta->prog.count)
+        _scratch_vm(&sc->delta->work, &re->delta->prog, 0);
+    return sc;
+}
+
+void regexx_scratch_free(regexx_scratch_t *scratch) {
+    if (scratch == NULL)
+        return;
+    _scratch_release(scratch);
+    free(scratch);
+}
+
+/**
+ * Begins a search: forgets the lookahead results from the last one.
+ */
+static void _pike_begin(pikectx_t *ctx, const regexx_t *re, regexx_scratch_t *sc, const char *text, size_t offset, size_t length) {
+    ctx->prog = &re->prog;
+    ctx->scratch = &sc->work;
+    ctx->budget = &sc->budget;
+    ctx->text = (const unsigned char *)text;
+    ctx->base = offset;
+    ctx->length = length;
+    ctx->first = NULL;
+    ctx->limit = length;
+
+    if (++sc->work.look_generation == 0) {
+        /* wrapped around, so the old stamps could look current */
+        if (sc->work.look_stamps)
+            memset(sc->work.look_stamps, 0, sc->work.look_max * sizeof(sc->work.look_stamps[0]));
+        sc->work.look_generation = 1;
+    }
+}
+
+static bool _look_holds(const pikectx_t *ctx, unsigned index, size_t pos, unsigned depth);
+
+/**
+ * Adds a thread at `pc`, and everything reachable through epsilon
+ * transitions, in priority order. Zero-width assertions are checked
+ * here, at `pos`. Instructions already in the list are skipped, because
+ * an earlier thread there has priority (and an earlier start).
+ */
+static void _pike_addthread(const pikectx_t *ctx, pikevm_t *vm, threadlist_t *list, unsigned pc, size_t pos, size_t start, unsigned depth) {
+#ifdef VM_THREADED
+    static const void *const ops[] = {
+        &&vm_OP_BYTE, &&vm_OP_CLASS, &&vm_OP_SPLIT, &&vm_OP_BEGIN,
+        &&vm_OP_END, &&vm_OP_LOOK, &&vm_OP_MATCH};
+#endif
+    const nfainst_t *insts = ctx->prog->insts;
+    unsigned *stack = vm->stack;
+    size_t count = 0;
+
+    stack[count++] = pc;
+    while (count) {
+        const nfainst_t *inst;
+
+        pc = stack[--count];
+        if (pc == NFA_NONE || _sparseset_contains(&list->pcs, pc))
+            continue;
+        _sparseset_add(&list->pcs, pc);
+        list->starts[pc] = start;
+
+        inst = &insts[pc];
+        VM_DISPATCH(ops, inst->op) {
+        VM_OP(OP_SPLIT):
+            /* `out` is pushed last so it's explored first */
+            stack[count++] = inst->out1;
+            stack[count++] = inst->out;
+            continue;
+        VM_OP(OP_BEGIN):
+            if (pos == 0)
+                stack[count++] = inst->out;
+            continue;
+        VM_OP(OP_END):
+            if (pos == ctx->length)
+                stack[count++] = inst->out;
+            continue;
+        VM_OP(OP_LOOK):
+            if (_look_holds(ctx, inst->arg, pos, depth))
+                stack[count++] = inst->out;
+            continue;
+        VM_OP(OP_BYTE):
+        VM_OP(OP_CLASS):
+        VM_OP(OP_MATCH):
+            /* these wait in the list for the next byte */
+            continue;
+        }
+    }
+}
+
+/** Whether the instruction consumes the byte at `pos` */
+static bool _pike_consumes(const pikectx_t *ctx, const nfainst_t *inst, size_t pos) {
+    if (pos >= ctx->length)
+        return false;
+    if (inst->op == OP_BYTE)
+        return inst->arg == ctx->text[pos];
+    if (inst->op == OP_CLASS)
+        return _charclass_match_char(&ctx->prog->classes[inst->arg], ctx->text[pos]);
+    return false;
+}
+
+/**
+ * Simulates the NFA from `pc`, moving all the threads forward one byte at
+ * a time, so it takes time proportional to the input length times the
+ * program size, no matter the pattern. Threads start at `from` and
+ * (unless anchored) at every later offset until something matches.
+ * @return true if a match was found, the leftmost one, either the longest
+ *  there or the first by priority (which is how lazy quantifiers work)
+ */
+static bool _pike_run(const pikectx_t *ctx, unsigned depth, unsigned pc, size_t from, unsigned mode, size_t *r_start, size_t *r_end) {
+#ifdef VM_THREADED
+    static const void *const ops[] = {
+        &&vm_OP_BYTE, &&vm_OP_CLASS, &&vm_OP_SPLIT, &&vm_OP_BEGIN,
+        &&vm_OP_END, &&vm_OP_LOOK, &&vm_OP_MATCH};
+#endif
+    pikevm_t *vm = _scratch_vm(ctx->scratch, ctx->prog, depth);
+    const nfainst_t *insts = ctx->prog->insts;
+    const charclass_t *classes = ctx->prog->classes;
+    threadlist_t *clist = &vm->lists[0];
+    threadlist_t *nlist = &vm->lists[1];
+    bool is_matched = false;
+    unsigned c;
+    size_t pos;
+
+    clist->pcs.count = 0;
+    for (pos=from; ; pos++) {
+        threadlist_t *tmp;
+        size_t i;
+
+        /* A new thread, with the lowest priority, unless we already
+         * have a match, which anything starting later can't beat */
+        if (!is_matched && (pos == from || (!(mode & PIKE_ANCHORED) && pos <= ctx->limit))) {
+            /* With no threads left, skip to where a match can start */
+            if (clist->pcs.count == 0 && ctx->first && !(mode & PIKE_ANCHORED)) {
+                pos = ctx->first->next(ctx->first, ctx->text, pos, ctx->length);
+                if (pos >= ctx->length || pos > ctx->limit)
+                    break;
+            }
+            _pike_addthread(ctx, vm, clist, pc, pos, pos, depth);
+        }
+        if (clist->pcs.count == 0)
+            break;
+        if (_budget_spend(ctx->budget, clist->pcs.count))
+            return false;
+
+        nlist->pcs.count = 0;
+        c = (pos < ctx->length) ? ctx->text[pos] : 256;
+        for (i=0; i<clist->pcs.count; i++) {
+            unsigned tpc = clist->pcs.dense[i];
+            size_t start = clist->starts[tpc];
+            const nfainst_t *inst = &insts[tpc];
+
+            /* Threads are in order of their start, so the rest can
+             * only find matches to the right of the one we have */
+            if (is_matched && start > *r_start)
+                break;
+
+            VM_DISPATCH(ops, inst->op) {
+            VM_OP(OP_BYTE):
+                if (inst->arg == c)
+                    _pike_addthread(ctx, vm, nlist, inst->out, pos + 1, start, depth);
+                continue;
+            VM_OP(OP_CLASS):
+                if (c < 256 && _charclass_match_char(&classes[inst->arg], c))
+                    _pike_addthread(ctx, vm, nlist, inst->out, pos + 1, start, depth);
+                continue;
+            VM_OP(OP_SPLIT):
+            VM_OP(OP_BEGIN):
+            VM_OP(OP_END):
+            VM_OP(OP_LOOK):
+                continue;
+            VM_OP(OP_MATCH):
+                goto match;
+            }
+        match:
+            if (pos == start && !(mode & PIKE_ANY)) {
+                /* Empty matches aren't reported. Without PIKE_LONGEST, one
+                 * that's preferred also rules out the lower priority
+                 * threads from the same start, as when backtracking */
+                if (!(mode & PIKE_LONGEST)) {
+                    while (i + 1 < clist->pcs.count && clist->starts[clist->pcs.dense[i + 1]] == start)
+                        i++;
+                }
+                continue;
+            }
+            *r_start = start;
+            *r_end = pos;
+            is_matched = true;
+            if (mode & PIKE_ANY)
+                return true;
+            if (!(mode & PIKE_LONGEST))
+                break; /* lower priority threads can't win */
+        }
+
+        tmp = clist;
+        clist = nlist;
+        nlist = tmp;
+        if (pos >= ctx->length)
+            break;
+    }
+    return is_matched;
+}
+
+/**
+ * For a lookahead whose body has no maximum length, finds where it
+ * matches for every offset at once, in a single pass running the body
+ * backwards from the end of the input. A position where the reversed
+ * body reaches its end is one where the body matches.
+ */
+static void _look_reverse(const pikectx_t *ctx, unsigned index, unsigned depth) {
+    scratch_t *scratch = ctx->scratch;
+    const lookahead_t *look = &ctx->prog->looks[index];
+    pikevm_t *vm = _scratch_vm(scratch, ctx->prog, depth);
+    threadlist_t *clist = &vm->lists[0];
+    threadlist_t *nlist = &vm->lists[1];
+    size_t window = ctx->length - ctx->base + 1;
+    size_t pos;
+
+    clist->pcs.count = 0;
+    for (pos=ctx->length; ; pos--) {
+        size_t slot = index * window + (pos - ctx->base);
+        unsigned char value = 0;
+        threadlist_t *tmp;
+        size_t i;
+
+        _pike_addthread(ctx, vm, clist, look->reverse, pos, pos, depth);
+        for (i=0; i<clist->pcs.count; i++) {
+            if (ctx->prog->insts[clist->pcs.dense[i]].op == OP_MATCH)
+                value = 1;
+        }
+        scratch->look_values[slot] = value;
+        scratch->look_stamps[slot] = scratch->look_generation;
+        if (pos == ctx->base)
+            break;
+
+        nlist->pcs.count = 0;
+        for (i=0; i<clist->pcs.count; i++) {
+            const nfainst_t *inst = &ctx->prog->insts[clist->pcs.dense[i]];
+            if (_pike_consumes(ctx, inst, pos - 1))
+                _pike_addthread(ctx, vm, nlist, inst->out, pos - 1, pos - 1, depth);
+        }
+        tmp = clist;
+        clist = nlist;
+        nlist = tmp;
+    }
+}
+
+/**
+ * Whether lookahead `index` holds at `pos`. Each is evaluated at most once
+ * per offset per search, so lookahead doesn't break the time guarantee.
+ */
+static bool _look_holds(const pikectx_t *ctx, unsigned index, size_t pos, unsigned depth) {
+    scratch_t *scratch = ctx->scratch;
+    const lookahead_t *look = &ctx->prog->looks[index];
+    size_t window = ctx->length - ctx->base + 1;
+    size_t needed = _size_mul(ctx->prog->look_count, window);
+    size_t slot = index * window + (pos - ctx->base);
+
+    if (needed > scratch->look_max) {
+        scratch->look_stamps = realloc(scratch->look_stamps, needed * sizeof(scratch->look_stamps[0]));
+        scratch->look_values = realloc(scratch->look_values, needed);
+        if (scratch->look_stamps == NULL || scratch->look_values == NULL)
+            abort();
+        memset(scratch->look_stamps + scratch->look_max, 0, (needed - scratch->look_max) * sizeof(scratch->look_stamps[0]));
+        scratch->look_max = needed;
+    }
+
+    if (scratch->look_stamps[slot] != scratch->look_generation) {
+        if (look->is_bounded) {
+            size_t start;
+            size_t end;
+            scratch->look_values[slot] = _pike_run(ctx, depth + 1, look->forward, pos, PIKE_ANCHORED|PIKE_ANY, &start, &end);
+            scratch->look_stamps[slot] = scratch->look_generation;
+        } else
+            _look_reverse(ctx, index, depth + 1);
+    }
+    return scratch->look_values[slot] != look->is_inverted;
+}
+
+/**
+ * Gets the (cleared) memo for backtracking a pattern of `node_count` nodes
+ * over the offsets from `offset` to `length`, reusing the memory from one
+ * call to the next.
+ * @return the memo, or NULL if it would be too large
+ */
+static unsigned *_scratch_memo(scratch_t *scratch, unsigned node_count, size_t offset, size_t length, evalctx_t *ctx) {
+    size_t span = length - offset + 1;
+    size_t count;
+
+    if (span > MEMO_MAX / node_count)
+        return NULL;
+    count = node_count * span;
+    if (scratch->memo_max < count) {
+        free(scratch->memo);
+        scratch->memo = malloc(count * sizeof(scratch->memo[0]));
+        if (scratch->memo == NULL)
+            abort();
+        scratch->memo_max = count;
+    }
+    memset(scratch->memo, 0, count * sizeof(scratch->memo[0]));
+    ctx->base = offset;
+    ctx->span = span;
+    return scratch->memo;
+}
+
+/**
+ * Finds a match of a single pattern at or after `offset` (or only at
+ * `offset` with PIKE_ANCHORED), with the Pike VM for REGEXX_PIKEVM,
+ * or otherwise by backtracking, which is also the fallback for
+ * patterns that couldn't be lowered. Empty matches don't count, as with
+ * the DFA. Matches starting after `limit` aren't looked for, such as
+ * when another pattern has already matched there.
+ */
+static bool _pattern_search(const regexx_t *re, regexx_scratch_t *sc, size_t index, const char *text, size_t offset, size_t length, size_t limit, unsigned mode, size_t *r_start, size_t *r_end) {
+    const prefilter_t *first = re->patterns[index].first;
+    evalctx_t ctx;
+    size_t start;
+    size_t end;
+
+    if (re->patterns[index].is_anchored) {
+        if (offset != 0)
+            return false;
+        mode |= PIKE_ANCHORED;
+    }
+    if (first && (mode & PIKE_ANCHORED)) {
+        if (offset >= length || !_prefilter_check(first, (const unsigned char *)text + offset))
+            return false;
+    }
+
+    if ((re->flags & REGEXX_PIKEVM) && re->patterns[index].start != NFA_NONE) {
+        pikectx_t ctx;
+
+        _pike_begin(&ctx, re, sc, text, offset, length);
+        ctx.first = first;
+        ctx.limit = limit;
+        if (!re->patterns[index].is_lazy)
+            mode |= PIKE_LONGEST;
+        return _pike_run(&ctx, 0, re->patterns[index].start, offset, mode, r_start, r_end);
+    }
+
+    ctx.text = text;
+    ctx.length = length;
+    ctx.scratch = &sc->work;
+    ctx.budget = &sc->budget;
+    ctx.memo = NULL;
+    if ((re->flags & REGEXX_MEMOIZE) && offset <= length)
+        ctx.memo = _scratch_memo(&sc->work, re->patterns[index].node_count, offset, length, &ctx);
+
+    for (start=offset; start<length && start<=limit; start++) {
+        if (first && !(mode & PIKE_ANCHORED)) {
+            start = first->next(first, (const unsigned char *)text, start, length);
+            if (start >= length || start > limit)
+                break;
+        }
+        if (sc->budget.is_stopped)
+            break;
+        if (_node_eval(&ctx, re->patterns[index].head->next, start, &end)
+            && end > start) {
+            *r_start = start;
+            *r_end = end;
+            return true;
+        }
+        if (mode & PIKE_ANCHORED)
+            break;
+    }
+    return false;
+}
+
+/**
+ * Runs the DFA anchored at `offset` for as long as any pattern might still
+ * match, remembering the last (longest) match.
+ * @return true if any DFA pattern matched, in which case `*r_end` gets
+ *  the end of the match and `*r_index` the pattern number
+ */
+static bool _dfa_longest(dfa_t *dfa, const prog_t *prog, budget_t *budget, const unsigned char *text, size_t offset, size_t length, size_t *r_end, size_t *r_index) {
+    unsigned state = (offset == 0) ? dfa->start_begin : dfa->start;
+    unsigned accept = 0;
+    size_t charged = offset;
+    size_t end = 0;
+    size_t i;
+
+    if (dfa->jit)
+        return _jit_longest(dfa, budget, text, offset, length, r_end, r_index);
+
+    for (i=offset; i<length && state; i++) {
+        unsigned next;
+
+        if (i - charged >= BUDGET_INTERVAL) {
+            if (_budget_spend(budget, i - charged))
+                return false;
+            charged = i;
+        }
+        next = dfa->trans[(size_t)state * dfa->class_count + dfa->byte_class[text[i]]];
+        if (next == DFA_UNKNOWN)
+            next = _dfa_miss(dfa, prog, &state, text[i]);
+        state = next;
+        if (dfa->accept[state]) {
+            accept = dfa->accept[state];
+            end = i + 1;
+        }
+    }
+    if (i == length && state && dfa->accept_eof[state] && i > offset) {
+        accept = dfa->accept_eof[state];
+        end = i;
+    }
+    if (_budget_spend(budget, i - charged))
+        return false;
+    if (accept == 0)
+        return false;
+    *r_end = end;
+    *r_index = accept - 1;
+    return true;
+}
+
+/**
+ * Finds where the leftmost-longest match ending at `end` starts: the
+ * longest match backwards from there, which can't go past the leftmost
+ * start, `offset`.
+ * @return false if stopped by the limits
+ */
+static bool _dfa_search_start(const regexx_t *re, regexx_scratch_t *sc, const unsigned char *text, size_t offset, size_t end, size_t length, size_t *r_start) {
+    dfa_t *dfa = sc->reverse;
+    unsigned state = (end == length) ? dfa->start_begin : dfa->start;
+    size_t start = end;
+    size_t i;
+
+    for (i=end; i>offset && state; i--) {
+        unsigned next = dfa->trans[(size_t)state * dfa->class_count + dfa->byte_class[text[i - 1]]];
+        if (next == DFA_UNKNOWN)
+            next = _dfa_miss(dfa, &re->prog, &state, text[i - 1]);
+        state = next;
+        if (dfa->accept[state])
+            start = i - 1;
+    }
+    if (i == 0 && state && dfa->accept_eof[state])
+        start = 0;
+    *r_start = start;
+    return !_budget_spend(&sc->budget, end - i);
+}
+
+/**
+ * Finds the leftmost-longest match of all the DFA patterns in one pass:
+ * the leftmost DFA finds where it ends, then the reverse DFA runs back
+ * from there to find where it begins. Matches starting after `limit`
+ * don't matter, since another engine already found one there.
+ * @return true if found, with the match in `*r_start` and `*r_end` and
+ *  the pattern number in `*r_index`
+ */
+static bool _dfa_search(const regexx_t *re, regexx_scratch_t *sc, const unsigned char *text, size_t offset, size_t length, size_t limit, size_t *r_start, size_t *r_end, size_t *r_index) {
+    dfa_t *dfa = sc->search;
+    unsigned state = (offset == 0) ? dfa->start_begin : dfa->start;
+    bool is_seeding = true;
+    unsigned accept = 0;
+    size_t charged = offset;
+    size_t start;
+    size_t end = 0;
+    size_t i;
+
+    /* Past the beginning, a DFA of only '^' patterns has nothing to do */
+    if (state == 0)
+        return false;
+    for (i=offset; i<length && state; i++) {
+        unsigned next;
+
+        if (i - charged >= BUDGET_INTERVAL) {
+            if (_budget_spend(&sc->budget, i - charged))
+                return false;
+            charged = i;
+        }
+        if (i > limit && is_seeding) {
+            state = _dfa_unseed(dfa, &re->prog, state);
+            is_seeding = false;
+            if (state == 0)
+                break;
+        } else if (state == dfa->start && re->prefilter
+                && dfa->trans[(size_t)state * dfa->class_count + dfa->byte_class[text[i]]] == state) {
+            /* Nothing is under way, and this byte doesn't start anything
+             * either, so skip to where a match might start, but no
+             * further than `limit` */
+            size_t bound = _prefilter_bound(re->prefilter, limit, length);
+
+            i = re->prefilter->next(re->prefilter, text, i, bound);
+            if (i >= bound || i > limit)
+                break;
+        }
+        next = dfa->trans[(size_t)state * dfa->class_count + dfa->byte_class[text[i]]];
+        if (next == DFA_UNKNOWN)
+            next = _dfa_miss(dfa, &re->prog, &state, text[i]);
+        state = next;
+        if (dfa->accept[state]) {
+            accept = dfa->accept[state];
+            end = i + 1;
+        }
+    }
+    if (i == length && state && dfa->accept_eof[state]) {
+        accept = dfa->accept_eof[state];
+        end = i;
+    }
+    if (_budget_spend(&sc->budget, i - charged))
+        return false;
+    if (accept == 0)
+        return false;
+
+    if (!_dfa_search_start(re, sc, text, offset, end, length, &start))
+        return false;
+
+    *r_start = start;
+    *r_end = end;
+    *r_index = accept - 1;
+    return true;
+}
+
+/* Which of the engines `_match_at()` consults, when compiled */
+#define ENGINE_DFA      0x01
+#define ENGINE_RESIDUAL 0x02
+#define ENGINE_LITERAL  0x04
+#define ENGINE_DELTA    0x08
+#define ENGINE_ALL      0x0F
+
+/**
+ * Gets the delta's scratch ready to search with what's left of the
+ * scan's budget, which `_delta_end()` takes back.
+ */
+static regexx_scratch_t *_delta_begin(regexx_scratch_t *sc) {
+    budget_t *budget = &sc->delta->budget;
+
+    budget->step_limit = sc->budget.step_limit;
+    budget->usec_limit = sc->budget.usec_limit;
+    budget->deadline = sc->budget.deadline;
+    budget->steps = sc->budget.steps;
+    budget->next_check = sc->budget.next_check;
+    budget->is_stopped = sc->budget.is_stopped;
+    return sc->delta;
+}
+
+static void _delta_end(regexx_scratch_t *sc) {
+    sc->budget.steps = sc->delta->budget.steps;
+    sc->budget.next_check = sc->delta->budget.next_check;
+    sc->budget.is_stopped = sc->delta->budget.is_stopped;
+}
+
+/**
+ * Finds the longest match of any pattern starting exactly at `offset`.
+ * The DFA (when compiled) handles most patterns at once, the Aho-Corasick
+ * automaton the plain strings, the delta those added since compiling,
+ * and whatever is left is evaluated one pattern at a time. Ties go to
+ * the pattern that was added first, like in `lex`. Empty matches aren't
+ * reported.
+ */
+static bool _match_at(const regexx_t *re, regexx_scratch_t *sc, const char *text, size_t offset, size_t length, unsigned engines, size_t *r_end, size_t *r_index) {
+    size_t longest = offset;
+    size_t index = 0;
+    size_t count;
+    size_t end;
+    size_t i;
+
+    if (re->dfa && (engines & ENGINE_DFA)) {
+        if (_dfa_longest(sc->dfa, &re->prog, &sc->budget, (const unsigned char *)text, offset, length, &end, &index))
+            longest = end;
+    }
+
+    if (re->literals && (engines & ENGINE_LITERAL)) {
+        size_t literal;
+        if (_literals_at(re->literals, (const unsigned char *)text, offset, length, &end, &literal)) {
+            if (end > longest || (end == longest && literal < index)) {
+                longest = end;
+                index = literal;
+            }
+        }
+    }
+
+    /* Uncompiled, every pattern is evaluated here */
+    count = re->dfa ? re->compiled_count : re->pattern_count;
+    if (re->dfa && (re->residual_count == 0 || !(engines & ENGINE_RESIDUAL)))
+        i = count;
+    else
+        i = 0;
+    for (; i<count; i++) {
+        size_t start;
+
+        if (re->dfa && !re->patterns[i].is_residual)
+            continue;
+        if (!_pattern_search(re, sc, i, text, offset, length, length, PIKE_ANCHORED, &start, &end))
+            continue;
+        if (end > longest || (end == longest && end > offset && i < index)) {
+            longest = end;
+            index = i;
+        }
+    }
+
+    /* The patterns added since compiling come after all the others, so
+     * they have to be longer to win */
+    if (re->delta && (engines & ENGINE_DELTA) && !sc->budget.is_stopped) {
+        if (_match_at(re->delta, _delta_begin(sc), text, offset, length, ENGINE_ALL, &end, &i) && end > longest) {
+            longest = end;
+            index = re->compiled_count + i;
+        }
+        _delta_end(sc);
+    }
+
+    if (longest == offset || sc->budget.is_stopped)
+        return false;
+    *r_end = longest;
+    *r_index = index;
+    return true;
+}
+
+/**
+ * Keep track of line numbers, and the character offset in the current line, for each
+ * token.
+ * TODO: this needs to be integrated into `lex` parsing instead of a separate step
+ */
+static void _set_offsets(regexx_scratch_t *sc, const char *buf, size_t offset, size_t token_length) {
+    size_t i;
+    
+    for (i=0; i<token_length; i++) {
+        if (buf[offset + i] == '\n') {
+            sc->offsets.line_number++;
+            sc->offsets.char_number = 0;
+        } else
+            sc->offsets.char_number++;
+    }
+}
+
+struct regexxtoken_t regexx_lex_token(regexx_t *re, const char *subject, size_t *subject_offset, size_t subject_length) {
+    if (re == NULL) {
+        struct regexxtoken_t result = {REGEXX_NOT_FOUND, 0, 0 , 0, 0};
+        return result;
+    }
+    return regexx_scratch_lex_token(re, &re->scratch, subject, subject_offset, subject_length);
+}
+
+struct regexxtoken_t regexx_scratch_lex_token(const regexx_t *re, regexx_scratch_t *sc, const char *subject, size_t *subject_offset, size_t subject_length) {
+    struct regexxtoken_t result = {REGEXX_NOT_FOUND, 0, 0 , 0, 0};
+    size_t end;
+    size_t index;
+    
+    /* Make sure input is valid */
+    if (re == NULL || sc == NULL || re->head == NULL || subject == NULL)
+        return result;
+
+    result.line_number = sc->offsets.line_number;
+    result.char_number = sc->offsets.char_number;
+
+    if (subject_length == SIZE_MAX)
+        subject_length = strlen(subject);
+    
+    /* Find the longest of all the patterns at this point */
+    _scratch_begin(re, sc);
+    if (!_match_at(re, sc, subject, *subject_offset, subject_length, ENGINE_ALL, &end, &index)) {
+        result.id = sc->budget.is_stopped ? REGEXX_NOT_FINISHED : REGEXX_NOT_FOUND;
+        return result;
+    }
+
+    result.id = re->patterns[index].id;
+    result.length = end - *subject_offset;
+    result.string = subject + *subject_offset;
+    _set_offsets(sc, subject, *subject_offset, result.length);
+    *subject_offset = end;
+    return result;
+}
+
+static size_t _scratch_match(const regexx_t *re, regexx_scratch_t *sc, const char *input, size_t in_offset, size_t in_length, size_t limit, size_t *out_offset, size_t *out_length);
+
+size_t regexx_match(regexx_t *re, const char *input, size_t in_offset, size_t in_length, size_t *out_offset, size_t *out_length) {
+    if (re == NULL)
+        return -1;
+    return regexx_scratch_match(re, &re->scratch, input, in_offset, in_length, out_offset, out_length);
+}
+
+size_t regexx_scratch_match(const regexx_t *re, regexx_scratch_t *sc, const char *input, size_t in_offset, size_t in_length, size_t *out_offset, size_t *out_length) {
+    if (in_length == SIZE_MAX)
+        in_length = strlen(input);
+    
+    /* Make sure input is valid */
+    if (re == NULL || sc == NULL || re->head == NULL || input == NULL)
+        return -1;
+    return _scratch_match(re, sc, input, in_offset, in_length, in_length, out_offset, out_length);
+}
+
+/**
+ * Searches compiled patterns for the first (leftmost) match, and the
+ * longest one there, except that matches starting after `limit` aren't
+ * looked for.
+ * @return true if found, false if not, or if stopped by the budget
+ */
+static bool _compiled_search(const regexx_t *re, regexx_scratch_t *sc, const char *input, size_t in_offset, size_t in_length, size_t limit, size_t *r_start, size_t *r_end, size_t *r_index) {
+    size_t best_start = limit;
+    size_t best_end = 0;
+    size_t best_index = SIZE_MAX;
+    size_t offset;
+    size_t i;
+
+    /* The engines that can search the whole input in one pass do
+     * so first, then the rest only need to look up to where that
+     * match starts */
+    if (re->literals) {
+        size_t length = in_length;
+
+        /* Literals starting by `limit` end soon after it */
+        if (limit < in_length && in_length - limit > re->literals->max_length)
+            length = limit + re->literals->max_length;
+        if (!_literals_search(re->literals, &sc->budget, (const unsigned char *)input, in_offset, length, &best_start, &best_end, &best_index)
+                || best_start > limit) {
+            best_start = limit;
+            best_end = 0;
+            best_index = SIZE_MAX;
+        }
+    }
+    if (re->search) {
+        size_t start;
+        size_t end;
+        size_t index;
+
+        if (_dfa_search(re, sc, (const unsigned char *)input, in_offset, in_length, best_start, &start, &end, &index)) {
+            if (start < best_start || (start == best_start && (end > best_end || (end == best_end && index < best_index)))) {
+                best_start = start;
+                best_end = end;
+                best_index = index;
+            }
+        }
+    }
+    if (re->flags & REGEXX_PIKEVM) {
+        for (i=0; i<re->compiled_count; i++) {
+            size_t start;
+            size_t end;
+
+            if (!re->patterns[i].is_residual)
+                continue;
+            if (!_pattern_search(re, sc, i, input, in_offset, in_length, best_start, 0, &start, &end))
+                continue;
+            if (start < best_start || (start == best_start && (end > best_end || (end == best_end && i < best_index)))) {
+                best_start = start;
+                best_end = end;
+                best_index = i;
+            }
+        }
+    }
+
+    /* Only the patterns evaluated by backtracking are left, to try
+     * offset by offset */
+    if (re->residual_count == 0 || (re->flags & REGEXX_PIKEVM))
+        offset = in_length;
+    else
+        offset = in_offset;
+    for (; offset<in_length && offset<=best_start; offset++) {
+        size_t end;
+        size_t index;
+
+        /* Skip ahead to where a pattern might start, except that
+         * patterns anchored with '^' are tried at the start */
+        if (re->prefilter && (offset != 0 || re->anchored_count == 0)) {
+            size_t bound = _prefilter_bound(re->prefilter, best_start, in_length);
+
+            offset = re->prefilter->next(re->prefilter, (const unsigned char *)input, offset, bound);
+            if (offset >= bound || offset > best_start)
+                break;
+        }
+        if (!_match_at(re, sc, input, offset, in_length, ENGINE_RESIDUAL, &end, &index)) {
+            if (sc->budget.is_stopped)
+                break;
+            continue;
+        }
+        if (offset < best_start || end > best_end || (end == best_end && index < best_index)) {
+            best_start = offset;
+            best_end = end;
+            best_index = index;
+        }
+        break;
+    }
+
+    /* Then the delta, whose patterns were added after all of these */
+    if (re->delta && !sc->budget.is_stopped) {
+        size_t start;
+        size_t end;
+        size_t index;
+
+        if (_compiled_search(re->delta, _delta_begin(sc), input, in_offset, in_length, best_start, &start, &end, &index)) {
+            if (start < best_start || (start == best_start && end > best_end)) {
+                best_start = start;
+                best_end = end;
+                best_index = re->compiled_count + index;
+            }
+        }
+        _delta_end(sc);
+    }
+
+    if (sc->budget.is_stopped || best_index == SIZE_MAX)
+        return false;
+    *r_start = best_start;
+    *r_end = best_end;
+    *r_index = best_index;
+    return true;
+}
+
+/**
+ * Does `regexx_scratch_match()`, except that matches starting after
+ * `limit` aren't looked for (when compiled). They can still end after it,
+ * and everything up to `in_length` counts for '$' and lookahead.
+ */
+static size_t _scratch_match(const regexx_t *re, regexx_scratch_t *sc, const char *input, size_t in_offset, size_t in_length, size_t limit, size_t *out_offset, size_t *out_length) {
+    size_t i;
+
+    _scratch_begin(re, sc);
+
+    /* When compiled, the patterns are searched for together, so the first
+     * (leftmost) match wins, then the longest one there */
+    if (re->dfa) {
+        size_t start;
+        size_t end;
+        size_t index;
+
+        if (!_compiled_search(re, sc, input, in_offset, in_length, limit, &start, &end, &index))
+            return sc->budget.is_stopped ? REGEXX_NOT_FINISHED : REGEXX_NOT_FOUND;
+        *out_offset = start;
+        *out_length = end - start;
+        return re->patterns[index].id;
+    }
+
+    /* Uncompiled, each pattern is searched for in turn, in one pass by
+     * the Pike VM, or by backtracking at each offset where it can start */
+    for (i=0; i<re->pattern_count; i++) {
+        size_t start;
+        size_t end;
+
+        if (_pattern_search(re, sc, i, input, in_offset, in_length, in_length, 0, &start, &end)) {
+            *out_offset = start;
+            *out_length = end - start;
+            return re->patterns[i].id;
+        }
+        if (sc->budget.is_stopped)
+            return REGEXX_NOT_FINISHED;
+    }
+    return REGEXX_NOT_FOUND;
+}
+
+
+static void _node_print_chars(const char *str, size_t length, buf_t *buf) {
+    size_t i;
+    for (i=0; i<length; i++) {
+        char c = str[i];
+        if (strchr(".^$*+?()[{}\\|", c)) {
+            _appendf(buf, "\\%c", c);
+        } else {
+            switch (c & 0xFF) {
+            case '\a': _appendf(buf, "\\a"); break;
+            case '\b': _appendf(buf, "\\b"); break;
+            case '\t': _appendf(buf, "\\t"); break;
+            case '\f': _appendf(buf, "\\f"); break;
+            case '\v': _appendf(buf, "\\v"); break;
+            case '\r': _appendf(buf, "\\r"); break;
+            case '\n': _appendf(buf, "\\n"); break;
+            default:
+                _appendf(buf, "%c", c);
+                break;
+            }
+        }
+    }
+}
+
+
+/**
+ * Recursively print the nodes
+ */
+static const char *_node_print(node_t *node, buf_t *buf) {
+    buf_t buf2[1] = {0,0};
+    if (buf == NULL)
+        buf = buf2; /* for debugging */
+
+    while (node) {
+    switch (node->type) {
+        case T_TRUE:
+            return buf->string;
+            break;
+        case T_ROOT:
+            break;
+        case T_DOT_ALL:
+        case T_DOT_NONEWLINE:
+            _appendf(buf, ".");
+            break;
+        case T_ANCHOR_BEGIN:
+            _appendf(buf, "^");
+            break;
+        case T_ANCHOR_END:
             _appendf(buf, "$");
             break;
-        case T_QUANTIFIER:
-            if (node->quantifier.min == 0 && node->quantifier.max == 1) {
-                _node_print(node->quantifier.child, buf);
-                _appendf(buf, "?");
-            } else if (node->quantifier.min == 0 && node->quantifier.max == SIZE_MAX) {
-                _node_print(node->quantifier.child, buf);
-                _appendf(buf, "*%s", node->quantifier.is_lazy?"?":"");
-            } else if (node->quantifier.min == 1 && node->quantifier.max == SIZE_MAX) {
-                _node_print(node->quantifier.child, buf);
-                _appendf(buf, "+%s", node->quantifier.is_lazy?"?":"");
-            } else if (node->quantifier.min == 1 && node->quantifier.max == 1) {
-                _node_print(node->quantifier.child, buf);
-            } else if (node->quantifier.min == 0 && node->quantifier.max == 0) {
-                ;
-            } else {
-                _node_print(node->quantifier.child, buf);
-                if (node->quantifier.min == node->quantifier.max) {
-                    _appendf(buf, "{%u}%s", (unsigned)node->quantifier.max, node->quantifier.is_lazy?"?":"");
-                } else if (node->quantifier.min == 0) {
-                    _appendf(buf, "{,%u}%s", (unsigned)node->quantifier.max, node->quantifier.is_lazy?"?":"");
-                } else if (SIZE_MAX == node->quantifier.max) {
-                    _appendf(buf, "{%u,}%s", (unsigned)node->quantifier.min, node->quantifier.is_lazy?"?":"");
-                } else {
-                    _appendf(buf, "{%u,%u}%s", (unsigned)node->quantifier.min, (unsigned)node->quantifier.max, node->quantifier.is_lazy?"?":"");
-                }
+        case T_QUANTIFIER:
+            if (node->quantifier.min == 0 && node->quantifier.max == 1) {
+                _node_print(node->quantifier.child, buf);
+                _appendf(buf, "?");
+            } else if (node->quantifier.min == 0 && node->quantifier.max == SIZE_MAX) {
+                _node_print(node->quantifier.child, buf);
+                _appendf(buf, "*%s", node->quantifier.is_lazy?"?":"");
+            } else if (node->quantifier.min == 1 && node->quantifier.max == SIZE_MAX) {
+                _node_print(node->quantifier.child, buf);
+                _appendf(buf, "+%s", node->quantifier.is_lazy?"?":"");
+            } else if (node->quantifier.min == 1 && node->quantifier.max == 1) {
+                _node_print(node->quantifier.child, buf);
+            } else if (node->quantifier.min == 0 && node->quantifier.max == 0) {
+                ;
+            } else {
+                _node_print(node->quantifier.child, buf);
+                if (node->quantifier.min == node->quantifier.max) {
+                    _appendf(buf, "{%u}%s", (unsigned)node->quantifier.max, node->quantifier.is_lazy?"?":"");
+                } else if (node->quantifier.min == 0) {
+                    _appendf(buf, "{,%u}%s", (unsigned)node->quantifier.max, node->quantifier.is_lazy?"?":"");
+                } else if (SIZE_MAX == node->quantifier.max) {
+                    _appendf(buf, "{%u,}%s", (unsigned)node->quantifier.min, node->quantifier.is_lazy?"?":"");
+                } else {
+                    _appendf(buf, "{%u,%u}%s", (unsigned)node->quantifier.min, (unsigned)node->quantifier.max, node->quantifier.is_lazy?"?":"");
+                }
+            }
+            break;
+        case T_ALTERNATION:
+            _node_print(node->alternation.child, buf);
+            _appendf(buf, "|");
+            break;
+        case T_GROUP:
+            _appendf(buf, "(");
+            _node_print(node->group.child, buf);
+            _appendf(buf, ")");
+            break;
+        case T_STRING:
+            _node_print_chars(node->string.chars, node->string.length, buf);
+            break;
+        case T_CHARCLASS:
+            if (_charclass_is_equal(node->charclass, _whitespace))
+                _appendf(buf, "\\s");
+            else if (_charclass_is_equal(node->charclass, _invert(_whitespace)))
+                _appendf(buf, "\\S");
+            else if (_charclass_is_equal(node->charclass, _word))
+                _appendf(buf, "\\w");
+            else if (_charclass_is_equal(node->charclass, _invert(_word)))
+                _appendf(buf, "\\W");
+            else if (_charclass_is_equal(node->charclass, _digits))
+                _appendf(buf, "\\d");
+            else if (_charclass_is_equal(node->charclass, _invert(_digits)))
+                _appendf(buf, "\\D");
+            else if (_charclass_is_equal(node->charclass, _dot_all))
+                _appendf(buf, "[\\s\\S]");
+            else {
+                char normal[1024];
+                char inverted[1024];
+                _charclass_print(node->charclass, normal, sizeof(normal));
+                _charclass_print(_invert(node->charclass), inverted, sizeof(inverted));
+                if (strlen(normal) < strlen(inverted)) {
+                    _appendf(buf, "[%s]", normal);
+                } else {
+                    _appendf(buf, "[^%s]", inverted);
+                }
+            }
+            break;
+        case T_GROUP_START:
+            /* Only useful when printing partial regex chains, such as while debugging.
+             * If seen in actual output, this is an error */
+            _appendf(buf, "(");
+            break;
+        default:
+            _appendf(buf, "*****errror*****");
+            return buf->string;
+    }
+        node = node->next;
+    }
+    return buf->string;
+}
+
+char *regexx_print(regexx_t *re, size_t index, size_t *id, bool is_flag_shown)
+{
+    node_t *head;
+    buf_t buf[1] = {0,0};
+ 
+    if (index >= re->pattern_count) {
+        if (id)
+            *id = REGEXX_NOT_FOUND;
+        return NULL;
+    } else {
+        head = re->patterns[index].head;
+        if (id)
+            *id = re->patterns[index].id;
+    }
+    
+    //_appendf(buf, "");
+    
+    if (is_flag_shown)
+        _appendf(buf, "/");
+    _node_print(head, buf);
+    if (is_flag_shown)
+        _appendf(buf, "/");
+    return buf->string;
+}
+
+/****************************************************************************
+ * Serialization
+ *
+ * `regexx_serialize()` writes what `regexx_compile()` built into a buffer
+ * that can be saved to a file, and `regexx_deserialize()` turns that back
+ * into a working engine, much faster than compiling again. The buffer
+ * holds no pointers, only lengths and state numbers, so it can be
+ * `mmap()`ed from the file, and the big tables (the DFA's transitions and
+ * the Aho-Corasick cells) are used right where they are, shared by all
+ * the processes that map it. The patterns themselves are kept as their
+ * source text and parsed again, which is quick.
+ *
+ * After the header come the macros, the patterns, the DFA (unless it's
+ * lazy) and the literals, each piece padded to 8 bytes, all in the byte
+ * order of the machine that wrote it.
+ ****************************************************************************/
+
+#define DB_MAGIC        "REGEXXDB"
+#define DB_VERSION      2
+#define DB_BYTE_ORDER   0x01020304
+
+typedef struct dbheader_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;    /* DB_BYTE_ORDER, as the writer saw it */
+    uint64_t size;          /* of everything, including this header */
+    uint64_t checksum;      /* of everything after this header */
+    uint32_t flags;         /* from `regexx_create()` */
+    uint32_t macro_count;
+    uint32_t pattern_count;
+    uint32_t has_dfa;
+    uint32_t has_literals;
+    uint32_t reserved;
+} dbheader_t;
+
+/* Each followed by the name and value */
+typedef struct dbmacro_t {
+    uint32_t name_length;
+    uint32_t value_length;
+} dbmacro_t;
+
+/* Each followed by the source */
+typedef struct dbpattern_t {
+    uint64_t id;
+    uint32_t flags;
+    uint32_t length;
+} dbpattern_t;
+
+/* Followed by the transitions, accepts, and accepts at the end */
+typedef struct dbdfa_t {
+    uint32_t state_count;
+    uint32_t built_count;
+    uint32_t class_count;
+    uint32_t start;
+    uint32_t start_begin;
+    uint32_t reserved;
+    unsigned char byte_class[256];
+    unsigned char class_byte[256];
+} dbdfa_t;
+
+/* Followed by the cells, their failure links and infos, and the dense transitions */
+typedef struct dbliterals_t {
+    uint32_t cell_count;
+    uint32_t max_length;
+    uint32_t dense_count;
+    uint32_t class_count;
+    unsigned char byte_class[256];
+} dbliterals_t;
+
+typedef struct dbwriter_t {
+    unsigned char *data;
+    size_t length;
+    size_t max;
+} dbwriter_t;
+
+typedef struct dbreader_t {
+    const unsigned char *data;
+    size_t length;
+    size_t offset;
+} dbreader_t;
+
+/** FNV-1a, to notice a damaged file */
+static uint64_t _db_checksum(const unsigned char *data, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i=0; i<length; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/** Appends `size` bytes (zeroes if `data` is NULL), padded to 8 */
+static void _db_put(dbwriter_t *writer, const void *data, size_t size) {
+    size_t padded = (size + 7) & ~(size_t)7;
+
+    if (writer->length + padded > writer->max) {
+        writer->max = (writer->length + padded) * 2;
+        writer->data = realloc(writer->data, writer->max);
+        if (writer->data == NULL)
+            abort();
+    }
+    if (data)
+        memcpy(writer->data + writer->length, data, size);
+    else
+        memset(writer->data + writer->length, 0, size);
+    memset(writer->data + writer->length + size, 0, padded - size);
+    writer->length += padded;
+}
+
+/**
+ * Takes the next `size` bytes (padded to 8).
+ * @return where they are, or NULL if the data is too short
+ */
+static const void *_db_get(dbreader_t *reader, size_t size) {
+    size_t padded = (size + 7) & ~(size_t)7;
+    const void *result;
+
+    if (padded < size || padded > reader->length - reader->offset)
+        return NULL;
+    result = reader->data + reader->offset;
+    reader->offset += padded;
+    return result;
+}
+
+int regexx_serialize(regexx_t *re, void **r_data, size_t *r_length) {
+    dbwriter_t writer = {0, 0, 0};
+    dbheader_t header;
+    dbheader_t *out;
+    size_t i;
+
+    if (re == NULL || r_data == NULL || r_length == NULL)
+        return -1;
+    if (re->dfa == NULL) {
+        _error_msg(re, "patterns must be compiled before they're serialized");
+        return -1;
+    }
+
+    /* Only the one DFA is saved, so the delta is compiled in with it */
+    if (re->delta && _compile(re, NULL, NULL) != 0)
+        return -1;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DB_MAGIC, sizeof(header.magic));
+    header.version = DB_VERSION;
+    header.byte_order = DB_BYTE_ORDER;
+    header.flags = re->flags;
+    header.macro_count = (uint32_t)re->macro_count;
+    header.pattern_count = (uint32_t)re->pattern_count;
+    header.has_dfa = !re->dfa->is_lazy;
+    header.has_literals = (re->literals != NULL);
+    _db_put(&writer, &header, sizeof(header));
+
+    for (i=0; i<re->macro_count; i++) {
+        dbmacro_t macro;
+
+        macro.name_length = (uint32_t)strlen(re->macros[i].name);
+        macro.value_length = (uint32_t)strlen(re->macros[i].value);
+        _db_put(&writer, &macro, sizeof(macro));
+        _db_put(&writer, re->macros[i].name, macro.name_length);
+        _db_put(&writer, re->macros[i].value, macro.value_length);
+    }
+
+    for (i=0; i<re->pattern_count; i++) {
+        dbpattern_t pattern;
+
+        pattern.id = re->patterns[i].id;
+        pattern.flags = re->patterns[i].flags;
+        pattern.length = (uint32_t)strlen(re->patterns[i].source);
+        _db_put(&writer, &pattern, sizeof(pattern));
+        _db_put(&writer, re->patterns[i].source, pattern.length);
+    }
+
+    if (header.has_dfa) {
+        const dfa_t *dfa = re->dfa;
+        dbdfa_t table;
+
+        memset(&table, 0, sizeof(table));
+        table.state_count = dfa->state_count;
+        table.built_count = dfa->built_count;
+        table.class_count = dfa->class_count;
+        table.start = dfa->start;
+        table.start_begin = dfa->start_begin;
+        memcpy(table.byte_class, dfa->byte_class, sizeof(table.byte_class));
+        memcpy(table.class_byte, dfa->class_byte, sizeof(table.class_byte));
+        _db_put(&writer, &table, sizeof(table));
+        _db_put(&writer, dfa->trans, (size_t)dfa->state_count * dfa->class_count * sizeof(dfa->trans[0]));
+        _db_put(&writer, dfa->accept, dfa->state_count * sizeof(dfa->accept[0]));
+        _db_put(&writer, dfa->accept_eof, dfa->state_count * sizeof(dfa->accept_eof[0]));
+    }
+
+    if (header.has_literals) {
+        dbliterals_t literals;
+
+        memset(&literals, 0, sizeof(literals));
+        literals.cell_count = re->literals->cell_count;
+        literals.max_length = re->literals->max_length;
+        literals.dense_count = re->literals->dense_count;
+        literals.class_count = re->literals->class_count;
+        memcpy(literals.byte_class, re->literals->byte_class, sizeof(literals.byte_class));
+        _db_put(&writer, &literals, sizeof(literals));
+        _db_put(&writer, re->literals->cells, literals.cell_count * sizeof(re->literals->cells[0]));
+        _db_put(&writer, re->literals->fails, literals.cell_count * sizeof(re->literals->fails[0]));
+        _db_put(&writer, re->literals->infos, literals.cell_count * sizeof(re->literals->infos[0]));
+        _db_put(&writer, re->literals->dense, (size_t)literals.dense_count * literals.class_count * sizeof(re->literals->dense[0]));
+    }
+
+    out = (dbheader_t *)writer.data;
+    out->size = writer.length;
+    out->checksum = _db_checksum(writer.data + sizeof(header), writer.length - sizeof(header));
+    *r_data = writer.data;
+    *r_length = writer.length;
+    return 0;
+}
+
+/**
+ * Reads the DFA, whose tables stay where they are. Every state number
+ * is checked, so a bad file can't make matching go astray.
+ * @return the DFA, or NULL if it's not valid
+ */
+static dfa_t *_db_get_dfa(dbreader_t *reader, size_t pattern_count) {
+    const dbdfa_t *table = _db_get(reader, sizeof(*table));
+    const unsigned *trans;
+    const unsigned *accept;
+    const unsigned *accept_eof;
+    size_t count;
+    dfa_t *dfa;
+    size_t i;
+
+    if (table == NULL || table->class_count == 0 || table->class_count > 256
+        || table->state_count == 0 || table->state_count > DFA_STATE_MAX
+        || table->start >= table->state_count || table->start_begin >= table->state_count)
+        return NULL;
+    count = (size_t)table->state_count * table->class_count;
+    trans = _db_get(reader, count * sizeof(trans[0]));
+    accept = _db_get(reader, table->state_count * sizeof(accept[0]));
+    accept_eof = _db_get(reader, table->state_count * sizeof(accept_eof[0]));
+    if (trans == NULL || accept == NULL || accept_eof == NULL)
+        return NULL;
+    for (i=0; i<count; i++) {
+        if (trans[i] >= table->state_count)
+            return NULL;
+    }
+    for (i=0; i<table->state_count; i++) {
+        if (accept[i] > pattern_count || accept_eof[i] > pattern_count)
+            return NULL;
+    }
+    for (i=0; i<256; i++) {
+        if (table->byte_class[i] >= table->class_count)
+            return NULL;
+    }
+
+    dfa = malloc(sizeof(*dfa));
+    if (dfa == NULL)
+        abort();
+    memset(dfa, 0, sizeof(*dfa));
+    dfa->is_borrowed = true;
+    dfa->trans = (unsigned *)trans;
+    dfa->accept = (unsigned *)accept;
+    dfa->accept_eof = (unsigned *)accept_eof;
+    dfa->state_count = table->state_count;
+    dfa->state_max = table->state_count;
+    dfa->built_count = table->built_count;
+    dfa->class_count = table->class_count;
+    dfa->start = table->start;
+    dfa->start_begin = table->start_begin;
+    dfa->kind = DFA_LONGEST;
+    memcpy(dfa->byte_class, table->byte_class, sizeof(dfa->byte_class));
+    memcpy(dfa->class_byte, table->class_byte, sizeof(dfa->class_byte));
+    return dfa;
+}
+
+/**
+ * Reads the Aho-Corasick automaton, whose tables stay where they are,
+ * after checking that all the links between the states are in bounds.
+ * @return the automaton, or NULL if it's not valid
+ */
+static literals_t *_db_get_literals(dbreader_t *reader, size_t pattern_count) {
+    const dbliterals_t *header = _db_get(reader, sizeof(*header));
+    const literalcell_t *cells;
+    const unsigned *fails;
+    const literalinfo_t *infos;
+    const unsigned short *dense;
+    literals_t *literals;
+    size_t i;
+
+    if (header == NULL || header->cell_count == 0 || header->cell_count > LITERALS_PARENT
+        || header->class_count == 0 || header->class_count > 256
+        || header->dense_count == 0 || header->dense_count > header->cell_count
+        || header->dense_count > LITERALS_ESCAPE)
+        return NULL;
+    cells = _db_get(reader, header->cell_count * sizeof(cells[0]));
+    fails = _db_get(reader, header->cell_count * sizeof(fails[0]));
+    infos = _db_get(reader, header->cell_count * sizeof(infos[0]));
+    dense = _db_get(reader, (size_t)header->dense_count * header->class_count * sizeof(dense[0]));
+    if (cells == NULL || fails == NULL || infos == NULL || dense == NULL)
+        return NULL;
+    for (i=0; i<256; i++) {
+        if (header->byte_class[i] >= header->class_count)
+            return NULL;
+    }
+    for (i=0; i<header->cell_count; i++) {
+        const literalinfo_t *info = &infos[i];
+        unsigned parent = cells[i].check & LITERALS_PARENT;
+
+        if (cells[i].check == NFA_NONE)
+            continue;
+        if (parent >= header->cell_count || cells[parent].check == NFA_NONE
+            || fails[i] >= header->cell_count || cells[fails[i]].check == NFA_NONE
+            || info->match > pattern_count)
+            return NULL;
+        if (info->output == NFA_NONE ? (cells[i].check & LITERALS_OUTPUT) != 0
+            : (cells[i].check & LITERALS_OUTPUT) == 0 || info->output >= header->cell_count
+            || cells[info->output].check == NFA_NONE || infos[info->output].match == 0)
+            return NULL;
+
+        /* Each state is one byte deeper than its parent (the root, cell 0,
+         * is its own), and its failure and output states are suffixes,
+         * so shallower. Otherwise a match could seem to start before the
+         * search did, or following the failure links might not end. */
+        if (i == 0 ? (cells[i].check != 0 || info->depth != 0) : info->depth != infos[parent].depth + 1)
+            return NULL;
+        if (info->depth > header->max_length)
+            return NULL;
+        if (i != 0 && infos[fails[i]].depth >= info->depth)
+            return NULL;
+        if (info->output != NFA_NONE && infos[info->output].depth > info->depth)
+            return NULL;
+    }
+
+    /* The dense transitions go at most one byte deeper too */
+    for (i=0; i<(size_t)header->dense_count * header->class_count; i++) {
+        size_t state = i / header->class_count;
+
+        if (dense[i] == LITERALS_ESCAPE)
+            continue;
+        if (dense[i] >= header->dense_count || cells[dense[i]].check == NFA_NONE)
+            return NULL;
+        if (cells[state].check != NFA_NONE && infos[dense[i]].depth > infos[state].depth + 1)
+            return NULL;
+    }
+
+    literals = malloc(sizeof(*literals));
+    if (literals == NULL)
+        abort();
+    memset(literals, 0, sizeof(*literals));
+    literals->cells = (literalcell_t *)cells;
+    literals->fails = (unsigned *)fails;
+    literals->infos = (literalinfo_t *)infos;
+    literals->dense = (unsigned short *)dense;
+    literals->cell_count = header->cell_count;
+    literals->dense_count = header->dense_count;
+    literals->class_count = header->class_count;
+    literals->max_length = header->max_length;
+    memcpy(literals->byte_class, header->byte_class, sizeof(literals->byte_class));
+    literals->is_borrowed = true;
+    return literals;
+}
+
+regexx_t *regexx_deserialize(const void *data, size_t length) {
+    const dbheader_t *header = data;
+    dbreader_t reader;
+    regexx_t *re;
+    dfa_t *dfa = NULL;
+    literals_t *literals = NULL;
+    size_t i;
+
+    /* The tables are used in place, so they have to be aligned */
+    if (data == NULL || ((uintptr_t)data & 7) != 0 || length < sizeof(*header))
+        return NULL;
+    if (memcmp(header->magic, DB_MAGIC, sizeof(header->magic)) != 0
+        || header->version != DB_VERSION || header->byte_order != DB_BYTE_ORDER
+        || header->size < sizeof(*header) || header->size > length)
+        return NULL;
+    reader.data = data;
+    reader.length = (size_t)header->size;
+    reader.offset = sizeof(*header);
+    if (_db_checksum(reader.data + reader.offset, reader.length - reader.offset) != header->checksum)
+        return NULL;
+
+    re = regexx_create(header->flags);
+
+    for (i=0; i<header->macro_count; i++) {
+        const dbmacro_t *macro = _db_get(&reader, sizeof(*macro));
+        const char *name;
+        const char *value;
+        char *name2;
+        char *value2;
+        int err;
+
+        if (macro == NULL)
+            goto fail;
+        name = _db_get(&reader, macro->name_length);
+        value = _db_get(&reader, macro->value_length);
+        if (name == NULL || value == NULL)
+            goto fail;
+        name2 = malloc(macro->name_length + 1);
+        value2 = malloc(macro->value_length + 1);
+        if (name2 == NULL || value2 == NULL)
+            abort();
+        memcpy(name2, name, macro->name_length);
+        name2[macro->name_length] = '\0';
+        memcpy(value2, value, macro->value_length);
+        value2[macro->value_length] = '\0';
+        err = regexx_add_macro(re, name2, value2);
+        free(name2);
+        free(value2);
+        if (err)
+            goto fail;
+    }
+
+    for (i=0; i<header->pattern_count; i++) {
+        const dbpattern_t *pattern = _db_get(&reader, sizeof(*pattern));
+        const char *source;
+        char *source2;
+        int err;
+
+        if (pattern == NULL)
+            goto fail;
+        source = _db_get(&reader, pattern->length);
+        if (source == NULL)
+            goto fail;
+        source2 = malloc(pattern->length + 1);
+        if (source2 == NULL)
+            abort();
+        memcpy(source2, source, pattern->length);
+        source2[pattern->length] = '\0';
+        err = regexx_add_pattern(re, source2, (size_t)pattern->id, pattern->flags);
+        free(source2);
+        if (err)
+            goto fail;
+    }
+
+    if (header->has_dfa) {
+        dfa = _db_get_dfa(&reader, re->pattern_count);
+        if (dfa == NULL)
+            goto fail;
+    }
+    if (header->has_literals) {
+        literals = _db_get_literals(&reader, re->pattern_count);
+        if (literals == NULL)
+            goto fail;
+    }
+    if (_compile(re, dfa, literals) != 0)
+        goto fail_compiled;
+    return re;
+
+fail:
+    _dfa_free(dfa);
+    _literals_free(literals);
+fail_compiled:
+    regexx_free(re);
+    return NULL;
+}
+
+/****************************************************************************
+ * Code generation
+ *
+ * `regexx_generate()` writes the DFA of a set of patterns as C source for
+ * a standalone scanner, like `flex` or `re2c` do, so a program with a
+ * fixed set of patterns needs neither this library nor any time to
+ * compile them when it starts. The DFA is either tables, or a state
+ * machine of `switch` and `goto`, which the C compiler can optimize.
+ ****************************************************************************/
+
+/** Writes the numbers in an array initializer, 16 to a line */
+static void _gen_numbers(FILE *fp, const unsigned *numbers, size_t count) {
+    size_t i;
+
+    for (i=0; i<count; i++) {
+        if (i % 16 == 0)
+            fprintf(fp, "    ");
+        fprintf(fp, "%u,", numbers[i]);
+        fprintf(fp, (i % 16 == 15 || i + 1 == count) ? "\n" : " ");
+    }
+}
+
+/** The scanner as tables, run by a loop like `_dfa_longest()` */
+static void _gen_tables(FILE *fp, const dfa_t *dfa, const char *prefix) {
+    const char *type;
+    unsigned *numbers;
+    unsigned state;
+    size_t i;
+
+    if (dfa->state_count <= 256)
+        type = "unsigned char";
+    else if (dfa->state_count <= 65536)
+        type = "unsigned short";
+    else
+        type = "unsigned";
+
+    numbers = malloc(256 * sizeof(numbers[0]));
+    if (numbers == NULL)
+        abort();
+    for (i=0; i<256; i++)
+        numbers[i] = dfa->byte_class[i];
+    fprintf(fp, "static const unsigned char %s_classes[256] = {\n", prefix);
+    _gen_numbers(fp, numbers, 256);
+    fprintf(fp, "};\n\n");
+    free(numbers);
+
+    fprintf(fp, "static const %s %s_trans[%u][%u] = {\n", type, prefix, dfa->state_count, dfa->class_count);
+    for (state=0; state<dfa->state_count; state++) {
+        fprintf(fp, "  {\n");
+        _gen_numbers(fp, dfa->trans + (size_t)state * dfa->class_count, dfa->class_count);
+        fprintf(fp, "  },\n");
+    }
+    fprintf(fp, "};\n\n");
+
+    fprintf(fp, "static const unsigned %s_accept[%u] = {\n", prefix, dfa->state_count);
+    _gen_numbers(fp, dfa->accept, dfa->state_count);
+    fprintf(fp, "};\n\n");
+    fprintf(fp, "static const unsigned %s_accept_eof[%u] = {\n", prefix, dfa->state_count);
+    _gen_numbers(fp, dfa->accept_eof, dfa->state_count);
+    fprintf(fp, "};\n\n");
+
+    fprintf(fp,
+        "size_t %s_scan(const char *text, size_t offset, size_t length, size_t *r_length) {\n"
+        "    const unsigned char *s = (const unsigned char *)text;\n"
+        "    unsigned state = (offset == 0) ? %u : %u;\n"
+        "    unsigned accept = 0;\n"
+        "    size_t end = 0;\n"
+        "    size_t i;\n"
+        "\n"
+        "    for (i=offset; i<length && state; i++) {\n"
+        "        state = %s_trans[state][%s_classes[s[i]]];\n"
+        "        if (%s_accept[state]) {\n"
+        "            accept = %s_accept[state];\n"
+        "            end = i + 1;\n"
+        "        }\n"
+        "    }\n"
+        "    if (i == length && state && %s_accept_eof[state] && i > offset) {\n"
+        "        accept = %s_accept_eof[state];\n"
+        "        end = i;\n"
+        "    }\n"
+        "    if (accept == 0)\n"
+        "        return (size_t)-1;\n"
+        "    *r_length = end - offset;\n"
+        "    return %s_ids[accept - 1];\n"
+        "}\n",
+        prefix, dfa->start_begin, dfa->start, prefix, prefix, prefix, prefix,
+        prefix, prefix, prefix);
+}
+
+/**
+ * The scanner as a state machine, with a label for each state and a
+ * `switch` on the class of the next byte for its transitions.
+ */
+static void _gen_switch(FILE *fp, const dfa_t *dfa, const char *prefix) {
+    unsigned *numbers;
+    unsigned state;
+    size_t i;
+
+    numbers = malloc(256 * sizeof(numbers[0]));
+    if (numbers == NULL)
+        abort();
+    for (i=0; i<256; i++)
+        numbers[i] = dfa->byte_class[i];
+    fprintf(fp, "static const unsigned char %s_classes[256] = {\n", prefix);
+    _gen_numbers(fp, numbers, 256);
+    fprintf(fp, "};\n\n");
+    free(numbers);
+
+    fprintf(fp,
+        "size_t %s_scan(const char *text, size_t offset, size_t length, size_t *r_length) {\n"
+        "    const unsigned char *s = (const unsigned char *)text;\n"
+        "    unsigned accept = 0;\n"
+        "    size_t end = 0;\n"
+        "    size_t i = offset;\n"
+        "\n"
+        "    if (offset == 0)\n",
+        prefix);
+    if (dfa->start_begin)
+        fprintf(fp, "        goto s%u;\n", dfa->start_begin);
+    else
+        fprintf(fp, "        goto done;\n");
+    if (dfa->start)
+        fprintf(fp, "    goto s%u;\n", dfa->start);
+    else
+        fprintf(fp, "    goto done;\n");
+
+    /* The dead state is the `default` of every switch */
+    for (state=1; state<dfa->state_count; state++) {
+        const unsigned *trans = dfa->trans + (size_t)state * dfa->class_count;
+        unsigned k;
+
+        fprintf(fp, "s%u:\n", state);
+        if (dfa->accept[state]) {
+            /* The start states haven't matched anything yet when the
+             * scan begins in them */
+            if (state == dfa->start || state == dfa->start_begin)
+                fprintf(fp, "    if (i > offset) {\n        accept = %u;\n        end = i;\n    }\n", dfa->accept[state]);
+            else
+                fprintf(fp, "    accept = %u;\n    end = i;\n", dfa->accept[state]);
+        }
+        fprintf(fp, "    if (i == length) {\n");
+        if (dfa->accept_eof[state])
+            fprintf(fp, "        if (i > offset) {\n            accept = %u;\n            end = i;\n        }\n", dfa->accept_eof[state]);
+        fprintf(fp, "        goto done;\n    }\n");
+        fprintf(fp, "    switch (%s_classes[s[i++]]) {\n", prefix);
+
+        /* A case for each class, grouped by where they go */
+        for (k=0; k<dfa->class_count; k++) {
+            unsigned k2;
+
+            if (trans[k] == 0)
+                continue;
+            for (k2=0; k2<k; k2++) {
+                if (trans[k2] == trans[k])
+                    break;
+            }
+            if (k2 < k)
+                continue; /* already done */
+            for (k2=k; k2<dfa->class_count; k2++) {
+                if (trans[k2] == trans[k])
+                    fprintf(fp, "    case %u:\n", k2);
+            }
+            fprintf(fp, "        goto s%u;\n", trans[k]);
+        }
+        fprintf(fp, "    default:\n        goto done;\n    }\n");
+    }
+    fprintf(fp,
+        "done:\n"
+        "    if (accept == 0)\n"
+        "        return (size_t)-1;\n"
+        "    *r_length = end - offset;\n"
+        "    return %s_ids[accept - 1];\n"
+        "}\n",
+        prefix);
+}
+
+int regexx_generate(regexx_t *re, FILE *fp, const char *prefix, unsigned flags) {
+    unsigned *starts;
+    unsigned *ids;
+    size_t start_count = 0;
+    dfa_t *dfa;
+    size_t i;
+
+    if (re == NULL || fp == NULL || prefix == NULL)
+        return -1;
+    if (re->pattern_count == 0) {
+        _error_msg(re, "no patterns");
+        return -1;
+    }
+
+    /* Every pattern has to be in the DFA, including plain strings, which
+     * otherwise go to the Aho-Corasick automaton instead */
+    starts = malloc(re->pattern_count * sizeof(starts[0]));
+    if (starts == NULL)
+        abort();
+    for (i=0; i<re->pattern_count; i++) {
+        if (re->patterns[i].is_residual) {
+            _error_msg(re, "pattern %u can't be put in a DFA (lazy quantifier or lookahead)", (unsigned)i);
+            free(starts);
+            return -1;
+        }
+        starts[start_count++] = re->patterns[i].start;
+    }
+    dfa = _dfa_create(&re->prog, starts, start_count, DFA_STATE_MAX, DFA_LONGEST);
+    free(starts);
+    if (_dfa_build(dfa, &re->prog) != 0) {
+        _dfa_free(dfa);
+        _error_msg(re, "DFA too large (more than %u states)", (unsigned)DFA_STATE_MAX);
+        return -1;
+    }
+    _dfa_minimize(dfa);
+
+    fprintf(fp,
+        "/* Generated by regexx_generate() from %u patterns into a DFA of %u\n"
+        " * states; don't edit */\n"
+        "#include <stddef.h>\n"
+        "\n",
+        (unsigned)re->pattern_count, dfa->state_count);
+    for (i=0; i<re->pattern_count; i++) {
+        const char *source = re->patterns[i].source;
+        fprintf(fp, "/* %u: ", (unsigned)re->patterns[i].id);
+        for (; source && *source; source++) {
+            /* so the pattern can't end the comment */
+            fputc(*source, fp);
+            if (*source == '*' && source[1] == '/')
+                fputc(' ', fp);
+        }
+        fprintf(fp, " */\n");
+    }
+    fprintf(fp, "\n");
+
+    ids = malloc(re->pattern_count * sizeof(ids[0]));
+    if (ids == NULL)
+        abort();
+    for (i=0; i<re->pattern_count; i++)
+        ids[i] = (unsigned)re->patterns[i].id;
+    fprintf(fp, "static const size_t %s_ids[%u] = {\n", prefix, (unsigned)re->pattern_count);
+    _gen_numbers(fp, ids, re->pattern_count);
+    fprintf(fp, "};\n\n");
+    free(ids);
+
+    if (flags & REGEXX_GEN_SWITCH)
+        _gen_switch(fp, dfa, prefix);
+    else
+        _gen_tables(fp, dfa, prefix);
+    _dfa_free(dfa);
+
+    if (ferror(fp)) {
+        _error_msg(re, "write: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/****************************************************************************
+ * Streams
+ *
+ * `regexx_stream_open()` scans input that arrives in chunks, carrying the
+ * state of the search from one chunk to the next. This uses the Pike VM
+ * rather than the DFA, because its threads know where their matches
+ * started, which the DFA only finds by scanning backwards from the end,
+ * over input that may be chunks ago. Positions are counted from the
+ * start of the stream.
+ *
+ * After a match, the search starts again where it ended, but we only know
+ * the match is the longest once every thread that could extend it dies,
+ * which may be further on. So the bytes after a match that's waiting to
+ * be reported are kept, to be scanned again once it is.
+ ****************************************************************************/
+
+/** The threads of a stream, like `threadlist_t` but with positions in
+ * the stream, which can go past what a `size_t` holds */
+typedef struct streamlist_t {
+    sparseset_t pcs;
+    uint64_t *starts;
+} streamlist_t;
+
+struct regexxstream_t {
+    regexx_t *re;
+    regexx_match_fn on_match;
+    void *ctx;
+    unsigned prog_size;     /* to notice patterns added since opening */
+
+    streamlist_t lists[2];
+    streamlist_t *clist;
+    streamlist_t *nlist;
+    unsigned *stack;
+
+    /* The threads that start a match of any pattern: everything the
+     * starts of the patterns reach through epsilons, in priority order,
+     * at the start of the stream ([0], where '^' holds) and after it */
+    unsigned *seeds[2];
+    unsigned seed_counts[2];
+
+    /* The bytes that can begin a match, to skip the rest quickly */
+    charclass_t first;
+
+    /* The position of the next byte to scan */
+    uint64_t pos;
+
+    /* The best match so far, waiting for the threads that might
+     * make it longer (or start it sooner) */
+    bool is_matched;
+    uint64_t match_start;
+    uint64_t match_end;
+    unsigned match_index;
+
+    /* The input since `buf_base` that may need to be scanned again */
+    unsigned char *buf;
+    size_t buf_length;
+    size_t buf_max;
+    uint64_t buf_base;
+
+    /* What `on_match` returned to stop the stream, or 0 */
+    int result;
+};
+
+/**
+ * Adds a thread at `pc` and what it reaches through epsilons, like
+ * `_pike_addthread()`. Where the input ends is only known when the stream
+ * is closed, so '$' only holds then, with `is_end`.
+ */
+static void _stream_addthread(regexxstream_t *stream, streamlist_t *list, unsigned pc, uint64_t pos, uint64_t start, bool is_end) {
+    const nfainst_t *insts = stream->re->prog.insts;
+    unsigned *stack = stream->stack;
+    size_t count = 0;
+
+    stack[count++] = pc;
+    while (count) {
+        const nfainst_t *inst;
+
+        pc = stack[--count];
+        if (pc == NFA_NONE || _sparseset_contains(&list->pcs, pc))
+            continue;
+        _sparseset_add(&list->pcs, pc);
+        list->starts[pc] = start;
+
+        inst = &insts[pc];
+        switch (inst->op) {
+        case OP_SPLIT:
+            stack[count++] = inst->out1;
+            stack[count++] = inst->out;
+            break;
+        case OP_BEGIN:
+            if (pos == 0)
+                stack[count++] = inst->out;
+            break;
+        case OP_END:
+            if (is_end)
+                stack[count++] = inst->out;
+            break;
+        default:
+            /* Patterns with lookahead can't be opened in a stream,
+             * so OP_LOOK doesn't happen */
+            break;
+        }
+    }
+}
+
+/** Notes a thread reaching the end of a pattern at `pos` */
+static void _stream_matched(regexxstream_t *stream, const nfainst_t *inst, uint64_t start, uint64_t pos) {
+    if (pos == start)
+        return; /* empty matches aren't reported */
+    if (stream->is_matched && start == stream->match_start && pos <= stream->match_end)
+        return; /* a pattern added earlier matched the same */
+    stream->is_matched = true;
+    stream->match_start = start;
+    stream->match_end = pos;
+    stream->match_index = inst->arg;
+}
+
+/**
+ * Moves the threads forward over the byte `c` at `stream->pos`.
+ * @return true if there's a match, and nothing left that can change it
+ */
+static bool _stream_step(regexxstream_t *stream, unsigned c) {
+    const nfainst_t *insts = stream->re->prog.insts;
+    const charclass_t *classes = stream->re->prog.classes;
+    streamlist_t *clist = stream->clist;
+    streamlist_t *nlist = stream->nlist;
+    uint64_t pos = stream->pos;
+    size_t i;
+
+    /* New threads, with the lowest priority, unless there's a match,
+     * which anything starting later can't beat */
+    if (!stream->is_matched) {
+        unsigned which = (pos != 0);
+        const unsigned *seeds = stream->seeds[which];
+
+        for (i=0; i<stream->seed_counts[which]; i++) {
+            if (!_sparseset_contains(&clist->pcs, seeds[i])) {
+                _sparseset_add(&clist->pcs, seeds[i]);
+                clist->starts[seeds[i]] = pos;
             }
+        }
+    }
+
+    nlist->pcs.count = 0;
+    for (i=0; i<clist->pcs.count; i++) {
+        unsigned pc = clist->pcs.dense[i];
+        uint64_t start = clist->starts[pc];
+        const nfainst_t *inst = &insts[pc];
+
+        /* Threads are in order of their start */
+        if (stream->is_matched && start > stream->match_start)
             break;
-        case T_ALTERNATION:
-            _node_print(node->alternation.child, buf);
-            _appendf(buf, "|");
+
+        switch (inst->op) {
+        case OP_BYTE:
+            if (inst->arg == c)
+                _stream_addthread(stream, nlist, inst->out, pos + 1, start, false);
             break;
-        case T_GROUP:
-            _appendf(buf, "(");
-            _node_print(node->group.child, buf);
-            _appendf(buf, ")");
+        case OP_CLASS:
+            if (_charclass_match_char(&classes[inst->arg], c))
+                _stream_addthread(stream, nlist, inst->out, pos + 1, start, false);
             break;
-        case T_STRING:
-            _node_print_chars(node->string.chars, node->string.length, buf);
+        case OP_MATCH:
+            _stream_matched(stream, inst, start, pos);
             break;
-        case T_CHARCLASS:
-            if (_charclass_is_equal(node->charclass, _whitespace))
-                _appendf(buf, "\\s");
-            else if (_charclass_is_equal(node->charclass, _invert(_whitespace)))
-                _appendf(buf, "\\S");
-            else if (_charclass_is_equal(node->charclass, _word))
-                _appendf(buf, "\\w");
-            else if (_charclass_is_equal(node->charclass, _invert(_word)))
-                _appendf(buf, "\\W");
-            else if (_charclass_is_equal(node->charclass, _digits))
-                _appendf(buf, "\\d");
-            else if (_charclass_is_equal(node->charclass, _invert(_digits)))
-                _appendf(buf, "\\D");
-            else if (_charclass_is_equal(node->charclass, _dot_all))
-                _appendf(buf, "[\\s\\S]");
-            else {
-                char normal[1024];
-                char inverted[1024];
-                _charclass_print(node->charclass, normal, sizeof(normal));
-                _charclass_print(_invert(node->charclass), inverted, sizeof(inverted));
-                if (strlen(normal) < strlen(inverted)) {
-                    _appendf(buf, "[%s]", normal);
-                } else {
-                    _appendf(buf, "[^%s]", inverted);
+        default:
+            break;
+        }
+    }
+
+    stream->clist = nlist;
+    stream->nlist = clist;
+    stream->pos = pos + 1;
+    return stream->is_matched && nlist->pcs.count == 0;
+}
+
+/**
+ * At the end of the stream, follows the threads waiting on '$', and
+ * takes any matches that end there.
+ * @return true if there's a match
+ */
+static bool _stream_end(regexxstream_t *stream) {
+    const nfainst_t *insts = stream->re->prog.insts;
+    streamlist_t *clist = stream->clist;
+    streamlist_t *nlist = stream->nlist;
+    size_t i;
+
+    /* Everything stays in the same order, with what '$' leads to
+     * in place of the '$' */
+    nlist->pcs.count = 0;
+    for (i=0; i<clist->pcs.count; i++) {
+        unsigned pc = clist->pcs.dense[i];
+        uint64_t start = clist->starts[pc];
+
+        if (insts[pc].op == OP_END)
+            _stream_addthread(stream, nlist, insts[pc].out, stream->pos, start, true);
+        else if (!_sparseset_contains(&nlist->pcs, pc)) {
+            _sparseset_add(&nlist->pcs, pc);
+            nlist->starts[pc] = start;
+        }
+    }
+
+    for (i=0; i<nlist->pcs.count; i++) {
+        unsigned pc = nlist->pcs.dense[i];
+        uint64_t start = nlist->starts[pc];
+
+        if (stream->is_matched && start > stream->match_start)
+            break;
+        if (insts[pc].op == OP_MATCH)
+            _stream_matched(stream, &insts[pc], start, stream->pos);
+    }
+    clist->pcs.count = 0;
+    nlist->pcs.count = 0;
+    return stream->is_matched;
+}
+
+/**
+ * Reports the match, and goes back to where it ended, to search again
+ * from there.
+ * @return what `on_match` returned
+ */
+static int _stream_report(regexxstream_t *stream) {
+    size_t index = stream->match_index;
+
+    stream->is_matched = false;
+    stream->clist->pcs.count = 0;
+    stream->pos = stream->match_end;
+    stream->result = stream->on_match(stream->ctx, stream->re->patterns[index].id,
+            stream->match_start, stream->match_end - stream->match_start);
+    return stream->result;
+}
+
+/**
+ * Scans from `stream->pos` to the end of `text`, which holds the stream
+ * from `base`, including everything since the end of the match waiting
+ * to be reported (if any), which the scan may go back to.
+ * @return 0, or what `on_match` returned to stop
+ */
+static int _stream_run(regexxstream_t *stream, const unsigned char *text, uint64_t base, size_t length, bool is_end) {
+    uint64_t end = base + length;
+
+    for (;;) {
+        while (stream->pos < end) {
+            unsigned c = text[stream->pos - base];
+
+            /* With no threads, skip to where a match can start */
+            if (stream->clist->pcs.count == 0 && !stream->is_matched
+                    && !_charclass_match_char(&stream->first, c)) {
+                stream->pos++;
+                continue;
+            }
+            if (_stream_step(stream, c) && _stream_report(stream))
+                return stream->result;
+        }
+        if (!is_end || !_stream_end(stream))
+            return 0;
+        if (_stream_report(stream))
+            return stream->result;
+    }
+}
+
+regexxstream_t *regexx_stream_open(regexx_t *re, regexx_match_fn on_match, void *ctx) {
+    regexxstream_t *stream;
+    unsigned count;
+    size_t i;
+    unsigned j;
+
+    if (re == NULL || on_match == NULL)
+        return NULL;
+    if (re->pattern_count == 0) {
+        _error_msg(re, "no patterns");
+        return NULL;
+    }
+    for (i=0; i<re->pattern_count; i++) {
+        if (re->patterns[i].is_residual) {
+            _error_msg(re, "pattern %u can't be matched in a stream (lazy quantifier or lookahead)", (unsigned)i);
+            return NULL;
+        }
+    }
+
+    stream = calloc(1, sizeof(*stream));
+    if (stream == NULL)
+        abort();
+    stream->re = re;
+    stream->on_match = on_match;
+    stream->ctx = ctx;
+    count = re->prog.count;
+    stream->prog_size = count;
+    for (j=0; j<2; j++) {
+        _sparseset_init(&stream->lists[j].pcs, count);
+        stream->lists[j].starts = malloc((count + 1) * sizeof(stream->lists[j].starts[0]));
+        if (stream->lists[j].starts == NULL)
+            abort();
+    }
+    stream->clist = &stream->lists[0];
+    stream->nlist = &stream->lists[1];
+    stream->stack = malloc((count * 2 + 1) * sizeof(stream->stack[0]));
+    if (stream->stack == NULL)
+        abort();
+
+    /* The seeds are the same at every position after the first, so
+     * they're worked out once here, in the order the patterns were added */
+    for (j=0; j<2; j++) {
+        streamlist_t *list = &stream->lists[0];
+
+        list->pcs.count = 0;
+        for (i=0; i<re->pattern_count; i++)
+            _stream_addthread(stream, list, re->patterns[i].start, j, j, false);
+        stream->seeds[j] = malloc((list->pcs.count + 1) * sizeof(stream->seeds[j][0]));
+        if (stream->seeds[j] == NULL)
+            abort();
+        memcpy(stream->seeds[j], list->pcs.dense, list->pcs.count * sizeof(stream->seeds[j][0]));
+        stream->seed_counts[j] = list->pcs.count;
+        list->pcs.count = 0;
+    }
+    for (i=0; i<re->pattern_count; i++)
+        _node_first(re->patterns[i].head, &stream->first);
+    return stream;
+}
+
+int regexx_stream_scan(regexxstream_t *stream, const void *chunk, size_t length) {
+    const unsigned char *text;
+    uint64_t base;
+    uint64_t keep_from;
+    size_t keep;
+
+    if (stream == NULL || (chunk == NULL && length))
+        return -1;
+    if (stream->result)
+        return stream->result;
+    if (stream->prog_size != stream->re->prog.count) {
+        _error_msg(stream->re, "patterns added while a stream is open");
+        return -1;
+    }
+
+    /* When nothing is kept from before, the chunk is scanned where it
+     * is, otherwise it's added to what's kept */
+    if (stream->buf_length) {
+        if (stream->buf_length + length > stream->buf_max) {
+            stream->buf_max = (stream->buf_length + length) * 2;
+            stream->buf = realloc(stream->buf, stream->buf_max);
+            if (stream->buf == NULL)
+                abort();
+        }
+        memcpy(stream->buf + stream->buf_length, chunk, length);
+        stream->buf_length += length;
+        text = stream->buf;
+        base = stream->buf_base;
+        length = stream->buf_length;
+    } else {
+        text = chunk;
+        base = stream->pos;
+    }
+
+    if (_stream_run(stream, text, base, length, false))
+        return stream->result;
+
+    /* Keep what may need scanning again */
+    keep_from = stream->is_matched ? stream->match_end : stream->pos;
+    keep = (size_t)(base + length - keep_from);
+    if (keep > stream->buf_max) {
+        stream->buf_max = keep * 2;
+        stream->buf = realloc(stream->buf, stream->buf_max);
+        if (stream->buf == NULL)
+            abort();
+    }
+    if (keep)
+        memmove(stream->buf, text + (keep_from - base), keep);
+    stream->buf_length = keep;
+    stream->buf_base = keep_from;
+    return 0;
+}
+
+int regexx_stream_close(regexxstream_t *stream) {
+    int result;
+    unsigned j;
+
+    if (stream == NULL)
+        return -1;
+    result = stream->result;
+    if (result == 0 && stream->prog_size != stream->re->prog.count) {
+        _error_msg(stream->re, "patterns added while a stream is open");
+        result = -1;
+    }
+    if (result == 0) {
+        if (stream->buf_length == 0)
+            stream->buf_base = stream->pos;
+        result = _stream_run(stream, stream->buf, stream->buf_base, stream->buf_length, true);
+    }
+
+    for (j=0; j<2; j++) {
+        _sparseset_free(&stream->lists[j].pcs);
+        free(stream->lists[j].starts);
+        free(stream->seeds[j]);
+    }
+    free(stream->stack);
+    free(stream->buf);
+    free(stream);
+    return result;
+}
+
+/****************************************************************************
+ * Parallel scanning
+ *
+ * `regexx_scan_parallel()` splits a large buffer into chunks, and threads
+ * find the matches starting in each chunk, each with its own scratch. A
+ * chunk's search reads past its end as far as the matches there need,
+ * and everything to the end of the buffer counts for '$' and lookahead,
+ * so the chunks only differ from one long search in where they start.
+ *
+ * Matches follow one another, each search starting where the last match
+ * ended, so a chunk has to guess that the search enters it at its start.
+ * When a match crosses into it, the guess is wrong, and the merge (back on
+ * the calling thread) searches again from where that match ends, until
+ * its matches meet up with the chunk's. They soon do, since the matches
+ * are short: patterns with no maximum length (like `a.*b`) could cross
+ * every chunk.
+ *
+ * When all the patterns are in the DFA, the chunks are instead searched
+ * speculatively, which works whatever the length of the matches. Each
+ * search is one pass of the leftmost DFA, so a chunk runs it from the
+ * start state at its first byte, stops at its last, and notes the DFA
+ * state every PARALLEL_CHECK_SPAN bytes. Whatever came before, the DFA
+ * soon forgets it, reaching the same states as the chunk's guess did, and
+ * from there on it does the same as the chunk's search. So the merge only
+ * follows the real search until its state is the same as the chunk's at
+ * one of those checkpoints, then skips ahead.
+ ****************************************************************************/
+
+/* Chunks are at least this big, and at least this many times the longest
+ * match, and each thread gets a few, so a slow one doesn't hold up
+ * the rest */
+#define PARALLEL_CHUNK_MIN      (256 * 1024)
+#define PARALLEL_CHUNK_SPAN     64
+#define PARALLEL_CHUNKS_PER_THREAD 4
+
+/* How often a speculative search notes its DFA state, as offsets that are
+ * multiples of this */
+#define PARALLEL_CHECK_SPAN     4096
+
+typedef struct parmatch_t {
+    size_t start;
+    size_t end;
+    size_t id;
+} parmatch_t;
+
+/** A search with the leftmost DFA, that has read up to `i` */
+typedef struct parrun_t {
+    size_t start;       /* where the search began */
+    size_t i;
+    unsigned state;
+    unsigned accept;    /* 1 + the pattern of the last match, or 0 */
+    size_t end;         /* where that match ends */
+} parrun_t;
+
+/** Speculative mode: one of a chunk's searches, and how it turned out */
+typedef struct parsearch_t {
+    size_t start;
+    size_t match;       /* the index its match would have in the chunk's */
+    unsigned accept;
+    size_t end;
+} parsearch_t;
+
+/** Speculative mode: the state of a chunk's search at a checkpoint, as a
+ * kernel of `kernel_count` in the chunk's `kernels` */
+typedef struct parcheck_t {
+    size_t offset;
+    size_t search;
+    size_t kernel;
+    size_t kernel_count;
+} parcheck_t;
+
+/** The matches starting within a chunk, as found by searching from its
+ * start */
+typedef struct parchunk_t {
+    size_t begin;
+    size_t end;
+    parmatch_t *matches;
+    size_t count;
+    size_t max;
+    bool is_stopped;    /* by `regexx_set_limits()` */
+
+    /* Speculative mode: the searches and checkpoints. The last search is
+     * either still going at the end of the chunk, in `open` (with its
+     * state at `open_kernel`), or the next would begin at `next`, or
+     * `is_done` if nothing more matches in the input. */
+    parsearch_t *searches;
+    size_t search_count;
+    size_t search_max;
+    parcheck_t *checks;
+    size_t check_count;
+    size_t check_max;
+    unsigned *kernels;
+    size_t kernel_count;
+    size_t kernel_max;
+    bool is_open;
+    parrun_t open;
+    size_t open_kernel;
+    size_t open_kernel_count;
+    size_t next;
+    bool is_done;
+} parchunk_t;
+
+#if defined(_WIN32)
+typedef DWORD (WINAPI *parworker_t)(LPVOID arg);
+#else
+typedef void *(*parworker_t)(void *arg);
+#endif
+
+typedef struct parscan_t {
+    const regexx_t *re;
+    const char *input;
+    size_t length;
+    parchunk_t *chunks;
+    size_t chunk_count;
+    long next_chunk;
+    bool is_speculative;
+} parscan_t;
+
+/**
+ * Finds the next (non-empty) match from `*offset`, starting before `end`,
+ * and moves `*offset` past it.
+ * @return 1 if found, 0 if not, -1 if stopped by the limits
+ */
+static int _parallel_next(const parscan_t *scan, regexx_scratch_t *sc, size_t *offset, size_t end, parmatch_t *match) {
+    while (*offset < end) {
+        size_t start;
+        size_t length;
+        size_t id;
+
+        id = _scratch_match(scan->re, sc, scan->input, *offset, scan->length, end - 1, &start, &length);
+        if (id == REGEXX_NOT_FINISHED)
+            return -1;
+        if (id == REGEXX_NOT_FOUND || start >= end)
+            return 0;
+        if (length == 0) {
+            /* nothing longer starts here */
+            *offset = start + 1;
+            continue;
+        }
+        match->start = start;
+        match->end = start + length;
+        match->id = id;
+        *offset = match->end;
+        return 1;
+    }
+    return 0;
+}
+
+/** Finds the matches in a chunk, as if the search entered it at its start */
+static void _parallel_chunk(const parscan_t *scan, regexx_scratch_t *sc, parchunk_t *chunk) {
+    size_t offset = chunk->begin;
+    parmatch_t match;
+    int found;
+
+    while ((found = _parallel_next(scan, sc, &offset, chunk->end, &match)) > 0) {
+        if (chunk->count >= chunk->max) {
+            chunk->max = chunk->max * 2 + 64;
+            chunk->matches = realloc(chunk->matches, chunk->max * sizeof(chunk->matches[0]));
+            if (chunk->matches == NULL)
+                abort();
+        }
+        chunk->matches[chunk->count++] = match;
+    }
+    chunk->is_stopped = (found < 0);
+}
+
+/** Makes sure a growing array has room for `count` items */
+static void *_parallel_reserve(void *list, size_t count, size_t *max, size_t size) {
+    if (count <= *max)
+        return list;
+    *max = count * 2 + 64;
+    list = realloc(list, *max * size);
+    if (list == NULL)
+        abort();
+    return list;
+}
+
+static void _parrun_begin(regexx_scratch_t *sc, parrun_t *run, size_t offset) {
+    run->start = offset;
+    run->i = offset;
+    run->state = (offset == 0) ? sc->search->start_begin : sc->search->start;
+    run->accept = 0;
+    run->end = 0;
+}
+
+/**
+ * Runs a search on until `stop`, or until the DFA dies, like the forward
+ * pass of `_dfa_search()`.
+ * @return false if stopped by the limits
+ */
+static bool _parrun_step(const regexx_t *re, regexx_scratch_t *sc, const unsigned char *text, size_t length, parrun_t *run, size_t stop) {
+    dfa_t *dfa = sc->search;
+    unsigned state = run->state;
+    size_t charged = run->i;
+    size_t i;
+
+    for (i=run->i; i<stop && state; i++) {
+        unsigned next;
+
+        if (i - charged >= BUDGET_INTERVAL) {
+            if (_budget_spend(&sc->budget, i - charged))
+                return false;
+            charged = i;
+        }
+        if (state == dfa->start && re->prefilter
+                && dfa->trans[(size_t)state * dfa->class_count + dfa->byte_class[text[i]]] == state) {
+            i = re->prefilter->next(re->prefilter, text, i, _prefilter_bound(re->prefilter, stop - 1, length));
+            if (i >= stop) {
+                i = stop;
+                break;
+            }
+        }
+        next = dfa->trans[(size_t)state * dfa->class_count + dfa->byte_class[text[i]]];
+        if (next == DFA_UNKNOWN)
+            next = _dfa_miss(dfa, &re->prog, &state, text[i]);
+        state = next;
+        if (dfa->accept[state]) {
+            run->accept = dfa->accept[state];
+            run->end = i + 1;
+        }
+    }
+    run->i = i;
+    run->state = state;
+    return !_budget_spend(&sc->budget, i - charged);
+}
+
+/**
+ * Finishes a search that has died or reached the end of the input,
+ * finding where its match starts.
+ * @return 1 if it matched, 0 if not, -1 if stopped by the limits
+ */
+static int _parrun_finish(const regexx_t *re, regexx_scratch_t *sc, const unsigned char *text, size_t length, parrun_t *run, parmatch_t *match) {
+    if (run->i == length && run->state && sc->search->accept_eof[run->state]) {
+        run->accept = sc->search->accept_eof[run->state];
+        run->end = length;
+    }
+    run->state = 0;
+    if (run->accept == 0)
+        return 0;
+    if (!_dfa_search_start(re, sc, text, run->start, run->end, length, &match->start))
+        return -1;
+    match->end = run->end;
+    match->id = re->patterns[run->accept - 1].id;
+    return 1;
+}
+
+/** Speculative mode: copies the kernel of a search's state to the chunk */
+static size_t _parallel_note(parchunk_t *chunk, regexx_scratch_t *sc, const parrun_t *run, size_t *r_count) {
+    size_t offset = chunk->kernel_count;
+    const unsigned *kernel = _dfa_set(sc->search, run->state, r_count);
+
+    chunk->kernels = _parallel_reserve(chunk->kernels, offset + *r_count, &chunk->kernel_max, sizeof(chunk->kernels[0]));
+    memcpy(chunk->kernels + offset, kernel, *r_count * sizeof(kernel[0]));
+    chunk->kernel_count += *r_count;
+    return offset;
+}
+
+/**
+ * Speculative mode: finds the matches in a chunk, as if a search began at
+ * its start, noting the state of the searches at the checkpoints. The
+ * search that's still going at the end of the chunk is left there.
+ */
+static void _parallel_speculate(const parscan_t *scan, regexx_scratch_t *sc, parchunk_t *chunk) {
+    const regexx_t *re = scan->re;
+    const unsigned char *text = (const unsigned char *)scan->input;
+    size_t offset = chunk->begin;
+
+    while (offset < chunk->end) {
+        parsearch_t *search;
+        parrun_t run;
+        parmatch_t match;
+        int found;
+
+        chunk->searches = _parallel_reserve(chunk->searches, chunk->search_count + 1, &chunk->search_max, sizeof(chunk->searches[0]));
+        search = &chunk->searches[chunk->search_count++];
+        search->start = offset;
+        search->match = chunk->count;
+
+        _scratch_begin(re, sc);
+        _parrun_begin(sc, &run, offset);
+        for (;;) {
+            size_t stop;
+
+            /* A search that gets back to a checkpoint after an earlier
+             * one has the same future from there, so either will do */
+            if ((run.i == chunk->begin || run.i % PARALLEL_CHECK_SPAN == 0)
+                    && (chunk->check_count == 0 || chunk->checks[chunk->check_count - 1].offset < run.i)) {
+                parcheck_t *check;
+
+                chunk->checks = _parallel_reserve(chunk->checks, chunk->check_count + 1, &chunk->check_max, sizeof(chunk->checks[0]));
+                check = &chunk->checks[chunk->check_count++];
+                check->offset = run.i;
+                check->search = chunk->search_count - 1;
+                check->kernel = _parallel_note(chunk, sc, &run, &check->kernel_count);
+            }
+
+            stop = (run.i / PARALLEL_CHECK_SPAN + 1) * PARALLEL_CHECK_SPAN;
+            if (stop > chunk->end)
+                stop = chunk->end;
+            if (!_parrun_step(re, sc, text, scan->length, &run, stop)) {
+                chunk->is_stopped = true;
+                return;
+            }
+            if (run.state == 0 || run.i == scan->length)
+                break;
+            if (run.i == chunk->end) {
+                chunk->is_open = true;
+                chunk->open = run;
+                chunk->open_kernel = _parallel_note(chunk, sc, &run, &chunk->open_kernel_count);
+                return;
+            }
+        }
+
+        found = _parrun_finish(re, sc, text, scan->length, &run, &match);
+        search->accept = run.accept;
+        search->end = run.end;
+        if (found < 0) {
+            chunk->is_stopped = true;
+            return;
+        }
+        if (found == 0) {
+            chunk->is_done = true;
+            return;
+        }
+        if (match.start == match.end) {
+            /* nothing longer starts here */
+            offset = match.start + 1;
+            continue;
+        }
+        chunk->matches = _parallel_reserve(chunk->matches, chunk->count + 1, &chunk->max, sizeof(chunk->matches[0]));
+        chunk->matches[chunk->count++] = match;
+        offset = match.end;
+    }
+    chunk->next = offset;
+}
+
+/** A thread, taking the next chunk until there are none left */
+#if defined(_WIN32)
+static DWORD WINAPI _parallel_worker(LPVOID arg) {
+#else
+static void *_parallel_worker(void *arg) {
+#endif
+    parscan_t *scan = (parscan_t *)arg;
+    regexx_scratch_t *sc = regexx_scratch_create(scan->re);
+
+    for (;;) {
+        long index = ATOMIC_ADD(&scan->next_chunk, 1);
+        if (index < 0 || (size_t)index >= scan->chunk_count)
+            break;
+        if (scan->is_speculative)
+            _parallel_speculate(scan, sc, &scan->chunks[index]);
+        else
+            _parallel_chunk(scan, sc, &scan->chunks[index]);
+    }
+    regexx_scratch_free(sc);
+    return 0;
+}
+
+static unsigned _parallel_cpu_count(void) {
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    return (unsigned)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0) ? (unsigned)count : 1;
+#endif
+}
+
+/** Runs `thread_count` workers, this thread being one of them */
+static void _parallel_run(parworker_t worker, void *arg, unsigned thread_count) {
+#if defined(_WIN32)
+    HANDLE *threads = malloc(thread_count * sizeof(threads[0]));
+#else
+    pthread_t *threads = malloc(thread_count * sizeof(threads[0]));
+#endif
+    unsigned started = 0;
+    unsigned i;
+
+    if (threads == NULL)
+        abort();
+    for (i=1; i<thread_count; i++) {
+#if defined(_WIN32)
+        threads[started] = CreateThread(NULL, 0, worker, arg, 0, NULL);
+        if (threads[started] == NULL)
+            break;
+#else
+        if (pthread_create(&threads[started], NULL, worker, arg) != 0)
+            break;
+#endif
+        started++;
+    }
+
+    /* If threads couldn't be started, there are just fewer of them */
+    worker(arg);
+
+    for (i=0; i<started; i++) {
+#if defined(_WIN32)
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], NULL);
+#endif
+    }
+    free(threads);
+}
+
+/**
+ * Reports the matches in order, one chunk after another. Where a match
+ * crossed into a chunk, its guessed matches overlapping that one are
+ * wrong, so the search starts again after it, until it finds a match
+ * that the chunk's search also went through.
+ * @return 0, what `on_match` returned to stop, or -1 if stopped by limits
+ */
+static int _parallel_merge(const parscan_t *scan, regexx_scratch_t *sc, regexx_match_fn on_match, void *ctx) {
+    size_t offset = 0;      /* where the real search is */
+    size_t c;
+
+    for (c=0; c<scan->chunk_count; c++) {
+        const parchunk_t *chunk = &scan->chunks[c];
+        size_t guess = chunk->begin;    /* where the chunk's search was */
+        size_t k = 0;
+
+        if (chunk->is_stopped)
+            return -1;
+
+        /* No match starts between the end of the last one and the
+         * chunk, or it would've been found in the chunk before */
+        if (offset < chunk->begin)
+            offset = chunk->begin;
+
+        for (;;) {
+            parmatch_t match;
+            int found;
+            int result;
+
+            /* Skip the guesses the real search has gone past */
+            while (k < chunk->count && chunk->matches[k].start < offset) {
+                guess = chunk->matches[k].end;
+                k++;
+            }
+
+            if (guess <= offset) {
+                /* The chunk's search had been through here too, so its
+                 * next match is the real one */
+                if (k == chunk->count)
+                    break;
+                match = chunk->matches[k];
+                guess = match.end;
+                k++;
+            } else {
+                /* We're in the middle of a guessed match */
+                found = _parallel_next(scan, sc, &offset, chunk->end, &match);
+                if (found < 0)
+                    return -1;
+                if (found == 0)
+                    break;
+            }
+            offset = match.end;
+            result = on_match(ctx, match.id, match.start, match.end - match.start);
+            if (result)
+                return result;
+        }
+    }
+    return 0;
+}
+
+/** Speculative mode: the chunk's search that began at `offset`, if any */
+static const parsearch_t *_parallel_find_search(const parchunk_t *chunk, size_t offset) {
+    size_t lo = 0;
+    size_t hi = chunk->search_count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (chunk->searches[mid].start < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < chunk->search_count && chunk->searches[lo].start == offset)
+        return &chunk->searches[lo];
+    return NULL;
+}
+
+/** Speculative mode: the chunk's checkpoint at `offset`, if any */
+static const parcheck_t *_parallel_find_check(const parchunk_t *chunk, size_t offset) {
+    size_t lo = 0;
+    size_t hi = chunk->check_count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (chunk->checks[mid].offset < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < chunk->check_count && chunk->checks[lo].offset == offset)
+        return &chunk->checks[lo];
+    return NULL;
+}
+
+/**
+ * Speculative mode: the state in our own DFA with the same kernel as one
+ * from a chunk's DFA.
+ */
+static unsigned _parallel_state(const regexx_t *re, regexx_scratch_t *sc, const unsigned *kernel, size_t count) {
+    dfa_t *dfa = sc->search;
+    unsigned state;
+
+    state = _dfa_add(dfa, &re->prog, kernel, count, &dfa->tmp, dfa->stack);
+    if (state == NFA_NONE) {
+        _dfa_flush(dfa, &re->prog, 0);
+        state = _dfa_add(dfa, &re->prog, kernel, count, &dfa->tmp, dfa->stack);
+    }
+    return state;
+}
+
+/**
+ * Speculative mode: reports the matches in order, running the real search
+ * until it's in the same state as one of a chunk's, from where the
+ * chunk's results hold.
+ *
+ * A search that begins where one of the chunk's did is the same search,
+ * so all the chunk's matches from there on are the real ones. A search in
+ * the same state at a checkpoint reads the same from there on, matching
+ * where the chunk's did, except that it may have begun sooner, so where
+ * its match starts is found again. And it keeps its own last match, if
+ * the chunk's search didn't match after the checkpoint.
+ * @return 0, what `on_match` returned to stop, or -1 if stopped by limits
+ */
+static int _parallel_resolve(const parscan_t *scan, regexx_scratch_t *sc, regexx_match_fn on_match, void *ctx) {
+    const regexx_t *re = scan->re;
+    const unsigned char *text = (const unsigned char *)scan->input;
+    size_t length = scan->length;
+    parrun_t run;
+    size_t c = 0;
+
+    _scratch_begin(re, sc);
+    _parrun_begin(sc, &run, 0);
+    for (;;) {
+        const parchunk_t *chunk;
+        const parsearch_t *search;
+        const parcheck_t *check;
+        parmatch_t match;
+        size_t offset;
+        int found;
+        int result;
+
+        while (c + 1 < scan->chunk_count && run.i >= scan->chunks[c].end)
+            c++;
+        chunk = &scan->chunks[c];
+        if (chunk->is_stopped)
+            return -1;
+
+        if (run.state && run.i < length) {
+            if (run.i == run.start && (search = _parallel_find_search(chunk, run.start)) != NULL) {
+                size_t k;
+
+                for (k=search->match; k<chunk->count; k++) {
+                    match = chunk->matches[k];
+                    result = on_match(ctx, match.id, match.start, match.end - match.start);
+                    if (result)
+                        return result;
+                }
+                if (chunk->is_done)
+                    return 0;
+                if (chunk->is_open) {
+                    run = chunk->open;
+                    run.state = _parallel_state(re, sc, chunk->kernels + chunk->open_kernel, chunk->open_kernel_count);
+                } else if (chunk->next > length)
+                    return 0;
+                else {
+                    _scratch_begin(re, sc);
+                    _parrun_begin(sc, &run, chunk->next);
                 }
+                continue;
             }
+
+            check = _parallel_find_check(chunk, run.i);
+            if (check) {
+                size_t count;
+                const unsigned *kernel = _dfa_set(sc->search, run.state, &count);
+
+                if (count == check->kernel_count
+                        && memcmp(kernel, chunk->kernels + check->kernel, count * sizeof(kernel[0])) == 0) {
+                    search = &chunk->searches[check->search];
+                    if (chunk->is_open && check->search + 1 == chunk->search_count) {
+                        if (chunk->open.accept && chunk->open.end > run.i) {
+                            run.accept = chunk->open.accept;
+                            run.end = chunk->open.end;
+                        }
+                        run.state = _parallel_state(re, sc, chunk->kernels + chunk->open_kernel, chunk->open_kernel_count);
+                        run.i = chunk->end;
+                    } else {
+                        if (search->accept && search->end > run.i) {
+                            run.accept = search->accept;
+                            run.end = search->end;
+                        }
+                        run.state = 0;
+                    }
+                    continue;
+                }
+            }
+
+            offset = (run.i / PARALLEL_CHECK_SPAN + 1) * PARALLEL_CHECK_SPAN;
+            if (offset > chunk->end)
+                offset = chunk->end;
+            if (!_parrun_step(re, sc, text, length, &run, offset))
+                return -1;
+            continue;
+        }
+
+        found = _parrun_finish(re, sc, text, length, &run, &match);
+        if (found <= 0)
+            return found;
+        offset = match.end;
+        if (match.start == match.end)
+            offset++;
+        else {
+            result = on_match(ctx, match.id, match.start, match.end - match.start);
+            if (result)
+                return result;
+        }
+        if (offset > length)
+            return 0;
+        _scratch_begin(re, sc);
+        _parrun_begin(sc, &run, offset);
+    }
+}
+
+int regexx_scan_parallel(const regexx_t *re, const char *input, size_t length, unsigned thread_count, regexx_match_fn on_match, void *ctx) {
+    parscan_t scan[1];
+    regexx_scratch_t *sc;
+    size_t max_length = 0;
+    size_t chunk_size;
+    size_t chunk_count = 1;
+    bool is_speculative;
+    int result;
+    size_t i;
+
+    if (re == NULL || input == NULL || on_match == NULL || re->head == NULL)
+        return -1;
+    if (thread_count == 0)
+        thread_count = _parallel_cpu_count();
+
+    /* With all the patterns in the DFA, chunks can be searched
+     * speculatively. Otherwise, how long the longest match can be decides
+     * how small the chunks can be, with unbounded patterns scanned by one
+     * thread. */
+    is_speculative = (re->search && re->literals == NULL && re->residual_count == 0 && re->delta == NULL);
+    for (i=0; i<re->pattern_count && max_length != SIZE_MAX; i++) {
+        size_t n = _node_max_length(re->patterns[i].head);
+        if (n > max_length)
+            max_length = n;
+    }
+    chunk_size = length / ((size_t)thread_count * PARALLEL_CHUNKS_PER_THREAD);
+    if (re->dfa && thread_count > 1 && chunk_size >= PARALLEL_CHUNK_MIN
+            && (is_speculative || (max_length != SIZE_MAX && chunk_size / PARALLEL_CHUNK_SPAN >= max_length)))
+        chunk_count = (length + chunk_size - 1) / chunk_size;
+    else {
+        chunk_size = length;
+        thread_count = 1;
+    }
+
+    scan->re = re;
+    scan->input = input;
+    scan->length = length;
+    scan->chunk_count = chunk_count;
+    scan->next_chunk = 0;
+    scan->is_speculative = is_speculative;
+    scan->chunks = calloc(chunk_count, sizeof(scan->chunks[0]));
+    if (scan->chunks == NULL)
+        abort();
+    for (i=0; i<chunk_count; i++) {
+        scan->chunks[i].begin = i * chunk_size;
+        scan->chunks[i].end = (i + 1 == chunk_count) ? length : (i + 1) * chunk_size;
+    }
+    if (length == 0 && !is_speculative)
+        scan->chunks[0].end = 1; /* so an empty input is searched once */
+
+    _parallel_run(_parallel_worker, scan, thread_count);
+
+    sc = regexx_scratch_create(re);
+    if (is_speculative)
+        result = _parallel_resolve(scan, sc, on_match, ctx);
+    else
+        result = _parallel_merge(scan, sc, on_match, ctx);
+    regexx_scratch_free(sc);
+    for (i=0; i<chunk_count; i++) {
+        free(scan->chunks[i].matches);
+        free(scan->chunks[i].searches);
+        free(scan->chunks[i].checks);
+        free(scan->chunks[i].kernels);
+    }
+    free(scan->chunks);
+    return result;
+}
+
+/****************************************************************************
+ * Adding patterns in bulk
+ *
+ * `regexx_add_patterns()` parses and lowers large rule sets on several
+ * threads. Each batch of patterns is added by `regexx_add_pattern()` to a
+ * parser of its own, a `regexx_t` sharing the macros, with an arena and
+ * an NFA program of its own. Then the batches are merged in order: each
+ * program is appended to the real one, with its instructions renumbered,
+ * and the arena holding the parse trees is handed over.
+ ****************************************************************************/
+
+/* How many patterns a thread takes at a time */
+#define BULK_BATCH 256
+
+typedef struct bulkbatch_t {
+    size_t begin;
+    size_t end;
+    regexx_t *parser;
+    buf_t errors;       /* a line for each pattern that failed */
+} bulkbatch_t;
+
+typedef struct bulk_t {
+    const regexx_t *re;
+    const char *const *patterns;
+    const size_t *ids;
+    unsigned flags;
+    int *results;
+    bulkbatch_t *batches;
+    size_t batch_count;
+    long next_batch;
+} bulk_t;
+
+static void _bulk_batch(const bulk_t *bulk, bulkbatch_t *batch) {
+    const regexx_t *re = bulk->re;
+    regexx_t *parser;
+    size_t i;
+
+    parser = calloc(1, sizeof(*parser));
+    if (parser == NULL)
+        abort();
+    parser->alloc = re->alloc;
+    parser->release = re->release;
+    parser->alloc_ctx = re->alloc_ctx;
+    parser->is_dot_match_newline = re->is_dot_match_newline;
+    parser->flags = re->flags;
+    parser->macros = re->macros;
+    parser->macro_count = re->macro_count;
+    parser->head = _node_new(parser);
+    parser->head->type = T_ROOT;
+    parser->tail = parser->head;
+
+    for (i=batch->begin; i<batch->end; i++) {
+        bulk->results[i] = regexx_add_pattern(parser, bulk->patterns[i], bulk->ids[i], bulk->flags);
+        if (bulk->results[i] != 0)
+            _appendf(&batch->errors, "pattern %u: %s\n", (unsigned)i, regexx_get_error_msg(parser));
+    }
+    batch->parser = parser;
+}
+
+/** A thread, taking the next batch until there are none left */
+#if defined(_WIN32)
+static DWORD WINAPI _bulk_worker(LPVOID arg) {
+#else
+static void *_bulk_worker(void *arg) {
+#endif
+    bulk_t *bulk = (bulk_t *)arg;
+
+    for (;;) {
+        long index = ATOMIC_ADD(&bulk->next_batch, 1);
+        if (index < 0 || (size_t)index >= bulk->batch_count)
             break;
-        case T_GROUP_START:
-            /* Only useful when printing partial regex chains, such as while debugging.
-             * If seen in actual output, this is an error */
-            _appendf(buf, "(");
-            break;
-        default:
-            _appendf(buf, "*****errror*****");
-            return buf->string;
+        _bulk_batch(bulk, &bulk->batches[index]);
     }
-        node = node->next;
+    return 0;
+}
+
+/**
+ * Moves a batch's patterns to `re`, appending its NFA program to ours,
+ * then frees the parser.
+ */
+static void _bulk_merge(regexx_t *re, regexx_t *parser) {
+    prog_t *prog = &re->prog;
+    const prog_t *from = &parser->prog;
+    unsigned base = prog->count;
+    unsigned look_base = prog->look_count;
+    size_t pattern_base = re->pattern_count;
+    unsigned *classes;
+    size_t i;
+
+    /* Charclasses are shared, so they may be in ours already */
+    classes = malloc((from->class_count + 1) * sizeof(classes[0]));
+    if (classes == NULL)
+        abort();
+    for (i=0; i<from->class_count; i++)
+        classes[i] = _prog_class(prog, from->classes[i]);
+
+    if (prog->count + from->count > prog->max) {
+        prog->max = (prog->count + from->count) * 2 + 64;
+        prog->insts = realloc(prog->insts, prog->max * sizeof(prog->insts[0]));
+        if (prog->insts == NULL)
+            abort();
     }
-    return buf->string;
+    for (i=0; i<from->count; i++) {
+        nfainst_t inst = from->insts[i];
+
+        if (inst.out != NFA_NONE)
+            inst.out += base;
+        if (inst.out1 != NFA_NONE)
+            inst.out1 += base;
+        if (inst.op == OP_CLASS)
+            inst.arg = classes[inst.arg];
+        else if (inst.op == OP_LOOK)
+            inst.arg += look_base;
+        else if (inst.op == OP_MATCH && inst.arg != NFA_NONE)
+            inst.arg += (unsigned)pattern_base;
+        prog->insts[prog->count++] = inst;
+    }
+    free(classes);
+
+    if (from->look_count) {
+        prog->looks = realloc(prog->looks, (prog->look_count + from->look_count) * sizeof(prog->looks[0]));
+        if (prog->looks == NULL)
+            abort();
+        for (i=0; i<from->look_count; i++) {
+            lookahead_t look = from->looks[i];
+            look.forward += base;
+            look.reverse += base;
+            prog->looks[prog->look_count++] = look;
+        }
+    }
+
+    if (parser->pattern_count) {
+        re->patterns = realloc(re->patterns, (re->pattern_count + parser->pattern_count) * sizeof(re->patterns[0]));
+        if (re->patterns == NULL)
+            abort();
+    }
+    for (i=0; i<parser->pattern_count; i++) {
+        re->patterns[re->pattern_count] = parser->patterns[i];
+        if (parser->patterns[i].start != NFA_NONE)
+            re->patterns[re->pattern_count].start += base;
+        if (parser->patterns[i].reverse != NFA_NONE)
+            re->patterns[re->pattern_count].reverse += base;
+        re->pattern_count++;
+    }
+    re->residual_count += parser->residual_count;
+    re->anchored_count += parser->anchored_count;
+
+    /* The parse trees and sources stay where they are, in blocks that
+     * now belong to us, after the one we're allocating from */
+    if (parser->arena) {
+        arenablock_t *last = parser->arena;
+
+        while (last->next)
+            last = last->next;
+        if (re->arena) {
+            last->next = re->arena->next;
+            re->arena->next = parser->arena;
+        } else
+            re->arena = parser->arena;
+    }
+
+    _prog_free(&parser->prog);
+    free(parser->patterns);
+    free(parser->error_msg.string);
+    free(parser);
 }
 
-char *regexx_print(regexx_t *re, size_t index, size_t *id, bool is_flag_shown)
-{
-    node_t *head;
-    buf_t buf[1] = {0,0};
- 
-    if (index >= re->pattern_count) {
-        if (id)
-            *id = REGEXX_NOT_FOUND;
+int regexx_add_patterns(regexx_t *re, const char *const *patterns, const size_t *ids, size_t count, unsigned flags, unsigned thread_count, int *results) {
+    bulk_t bulk[1];
+    bool is_error = false;
+    size_t failed = 0;
+    size_t i;
+
+    if (re == NULL || (count && (patterns == NULL || ids == NULL)))
+        return -1;
+    if (count == 0)
+        return 0;
+    if (thread_count == 0)
+        thread_count = _parallel_cpu_count();
+
+    bulk->re = re;
+    bulk->patterns = patterns;
+    bulk->ids = ids;
+    bulk->flags = flags;
+    bulk->results = results ? results : malloc(count * sizeof(bulk->results[0]));
+    bulk->batch_count = (count + BULK_BATCH - 1) / BULK_BATCH;
+    bulk->next_batch = 0;
+    bulk->batches = calloc(bulk->batch_count, sizeof(bulk->batches[0]));
+    if (bulk->results == NULL || bulk->batches == NULL)
+        abort();
+    for (i=0; i<bulk->batch_count; i++) {
+        bulk->batches[i].begin = i * BULK_BATCH;
+        bulk->batches[i].end = (i + 1 == bulk->batch_count) ? count : (i + 1) * BULK_BATCH;
+    }
+    if (thread_count > bulk->batch_count)
+        thread_count = (unsigned)bulk->batch_count;
+
+    _parallel_run(_bulk_worker, bulk, thread_count);
+
+    for (i=0; i<bulk->batch_count; i++) {
+        bulkbatch_t *batch = &bulk->batches[i];
+
+        _bulk_merge(re, batch->parser);
+        if (batch->errors.length) {
+            if (!is_error)
+                re->error_msg.length = 0;
+            _appendf(&re->error_msg, "%s", batch->errors.string);
+            is_error = true;
+        }
+        free(batch->errors.string);
+    }
+    free(bulk->batches);
+
+    /* One message per line, without a newline at the end */
+    if (is_error)
+        re->error_msg.string[--re->error_msg.length] = '\0';
+    for (i=0; i<count; i++) {
+        if (bulk->results[i] != 0)
+            failed++;
+    }
+    if (bulk->results != results)
+        free(bulk->results);
+    /* Too many to be worth a delta, so a compiled set is compiled again */
+    if (failed < count && (re->dfa == NULL || _compile(re, NULL, NULL) != 0))
+        _compiled_free(re);
+    return (failed > INT_MAX) ? INT_MAX : (int)failed;
+}
+
+/****************************************************************************
+ * Reloading while scanning
+ *
+ * A `regexxlive_t` holds the current version of the patterns, which
+ * readers on other threads scan with, and replaces it in the style of
+ * RCU. A reload compiles the new patterns on a thread of its own, then
+ * swaps in the pointer to them. Each reader announces the version it's
+ * scanning with, and clears that between scans, so once every reader has
+ * been seen not using the old version, none can reach it any more, and
+ * the reload's thread frees it. Readers never take a lock or wait.
+ ****************************************************************************/
+
+typedef struct liveversion_t {
+    regexx_t *re;
+    unsigned long serial;   /* counts the versions, since addresses get reused */
+} liveversion_t;
+
+struct regexxreader_t {
+    regexxlive_t *live;
+    struct regexxreader_t *next;
+    bool is_retired;    /* freed while a reload was waiting, so left for it to free */
+
+    /* The version being scanned with, or NULL between scans */
+    liveversion_t *in_use;
+
+    /* The scratch, and the serial of the version it's for */
+    regexx_scratch_t *scratch;
+    unsigned long serial;
+};
+
+struct regexxlive_t {
+    liveversion_t *current;
+    unsigned long serial;
+
+    /* The readers, which are locked when added or removed. While a reload
+     * waits for them to be done with the old version, it walks the list
+     * without the lock, so new readers only go on the front of the list,
+     * and the ones freed stay on it, retired, until the reload is done. */
+#if defined(_WIN32)
+    CRITICAL_SECTION lock;
+#else
+    pthread_mutex_t lock;
+#endif
+    regexxreader_t *readers;
+    bool is_waiting;
+
+    /* The reload in progress, if any */
+    regexx_t *pending;
+    bool is_reloading;
+    int result;
+#if defined(_WIN32)
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+};
+
+static void _live_lock(regexxlive_t *live) {
+#if defined(_WIN32)
+    EnterCriticalSection(&live->lock);
+#else
+    pthread_mutex_lock(&live->lock);
+#endif
+}
+
+static void _live_unlock(regexxlive_t *live) {
+#if defined(_WIN32)
+    LeaveCriticalSection(&live->lock);
+#else
+    pthread_mutex_unlock(&live->lock);
+#endif
+}
+
+static liveversion_t *_live_version(regexxlive_t *live, regexx_t *re) {
+    liveversion_t *version;
+
+    version = malloc(sizeof(*version));
+    if (version == NULL)
+        abort();
+    version->re = re;
+    version->serial = ++live->serial;
+    return version;
+}
+
+/**
+ * Makes `re` the current version, then waits until no reader is still
+ * scanning with the old one, and frees it. A reader that announces the
+ * old version after it was replaced sees that it was, and doesn't use it.
+ * Readers created after the swap can't be using the old version, so only
+ * the ones already on the list are waited for, without holding the lock,
+ * so that readers can still be created and freed meanwhile.
+ */
+static void _live_publish(regexxlive_t *live, regexx_t *re) {
+    liveversion_t *old;
+    regexxreader_t *readers;
+    regexxreader_t *reader;
+    regexxreader_t **r;
+
+    old = ATOMIC_EXCHANGE_PTR(&live->current, _live_version(live, re));
+
+    _live_lock(live);
+    live->is_waiting = true;
+    readers = live->readers;
+    _live_unlock(live);
+
+    for (reader = readers; reader; reader = reader->next) {
+        while (ATOMIC_LOAD_PTR(&reader->in_use) == old) {
+#if defined(_WIN32)
+            SwitchToThread();
+#else
+            sched_yield();
+#endif
+        }
+    }
+
+    /* Now the readers freed in the meantime can go */
+    _live_lock(live);
+    live->is_waiting = false;
+    for (r = &live->readers; *r; ) {
+        reader = *r;
+        if (reader->is_retired) {
+            *r = reader->next;
+            free(reader);
+        } else
+            r = &reader->next;
+    }
+    _live_unlock(live);
+
+    regexx_free(old->re);
+    free(old);
+}
+
+/** The reload's thread: compiles the new version, and publishes it */
+#if defined(_WIN32)
+static DWORD WINAPI _live_worker(LPVOID arg) {
+#else
+static void *_live_worker(void *arg) {
+#endif
+    regexxlive_t *live = (regexxlive_t *)arg;
+    regexx_t *re = live->pending;
+
+    live->pending = NULL;
+    live->result = 0;
+    if (re->dfa == NULL)
+        live->result = regexx_compile(re);
+    if (live->result == 0)
+        _live_publish(live, re);
+    else
+        regexx_free(re);
+    return 0;
+}
+
+regexxlive_t *regexx_live_create(regexx_t *re) {
+    regexxlive_t *live;
+
+    if (re == NULL)
         return NULL;
-    } else {
-        head = re->patterns[index].head;
-        if (id)
-            *id = re->patterns[index].id;
+    live = calloc(1, sizeof(*live));
+    if (live == NULL)
+        abort();
+#if defined(_WIN32)
+    InitializeCriticalSection(&live->lock);
+#else
+    pthread_mutex_init(&live->lock, NULL);
+#endif
+    live->current = _live_version(live, re);
+    return live;
+}
+
+int regexx_live_reload(regexxlive_t *live, regexx_t *re) {
+    if (live == NULL || re == NULL)
+        return -1;
+    regexx_live_wait(live);
+
+    live->pending = re;
+    live->is_reloading = true;
+#if defined(_WIN32)
+    live->thread = CreateThread(NULL, 0, _live_worker, live, 0, NULL);
+    if (live->thread != NULL)
+        return 0;
+#else
+    if (pthread_create(&live->thread, NULL, _live_worker, live) == 0)
+        return 0;
+#endif
+
+    /* Without a thread, the reload happens here */
+    live->is_reloading = false;
+    _live_worker(live);
+    return live->result;
+}
+
+int regexx_live_wait(regexxlive_t *live) {
+    if (live == NULL)
+        return -1;
+    if (live->is_reloading) {
+#if defined(_WIN32)
+        WaitForSingleObject(live->thread, INFINITE);
+        CloseHandle(live->thread);
+#else
+        pthread_join(live->thread, NULL);
+#endif
+        live->is_reloading = false;
     }
-    
-    //_appendf(buf, "");
-    
-    if (is_flag_shown)
-        _appendf(buf, "/");
-    _node_print(head, buf);
-    if (is_flag_shown)
-        _appendf(buf, "/");
-    return buf->string;
+    return live->result;
+}
+
+void regexx_live_free(regexxlive_t *live) {
+    if (live == NULL)
+        return;
+    regexx_live_wait(live);
+    regexx_free(live->current->re);
+    free(live->current);
+#if defined(_WIN32)
+    DeleteCriticalSection(&live->lock);
+#else
+    pthread_mutex_destroy(&live->lock);
+#endif
+    free(live);
+}
+
+regexxreader_t *regexx_live_reader_create(regexxlive_t *live) {
+    regexxreader_t *reader;
+
+    if (live == NULL)
+        return NULL;
+    reader = calloc(1, sizeof(*reader));
+    if (reader == NULL)
+        abort();
+    reader->live = live;
+    _live_lock(live);
+    reader->next = live->readers;
+    live->readers = reader;
+    _live_unlock(live);
+    return reader;
+}
+
+void regexx_live_reader_free(regexxreader_t *reader) {
+    regexxlive_t *live;
+    regexxreader_t **r;
+
+    if (reader == NULL)
+        return;
+    live = reader->live;
+    regexx_scratch_free(reader->scratch);
+    reader->scratch = NULL;
+
+    /* A reload waiting for the readers may be looking at this one */
+    _live_lock(live);
+    if (live->is_waiting) {
+        reader->is_retired = true;
+        _live_unlock(live);
+        return;
+    }
+    for (r = &live->readers; *r; r = &(*r)->next) {
+        if (*r == reader) {
+            *r = reader->next;
+            break;
+        }
+    }
+    _live_unlock(live);
+    free(reader);
+}
+
+const regexx_t *regexx_live_enter(regexxreader_t *reader, regexx_scratch_t **r_scratch) {
+    liveversion_t *version;
+    liveversion_t *current;
+
+    if (reader == NULL)
+        return NULL;
+
+    /* Announce the current version, until it's still current after being
+     * announced, which a reload waiting for readers is sure to see */
+    version = ATOMIC_LOAD_PTR(&reader->live->current);
+    for (;;) {
+        (void)ATOMIC_EXCHANGE_PTR(&reader->in_use, version);
+        current = ATOMIC_LOAD_PTR(&reader->live->current);
+        if (current == version)
+            break;
+        version = current;
+    }
+
+    /* The scratch from an older version only still has its own memory */
+    if (reader->scratch == NULL || reader->serial != version->serial) {
+        regexx_scratch_free(reader->scratch);
+        reader->scratch = regexx_scratch_create(version->re);
+        reader->serial = version->serial;
+    }
+    if (r_scratch)
+        *r_scratch = reader->scratch;
+    return version->re;
+}
+
+void regexx_live_leave(regexxreader_t *reader) {
+    if (reader)
+        (void)ATOMIC_EXCHANGE_PTR(&reader->in_use, NULL);
+}
+
+size_t regexx_live_match(regexxreader_t *reader, const char *input, size_t in_offset, size_t in_length, size_t *out_offset, size_t *out_length) {
+    regexx_scratch_t *sc;
+    const regexx_t *re;
+    size_t id;
+
+    re = regexx_live_enter(reader, &sc);
+    if (re == NULL)
+        return -1;
+    id = regexx_scratch_match(re, sc, input, in_offset, in_length, out_offset, out_length);
+    regexx_live_leave(reader);
+    return id;
 }
 
 regexx_t *regexx_create(unsigned flags) {
     regexx_t *re;
     
     re = malloc(sizeof(*re));
+    if (re == NULL)
+        abort();
     memset(re, 0, sizeof(*re));
+    re->alloc = _default_alloc;
+    re->release = _default_release;
     
-    re->head = malloc(sizeof(node_t));
-    memset(re->head, 0, sizeof(node_t));
+    re->head = _node_new(re);
     re->head->type = T_ROOT;
     re->tail = re->head;
-    re->offsets.line_number = 1;
+    re->scratch.offsets.line_number = 1;
     re->is_dot_match_newline = 1;
+    re->flags = flags;
+    re->cache_size = DFA_CACHE_SIZE;
     return re;
 }
 
+int regexx_set_allocator(regexx_t *re,
+        void *(*alloc)(void *ctx, size_t size),
+        void (*release)(void *ctx, void *ptr),
+        void *ctx) {
+    if (re == NULL || (alloc == NULL) != (release == NULL))
+        return -1;
+    if (alloc == NULL) {
+        alloc = _default_alloc;
+        release = _default_release;
+    }
+    re->alloc = alloc;
+    re->release = release;
+    re->alloc_ctx = ctx;
+    return 0;
+}
+
 const char *regexx_get_error_msg(regexx_t *re)
 {
     if (re == NULL) {
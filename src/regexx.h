@@ -25,14 +25,49 @@ typedef int bool;
 #endif
 
 typedef struct regexx_t regexx_t;
+typedef struct regexx_scratch_t regexx_scratch_t;
 
 #define REGEXX_NOT_FOUND SIZE_MAX
 #define REGEXX_NOT_FINISHED (SIZE_MAX-1)
 
 enum regexx_flags_t {
     REGEXX_LAZY = 0x00000010,
+
+    /* For `regexx_create()`, to ignore the case of ASCII letters in every
+     * pattern, or for `regexx_add_pattern()`, in only that one. Patterns
+     * that are plain strings keep to the fast literal search only when
+     * the whole set ignores case */
     REGEXX_IGNORECASE = 0x00000020,
 
+    /* For `regexx_create()`: instead of building the entire DFA in
+     * `regexx_compile()`, build states only when the input reaches them,
+     * keeping them in a cache of bounded size (see `regexx_set_cache_size()`) */
+    REGEXX_LAZY_DFA = 0x00000040,
+
+    /* For `regexx_create()`: evaluate patterns the DFA can't handle (or all
+     * patterns, when not compiled) by simulating the NFA, whose time is
+     * linear in the input length, instead of by backtracking, which
+     * can take exponential time on patterns like `(a*)*b` */
+    REGEXX_PIKEVM = 0x00000080,
+
+    /* For `regexx_create()`: when backtracking, remember the result for
+     * each part of the pattern at each offset, so nothing is evaluated
+     * twice. Time is then polynomial rather than exponential, with memory
+     * for the pattern's size times the input length, so this only applies
+     * to short inputs (like packets or log lines) */
+    REGEXX_MEMOIZE = 0x00000100,
+
+    /* For `regexx_create()`: compile the DFA to machine code (x86-64 on
+     * Unix), instead of interpreting its tables, for faster tokenizing.
+     * Only the DFA that `regexx_lex_token()` runs is compiled: the ones
+     * `regexx_match()` searches with are built lazily, as the input
+     * reaches their states, so they're always interpreted. Ignored with
+     * REGEXX_LAZY_DFA, or where this isn't possible */
+    REGEXX_JIT = 0x00000200,
+
+    /* For `regexx_generate()`: write the scanner as a state machine of
+     * `switch` and `goto` instead of as tables */
+    REGEXX_GEN_SWITCH = 0x00010000,
 };
 
 typedef struct regexxtoken_t {
@@ -62,6 +97,30 @@ regexx_t *regexx_create(unsigned flags);
  */
 void regexx_free(regexx_t *re);
 
+/**
+ * Use a different allocator for the memory that parsing patterns takes
+ * (the parse trees, macros and pattern text). This is taken in large
+ * blocks, which are only given back by `regexx_free()`, all at once, so
+ * a rule set can be thrown away quickly. Blocks already taken are given
+ * back to the allocator they came from.
+ *
+ * Only parsing uses this. What `regexx_compile()` builds (the NFA
+ * program, the DFAs and the Aho-Corasick tables), scratch, and the state
+ * caches of REGEXX_LAZY_DFA still come from `malloc()` and `realloc()`.
+ * @param alloc
+ *  Returns `size` bytes (aligned for any type), or NULL to abort. NULL
+ *  here and for `release` goes back to `malloc()` and `free()`.
+ * @param release
+ *  Gives back memory from `alloc`.
+ * @param ctx
+ *  Passed to both.
+ * @return 0 on success, or a negative number on error
+ */
+int regexx_set_allocator(regexx_t *re,
+        void *(*alloc)(void *ctx, size_t size),
+        void (*release)(void *ctx, void *ptr),
+        void *ctx);
+
 /**
  * Add a macro that can be used when defining regular expressions.
  */
@@ -83,6 +142,27 @@ int regexx_add_macro(regexx_t *re, const char *name, const char *value);
  */
 int regexx_add_pattern(regexx_t *re, const char *pattern, size_t id, unsigned flags);
 
+/**
+ * Add many patterns at once, the same as calling `regexx_add_pattern()`
+ * for each in turn, but parsed on several threads, for loading large
+ * rule sets. Macros must be added first. If an allocator was given to
+ * `regexx_set_allocator()`, it's called from those threads too.
+ * @param patterns
+ *  `count` regular expressions, and in `ids` the identifier of each.
+ * @param flags
+ *  The flags for all of them, as for `regexx_add_pattern()`.
+ * @param thread_count
+ *  How many threads to use, or 0 for one per CPU.
+ * @param results
+ *  If not NULL, receives for each pattern 0 if it was added, or -1 if it
+ *  couldn't be parsed.
+ * @return
+ *  0 if all were added, a negative number on error, or else how many
+ *  couldn't be parsed, in which case `regexx_get_error_msg()` has a line
+ *  for each, starting with its position in `patterns`
+ */
+int regexx_add_patterns(regexx_t *re, const char *const *patterns, const size_t *ids, size_t count, unsigned flags, unsigned thread_count, int *results);
+
 /**
  * Gets the regular expression, by `index`.
  * @param re
@@ -98,12 +178,355 @@ int regexx_add_pattern(regexx_t *re, const char *pattern, size_t id, unsigned fl
  */
 char *regexx_print(regexx_t *re, size_t index, size_t *id, bool is_flag_shown);
 
+/**
+ * Compile all the patterns added so far into a single DFA, so that they
+ * are all matched together in one pass, rather than one-by-one. Call this
+ * after adding all the patterns. Patterns added afterwards are compiled
+ * into a small delta of their own, searched alongside the rest. Adding
+ * one extends the delta's lazy DFAs rather than compiling them again, so
+ * it takes as long however many the delta holds. Once there are enough
+ * (more than 64, and 1/32 of the compiled set), everything is compiled
+ * again on another thread, while scans go on with the old set and the
+ * delta, and the first `regexx_add_pattern()` after that's done swaps
+ * the new set in. Calling this meanwhile, or `regexx_add_macro()`, waits
+ * for that thread. If an allocator was given to `regexx_set_allocator()`,
+ * it's called from that thread too.
+ *
+ * Patterns with features a DFA can't handle (lazy quantifiers, lookahead)
+ * are still evaluated separately, with their results merged in.
+ * @param re
+ *  A regex pattern-matching subsystem with patterns added.
+ * @return
+ *  0 on success, or a negative number on error, such as the DFA becoming
+ *  too large, in which case patterns are still matched one-by-one.
+ */
+int regexx_compile(regexx_t *re);
+
+/**
+ * Save the compiled patterns (after `regexx_compile()`), so they can be
+ * loaded by `regexx_deserialize()` without compiling them again, such as
+ * by other processes, or the next time the program starts.
+ * @param r_data
+ *  Receives the serialized form, allocated with `malloc()`, which the
+ *  caller frees with `free()`.
+ * @param r_length
+ *  Receives its length in bytes.
+ * @return 0 on success, or a negative number on error, such as the
+ *  patterns not being compiled
+ */
+int regexx_serialize(regexx_t *re, void **r_data, size_t *r_length);
+
+/**
+ * Load patterns saved by `regexx_serialize()`, ready for matching as if
+ * `regexx_compile()` had been called. The big tables are used where they
+ * are, rather than copied, so `data` must stay valid and unchanged until
+ * the result is freed with `regexx_free()`. This means it can be a
+ * read-only `mmap()` of a file, shared by many processes.
+ *
+ * What isn't saved is the parse trees and the NFA program, since they're
+ * full of pointers, and the backtracker, streams and parallel scans need
+ * the trees. So loading still parses every pattern again from its text,
+ * and lowers it to the program, and creates empty lazy DFAs for
+ * `regexx_match()` to search with, from the program's start states. That
+ * takes about 2.4 microseconds a pattern (a quarter of a second for
+ * 100,000), and the memory for it is each process's own. It's compiling
+ * the DFA, or the Aho-Corasick tables, that loading saves.
+ * @param data
+ *  The serialized form, aligned to 8 bytes (as from `mmap()` or `malloc()`).
+ * @return a new pattern matcher, or NULL if the data is damaged, or was
+ *  written by a different version of this library or kind of machine
+ */
+regexx_t *regexx_deserialize(const void *data, size_t length);
+
+/**
+ * Write C source for a standalone scanner that matches the patterns,
+ * without this library, as:
+ *
+ *   size_t <prefix>_scan(const char *text, size_t offset, size_t length,
+ *                        size_t *r_length);
+ *
+ * which returns the id of the longest pattern matching at `offset` (the
+ * first added, when several match as long), with its length, or
+ * `(size_t)-1` if none matches, like `regexx_lex_token()` does.
+ * @param fp
+ *  Where to write the source.
+ * @param prefix
+ *  The prefix of the names in the source, a C identifier.
+ * @param flags
+ *  REGEXX_GEN_SWITCH for a state machine of `switch` and `goto`, otherwise
+ *  the DFA is written as tables.
+ * @return 0 on success, or a negative number on error, such as a pattern
+ *  a DFA can't handle (lazy quantifiers, lookahead)
+ */
+int regexx_generate(regexx_t *re, FILE *fp, const char *prefix, unsigned flags);
+
+/**
+ * With REGEXX_LAZY_DFA, set the maximum memory used to cache DFA states,
+ * which otherwise defaults to 2 megabytes. When the cache fills, it's
+ * flushed and states are rebuilt as needed. Call before `regexx_compile()`.
+ * @return 0 on success, or a negative number on error
+ */
+int regexx_set_cache_size(regexx_t *re, size_t bytes);
+
+/**
+ * Limit how much work each `regexx_match()` or `regexx_lex_token()` call
+ * can do, so one pathological input can't tie up the CPU. A call that
+ * reaches a limit stops and returns REGEXX_NOT_FINISHED (as the token's
+ * `id`, for `regexx_lex_token()`).
+ * @param step_limit
+ *  The most engine steps per call, or 0 for no limit. A step is about one
+ *  input byte for the DFA, one thread at one byte for the Pike VM, or one
+ *  node tried when backtracking.
+ * @param usec_limit
+ *  The most time per call, in microseconds, or 0 for no limit. The clock
+ *  is only checked every few thousand steps.
+ * @return 0 on success, or a negative number on error
+ */
+int regexx_set_limits(regexx_t *re, size_t step_limit, uint64_t usec_limit);
+
+/**
+ * Stop the `regexx_match()` or `regexx_lex_token()` call in progress (or,
+ * if there isn't one, the next one), which then returns
+ * REGEXX_NOT_FINISHED. It notices within a few thousand steps. Unlike the
+ * rest of the API, this can be called from another thread.
+ */
+void regexx_cancel(regexx_t *re);
+
+/**
+ * After `regexx_compile()`, get the number of byte equivalence classes:
+ * groups of bytes that none of the patterns tell apart. DFA transition
+ * tables have one column per class, instead of one per byte value.
+ * @return the number of classes (at most 256), or 0 if not compiled
+ */
+size_t regexx_get_class_count(regexx_t *re);
+
+/**
+ * After `regexx_compile()`, get the number of DFA states. Subset
+ * construction builds `*built` of them, which are then minimized by
+ * merging those that no input can tell apart, leaving `*minimized`.
+ * With REGEXX_LAZY_DFA, states are built on demand and not minimized,
+ * so both are the number currently in the cache.
+ * @return 0 on success, or a negative number if not compiled
+ */
+int regexx_get_state_counts(regexx_t *re, size_t *built, size_t *minimized);
+
 /**
  * Using compiled regex patterns, match an input string.
+ *
+ * Without `regexx_compile()`, this returns the first pattern (in the order
+ * they were added) that matches anywhere. After compiling, this returns
+ * the match that starts first, and the longest one if several patterns
+ * match there (or the first added, if they're the same length), found
+ * in a single pass over the input for all the patterns together. Either
+ * way, empty matches aren't reported.
+ *
+ * Returns REGEXX_NOT_FINISHED when stopped by `regexx_set_limits()` or
+ * `regexx_cancel()`.
  */
 size_t regexx_match(regexx_t *re, const char *input, size_t in_offset, size_t in_length, size_t *out_offset, size_t *out_length);
 
 
+/**
+ * A scan of input that arrives in pieces, like a TCP stream or a pipe,
+ * from `regexx_stream_open()`.
+ */
+typedef struct regexxstream_t regexxstream_t;
+
+/**
+ * Called by a stream for each match, with its `id` and where it is, from
+ * the start of the stream.
+ * @return 0 to keep going, or something else to stop the stream, which
+ *  is then returned by `regexx_stream_scan()` and `regexx_stream_close()`
+ */
+typedef int (*regexx_match_fn)(void *ctx, size_t id, uint64_t offset, uint64_t length);
+
+/**
+ * Start scanning a stream of input for the patterns. Matches are found as
+ * `regexx_match()` finds them after `regexx_compile()` (the one that
+ * starts first, the longest there, then searching again where it ends),
+ * no matter how the input is split into chunks, so ones that span chunks
+ * are found too. Empty matches aren't reported.
+ *
+ * A match is reported once nothing later in the stream could change it,
+ * which may be a few chunks after it ends. Only the bytes since the end
+ * of a match waiting to be reported are kept, so memory doesn't grow
+ * with the stream.
+ *
+ * Any number of streams can be open at once. Patterns must not be added
+ * while they are, and the patterns can't use lazy quantifiers or
+ * lookahead, whose results can't be decided without the rest of the input.
+ * @param on_match
+ *  Called with each match, and `ctx`.
+ * @return a stream, which must be closed with `regexx_stream_close()`, or
+ *  NULL on error
+ */
+regexxstream_t *regexx_stream_open(regexx_t *re, regexx_match_fn on_match, void *ctx);
+
+/**
+ * Scan the next chunk of the stream, reporting the matches that can be
+ * decided so far.
+ * @return 0, or what `on_match` returned to stop the stream (after which
+ *  chunks are ignored), or a negative number on error, such as patterns
+ *  being added since the stream was opened
+ */
+int regexx_stream_scan(regexxstream_t *stream, const void *chunk, size_t length);
+
+/**
+ * End the stream, reporting the matches left (including those that needed
+ * to know where the input ends, for '$'), and free it.
+ * @return the same as `regexx_stream_scan()`
+ */
+int regexx_stream_close(regexxstream_t *stream);
+
+/**
+ * Create the memory that scanning changes, for one thread, so that many
+ * threads can scan with the same patterns at the same time, without
+ * locks. Once compiled, a `regexx_t` is only read by the `regexx_scratch_*`
+ * calls, and each thread passes its own scratch. The plain calls, like
+ * `regexx_match()`, use scratch inside the `regexx_t`, so only one
+ * thread at a time can use those.
+ *
+ * This allocates the scratch's own copies of the lazy DFAs, the scratch
+ * for the delta of patterns added after compiling, and the Pike VM, so
+ * most scans allocate nothing. What a scan can still allocate, keeping
+ * it for the next one, depends on the input or how far the scan gets:
+ * the lazy DFAs' states as they're found, up to the cache size (see
+ * `regexx_set_cache_size()`), which isn't reserved up front since most
+ * scans need few; for lookahead, a result for each lookahead and offset
+ * of the input, and a Pike VM for each level of nesting; with
+ * REGEXX_MEMOIZE, a result for each node and offset; the backtracker's
+ * stack; and, on the first scan after compiling again or adding
+ * patterns, new copies of the DFAs and Pike VMs.
+ *
+ * There's no separate read-only type for the compiled patterns: a
+ * compiled `regexx_t` is that already, as long as only the
+ * `regexx_scratch_*` calls are used on it, and adding patterns goes on
+ * working on the same object. Compiling again or adding patterns is not
+ * safe while other threads scan (`regexx_live_create()` is for that),
+ * though the scratch catches up with it afterwards.
+ * @return scratch to free with `regexx_scratch_free()`, before the
+ *  `regexx_t` is freed
+ */
+regexx_scratch_t *regexx_scratch_create(const regexx_t *re);
+
+/**
+ * Free scratch from `regexx_scratch_create()`.
+ */
+void regexx_scratch_free(regexx_scratch_t *scratch);
+
+/**
+ * The same as `regexx_match()`, with the scratch given.
+ */
+size_t regexx_scratch_match(const regexx_t *re, regexx_scratch_t *scratch, const char *input, size_t in_offset, size_t in_length, size_t *out_offset, size_t *out_length);
+
+/**
+ * The same as `regexx_lex_token()`, with the scratch given, which also
+ * keeps the line numbers.
+ */
+struct regexxtoken_t regexx_scratch_lex_token(const regexx_t *re, regexx_scratch_t *scratch, const char *subject, size_t *subject_offset, size_t subject_length);
+
+/**
+ * The same as `regexx_lex_push()` and `regexx_lex_pop()`, for the line
+ * numbers kept in the scratch.
+ */
+void regexx_scratch_lex_push(regexx_scratch_t *scratch);
+void regexx_scratch_lex_pop(regexx_scratch_t *scratch);
+
+/**
+ * The same as `regexx_cancel()`, for a scan with this scratch.
+ */
+void regexx_scratch_cancel(regexx_scratch_t *scratch);
+
+/**
+ * Find all the matches in a large buffer, using several threads. The
+ * matches are those from calling `regexx_match()` over and over, from
+ * where the last match ended (skipping empty matches), and they're
+ * reported in that order, on the calling thread, once all the threads
+ * are done.
+ *
+ * The buffer is split into chunks that threads search at the same time,
+ * after `regexx_compile()`. When all the patterns can go in the DFA (not
+ * plain strings, nor lazy quantifiers or lookahead), the chunks' DFA runs
+ * are stitched together, whatever the length of the matches. Otherwise,
+ * the patterns need a maximum length: when one has none (like `a.*b`),
+ * whose matches could run through every chunk, or for small buffers,
+ * this thread searches the buffer by itself.
+ * @param thread_count
+ *  How many threads to use, or 0 for one per CPU.
+ * @param on_match
+ *  Called with each match, and `ctx`, returning 0 to keep going.
+ * @return 0, or what `on_match` returned to stop, or a negative number on
+ *  error, such as a search stopped by `regexx_set_limits()`
+ */
+int regexx_scan_parallel(const regexx_t *re, const char *input, size_t length, unsigned thread_count, regexx_match_fn on_match, void *ctx);
+
+/**
+ * Patterns that can be replaced while other threads scan with them, such
+ * as when rules are reloaded, from `regexx_live_create()`. Each scanning
+ * thread has a reader, from `regexx_live_reader_create()`, and scans with
+ * whatever version is current when it starts. Replacing it never makes
+ * them wait: a new version is compiled on a thread of its own, and the
+ * old one is freed once no reader is scanning with it.
+ */
+typedef struct regexxlive_t regexxlive_t;
+typedef struct regexxreader_t regexxreader_t;
+
+/**
+ * Start with `re` (normally already compiled) as the current version.
+ * It belongs to the result from then on, and must not be changed.
+ * @return the live patterns, to free with `regexx_live_free()`
+ */
+regexxlive_t *regexx_live_create(regexx_t *re);
+
+/**
+ * Replace the patterns with `re`, which is compiled (unless it already
+ * is) on a thread of its own, then made current. This returns at once;
+ * a reload still in progress is waited for first. `re` belongs to the
+ * live patterns from then on, and is freed if it can't be compiled.
+ * @return 0, or a negative number on error
+ */
+int regexx_live_reload(regexxlive_t *live, regexx_t *re);
+
+/**
+ * Wait for the last reload to finish, including freeing the version it
+ * replaced, which waits for the readers still scanning with it.
+ * @return 0 if it was made current, or a negative number if it couldn't
+ *  be compiled, in which case the old patterns are still current
+ */
+int regexx_live_wait(regexxlive_t *live);
+
+/**
+ * Free the live patterns, after waiting for a reload. The readers must
+ * be freed first.
+ */
+void regexx_live_free(regexxlive_t *live);
+
+/**
+ * Create a reader for a thread to scan with, which holds the scratch for
+ * the version it last scanned with. Free it with `regexx_live_reader_free()`,
+ * but not while it's scanning, between `regexx_live_enter()` and
+ * `regexx_live_leave()`, since a reload would wait for that scan forever.
+ * Creating and freeing other readers is fine at any time, even from a
+ * scan, and doesn't wait for a reload.
+ */
+regexxreader_t *regexx_live_reader_create(regexxlive_t *live);
+void regexx_live_reader_free(regexxreader_t *reader);
+
+/**
+ * Begin scanning with the current version, which stays valid until
+ * `regexx_live_leave()`, even if it's replaced in the meantime. Scan
+ * with the `regexx_scratch_*` calls (or `regexx_scan_parallel()`), and
+ * the scratch returned in `*r_scratch`. Keep scans short, since a reload
+ * can't free the old version until they're left.
+ */
+const regexx_t *regexx_live_enter(regexxreader_t *reader, regexx_scratch_t **r_scratch);
+void regexx_live_leave(regexxreader_t *reader);
+
+/**
+ * The same as `regexx_scratch_match()`, with the current version.
+ */
+size_t regexx_live_match(regexxreader_t *reader, const char *input, size_t in_offset, size_t in_length, size_t *out_offset, size_t *out_length);
+
 /**
  * Retrieve the latest error message. Call this if one of the other functions returns
  * an error.